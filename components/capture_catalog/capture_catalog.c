@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "capture_catalog.h"
+
+#ifdef ESP_PLATFORM
+    #include "freertos/FreeRTOS.h"
+    #include "freertos/semphr.h"
+    #include "esp_log.h"
+    #include "esp_timer.h"
+
+    static const char* TAG = "CAPTURE CATALOG";
+    static SemaphoreHandle_t lock;
+    static SemaphoreHandle_t sync_lock;
+
+    #define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+    #define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+    #define LOCK() xSemaphoreTake(lock, portMAX_DELAY)
+    #define UNLOCK() assert(xSemaphoreGive(lock) == pdTRUE)
+    #define SYNC_LOCK() xSemaphoreTake(sync_lock, portMAX_DELAY)
+    #define SYNC_UNLOCK() assert(xSemaphoreGive(sync_lock) == pdTRUE)
+    #define NOW_US() esp_timer_get_time()
+#else
+    #include <pthread.h>
+
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    static int64_t now_us(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    #define LOGI(fmt, ...) printf("CAPTURE CATALOG: " fmt "\n", ##__VA_ARGS__)
+    #define LOGE(fmt, ...) fprintf(stderr, "CAPTURE CATALOG: " fmt "\n", ##__VA_ARGS__)
+    #define LOCK() pthread_mutex_lock(&lock)
+    #define UNLOCK() pthread_mutex_unlock(&lock)
+    #define SYNC_LOCK() pthread_mutex_lock(&sync_lock)
+    #define SYNC_UNLOCK() pthread_mutex_unlock(&sync_lock)
+    #define NOW_US() now_us()
+#endif
+
+#define MAX_FILES CONFIG_CAPTURE_CATALOG_MAX_FILES
+#define MAX_MOUNT_LEN 32
+#define PATH_LEN (MAX_MOUNT_LEN + 1 + CAPTURE_CATALOG_NAME_LEN)
+#define SIDECAR_SUFFIX ".idx"           // CAPTURE_INDEX_SUFFIX of capture_index.h
+#define FILE_MAGIC 0x54414343           // "CCAT" little endian
+#define FILE_VERSION 1
+
+// Layout of the catalog file, followed by n entries
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_len;         // sizeof(capture_catalog_entry_t)
+    uint32_t n;
+    uint16_t next_id;
+    uint16_t reserved;
+} file_hdr_t;
+
+//*****************************************************************************
+// The table is compact and in creation order. Everything here changes under
+// LOCK. sync_lock only keeps two syncs from writing the file at once, the
+// table lock is dropped between entries so a sync never holds up a listing
+// for a whole flash write.
+//*****************************************************************************
+
+static capture_catalog_entry_t table[MAX_FILES];
+static uint16_t n_files = 0;
+static uint16_t next_id = 1;
+static uint8_t dirty = 0;
+static uint8_t inited = 0;
+static char mount[MAX_MOUNT_LEN + 1];
+static size_t mount_len;
+static capture_catalog_stats_t stats = {0};
+
+//*****************************************************************************
+// Helpers, the table ones must be called with LOCK held
+//*****************************************************************************
+
+// Name of path relative to the mount or NULL if it is not a file we can track
+static const char* rel_name(const char* path)
+{
+    if(strncmp(path, mount, mount_len) || path[mount_len] != '/')
+    {
+        return NULL;
+    }
+
+    const char* name = path + mount_len + 1;
+    size_t len = strnlen(name, CAPTURE_CATALOG_NAME_LEN + 1);
+    if(len == 0 || len > CAPTURE_CATALOG_NAME_LEN || strchr(name, '/'))
+    {
+        return NULL;
+    }
+    return name;
+}
+
+static int find(const char* name)
+{
+    uint16_t i;
+    for(i = 0; i < n_files; ++i)
+    {
+        if(!strcmp(table[i].name, name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_id(uint16_t id)
+{
+    uint16_t i;
+    for(i = 0; i < n_files; ++i)
+    {
+        if(table[i].id == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Ids only have to be unique among live entries, 0 is never handed out
+static uint16_t new_id(void)
+{
+    uint16_t id;
+    do
+    {
+        id = next_id++;
+    } while(id == 0 || find_id(id) >= 0);
+    return id;
+}
+
+static void drop(uint16_t i)
+{
+    memmove(&table[i], &table[i + 1], (n_files - i - 1) * sizeof(capture_catalog_entry_t));
+    n_files--;
+}
+
+static void add_bssid(capture_catalog_entry_t* e, const uint8_t* bssid)
+{
+    uint8_t j;
+    for(j = 0; j < e->n_bssids; ++j)
+    {
+        if(!memcmp(e->bssids[j], bssid, 6)) { return; }
+    }
+
+    if(e->n_bssids < CAPTURE_CATALOG_MAX_BSSIDS)
+    {
+        memcpy(e->bssids[e->n_bssids++], bssid, 6);
+    }
+    else
+    {
+        e->flags |= CAPTURE_CATALOG_BSSID_OVERFLOW;
+    }
+}
+
+static void catalog_path(char* path)
+{
+    snprintf(path, PATH_LEN + 1, "%s/%s", mount, CONFIG_CAPTURE_CATALOG_FILE);
+}
+
+// Drop the entry of path if there is one
+static void forget(const char* path)
+{
+    const char* name = rel_name(path);
+    if(!name)
+    {
+        return;
+    }
+
+    LOCK();
+    int i = find(name);
+    if(i >= 0)
+    {
+        drop(i);
+        dirty = 1;
+    }
+    UNLOCK();
+}
+
+//*****************************************************************************
+// Boot. Read the table back, then one scan of the mount to fix up whatever
+// happened while we were not looking.
+//*****************************************************************************
+
+static void load(void)
+{
+    char path[PATH_LEN + 1];
+    file_hdr_t h;
+    uint16_t i;
+
+    catalog_path(path);
+    FILE* f = fopen(path, "r");
+    if(!f)
+    {
+        LOGI("No catalog at %s, building one", path);
+        dirty = 1;
+        return;
+    }
+
+    if(fread(&h, 1, sizeof(h), f) != sizeof(h) ||
+       h.magic != FILE_MAGIC ||
+       h.version != FILE_VERSION ||
+       h.entry_len != sizeof(capture_catalog_entry_t) ||
+       h.n > MAX_FILES ||
+       fread(table, sizeof(capture_catalog_entry_t), h.n, f) != h.n)
+    {
+        LOGE("Catalog %s unreadable, rebuilding it", path);
+        n_files = 0;
+        dirty = 1;
+    }
+    else
+    {
+        n_files = h.n;
+        next_id = h.next_id;
+    }
+    fclose(f);
+
+    for(i = 0; i < n_files; ++i)
+    {
+        table[i].name[CAPTURE_CATALOG_NAME_LEN] = 0;
+        table[i].ssid[CAPTURE_CATALOG_SSID_LEN] = 0;
+        if(table[i].n_bssids > CAPTURE_CATALOG_MAX_BSSIDS)
+        {
+            table[i].n_bssids = CAPTURE_CATALOG_MAX_BSSIDS;
+        }
+    }
+}
+
+// Returns 1 if the mount could not be scanned
+static uint8_t reconcile(void)
+{
+    static uint8_t seen[MAX_FILES];
+    char path[PATH_LEN + 1];
+    struct dirent* d;
+    struct stat st;
+    int i;
+
+    DIR* dir = opendir(mount);
+    if(!dir)
+    {
+        LOGE("Failed to open %s - %s", mount, strerror(errno));
+        return 1;
+    }
+
+    memset(seen, 0, sizeof(seen));
+    while((d = readdir(dir)) != NULL)
+    {
+        if(d->d_name[0] == '.')
+        {
+            continue;
+        }
+        if(strlen(d->d_name) > CAPTURE_CATALOG_NAME_LEN)
+        {
+            stats.untracked++;
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%.*s", mount, CAPTURE_CATALOG_NAME_LEN, d->d_name);
+        if(stat(path, &st) || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        // Known file. One that was open when we went down has lost its tail
+        // and we can not vouch for its CRC any more.
+        i = find(d->d_name);
+        if(i >= 0 && !seen[i])
+        {
+            capture_catalog_entry_t* e = &table[i];
+            seen[i] = 1;
+            if((e->flags & CAPTURE_CATALOG_OPEN) || e->size != (uint32_t) st.st_size)
+            {
+                e->flags &= ~(CAPTURE_CATALOG_OPEN | CAPTURE_CATALOG_CRC);
+                e->size = (uint32_t) st.st_size;
+                e->mtime = (uint32_t) st.st_mtime;
+                dirty = 1;
+            }
+            continue;
+        }
+
+        if(n_files == MAX_FILES)
+        {
+            stats.untracked++;
+            continue;
+        }
+
+        capture_catalog_entry_t* e = &table[n_files];
+        memset(e, 0, sizeof(capture_catalog_entry_t));
+        strcpy(e->name, d->d_name);
+        e->id = new_id();
+        e->flags = CAPTURE_CATALOG_FOREIGN;
+        size_t len = strlen(e->name);
+        if(len > 4 && !strcmp(e->name + len - 4, SIDECAR_SUFFIX))
+        {
+            e->flags |= CAPTURE_CATALOG_SIDECAR;
+        }
+        e->size = (uint32_t) st.st_size;
+        e->created = (uint32_t) st.st_mtime;
+        e->mtime = e->created;
+        seen[n_files++] = 1;
+        stats.foreign++;
+        dirty = 1;
+    }
+    closedir(dir);
+
+    // Entries whose file is gone, back to front so seen stays in step
+    for(i = n_files - 1; i >= 0; --i)
+    {
+        if(!seen[i])
+        {
+            drop(i);
+            dirty = 1;
+        }
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// API
+//*****************************************************************************
+
+esp_err_t capture_catalog_init(const char* mount_path)
+{
+    if(inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(strnlen(mount_path, MAX_MOUNT_LEN + 1) > MAX_MOUNT_LEN)
+    {
+        LOGE("Mount path %s too long", mount_path);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    strcpy(mount, mount_path);
+    mount_len = strlen(mount);
+
+    #ifdef ESP_PLATFORM
+    if(!lock)
+    {
+        lock = xSemaphoreCreateBinary();
+        sync_lock = xSemaphoreCreateBinary();
+        if(!lock || !sync_lock)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        assert(xSemaphoreGive(lock) == pdTRUE);
+        assert(xSemaphoreGive(sync_lock) == pdTRUE);
+    }
+    #endif
+
+    load();
+    if(reconcile())
+    {
+        n_files = 0;
+        return ESP_FAIL;
+    }
+
+    inited = 1;
+    capture_catalog_sync();
+
+    LOGI("%u files in the catalog of %s, %lu found that it did not know", n_files, mount,
+         (unsigned long) stats.foreign);
+    if(stats.untracked)
+    {
+        LOGE("%lu files not tracked, catalog full or name too long", (unsigned long) stats.untracked);
+    }
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_open(const char* path, uint8_t fmt, uint8_t flags, const char* ssid)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const char* name = rel_name(path);
+    if(!name)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    LOCK();
+
+    // A file created again over an old one is a new file, it goes to the end
+    int i = find(name);
+    if(i >= 0)
+    {
+        drop(i);
+    }
+
+    if(n_files == MAX_FILES)
+    {
+        stats.untracked++;
+        dirty = 1;
+        UNLOCK();
+        LOGE("Catalog full, %s will not be listed", path);
+        return ESP_ERR_NO_MEM;
+    }
+
+    capture_catalog_entry_t* e = &table[n_files++];
+    memset(e, 0, sizeof(capture_catalog_entry_t));
+    strcpy(e->name, name);
+    if(ssid)
+    {
+        strncpy(e->ssid, ssid, CAPTURE_CATALOG_SSID_LEN);
+    }
+    e->id = new_id();
+    e->flags = (flags & (CAPTURE_CATALOG_SIDECAR | CAPTURE_CATALOG_COMPRESSED)) |
+               CAPTURE_CATALOG_OPEN | CAPTURE_CATALOG_CRC;
+    e->fmt = fmt;
+    e->created = (uint32_t) time(NULL);
+    e->mtime = e->created;
+    dirty = 1;
+
+    UNLOCK();
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_update(const char* path,
+                                 uint32_t size,
+                                 uint32_t crc32,
+                                 uint32_t records,
+                                 const uint8_t* bssids,
+                                 uint8_t n_bssids,
+                                 uint8_t bssid_overflow)
+{
+    uint8_t j;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const char* name = rel_name(path);
+    if(!name)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    LOCK();
+    int i = find(name);
+    if(i < 0)
+    {
+        UNLOCK();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    capture_catalog_entry_t* e = &table[i];
+    e->size = size;
+    e->crc32 = crc32;
+    e->records += records;
+    e->mtime = (uint32_t) time(NULL);
+    for(j = 0; bssids && j < n_bssids; ++j)
+    {
+        add_bssid(e, bssids + 6 * j);
+    }
+    if(bssid_overflow)
+    {
+        e->flags |= CAPTURE_CATALOG_BSSID_OVERFLOW;
+    }
+    UNLOCK();
+
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_close(const char* path, uint32_t size, uint32_t crc32)
+{
+    esp_err_t err = capture_catalog_update(path, size, crc32, 0, NULL, 0, 0);
+    if(err != ESP_OK)
+    {
+        return err;
+    }
+
+    LOCK();
+    int i = find(rel_name(path));
+    if(i >= 0)
+    {
+        table[i].flags &= ~CAPTURE_CATALOG_OPEN;
+        dirty = 1;
+    }
+    UNLOCK();
+
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_delete(const char* path)
+{
+    char idx_path[PATH_LEN + sizeof(SIDECAR_SUFFIX)];
+
+    if(strlen(path) > PATH_LEN)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    snprintf(idx_path, sizeof(idx_path), "%s%s", path, SIDECAR_SUFFIX);
+
+    esp_err_t err = remove(path) ? ESP_ERR_NOT_FOUND : ESP_OK;
+    remove(idx_path);
+
+    if(inited)
+    {
+        forget(path);
+        forget(idx_path);
+    }
+
+    return err;
+}
+
+esp_err_t capture_catalog_clear(void)
+{
+    char path[PATH_LEN + 1];
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for(;;)
+    {
+        LOCK();
+        if(n_files == 0)
+        {
+            UNLOCK();
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/%s", mount, table[n_files - 1].name);
+        UNLOCK();
+
+        LOGI("Removing %s", path);
+        capture_catalog_delete(path);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_sync(void)
+{
+    char path[PATH_LEN + 1];
+    capture_catalog_entry_t e;
+    file_hdr_t h = {0};
+    uint32_t i;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    SYNC_LOCK();
+
+    LOCK();
+    uint8_t was_dirty = dirty;
+    dirty = 0;
+    h.magic = FILE_MAGIC;
+    h.version = FILE_VERSION;
+    h.entry_len = sizeof(capture_catalog_entry_t);
+    h.n = n_files;
+    h.next_id = next_id;
+    UNLOCK();
+
+    if(!was_dirty)
+    {
+        SYNC_UNLOCK();
+        return ESP_OK;
+    }
+
+    // A change landing while we write marks the table dirty again, the next
+    // sync picks it up
+    int64_t start = NOW_US();
+    catalog_path(path);
+    FILE* f = fopen(path, "w");
+    uint8_t failed = !f || fwrite(&h, 1, sizeof(h), f) != sizeof(h);
+    for(i = 0; !failed && i < h.n; ++i)
+    {
+        LOCK();
+        if(i < n_files) { e = table[i]; }
+        else            { memset(&e, 0, sizeof(e)); }
+        UNLOCK();
+        failed = fwrite(&e, 1, sizeof(e), f) != sizeof(e);
+    }
+    if(f && fclose(f))
+    {
+        failed = 1;
+    }
+
+    LOCK();
+    stats.syncs++;
+    stats.sync_us_last = (uint32_t) (NOW_US() - start);
+    if(failed)
+    {
+        stats.sync_errors++;
+        dirty = 1;
+    }
+    UNLOCK();
+
+    SYNC_UNLOCK();
+
+    if(failed)
+    {
+        LOGE("Failed to write %s - %s", path, strerror(errno));
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t capture_catalog_get(uint16_t i, capture_catalog_entry_t* e)
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    if(i < n_files)
+    {
+        *e = table[i];
+        err = ESP_OK;
+    }
+    UNLOCK();
+
+    return err;
+}
+
+esp_err_t capture_catalog_find(const char* name, capture_catalog_entry_t* e)
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    int i = find(name);
+    if(i >= 0)
+    {
+        *e = table[i];
+        err = ESP_OK;
+    }
+    UNLOCK();
+
+    return err;
+}
+
+esp_err_t capture_catalog_find_id(uint16_t id, capture_catalog_entry_t* e)
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    int i = find_id(id);
+    if(i >= 0)
+    {
+        *e = table[i];
+        err = ESP_OK;
+    }
+    UNLOCK();
+
+    return err;
+}
+
+esp_err_t capture_catalog_get_stats(capture_catalog_stats_t* s)
+{
+    if(inited) { LOCK(); }
+    *s = stats;
+    s->n_files = n_files;
+    s->max_files = MAX_FILES;
+    if(inited) { UNLOCK(); }
+
+    return ESP_OK;
+}
@@ -0,0 +1,225 @@
+//*****************************************************************************
+// Capture Catalog. An in RAM table of every capture file on SPIFFS with its
+// size, CRC, creation time, record count and SSID / BSSID tags. Listing SPIFFS
+// with opendir / readdir walks the whole object lookup of the partition and
+// then every file needs a stat on top, which gets slow as the FS fills and
+// tells us nothing about what is in a capture. Instead the capture writer
+// tells the catalog as it creates, grows, closes and deletes files, and the
+// file server and the REPL list straight out of the table.
+//
+// |----------------|  open / update  |------------|  list / find  |-------------|
+// | Capture Writer |---------------->|  RAM table |<--------------| File Server |
+// |  (flush task)  |  close / delete |------------|               |    REPL     |
+// |----------------|                       |                      |-------------|
+//                                          | sync (on change)
+//                                          V
+//                                 <mount>/CONFIG_CAPTURE_CATALOG_FILE
+//
+// Table) Up to CONFIG_CAPTURE_CATALOG_MAX_FILES entries in creation order. A
+//        capture's .idx sidecar is an entry of its own, flagged SIDECAR, so a
+//        listing needs nothing but the table. Every entry gets an id that is
+//        unique while it exists, so a client can be shown a table and ask for
+//        a file of it later even if other files came and went in between. A
+//        file the table has no room for is still written, it is just not
+//        listed, and counted in untracked.
+//
+// Updates) The writer reports size and CRC of what landed on flash plus the
+//          records and BSSIDs of each buffer it flushes. These only change
+//          RAM. Creating, closing and deleting files mark the table dirty and
+//          capture_catalog_sync writes it out, so a rotation (close, delete,
+//          create) costs one small write.
+//
+// Persistence) The table is written as is, behind a small header, to a hidden
+//              file on the mount. At boot it is read back and checked against
+//              one directory scan: entries whose file is gone are dropped, a
+//              file that was open when we lost power takes its size from the
+//              FS and loses its CRC, and files nobody told us about are added
+//              as FOREIGN with only a size. This is the only directory scan.
+//
+// Times) created / mtime come from time(), which is unix time once the wall
+//        clock is set (capture_time_set_epoch, REPL time_set) and seconds
+//        since that boot before it.
+//
+// Assumptions) The FS is mounted before init. Every file under the mount is
+//              created and removed through the catalog, names starting with
+//              '.' are ours and never listed.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+    #include "esp_err.h"
+#else
+    #ifndef ESP_OK
+        typedef int esp_err_t;
+        #define ESP_OK 0
+        #define ESP_FAIL -1
+        #define ESP_ERR_NO_MEM 0x101
+        #define ESP_ERR_INVALID_ARG 0x102
+        #define ESP_ERR_INVALID_STATE 0x103
+        #define ESP_ERR_NOT_FOUND 0x105
+    #endif
+
+    #ifndef CONFIG_CAPTURE_CATALOG_MAX_FILES
+        #define CONFIG_CAPTURE_CATALOG_MAX_FILES 64
+    #endif
+    #ifndef CONFIG_CAPTURE_CATALOG_FILE
+        #define CONFIG_CAPTURE_CATALOG_FILE ".catalog"
+    #endif
+#endif
+
+#define CAPTURE_CATALOG_NAME_LEN 32         // Relative to the mount path
+#define CAPTURE_CATALOG_SSID_LEN 32
+#define CAPTURE_CATALOG_MAX_BSSIDS 4
+
+#define CAPTURE_CATALOG_OPEN 0x01           // Being written, size and CRC still grow
+#define CAPTURE_CATALOG_CRC 0x02            // crc32 is valid for size bytes
+#define CAPTURE_CATALOG_SIDECAR 0x04        // .idx of a capture, see capture_index.h
+#define CAPTURE_CATALOG_COMPRESSED 0x08     // LZ blocks, see capture_lz.h
+#define CAPTURE_CATALOG_FOREIGN 0x10        // Found on the FS, only size is known
+#define CAPTURE_CATALOG_BSSID_OVERFLOW 0x20 // Saw more BSSIDs than kept
+
+typedef struct
+{
+    char name[CAPTURE_CATALOG_NAME_LEN + 1];
+    char ssid[CAPTURE_CATALOG_SSID_LEN + 1];    // Tag given at open, may be empty
+    uint16_t id;                    // Unique while the entry exists
+    uint8_t flags;                  // CAPTURE_CATALOG_*
+    uint8_t fmt;                    // capture_writer_fmt_t
+    uint32_t size;
+    uint32_t crc32;                 // zlib / ethernet CRC of the whole file
+    uint32_t records;               // Records written, frames for pcap(ng)
+    uint32_t created;               // time() at create
+    uint32_t mtime;                 // time() of the last update
+    uint8_t n_bssids;
+    uint8_t bssids[CAPTURE_CATALOG_MAX_BSSIDS][6];
+} capture_catalog_entry_t;
+
+typedef struct
+{
+    uint16_t n_files;               // Entries in the table
+    uint16_t max_files;
+    uint32_t untracked;             // Files created while the table was full
+    uint32_t foreign;               // Files found at boot the table did not know
+    uint32_t syncs;                 // Table writes
+    uint32_t sync_errors;
+    uint32_t sync_us_last;          // Time of the last table write
+} capture_catalog_stats_t;
+
+//*****************************************************************************
+// capture_catalog_init) Load the table of mount_path, reconcile it with one
+//                       directory scan and write it back if that changed
+//                       anything.
+//
+// mount_path) Mount point of the FS, i.e. "/spiffs". Copied.
+//
+// Returns) ESP_OK, INVALID_STATE if already inited, INVALID_ARG if the path is
+//          too long, NO_MEM if the locks could not be created, FAIL if the
+//          mount could not be opened.
+//*****************************************************************************
+esp_err_t capture_catalog_init(const char* mount_path);
+
+//*****************************************************************************
+// capture_catalog_open) Add a file the caller just created. An entry of the
+//                       same name is replaced. Size, CRC and records start
+//                       at 0 and the entry is OPEN until closed.
+//
+// path) Full path, under the mount path.
+// fmt) capture_writer_fmt_t of the file.
+// flags) SIDECAR, COMPRESSED, others are ignored.
+// ssid) SSID tag or NULL.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, INVALID_ARG if the path is not
+//          under the mount or too long, NO_MEM if the table is full.
+//*****************************************************************************
+esp_err_t capture_catalog_open(const char* path, uint8_t fmt, uint8_t flags, const char* ssid);
+
+//*****************************************************************************
+// capture_catalog_update) Account data that landed in an open file. RAM only.
+//
+// path) Full path, under the mount path.
+// size) Bytes now in the file.
+// crc32) CRC of those bytes.
+// records) Records added.
+// bssids) n_bssids BSSIDs seen in the added records, back to back 6 bytes
+//         each. May be NULL.
+// bssid_overflow) The added records saw more BSSIDs than passed.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, NOT_FOUND if untracked.
+//*****************************************************************************
+esp_err_t capture_catalog_update(const char* path,
+                                 uint32_t size,
+                                 uint32_t crc32,
+                                 uint32_t records,
+                                 const uint8_t* bssids,
+                                 uint8_t n_bssids,
+                                 uint8_t bssid_overflow);
+
+//*****************************************************************************
+// capture_catalog_close) The caller closed the file. Sets its final size and
+//                        CRC and clears OPEN.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, NOT_FOUND if untracked.
+//*****************************************************************************
+esp_err_t capture_catalog_close(const char* path, uint32_t size, uint32_t crc32);
+
+//*****************************************************************************
+// capture_catalog_delete) Remove a file, its .idx sidecar and their entries.
+//                         The files are removed even if untracked or the
+//                         catalog is not inited.
+//
+// path) Full path of the capture.
+//
+// Returns) ESP_OK, NOT_FOUND if there was no such file, INVALID_ARG if the
+//          path is too long.
+//*****************************************************************************
+esp_err_t capture_catalog_delete(const char* path);
+
+//*****************************************************************************
+// capture_catalog_clear) Remove every file in the table.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t capture_catalog_clear(void);
+
+//*****************************************************************************
+// capture_catalog_sync) Write the table out if open, close, delete or clear
+//                       changed it since the last write. Does flash IO, not
+//                       for the RX path.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, FAIL if the write failed.
+//*****************************************************************************
+esp_err_t capture_catalog_sync(void);
+
+//*****************************************************************************
+// capture_catalog_get) Copy out the i'th entry, oldest first. Iterate from 0
+//                      until NOT_FOUND. A file deleted mid walk shifts the
+//                      ones after it down one.
+//
+// Returns) ESP_OK, NOT_FOUND past the end, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t capture_catalog_get(uint16_t i, capture_catalog_entry_t* e);
+
+//*****************************************************************************
+// capture_catalog_find) Copy out the entry of a file name.
+//
+// name) Relative to the mount, i.e. "eapol.pkt".
+//
+// Returns) ESP_OK, NOT_FOUND, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t capture_catalog_find(const char* name, capture_catalog_entry_t* e);
+
+//*****************************************************************************
+// capture_catalog_find_id) Copy out the entry with the given id.
+//
+// Returns) ESP_OK, NOT_FOUND if it was deleted, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t capture_catalog_find_id(uint16_t id, capture_catalog_entry_t* e);
+
+//*****************************************************************************
+// capture_catalog_get_stats) Copy out the stats.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t capture_catalog_get_stats(capture_catalog_stats_t* stats);
@@ -0,0 +1,133 @@
+#include <string.h>
+#include <sys/time.h>
+
+#include "capture_time.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char* TAG = "Capture Time";
+
+#define WINDOW_US ((int64_t) CONFIG_CAPTURE_TIME_WINDOW_MS * 1000)
+#define RESYNC_US ((int64_t) CONFIG_CAPTURE_TIME_RESYNC_MS * 1000)
+
+//*****************************************************************************
+// Called from every sniffer cb that stamps frames, so all state is behind a
+// critical section and nothing here blocks.
+//*****************************************************************************
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t synced = 0;
+static int64_t rx_off = 0;          // esp_timer - unwrapped MAC clock
+static int64_t win_min = INT64_MAX; // Smallest esp_timer - MAC this window
+static int64_t win_end = 0;
+static int64_t last_us = 0;         // Last stamp handed out
+static capture_time_stats_t stats;
+
+//*****************************************************************************
+// Public API
+//*****************************************************************************
+
+int64_t capture_time_rx_us(const wifi_pkt_rx_ctrl_t* rx_ctrl)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t rx = rx_ctrl->timestamp;
+
+    portENTER_CRITICAL(&mux);
+
+    if(!synced)
+    {
+        rx_off = now - rx;
+        win_end = now + WINDOW_US;
+        synced = 1;
+    }
+
+    // The 64 bit MAC time congruent to rx closest to where the offset says
+    // the MAC clock is now.
+    int64_t expect = now - rx_off;
+    int64_t mac = expect + (int32_t) (rx - (uint32_t) expect);
+
+    int64_t delay = now - (mac + rx_off);
+    if(delay > RESYNC_US || delay < -RESYNC_US)
+    {
+        ++stats.resyncs;
+        rx_off = now - mac;
+        win_min = INT64_MAX;
+        win_end = now + WINDOW_US;
+    }
+    else if(delay < 0)
+    {
+        // Got here faster than the current offset assumes, never stamp a
+        // frame in the future.
+        rx_off = now - mac;
+    }
+
+    if(now - mac < win_min)
+    {
+        win_min = now - mac;
+    }
+    if(now >= win_end)
+    {
+        rx_off = win_min;
+        win_min = INT64_MAX;
+        win_end = now + WINDOW_US;
+    }
+
+    int64_t ts = mac + rx_off;
+    if(ts < last_us)
+    {
+        ++stats.clamps;
+        ts = last_us;
+    }
+    if(ts > now)
+    {
+        ts = now;
+    }
+    last_us = ts;
+    ++stats.rx_stamps;
+    stats.rx_offset_us = rx_off;
+
+    portEXIT_CRITICAL(&mux);
+    return ts;
+}
+
+uint64_t capture_time_to_wall(int64_t mono_us)
+{
+    portENTER_CRITICAL(&mux);
+    int64_t off = stats.epoch_offset_us;
+    portEXIT_CRITICAL(&mux);
+    return (uint64_t) (mono_us + off);
+}
+
+esp_err_t capture_time_set_epoch(uint64_t unix_us)
+{
+    int64_t now = esp_timer_get_time();
+    if(unix_us < (uint64_t) now)
+    {
+        ESP_LOGE(TAG, "Epoch before boot");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct timeval tv = {
+        .tv_sec = unix_us / 1000000,
+        .tv_usec = unix_us % 1000000
+    };
+    settimeofday(&tv, NULL);
+
+    portENTER_CRITICAL(&mux);
+    stats.epoch_offset_us = (int64_t) unix_us - now;
+    stats.epoch_set = 1;
+    portEXIT_CRITICAL(&mux);
+
+    ESP_LOGI(TAG, "Wall clock set, offset %lld us", (long long) stats.epoch_offset_us);
+    return ESP_OK;
+}
+
+esp_err_t capture_time_get_stats(capture_time_stats_t* out)
+{
+    portENTER_CRITICAL(&mux);
+    memcpy(out, &stats, sizeof(stats));
+    portEXIT_CRITICAL(&mux);
+    return ESP_OK;
+}
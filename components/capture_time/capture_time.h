@@ -0,0 +1,86 @@
+//*****************************************************************************
+// Capture Time. One time base for every capture record. Frames are stamped
+// with when the radio received them, not when our cb happened to run, and
+// the stamps can be turned into wall clock time once an operator has told us
+// what time it is.
+//
+//   rx_ctrl->timestamp  (32 bit, MAC clock, wraps every ~71 min)
+//            |
+//            | unwrap + offset to esp_timer (min delay filter)
+//            V
+//   mono us  (64 bit, esp_timer scale, never goes backwards)
+//            |
+//            | + epoch offset (capture_time_set_epoch, REPL time_set)
+//            V
+//   wall us  (unix time in us, what ends up in pcap / pcapng / index)
+//
+// Monotonic Base) esp_timer_get_time() - rx timestamp is the offset between
+//                 the two clocks plus however long the frame took to reach
+//                 our cb. The smallest value seen over a window of
+//                 CONFIG_CAPTURE_TIME_WINDOW_MS is taken as the offset, so
+//                 the stamps carry the MAC's reception precision while still
+//                 following any drift between the clocks. The 32 bit rx
+//                 timestamp is unwrapped against where the offset says the
+//                 MAC clock should be. If a stamp lands more than
+//                 CONFIG_CAPTURE_TIME_RESYNC_MS away from esp_timer (the MAC
+//                 timer restarted, i.e. wifi restart or modem sleep) we
+//                 resync and count it. Stamps are clamped so they never go
+//                 backwards or past esp_timer.
+//
+// Wall Clock) Until an epoch is set the wall clock is simply time since boot,
+//             i.e. captures start at 1970. Setting the epoch also sets the
+//             system time (settimeofday). The accuracy is that of the message
+//             that carried it, for scripts/time_sync.py over the AP a few ms.
+//             Setting it mid capture makes wall time jump, the monotonic base
+//             never does.
+//
+// Assumptions) Modem / light sleep off while sniffing, the MAC timestamp is
+//              only precise without it (the resync catches the jumps).
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+typedef struct
+{
+    int64_t rx_offset_us;       // esp_timer - MAC clock, current estimate
+    uint32_t rx_stamps;         // Frames stamped
+    uint32_t resyncs;           // MAC clock jumps we resynced on
+    uint32_t clamps;            // Stamps clamped to stay monotonic
+    uint8_t epoch_set;          // Wall clock has been set
+    int64_t epoch_offset_us;    // Wall - mono
+} capture_time_stats_t;
+
+//*****************************************************************************
+// capture_time_rx_us) Monotonic reception time of a frame. Never blocks, safe
+//                     from a pkt sniffer cb.
+//
+// rx_ctrl) Radio meta data of the frame from the promiscuous cb.
+//
+// Returns) us on the esp_timer_get_time scale
+//*****************************************************************************
+int64_t capture_time_rx_us(const wifi_pkt_rx_ctrl_t* rx_ctrl);
+
+//*****************************************************************************
+// capture_time_to_wall) Turn a monotonic stamp into wall clock us. Before an
+//                       epoch is set this is the stamp itself.
+//*****************************************************************************
+uint64_t capture_time_to_wall(int64_t mono_us);
+
+//*****************************************************************************
+// capture_time_set_epoch) Set the wall clock.
+//
+// unix_us) Current unix time in us.
+//
+// Returns) ESP_OK, INVALID_ARG if unix_us is before the current boot time.
+//*****************************************************************************
+esp_err_t capture_time_set_epoch(uint64_t unix_us);
+
+//*****************************************************************************
+// capture_time_get_stats) Copy out the stats.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t capture_time_get_stats(capture_time_stats_t* stats);
@@ -0,0 +1,59 @@
+//*****************************************************************************
+// Capture Index. Sidecar file written next to a pkt capture so a client can
+// find and pull just the part of a capture it cares about instead of the
+// whole file. The capture writer appends one entry per flushed buffer (a
+// "span"), and seals a buffer early once it holds CONFIG_CAPTURE_WRITER_INDEX_PKTS
+// frames so a span never covers more than that many frames.
+//
+// File Layout) <capture path>.idx
+//
+//     | capture_index_hdr_t | entry | entry | ... | entry |
+//
+// Spans) A span is a byte range [offset, offset + len) of the capture file that
+//        holds whole records. In a compressed capture a span is exactly one LZ
+//        block, so any subset of spans concatenated after the file header
+//        (the first data_hdr_len bytes of the capture) is itself a valid
+//        capture file. This is what the file server query sends back.
+//
+// BSSIDs) Up to CAPTURE_INDEX_MAX_BSSIDS distinct BSSIDs are kept per span. If
+//         a span saw more, CAPTURE_INDEX_BSSID_OVERFLOW is set and a BSSID
+//         query must treat the span as a match.
+//
+// Times are the ts_us handed to capture_writer_write_pkt. All fields are
+// little endian, structs are naturally aligned (no padding).
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#define CAPTURE_INDEX_MAGIC 0x58495743      // "CWIX" little endian
+#define CAPTURE_INDEX_VERSION 1
+#define CAPTURE_INDEX_SUFFIX ".idx"
+#define CAPTURE_INDEX_SUFFIX_LEN 4
+#define CAPTURE_INDEX_MAX_BSSIDS 4
+
+#define CAPTURE_INDEX_COMPRESSED 0x01       // Span is one LZ block
+#define CAPTURE_INDEX_BSSID_OVERFLOW 0x02   // Span saw more BSSIDs than kept
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_len;         // sizeof(capture_index_entry_t)
+    uint32_t data_hdr_len;      // Bytes of file header at the start of the capture
+    uint32_t reserved;
+} capture_index_hdr_t;
+
+typedef struct
+{
+    uint64_t first_us;          // ts of the first frame in the span
+    uint64_t last_us;           // ts of the last frame in the span
+    uint32_t offset;            // Offset of the span in the capture file
+    uint32_t len;               // Bytes of the span in the capture file
+    uint16_t n_pkts;
+    uint16_t n_mgmt;
+    uint16_t n_data;
+    uint8_t n_bssids;
+    uint8_t flags;
+    uint8_t bssids[CAPTURE_INDEX_MAX_BSSIDS][6];
+} capture_index_entry_t;
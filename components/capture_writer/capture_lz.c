@@ -0,0 +1,134 @@
+#include <string.h>
+
+#include "capture_lz.h"
+
+#define MIN_MATCH 4
+#define MFLIMIT 12          // Last match must start this far from the end
+#define LAST_LITERALS 5     // Last bytes of a block are always literals
+#define MAX_OFFSET 65535
+
+static uint16_t hash_tab[1 << CAPTURE_LZ_HASH_LOG];
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - CAPTURE_LZ_HASH_LOG);
+}
+
+// Write a length that did not fit in the 4 bit token field
+static inline uint8_t* put_len(uint8_t* op, uint32_t len)
+{
+    while(len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// Emit one sequence. Returns NULL if it would overflow the output.
+static uint8_t* emit(uint8_t* op,
+                     uint8_t* op_end,
+                     const uint8_t* lit,
+                     uint32_t lit_len,
+                     uint16_t offset,
+                     uint32_t match_len)
+{
+    // token + len bytes + literals + offset + len bytes, worst case
+    if(op + 1 + (lit_len / 255) + 1 + lit_len + 2 + (match_len / 255) + 1 > op_end)
+    {
+        return NULL;
+    }
+
+    uint8_t* token = op++;
+    *token = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+    if(lit_len >= 15)
+    {
+        op = put_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    // Last sequence has no match
+    if(match_len == 0)
+    {
+        return op;
+    }
+
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+
+    match_len -= MIN_MATCH;
+    *token |= (uint8_t) (match_len >= 15 ? 15 : match_len);
+    if(match_len >= 15)
+    {
+        op = put_len(op, match_len - 15);
+    }
+
+    return op;
+}
+
+uint32_t capture_lz_compress(const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap)
+{
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + cap;
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+
+    if(n > MAX_OFFSET + 1)
+    {
+        return 0;
+    }
+
+    // Positions are stored + 1 so that 0 means empty
+    memset(hash_tab, 0, sizeof(hash_tab));
+
+    if(n > MFLIMIT)
+    {
+        uint32_t limit = n - MFLIMIT;
+        while(ip < limit)
+        {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash(seq);
+            uint32_t ref = hash_tab[h];
+            hash_tab[h] = (uint16_t) (ip + 1);
+
+            if(ref == 0 || read32(src + ref - 1) != seq)
+            {
+                ++ip;
+                continue;
+            }
+            ref -= 1;
+
+            uint32_t match_len = MIN_MATCH;
+            while(ip + match_len < n - LAST_LITERALS && src[ref + match_len] == src[ip + match_len])
+            {
+                ++match_len;
+            }
+
+            op = emit(op, op_end, src + anchor, ip - anchor, (uint16_t) (ip - ref), match_len);
+            if(!op)
+            {
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = emit(op, op_end, src + anchor, n - anchor, 0, 0);
+    if(!op || op >= op_end)
+    {
+        return 0;
+    }
+
+    return (uint32_t) (op - dst);
+}
@@ -0,0 +1,45 @@
+//*****************************************************************************
+// Capture LZ. Small LZ77 codec used by the capture writer to squeeze capture
+// buffers before they hit flash. 802.11 headers repeat a lot (same BSSID and
+// addresses, counting sequence numbers) so even a tiny window does well.
+//
+// Codec) Each capture buffer is compressed on its own, so the window is the
+//        buffer itself (<= 64K) and every block decodes without any state from
+//        the blocks before it. The payload of a block is a standard LZ4 block
+//        (token, literals, 16 bit offset, match len) so any LZ4 block decoder
+//        can be used on the host. Matches are found greedily through a hash
+//        table of 2^CAPTURE_LZ_HASH_LOG 16 bit positions, which together with
+//        the output buffer of the writer is the entire RAM footprint.
+//
+// Block Layout)
+//
+//     | magic "CWZ1" (4) | raw_len (2) | blk_len (2) | payload (blk_len) |
+//
+//     If blk_len == raw_len the payload is the raw data (it did not compress)
+//     else it is an LZ4 block that inflates to raw_len bytes. A compressed
+//     file is just blocks back to back, see scripts/cw_decompress.py.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#define CAPTURE_LZ_MAGIC 0x315A5743     // "CWZ1" little endian
+#define CAPTURE_LZ_BLOCK_HDR_LEN 8
+#define CAPTURE_LZ_HASH_LOG 12
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t raw_len;
+    uint16_t blk_len;
+} capture_lz_block_hdr_t;
+
+//*****************************************************************************
+// capture_lz_compress) Compress n bytes of src into dst as an LZ4 block.
+//
+// cap) Size of dst. We give up as soon as the output would reach it.
+//
+// Returns) Compressed length, or 0 if it would not fit in cap bytes in which
+//          case the caller should store the data raw.
+//*****************************************************************************
+uint32_t capture_lz_compress(const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap);
@@ -0,0 +1,1116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_spiffs.h"
+#include "esp_rom_crc.h"
+
+#include "capture_writer.h"
+#include "capture_lz.h"
+#include "capture_index.h"
+#include "capture_time.h"
+#include "capture_catalog.h"
+#include "dot11.h"
+
+#if CONFIG_CAPTURE_WRITER_FLASH_LOG
+#include "flash_log.h"
+#endif
+#include "pcap.h"
+#include "pcapng.h"
+
+static const char* TAG = "CAPTURE WRITER";
+
+#define N_BUFS CONFIG_CAPTURE_WRITER_N_BUFS
+#define BUF_SIZE CONFIG_CAPTURE_WRITER_BUF_SIZE
+#define MAX_STREAMS CONFIG_CAPTURE_WRITER_MAX_STREAMS
+#define FLUSH_US ((int64_t) CONFIG_CAPTURE_WRITER_FLUSH_MS * 1000)
+#define MIN_FREE ((int32_t) CONFIG_CAPTURE_WRITER_MIN_FREE_KB * 1024)
+#define INDEX_PKTS CONFIG_CAPTURE_WRITER_INDEX_PKTS
+
+// Items on the flush Q are a buffer index, or a stream index with this bit set
+// to indicate that the stream should be closed
+#define CLOSE_MARKER 0x80
+
+#define NO_BUF -1
+
+// Rotated files are <path>.NNN, the seq wraps back to 000 after 999
+#define SEQ_MOD 1000
+
+typedef enum
+{
+    STREAM_FREE = 0,
+    STREAM_OPEN,
+    STREAM_CLOSING
+} stream_state_t;
+
+typedef struct
+{
+    stream_state_t state;
+    capture_writer_cfg_t cfg;
+    FILE* f;
+    FILE* idx_f;                // Sidecar index or NULL
+    uint16_t log_id;            // Flash log backend, file id of the open file
+    uint8_t log_open;           // ... and if one is open
+    int8_t fill;                // Buffer being filled or NO_BUF
+
+    // Flush task only
+    uint16_t seq;               // Number of the current file of the ring
+    uint16_t first_seq;         // Oldest file of the ring still on disk
+    uint8_t resumed;            // Ring picked up from the files already on disk
+    uint32_t file_bytes;        // Bytes in the current file
+    uint32_t hdr_bytes;         // ... of which are the file header
+    uint32_t file_crc;          // CRC of the file_bytes, for the catalog
+    uint32_t idx_bytes;         // Bytes in the current sidecar index
+    uint32_t idx_crc;
+    int64_t file_start_us;      // When the current file was created
+    uint8_t full;               // Dropping data, FS out of room
+} stream_t;
+
+typedef struct
+{
+    uint8_t stream;
+    uint32_t len;
+    int64_t first_write_us;
+    uint8_t timer_sealed;       // Sealed part full by the flush timer
+    uint16_t records;           // Records appended
+    capture_index_entry_t span; // Index entry of the buffer, offset and len set on flush
+} buf_desc_t;
+
+static uint8_t bufs[N_BUFS][BUF_SIZE];
+static buf_desc_t buf_descs[N_BUFS];
+static uint32_t free_bitmap = 0;
+static stream_t streams[MAX_STREAMS];
+
+static capture_writer_stats_t stats = {0};
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t flush_q;
+static uint8_t inited = 0;
+static int32_t fs_free = 0;     // Estimate of SPIFFS free bytes, flush task only
+static uint8_t log_ready = 0;    // Flash log backend found its partition
+
+#if CONFIG_CAPTURE_WRITER_COMPRESS
+#define COMPRESS_ENABLED 1
+_Static_assert(BUF_SIZE <= 65535, "Compressed block lengths are 16 bit");
+
+// Worst case of a block is a stored buffer, which we never need space for here
+static uint8_t lz_out[BUF_SIZE];
+#else
+#define COMPRESS_ENABLED 0
+#endif
+
+//*****************************************************************************
+// Buffer pool helpers. Must be called inside the critical section
+//*****************************************************************************
+
+static int8_t take_buf(uint8_t stream)
+{
+    int8_t i;
+    for(i = 0; i < N_BUFS; ++i)
+    {
+        if(free_bitmap & (1 << i))
+        {
+            free_bitmap &= ~(1 << i);
+            buf_descs[i].stream = stream;
+            buf_descs[i].len = 0;
+            buf_descs[i].first_write_us = esp_timer_get_time();
+            buf_descs[i].timer_sealed = 0;
+            buf_descs[i].records = 0;
+            memset(&buf_descs[i].span, 0, sizeof(capture_index_entry_t));
+            return i;
+        }
+    }
+
+    return NO_BUF;
+}
+
+static void give_buf(int8_t i)
+{
+    free_bitmap |= (1 << i);
+}
+
+// Detach the fill buffer of a stream. Returns the buffer to be queued for
+// flushing or NO_BUF if there was nothing in it.
+static int8_t seal_fill(stream_t* s)
+{
+    int8_t i = s->fill;
+    s->fill = NO_BUF;
+
+    if(i == NO_BUF)
+    {
+        return NO_BUF;
+    }
+
+    if(buf_descs[i].len == 0)
+    {
+        give_buf(i);
+        return NO_BUF;
+    }
+
+    return i;
+}
+
+// Account a frame in the index entry of the buffer it was appended to
+static void span_add(capture_index_entry_t* e, const dot11_header_t* hdr, uint64_t ts_us)
+{
+    const uint8_t* bssid = NULL;
+    uint8_t j;
+
+    if(e->n_pkts == 0) { e->first_us = ts_us; }
+    e->last_us = ts_us;
+    e->n_pkts++;
+
+    if(hdr->type == PKT_MGMT)      { e->n_mgmt++; }
+    else if(hdr->type == PKT_DATA) { e->n_data++; }
+
+    // Which addr is the BSSID depends on the to / from DS bits
+    if(hdr->ds_status == 0)      { bssid = hdr->addr3; }
+    else if(hdr->ds_status == 1) { bssid = hdr->addr1; }
+    else if(hdr->ds_status == 2) { bssid = hdr->addr2; }
+
+    if(!bssid) { return; }
+
+    for(j = 0; j < e->n_bssids; ++j)
+    {
+        if(!memcmp(e->bssids[j], bssid, 6)) { return; }
+    }
+
+    if(e->n_bssids < CAPTURE_INDEX_MAX_BSSIDS)
+    {
+        memcpy(e->bssids[e->n_bssids++], bssid, 6);
+    }
+    else
+    {
+        e->flags |= CAPTURE_INDEX_BSSID_OVERFLOW;
+    }
+}
+
+static void queue_item(uint8_t item)
+{
+    // Q is sized to hold every buffer plus a close marker per stream so this
+    // can never fail
+    assert(xQueueSend(flush_q, &item, 0) == pdTRUE);
+}
+
+//*****************************************************************************
+// Flush task. Only this task ever touches the FILE* of a stream.
+//*****************************************************************************
+
+static uint8_t is_log(stream_t* s)
+{
+    return s->cfg.backend == CAPTURE_BACKEND_FLASH_LOG;
+}
+
+static uint8_t is_rotating(stream_t* s)
+{
+    return s->cfg.rotate.max_bytes || s->cfg.rotate.max_secs;
+}
+
+static void file_path(stream_t* s, uint16_t seq, char* path)
+{
+    if(is_rotating(s))
+    {
+        snprintf(path, CAPTURE_WRITER_PATH_LEN + 1, "%s.%03u", s->cfg.path, seq);
+    }
+    else
+    {
+        strcpy(path, s->cfg.path);
+    }
+}
+
+static void index_path(stream_t* s, uint16_t seq, char* path)
+{
+    file_path(s, seq, path);
+    strcat(path, CAPTURE_INDEX_SUFFIX);
+}
+
+// Number of files of the ring, first_seq up to but not including seq
+static uint16_t ring_files(stream_t* s)
+{
+    return (s->seq + SEQ_MOD - s->first_seq) % SEQ_MOD;
+}
+
+// Carry a rotating stream on after the files of its ring already on disk,
+// from an earlier open or boot, instead of writing over them from 000. Those
+// are a run of suffixes, possibly wrapped past 999, the newest is the one
+// whose next suffix is free.
+static void resume_seq(stream_t* s)
+{
+    static uint8_t present[SEQ_MOD];
+    char dir_path[CAPTURE_WRITER_PATH_LEN + 1];
+    struct dirent* d;
+    uint16_t seq, end, n;
+    uint8_t any = 0;
+    char* end_ptr;
+
+    strcpy(dir_path, s->cfg.path);
+    char* slash = strrchr(dir_path, '/');
+    if(!slash)
+    {
+        return;
+    }
+    *slash = 0;
+    const char* base = s->cfg.path + (slash - dir_path) + 1;
+    size_t base_len = strlen(base);
+
+    DIR* dir = opendir(dir_path);
+    if(!dir)
+    {
+        return;
+    }
+
+    memset(present, 0, sizeof(present));
+    while((d = readdir(dir)) != NULL)
+    {
+        if(strlen(d->d_name) != base_len + CAPTURE_WRITER_ROTATE_SUFFIX_LEN ||
+           strncmp(d->d_name, base, base_len) || d->d_name[base_len] != '.')
+        {
+            continue;
+        }
+
+        seq = (uint16_t) strtoul(d->d_name + base_len + 1, &end_ptr, 10);
+        if(*end_ptr == 0 && end_ptr == d->d_name + base_len + CAPTURE_WRITER_ROTATE_SUFFIX_LEN)
+        {
+            present[seq] = 1;
+            any = 1;
+        }
+    }
+    closedir(dir);
+
+    if(!any)
+    {
+        return;
+    }
+
+    end = SEQ_MOD - 1;
+    for(seq = 0; seq < SEQ_MOD; ++seq)
+    {
+        if(present[seq] && !present[(seq + 1) % SEQ_MOD])
+        {
+            end = seq;
+            break;
+        }
+    }
+
+    s->seq = (end + 1) % SEQ_MOD;
+    s->first_seq = end;
+    for(n = 1; n < SEQ_MOD - 1 && present[(s->first_seq + SEQ_MOD - 1) % SEQ_MOD]; ++n)
+    {
+        s->first_seq = (s->first_seq + SEQ_MOD - 1) % SEQ_MOD;
+    }
+
+    ESP_LOGI(TAG, "%s resumes at .%03u, %u files on disk", s->cfg.path, s->seq, ring_files(s));
+}
+
+static void refresh_free(void)
+{
+    size_t total = 0, used = 0;
+    if(esp_spiffs_info(NULL, &total, &used) == ESP_OK)
+    {
+        fs_free = (int32_t) (total - used);
+    }
+}
+
+static void delete_oldest(stream_t* s)
+{
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+
+    // The flash log is a ring, old files are overwritten not deleted
+    if(is_log(s))
+    {
+        s->first_seq = (s->first_seq + 1) % SEQ_MOD;
+        return;
+    }
+
+    // Takes the sidecar index along
+    file_path(s, s->first_seq, path);
+    capture_catalog_delete(path);
+    s->first_seq = (s->first_seq + 1) % SEQ_MOD;
+    stats.files_deleted++;
+    ESP_LOGI(TAG, "Ring full, removed %s", path);
+}
+
+static void close_file(stream_t* s)
+{
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+
+    #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+    if(s->log_open)
+    {
+        flash_log_close(s->log_id);
+        s->log_open = 0;
+    }
+    #endif
+
+    if(s->f)
+    {
+        fclose(s->f);
+        s->f = NULL;
+        file_path(s, s->seq, path);
+        capture_catalog_close(path, s->file_bytes, s->file_crc);
+    }
+
+    if(s->idx_f)
+    {
+        fclose(s->idx_f);
+        s->idx_f = NULL;
+        index_path(s, s->seq, path);
+        capture_catalog_close(path, s->idx_bytes, s->idx_crc);
+    }
+}
+
+// Create the sidecar index of the current file. A failure here only costs us
+// the index, the capture itself carries on.
+static void open_index(stream_t* s, uint32_t hdr_bytes)
+{
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+    capture_index_hdr_t h = {0};
+
+    index_path(s, s->seq, path);
+    s->idx_f = fopen(path, "w");
+    if(!s->idx_f)
+    {
+        ESP_LOGE(TAG, "Failed to open %s - %s", path, strerror(errno));
+        stats.write_errors++;
+        return;
+    }
+    setvbuf(s->idx_f, NULL, _IONBF, 0);
+
+    h.magic = CAPTURE_INDEX_MAGIC;
+    h.version = CAPTURE_INDEX_VERSION;
+    h.entry_len = sizeof(capture_index_entry_t);
+    h.data_hdr_len = hdr_bytes;
+    if(fwrite(&h, 1, sizeof(h), s->idx_f) != sizeof(h))
+    {
+        ESP_LOGE(TAG, "Failed to write index header to %s", path);
+        stats.write_errors++;
+    }
+    fs_free -= sizeof(h);
+    s->idx_bytes = sizeof(h);
+    s->idx_crc = esp_rom_crc32_le(0, (const uint8_t*) &h, sizeof(h));
+
+    capture_catalog_open(path, CAPTURE_FMT_RAW, CAPTURE_CATALOG_SIDECAR, s->cfg.ssid);
+    capture_catalog_update(path, s->idx_bytes, s->idx_crc, 0, NULL, 0, 0);
+}
+
+static void write_index(stream_t* s, capture_index_entry_t* e, uint32_t offset, uint32_t len)
+{
+    if(!s->idx_f)
+    {
+        return;
+    }
+
+    e->offset = offset;
+    e->len = len;
+    if(s->cfg.compress) { e->flags |= CAPTURE_INDEX_COMPRESSED; }
+
+    if(fwrite(e, 1, sizeof(capture_index_entry_t), s->idx_f) != sizeof(capture_index_entry_t))
+    {
+        ESP_LOGE(TAG, "Failed to write index entry for %s", s->cfg.path);
+        stats.write_errors++;
+        return;
+    }
+    fs_free -= sizeof(capture_index_entry_t);
+    s->idx_bytes += sizeof(capture_index_entry_t);
+    s->idx_crc = esp_rom_crc32_le(s->idx_crc, (const uint8_t*) e, sizeof(capture_index_entry_t));
+    stats.index_entries++;
+}
+
+// Write to the current file of the stream, whichever backend it is on.
+// Returns 1 on failure
+static uint8_t sink_write(stream_t* s, const void* data, uint32_t len)
+{
+    #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+    if(is_log(s))
+    {
+        return flash_log_append(s->log_id, data, len) != ESP_OK;
+    }
+    #endif
+
+    if(fwrite(data, 1, len, s->f) != len)
+    {
+        return 1;
+    }
+    s->file_crc = esp_rom_crc32_le(s->file_crc, data, len);
+    return 0;
+}
+
+// Write a compressed block header. Returns 1 on failure
+static uint8_t write_block_hdr(stream_t* s, uint32_t raw_len, uint32_t blk_len)
+{
+    capture_lz_block_hdr_t h;
+    h.magic = CAPTURE_LZ_MAGIC;
+    h.raw_len = (uint16_t) raw_len;
+    h.blk_len = (uint16_t) blk_len;
+
+    return sink_write(s, &h, sizeof(h));
+}
+
+static uint8_t open_sink(stream_t* s, char* path)
+{
+    #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+    if(is_log(s))
+    {
+        if(flash_log_open(path, &s->log_id) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open %s in the flash log", path);
+            stats.write_errors++;
+            return 1;
+        }
+        s->log_open = 1;
+        return 0;
+    }
+    #endif
+
+    s->f = fopen(path, "w");
+    if(!s->f)
+    {
+        ESP_LOGE(TAG, "Failed to open %s - %s", path, strerror(errno));
+        stats.write_errors++;
+        return 1;
+    }
+
+    // We do our own buffering, dont let newlib copy everything a second time
+    setvbuf(s->f, NULL, _IONBF, 0);
+    return 0;
+}
+
+static uint8_t ensure_file(stream_t* s)
+{
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+    uint32_t hdr_bytes = s->cfg.file_hdr_len;
+
+    if(s->f || s->log_open)
+    {
+        return 0;
+    }
+
+    if(!s->resumed && is_rotating(s) && !is_log(s))
+    {
+        resume_seq(s);
+        s->resumed = 1;
+    }
+
+    file_path(s, s->seq, path);
+    if(open_sink(s, path))
+    {
+        return 1;
+    }
+    s->file_crc = 0;
+
+    // The file header is tiny, in a compressed file it is stored as is in a
+    // block of its own so the file is blocks from the first byte
+    if(s->cfg.compress && hdr_bytes)
+    {
+        hdr_bytes += CAPTURE_LZ_BLOCK_HDR_LEN;
+        if(write_block_hdr(s, s->cfg.file_hdr_len, s->cfg.file_hdr_len))
+        {
+            ESP_LOGE(TAG, "Failed to write block header to %s", path);
+            stats.write_errors++;
+        }
+    }
+
+    if(s->cfg.file_hdr_len && sink_write(s, s->cfg.file_hdr, s->cfg.file_hdr_len))
+    {
+        ESP_LOGE(TAG, "Failed to write file header to %s", path);
+        stats.write_errors++;
+    }
+
+    // File creation is rare, take the chance to resync the free estimate
+    if(!is_log(s))
+    {
+        refresh_free();
+        fs_free -= hdr_bytes;
+    }
+    s->file_bytes = hdr_bytes;
+    s->hdr_bytes = hdr_bytes;
+
+    // The flash log has a catalog of its own
+    if(!is_log(s))
+    {
+        capture_catalog_open(path, s->cfg.fmt, s->cfg.compress ? CAPTURE_CATALOG_COMPRESSED : 0, s->cfg.ssid);
+        capture_catalog_update(path, s->file_bytes, s->file_crc, 0, NULL, 0, 0);
+    }
+
+    if(s->cfg.index)
+    {
+        open_index(s, hdr_bytes);
+    }
+    s->file_start_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Opened %s", path);
+    return 0;
+}
+
+// Roll the stream to its next file if the current one is big or old enough
+static void maybe_rotate(stream_t* s, uint32_t len)
+{
+    if((!s->f && !s->log_open) || !is_rotating(s) || s->file_bytes <= s->hdr_bytes)
+    {
+        return;
+    }
+
+    capture_writer_rotate_t* r = &s->cfg.rotate;
+    int64_t age_us = esp_timer_get_time() - s->file_start_us;
+
+    if((r->max_bytes && s->file_bytes + len > r->max_bytes) ||
+       (r->max_secs && age_us >= (int64_t) r->max_secs * 1000 * 1000))
+    {
+        close_file(s);
+        s->seq = (s->seq + 1) % SEQ_MOD;
+        stats.rotations++;
+
+        // Without max_files the ring still can not outgrow the suffixes
+        uint16_t keep = r->max_files ? r->max_files : SEQ_MOD - 1;
+        while(ring_files(s) >= keep)
+        {
+            delete_oldest(s);
+        }
+    }
+}
+
+// Returns 1 if len bytes can not be written without dipping into the reserve
+static uint8_t make_room(stream_t* s, uint32_t len)
+{
+    if(is_log(s) || fs_free - (int32_t) len >= MIN_FREE)
+    {
+        return 0;
+    }
+
+    // Estimate says we are low, see what SPIFFS actually says before acting
+    refresh_free();
+
+    while(fs_free - (int32_t) len < MIN_FREE)
+    {
+        if(!is_rotating(s) || s->first_seq == s->seq)
+        {
+            return 1;
+        }
+
+        delete_oldest(s);
+        refresh_free();
+    }
+
+    return 0;
+}
+
+// Compress buffer i if the stream asks for it. Sets data and returns the bytes
+// of payload to write, a stored block if the buffer did not compress.
+static uint32_t compress_buf(stream_t* s, int8_t i, const uint8_t** data)
+{
+    uint32_t len = buf_descs[i].len;
+    *data = bufs[i];
+
+    #if CONFIG_CAPTURE_WRITER_COMPRESS
+    if(s->cfg.compress)
+    {
+        int64_t start = esp_timer_get_time();
+        uint32_t n = capture_lz_compress(bufs[i], len, lz_out, len);
+        stats.comp_us += (uint64_t) (esp_timer_get_time() - start);
+        stats.comp_in += len;
+        stats.comp_out += CAPTURE_LZ_BLOCK_HDR_LEN + (n ? n : len);
+
+        if(n)
+        {
+            *data = lz_out;
+            return n;
+        }
+    }
+    #endif
+
+    return len;
+}
+
+// Tell the catalog what buffer i added to the current file of the stream
+static void catalog_update(stream_t* s, int8_t i)
+{
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+    capture_index_entry_t* e = &buf_descs[i].span;
+
+    if(is_log(s))
+    {
+        return;
+    }
+
+    file_path(s, s->seq, path);
+    capture_catalog_update(path, s->file_bytes, s->file_crc, buf_descs[i].records,
+                           (const uint8_t*) e->bssids, e->n_bssids,
+                           e->flags & CAPTURE_INDEX_BSSID_OVERFLOW);
+
+    if(s->idx_f)
+    {
+        index_path(s, s->seq, path);
+        capture_catalog_update(path, s->idx_bytes, s->idx_crc, 0, NULL, 0, 0);
+    }
+}
+
+static void flush_buf(int8_t i)
+{
+    stream_t* s = &streams[buf_descs[i].stream];
+    uint32_t len = buf_descs[i].len;
+    uint32_t written = 0;
+    const uint8_t* data;
+
+    int64_t start = esp_timer_get_time();
+
+    // Compression runs here in the flush task, never on the RX path
+    uint32_t blk_len = compress_buf(s, i, &data);
+    uint32_t flash_len = blk_len + (s->cfg.compress ? CAPTURE_LZ_BLOCK_HDR_LEN : 0);
+
+    maybe_rotate(s, flash_len);
+    if(!ensure_file(s))
+    {
+        if(make_room(s, flash_len))
+        {
+            if(!s->full)
+            {
+                ESP_LOGE(TAG, "SPIFFS low on space, dropping capture data for %s", s->cfg.path);
+            }
+            s->full = 1;
+            stats.full_drops += len;
+        }
+        else if((s->cfg.compress && write_block_hdr(s, len, blk_len)) ||
+                sink_write(s, data, blk_len))
+        {
+            ESP_LOGE(TAG, "Failed to write %lu bytes to %s", flash_len, s->cfg.path);
+            stats.write_errors++;
+        }
+        else
+        {
+            write_index(s, &buf_descs[i].span, s->file_bytes, flash_len);
+            s->full = 0;
+            s->file_bytes += flash_len;
+            fs_free -= flash_len;
+            written = flash_len;
+            catalog_update(s, i);
+        }
+
+        #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+        // A quiet stream should land within the flush period, dont leave its
+        // tail staged in the flash log
+        if(is_log(s) && buf_descs[i].timer_sealed)
+        {
+            flash_log_sync();
+        }
+        #endif
+    }
+    uint32_t dt = (uint32_t) (esp_timer_get_time() - start);
+
+    portENTER_CRITICAL(&mux);
+    stats.bytes_buffered -= len;
+    stats.bytes_written += written;
+    stats.flushes++;
+    stats.flush_us_last = dt;
+    stats.flush_us_total += dt;
+    if(dt > stats.flush_us_max) { stats.flush_us_max = dt; }
+    give_buf(i);
+    portEXIT_CRITICAL(&mux);
+}
+
+static void close_stream(uint8_t stream)
+{
+    stream_t* s = &streams[stream];
+
+    // Make sure a capture with no records still leaves a valid file behind
+    ensure_file(s);
+    close_file(s);
+
+    ESP_LOGI(TAG, "Closed %s", s->cfg.path);
+
+    portENTER_CRITICAL(&mux);
+    s->state = STREAM_FREE;
+    portEXIT_CRITICAL(&mux);
+}
+
+// Seal any fill buffer that has sat in RAM longer than the flush period
+static void seal_stale(void)
+{
+    uint8_t j;
+    int8_t i;
+    int64_t now = esp_timer_get_time();
+
+    for(j = 0; j < MAX_STREAMS; ++j)
+    {
+        portENTER_CRITICAL(&mux);
+        i = NO_BUF;
+        if(streams[j].state == STREAM_OPEN &&
+           streams[j].fill != NO_BUF &&
+           (now - buf_descs[streams[j].fill].first_write_us) >= FLUSH_US)
+        {
+            i = seal_fill(&streams[j]);
+        }
+        portEXIT_CRITICAL(&mux);
+
+        if(i != NO_BUF)
+        {
+            buf_descs[i].timer_sealed = 1;
+            stats.timer_flushes++;
+            queue_item((uint8_t) i);
+        }
+    }
+}
+
+static void flush_task(void* args)
+{
+    uint8_t item;
+
+    while(1)
+    {
+        TickType_t wait = CONFIG_CAPTURE_WRITER_FLUSH_MS / portTICK_PERIOD_MS;
+
+        #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+        // Queue is drained, spend the idle time erasing ahead in the flash
+        // log so writes don't have to
+        if(log_ready && uxQueueMessagesWaiting(flush_q) == 0)
+        {
+            flash_log_maintain();
+        }
+        #endif
+
+        if(xQueueReceive(flush_q, &item, wait))
+        {
+            if(item & CLOSE_MARKER)
+            {
+                close_stream(item & ~CLOSE_MARKER);
+            }
+            else
+            {
+                flush_buf((int8_t) item);
+            }
+
+            // Files created, closed or deleted above go out to the catalog
+            capture_catalog_sync();
+        }
+
+        // Every pass, not just when the queue is idle. A busy stream keeps
+        // the queue going and must not hold back the flush of a quiet one.
+        seal_stale();
+    }
+}
+
+//*****************************************************************************
+// Formats
+//*****************************************************************************
+
+static void fill_file_hdr(capture_writer_cfg_t* cfg)
+{
+    if(cfg->fmt == CAPTURE_FMT_PCAPNG)
+    {
+        cfg->file_hdr_len = pcapng_file_header(cfg->file_hdr);
+    }
+    else if(cfg->fmt == CAPTURE_FMT_PCAP)
+    {
+        pcap_file_header_t file_hdr = {0};
+        file_hdr.magic = PCAP_MAGIC;
+        file_hdr.linktype = DOT11_LINK_TYPE;
+        file_hdr.snaplen = 0xffff;
+        file_hdr.version_major = 2;
+        file_hdr.version_minor = 4;
+        memcpy(cfg->file_hdr, &file_hdr, sizeof(pcap_file_header_t));
+        cfg->file_hdr_len = sizeof(pcap_file_header_t);
+    }
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t capture_writer_init(void)
+{
+    if(inited)
+    {
+        ESP_LOGE(TAG, "Already inited");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    flush_q = xQueueCreate(N_BUFS + MAX_STREAMS, sizeof(uint8_t));
+    if(flush_q == 0)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    free_bitmap = (1 << N_BUFS) - 1;
+    memset(streams, 0, sizeof(streams));
+
+    #if CONFIG_CAPTURE_WRITER_FLASH_LOG
+    // No capture partition just means no flash log backend, not a failure
+    flash_log_dev_t dev;
+    if(flash_log_dev_esp_init(&dev, CONFIG_FLASH_LOG_PARTITION_LABEL) == ESP_OK &&
+       flash_log_init(&dev) == ESP_OK)
+    {
+        log_ready = 1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Flash log backend unavailable");
+    }
+    #endif
+
+    TaskHandle_t h = NULL;
+    xTaskCreate(flush_task,
+                "cap_flush",
+                CONFIG_CAPTURE_WRITER_STACK_SIZE,
+                NULL,
+                CONFIG_CAPTURE_WRITER_PRIO,
+                &h);
+    if(!h)
+    {
+        ESP_LOGE(TAG, "Failed to launch flush task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    inited = 1;
+    ESP_LOGI(TAG, "Inited %d x %d byte buffers", N_BUFS, BUF_SIZE);
+    return ESP_OK;
+}
+
+esp_err_t capture_writer_open(capture_writer_cfg_t* cfg, uint8_t* stream)
+{
+    if(!inited)
+    {
+        ESP_LOGE(TAG, "Open called before init");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t max_path = CAPTURE_WRITER_PATH_LEN;
+    if(cfg->rotate.max_bytes || cfg->rotate.max_secs)
+    {
+        max_path -= CAPTURE_WRITER_ROTATE_SUFFIX_LEN;
+    }
+    if(cfg->index)
+    {
+        max_path -= CAPTURE_INDEX_SUFFIX_LEN;
+    }
+
+    if(cfg->file_hdr_len > CONFIG_CAPTURE_WRITER_MAX_FILE_HDR ||
+       strnlen(cfg->path, CAPTURE_WRITER_PATH_LEN + 1) > max_path ||
+       cfg->rotate.max_files >= SEQ_MOD ||
+       (cfg->compress && !COMPRESS_ENABLED) ||
+       (cfg->backend == CAPTURE_BACKEND_FLASH_LOG && (!log_ready || cfg->index)))
+    {
+        ESP_LOGE(TAG, "Invalid stream config");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    capture_writer_cfg_t c;
+    memcpy(&c, cfg, sizeof(capture_writer_cfg_t));
+    fill_file_hdr(&c);
+
+    uint8_t i;
+    portENTER_CRITICAL(&mux);
+    for(i = 0; i < MAX_STREAMS; ++i)
+    {
+        if(streams[i].state == STREAM_FREE)
+        {
+            memset(&streams[i], 0, sizeof(stream_t));
+            memcpy(&streams[i].cfg, &c, sizeof(capture_writer_cfg_t));
+            streams[i].fill = NO_BUF;
+            streams[i].state = STREAM_OPEN;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mux);
+
+    if(i == MAX_STREAMS)
+    {
+        ESP_LOGE(TAG, "All %d streams in use", MAX_STREAMS);
+        return ESP_ERR_NO_MEM;
+    }
+
+    *stream = i;
+    return ESP_OK;
+}
+
+// Append a record, if hdr is set the record is an 802.11 frame and is
+// accounted in the index of the buffer it lands in
+static esp_err_t append(uint8_t stream,
+                        const capture_writer_iov_t* iov,
+                        uint8_t n,
+                        const dot11_header_t* hdr,
+                        uint64_t ts_us)
+{
+    uint32_t need = 0;
+    uint8_t j;
+
+    for(j = 0; j < n; ++j)
+    {
+        need += iov[j].len;
+    }
+
+    if(stream >= MAX_STREAMS)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(need > BUF_SIZE)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    stream_t* s = &streams[stream];
+    int8_t sealed = NO_BUF;
+    esp_err_t e = ESP_OK;
+
+    portENTER_CRITICAL(&mux);
+
+    if(s->state != STREAM_OPEN)
+    {
+        e = ESP_ERR_INVALID_STATE;
+        goto write_end;
+    }
+
+    // Seal on a full buffer, or a full index span
+    if(s->fill != NO_BUF &&
+       (buf_descs[s->fill].len + need > BUF_SIZE ||
+        (s->cfg.index && buf_descs[s->fill].span.n_pkts >= INDEX_PKTS)))
+    {
+        sealed = seal_fill(s);
+    }
+
+    if(s->fill == NO_BUF)
+    {
+        s->fill = take_buf(stream);
+        if(s->fill == NO_BUF)
+        {
+            stats.overruns++;
+            e = ESP_ERR_NO_MEM;
+            goto write_end;
+        }
+    }
+
+    uint8_t* dst = bufs[s->fill] + buf_descs[s->fill].len;
+    for(j = 0; j < n; ++j)
+    {
+        if(iov[j].len)
+        {
+            memcpy(dst, iov[j].base, iov[j].len);
+            dst += iov[j].len;
+        }
+    }
+    buf_descs[s->fill].len += need;
+    buf_descs[s->fill].records++;
+    if(hdr)
+    {
+        span_add(&buf_descs[s->fill].span, hdr, ts_us);
+    }
+    stats.bytes_buffered += need;
+    stats.records++;
+
+    write_end:
+    portEXIT_CRITICAL(&mux);
+
+    if(sealed != NO_BUF)
+    {
+        queue_item((uint8_t) sealed);
+    }
+
+    return e;
+}
+
+esp_err_t capture_writer_writev(uint8_t stream,
+                                const capture_writer_iov_t* iov,
+                                uint8_t n)
+{
+    return append(stream, iov, n, NULL, 0);
+}
+
+esp_err_t capture_writer_write(uint8_t stream,
+                               const void* hdr,
+                               uint16_t hdr_len,
+                               const void* body,
+                               uint16_t body_len)
+{
+    capture_writer_iov_t iov[2] = 
+    {
+        { .base = hdr, .len = hdr_len },
+        { .base = body, .len = body_len }
+    };
+
+    return capture_writer_writev(stream, iov, 2);
+}
+
+esp_err_t capture_writer_write_pkt(uint8_t stream,
+                                   const void* pkt,
+                                   uint16_t len,
+                                   const wifi_pkt_rx_ctrl_t* rx_ctrl,
+                                   uint64_t ts_us,
+                                   uint8_t has_fcs)
+{
+    if(stream >= MAX_STREAMS)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Frames too short to hold a header are not indexed
+    const dot11_header_t* hdr = (len >= sizeof(dot11_header_t)) ? (const dot11_header_t*) pkt : NULL;
+    uint64_t wall_us = capture_time_to_wall((int64_t) ts_us);
+
+    if(streams[stream].cfg.fmt == CAPTURE_FMT_PCAPNG)
+    {
+        pcapng_epb_t epb;
+        pcapng_build_epb(&epb, wall_us, rx_ctrl, len, has_fcs);
+
+        capture_writer_iov_t iov[3] = 
+        {
+            { .base = epb.hdr, .len = epb.hdr_len },
+            { .base = pkt, .len = len },
+            { .base = epb.trailer, .len = epb.trailer_len }
+        };
+        return append(stream, iov, 3, hdr, wall_us);
+    }
+    else if(streams[stream].cfg.fmt == CAPTURE_FMT_PCAP)
+    {
+        pcap_pkthdr_t pkt_hdr;
+        pkt_hdr.ts_sec = (uint32_t) (wall_us / 1000000);
+        pkt_hdr.ts_usec = (uint32_t) (wall_us % 1000000);
+        pkt_hdr.caplen = len;
+        pkt_hdr.len = len;
+        capture_writer_iov_t iov[2] = 
+        {
+            { .base = &pkt_hdr, .len = sizeof(pcap_pkthdr_t) },
+            { .base = pkt, .len = len }
+        };
+        return append(stream, iov, 2, hdr, wall_us);
+    }
+
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t capture_writer_close(uint8_t stream)
+{
+    if(stream >= MAX_STREAMS)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    stream_t* s = &streams[stream];
+    int8_t sealed;
+
+    portENTER_CRITICAL(&mux);
+    if(s->state != STREAM_OPEN)
+    {
+        portEXIT_CRITICAL(&mux);
+        return ESP_ERR_INVALID_STATE;
+    }
+    sealed = seal_fill(s);
+    s->state = STREAM_CLOSING;
+    portEXIT_CRITICAL(&mux);
+
+    if(sealed != NO_BUF)
+    {
+        queue_item((uint8_t) sealed);
+    }
+    queue_item(CLOSE_MARKER | stream);
+
+    return ESP_OK;
+}
+
+capture_writer_stats_t* capture_writer_get_stats(void)
+{
+    return &stats;
+}
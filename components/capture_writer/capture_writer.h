@@ -0,0 +1,275 @@
+//*****************************************************************************
+// Capture Writer. Shared service for getting captured frames from the RX path
+// onto flash. Writing to SPIFFS directly from a pkt sniffer call back means
+// every frame eats the full flash latency (page writes, erases, GC) on the
+// wifi task. Instead producers append records into RAM buffers and a low prio
+// task flushes those buffers to flash.
+//
+// |----------|   append    |---------------|  full / timer  |-------------|
+// | Producer |------------>| Stream's fill |--------------->|  Flush Q    |
+// | (RX cb)  |  (no block) |    buffer     |                |-------------|
+// |----------|             |---------------|                       |
+//                                 ^                                |
+//                                 | free buffer                    V
+//                          |---------------|    fwrite     |-------------|
+//                          |  Buffer Pool  |<--------------| Flush Task  |--> SPIFFS
+//                          |---------------|               |-------------|
+//
+// Buffers) We have a single static pool of CONFIG_CAPTURE_WRITER_N_BUFS buffers
+//          each of CONFIG_CAPTURE_WRITER_BUF_SIZE bytes shared by all streams.
+//          A stream owns at most one "fill" buffer at a time. When a record
+//          does not fit in the fill buffer, the fill buffer is sealed and sent
+//          to the flush task and a fresh one is taken from the pool. With 2
+//          buffers and one stream this is a classic double buffer. Full
+//          buffers are a multiple of the SPIFFS page size so flash writes are
+//          whole pages. A partially filled buffer is flushed once it is older
+//          than CONFIG_CAPTURE_WRITER_FLUSH_MS so a quiet stream still lands.
+//
+// Overruns) If no buffer is free when a producer appends, the record is
+//           dropped and counted as an overrun. A producer NEVER waits on flash.
+//
+// Streams) A stream is one capture file. Opening a stream only claims a slot,
+//          the file itself is created lazily by the flush task (so open and
+//          close are safe to call from a sniffer cb). The configured file
+//          header (i.e. the pcap file header) is written by the flush task
+//          when the file is created. Closing seals the fill buffer and queues
+//          a close marker behind it, so everything appended before the close
+//          lands in the file.
+//
+// Rotation) A stream can be told to roll to a new file after max_bytes or
+//           max_secs. The files of a rotating stream are named <path>.NNN
+//           with NNN counting up from 000 and wrapping after 999. If
+//           max_files is set only the newest max_files are kept and the
+//           oldest is deleted on each roll, so a long capture becomes a
+//           bounded ring on SPIFFS. A ring whose files are already on disk,
+//           from before a reboot, carries on after the newest of them.
+//
+// Free Space) We never ask SPIFFS for its usage per frame. The flush task
+//             reads esp_spiffs_info when it creates a file and then counts
+//             down an estimate of free space as it writes. Once the estimate
+//             drops below CONFIG_CAPTURE_WRITER_MIN_FREE_KB the real usage is
+//             re-read and, for a rotating stream, the oldest files of that
+//             stream are deleted to make room. If there is still no room the
+//             buffer is dropped (counted in full_drops) rather than let the
+//             file system fill up.
+//
+// Formats) A stream is either RAW (caller writes whatever records it wants)
+//          or a pkt capture format. For PCAP and PCAPNG the writer fills in
+//          the file header on open and capture_writer_write_pkt frames each
+//          802.11 frame, so every capture producer shares one code path. PCAPNG
+//          records carry a radiotap header with RSSI, noise, channel and rate
+//          (see pcapng.h), PCAP is the bare LINKTYPE 105 format.
+//
+// Compression) With CONFIG_CAPTURE_WRITER_COMPRESS a stream can set compress
+//              and the flush task runs each buffer through a small LZ codec
+//              (see capture_lz.h) before it is written. Every buffer becomes
+//              one self contained block, so a file cut short by a reset or a
+//              rotation still inflates up to its last block. Frame headers
+//              are very repetitive and typically shrink 2-3x. Ratio and CPU
+//              time per MB are in the stats. The host side is
+//              scripts/cw_decompress.py which gives back the plain pcap(ng).
+//
+// Index) A stream that sets index also writes <path>.idx with one entry per
+//        flushed buffer holding its offset, time range, frame type counts and
+//        the BSSIDs seen, see capture_index.h. The entry is built as frames
+//        are appended so it costs the flush task one small extra write.
+//
+// Backends) By default files go to SPIFFS. With CONFIG_CAPTURE_WRITER_FLASH_LOG
+//           a stream can instead set backend to FLASH_LOG and its buffers are
+//           appended to the raw "capture" partition (see flash_log.h), which
+//           only partitions_flash_log.csv has, it takes 1M of SPIFFS. No FS
+//           metadata, no GC and erases happen ahead of time in the flush
+//           task's idle time, so sustained write rate and worst case latency
+//           are much better than SPIFFS. The price is that files are only
+//           readable by dumping the partition (scripts/flash_log_extract.py),
+//           and old captures are overwritten as the log wraps. Index is not
+//           supported on this backend.
+//
+// Catalog) Every SPIFFS file the flush task creates, grows, closes or deletes
+//          (sidecar index included) is reported to the capture catalog with
+//          its size, CRC, record count and BSSIDs, plus the ssid tag of the
+//          stream, see capture_catalog.h. The catalog file is synced by the
+//          flush task after each buffer or close that changed it.
+//
+// Assumptions) SPIFFS is mounted before any stream is opened. Records are
+//              whole units, i.e. a record is never split across buffers and
+//              thus never split in the file.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_wifi.h"
+#include "capture_catalog.h"
+
+#define CAPTURE_WRITER_PATH_LEN 32
+#define CAPTURE_WRITER_ROTATE_SUFFIX_LEN 4   // ".NNN"
+
+typedef struct
+{
+    uint32_t max_bytes;         // Roll after this many bytes, 0 = never
+    uint32_t max_secs;          // Roll after this many seconds, 0 = never
+    uint16_t max_files;         // Files of the ring kept on disk, below 1000, 0 = all
+} capture_writer_rotate_t;
+
+typedef enum
+{
+    CAPTURE_FMT_RAW = 0,
+    CAPTURE_FMT_PCAP,
+    CAPTURE_FMT_PCAPNG
+} capture_writer_fmt_t;
+
+#if CONFIG_CAPTURE_WRITER_PCAPNG
+    #define CAPTURE_WRITER_DEFAULT_FMT CAPTURE_FMT_PCAPNG
+#else
+    #define CAPTURE_WRITER_DEFAULT_FMT CAPTURE_FMT_PCAP
+#endif
+
+#if CONFIG_CAPTURE_WRITER_INDEX_DEFAULT
+    #define CAPTURE_WRITER_DEFAULT_INDEX 1
+#else
+    #define CAPTURE_WRITER_DEFAULT_INDEX 0
+#endif
+
+typedef enum
+{
+    CAPTURE_BACKEND_SPIFFS = 0,
+    CAPTURE_BACKEND_FLASH_LOG
+} capture_writer_backend_t;
+
+#if CONFIG_CAPTURE_WRITER_FLASH_LOG_DEFAULT
+    #define CAPTURE_WRITER_DEFAULT_BACKEND CAPTURE_BACKEND_FLASH_LOG
+#else
+    #define CAPTURE_WRITER_DEFAULT_BACKEND CAPTURE_BACKEND_SPIFFS
+#endif
+
+#if CONFIG_CAPTURE_WRITER_COMPRESS_DEFAULT
+    #define CAPTURE_WRITER_DEFAULT_COMPRESS 1
+#else
+    #define CAPTURE_WRITER_DEFAULT_COMPRESS 0
+#endif
+
+typedef struct
+{
+    const void* base;
+    uint16_t len;
+} capture_writer_iov_t;
+
+typedef struct
+{
+    capture_writer_fmt_t fmt;                         // RAW, PCAP, PCAPNG
+    char path[CAPTURE_WRITER_PATH_LEN + 1];           // Full path of the file
+    uint8_t file_hdr[CONFIG_CAPTURE_WRITER_MAX_FILE_HDR]; // RAW only, written on create
+    uint16_t file_hdr_len;
+    capture_writer_rotate_t rotate;                   // All 0 = no rotation
+    uint8_t compress;                                 // Write LZ blocks
+    uint8_t index;                                    // Write a <path>.idx sidecar
+    capture_writer_backend_t backend;                 // SPIFFS or FLASH_LOG
+    char ssid[CAPTURE_CATALOG_SSID_LEN + 1];          // Catalog tag, may be empty
+} capture_writer_cfg_t;
+
+typedef struct
+{
+    uint32_t bytes_buffered;    // Bytes sitting in RAM waiting for flash
+    uint64_t bytes_written;     // Bytes landed on flash
+    uint32_t records;           // Records accepted
+    uint32_t overruns;          // Records dropped, no free buffer
+    uint32_t flushes;           // Buffers written to flash
+    uint32_t timer_flushes;     // ... of which sealed by the flush timer
+    uint32_t write_errors;      // Failed fopen / fwrite
+    uint32_t rotations;         // Files rolled over
+    uint32_t files_deleted;     // Old ring files removed
+    uint64_t full_drops;        // Bytes dropped to keep the FS from filling
+    uint32_t flush_us_last;     // Flash latency of the last buffer write
+    uint32_t flush_us_max;      // Worst seen flash latency
+    uint64_t flush_us_total;    // Sum of flash latency, avg = total / flushes
+    uint64_t comp_in;           // Bytes fed to the compressor
+    uint64_t comp_out;          // ... and what came out, block headers included
+    uint64_t comp_us;           // CPU time spent compressing
+    uint32_t index_entries;     // Index entries written
+} capture_writer_stats_t;
+
+//*****************************************************************************
+// capture_writer_init) Create the buffer pool queues and launch the flush
+//                      task. Call once after the file system is mounted.
+//
+// Returns) ESP_OK, INVALID_STATE if already inited, NO_MEM if we could not
+//          create the queue or task.
+//*****************************************************************************
+esp_err_t capture_writer_init(void);
+
+//*****************************************************************************
+// capture_writer_open) Claim a stream slot for the file described by cfg. The
+//                      file is created (truncated) by the flush task when the
+//                      first buffer or the close for this stream arrives.
+//
+// cfg) Format, path, file header and rotation. Copied, caller may reuse it.
+//      For PCAP / PCAPNG the file header is filled in by the writer. If the
+//      stream rotates the path must leave room for the ".NNN" suffix.
+//      compress needs CONFIG_CAPTURE_WRITER_COMPRESS. With index the path
+//      must also leave room for the ".idx" suffix. The FLASH_LOG backend
+//      needs the capture partition and cannot be combined with index.
+//
+// stream) Out param, handle passed to write and close.
+//
+// Returns) ESP_OK, INVALID_ARG if cfg is bad, NO_MEM if all stream slots are
+//          used, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t capture_writer_open(capture_writer_cfg_t* cfg, uint8_t* stream);
+
+//*****************************************************************************
+// capture_writer_write) Append a record to the stream. The record is the
+//                       concatenation of hdr and body (either may be NULL / 0)
+//                       and is never split. Never blocks, safe from the pkt
+//                       sniffer call back.
+//
+// Returns) ESP_OK if buffered, INVALID_STATE if the stream is not open,
+//          INVALID_SIZE if the record is bigger than a buffer, NO_MEM if it
+//          was dropped as an overrun.
+//*****************************************************************************
+esp_err_t capture_writer_write(uint8_t stream,
+                               const void* hdr,
+                               uint16_t hdr_len,
+                               const void* body,
+                               uint16_t body_len);
+
+//*****************************************************************************
+// capture_writer_writev) Same as above but the record is the concatenation of
+//                        n pieces.
+//*****************************************************************************
+esp_err_t capture_writer_writev(uint8_t stream,
+                                const capture_writer_iov_t* iov,
+                                uint8_t n);
+
+//*****************************************************************************
+// capture_writer_write_pkt) Frame an 802.11 frame in the format of the stream
+//                           (PCAP or PCAPNG) and append it. Never blocks.
+//
+// pkt, len) The frame as handed to us by the pkt sniffer.
+// rx_ctrl) The wifi_pkt_rx_ctrl_t of the frame, used for the radiotap header.
+// ts_us) Monotonic capture time in us, see capture_time_rx_us. Written as
+//        wall clock time (capture_time_to_wall), also in the index.
+// has_fcs) 1 if the last 4 bytes of pkt are the FCS.
+//
+// Returns) As capture_writer_write, INVALID_ARG if the stream is RAW.
+//*****************************************************************************
+esp_err_t capture_writer_write_pkt(uint8_t stream,
+                                   const void* pkt,
+                                   uint16_t len,
+                                   const wifi_pkt_rx_ctrl_t* rx_ctrl,
+                                   uint64_t ts_us,
+                                   uint8_t has_fcs);
+
+//*****************************************************************************
+// capture_writer_close) Seal the stream and queue its close. Records written
+//                       before this call are flushed, then the file is closed
+//                       and the slot freed by the flush task. Never blocks.
+//
+// Returns) ESP_OK, INVALID_STATE if the stream is not open.
+//*****************************************************************************
+esp_err_t capture_writer_close(uint8_t stream);
+
+//*****************************************************************************
+// capture_writer_get_stats) Pointer to the live stats of the writer.
+//*****************************************************************************
+capture_writer_stats_t* capture_writer_get_stats(void);
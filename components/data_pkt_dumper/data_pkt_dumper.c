@@ -3,51 +3,72 @@
 
 #include "data_pkt_dumper.h"
 #include "pkt_sniffer.h"
-#include "pcap.h"
+#include "capture_writer.h"
+#include "capture_index.h"
+#include "capture_time.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_mac.h"
+#include "esp_timer.h"
 
 static const char* TAG = "Data Packet Dumper";
 
 #define LOG_DUMPER 0
 #define DISK_DUMPER 1
 
-static FILE* f = NULL;
+#define MAX_INSTANCES CONFIG_DPD_MAX_INSTANCES
 
-static int write_safe(void* buff, int num, char* prompt)
+typedef struct
 {
-    size_t num_written = fwrite(buff, 1 , num, f);
-    if(num_written != num)
+    uint8_t open;
+    uint8_t stream;
+    pkt_filter_t filter;
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+    data_pkt_dumper_stats_t stats;
+} dpd_t;
+
+static dpd_t instances[MAX_INSTANCES];
+static uint8_t num_open = 0;
+static SemaphoreHandle_t lock;
+static uint8_t one_time_init_done = 0;
+
+//*****************************************************************************
+// Lock Helpers. The dispatch cb only tries the lock so the RX path is never
+// held up by an open or close on the REPL. A frame it has to let go is still
+// counted against the open instances it matches, an instance's filter is
+// only written while it is closed so that can be read without the lock.
+//*****************************************************************************
+
+static uint8_t _take_lock(TickType_t wait)
+{
+    if(!one_time_init_done)
     {
-        ESP_LOGE(TAG, "Failed to wrtie %s", prompt);
-        fclose(f);
+        ESP_LOGE(TAG, "in take lock, not inited");
         return 1;
     }
-    ESP_LOGI(TAG, "%d bytes written to disk\n", num_written);
-    return 0;
-}
-
-static int write_pkt_safe(void* buff, int num, char* prompt)
-{
-    pcap_pkthdr_t pkt_hdr = {0};
-    pkt_hdr.caplen = num;
-    pkt_hdr.len = num;
 
-    if(write_safe(&pkt_hdr, sizeof(pcap_pkthdr_t), prompt)) {return 1;}
-    if(buff)
+    if(!xSemaphoreTake(lock, wait))
     {
-        if(write_safe(buff, num, prompt)) {return 1;}
+        return 1;
     }
 
     return 0;
 }
 
-static void dumper(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t subtype)
+static void _release_lock(void)
 {
-    wifi_pkt_rx_ctrl_t* rx_ctrl = (wifi_pkt_rx_ctrl_t*) meta_data;
+    assert(xSemaphoreGive(lock) == pdTRUE);
+}
+
+//*****************************************************************************
+// Dispatch
+//*****************************************************************************
 
+static void dump(dpd_t* d, void* pkt, wifi_pkt_rx_ctrl_t* rx_ctrl, pkt_type_t type)
+{
     #if LOG_DUMPER
         dot11_header_t* pkt_header = (dot11_header_t*) pkt;
         esp_log_write(ESP_LOG_INFO, "", "DS Status = 0x%x\n", pkt_header->ds_status);
@@ -59,50 +80,202 @@ static void dumper(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t su
     #endif
 
     #if DISK_DUMPER
-        if(write_pkt_safe(pkt, rx_ctrl->sig_len, "")){ return; }
+        // Buffered in RAM and flushed by the capture writer task, never blocks
+        // the RX path.
+        if(capture_writer_write_pkt(d->stream, pkt, rx_ctrl->sig_len, rx_ctrl, capture_time_rx_us(rx_ctrl), 1) != ESP_OK)
+        {
+            d->stats.drops++;
+            return;
+        }
     #endif
-}
 
+    d->stats.pkts++;
+    d->stats.bytes += rx_ctrl->sig_len;
+    if(type == PKT_MGMT) { d->stats.mgmt_pkts++; }
+    else                 { d->stats.data_pkts++; }
+}
 
-esp_err_t data_pkt_dumper_init(data_pkt_subtype_t s, char* file_name)
+static void dispatch(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t subtype)
 {
-    char path[33];
+    wifi_pkt_rx_ctrl_t* rx_ctrl = (wifi_pkt_rx_ctrl_t*) meta_data;
+    uint8_t i;
 
-    snprintf(path, 32, "/spiffs/%.23s", file_name);
-    ESP_LOGI(TAG, "Opening %s .. ", path);
-    f = fopen(path, "w");
-    if(!f)
+    if(_take_lock(0))
     {
-        ESP_LOGE(TAG, "Error opening file");
-        return ESP_ERR_INVALID_STATE;
+        for(i = 0; i < MAX_INSTANCES; ++i)
+        {
+            if(instances[i].open && pkt_sniffer_filter_match(&instances[i].filter, (dot11_header_t*) pkt))
+            {
+                instances[i].stats.busy_drops++;
+            }
+        }
+        return;
     }
 
-    pcap_file_header_t file_hdr = {0};
-    file_hdr.magic = PCAP_MAGIC;
-    file_hdr.linktype = DOT11_LINK_TYPE;
-    file_hdr.snaplen = 0xffff;
-    file_hdr.version_major = 2;
-    file_hdr.version_minor = 4;
-    if(write_safe(&file_hdr, sizeof(pcap_file_header_t), "pcap header"))
+    for(i = 0; i < MAX_INSTANCES; ++i)
     {
-        ESP_LOGE(TAG, "Failed to write pcap header");
-        fclose(f);
-        return ESP_ERR_INVALID_STATE;
+        if(instances[i].open && pkt_sniffer_filter_match(&instances[i].filter, (dot11_header_t*) pkt))
+        {
+            dump(&instances[i], pkt, rx_ctrl, type);
+        }
     }
 
+    _release_lock();
+}
+
+// Swap our sniffer filter for one that is the union of the open instances, in
+// one step so frames of the instances already open are not missed. Called
+// with the lock held.
+static esp_err_t update_sniffer_filter(void)
+{
     pkt_sniffer_filtered_src_t filt = {0};
-    filt.cb = dumper;
-    pkt_subtype_t x;
-    x.data_subtype = s;
-    pkt_sniffer_add_type_subtype(&filt, PKT_DATA, x);
-    
-    esp_err_t e = pkt_sniffer_add_filter(&filt);
-    ESP_LOGI(TAG, "Type Mask = 0x%x   Data Mask = 0x%x   MGMT Mask = 0x%x\n", filt.filter.type_bitmap, filt.filter.data_subtype_bitmap, filt.filter.mgmt_subtype_bitmap);
+    uint8_t i;
+
+    if(num_open == 0)
+    {
+        return pkt_sniffer_remove_filter(dispatch);
+    }
+
+    for(i = 0; i < MAX_INSTANCES; ++i)
+    {
+        if(instances[i].open)
+        {
+            filt.filter.type_bitmap |= instances[i].filter.type_bitmap;
+            filt.filter.mgmt_subtype_bitmap |= instances[i].filter.mgmt_subtype_bitmap;
+            filt.filter.data_subtype_bitmap |= instances[i].filter.data_subtype_bitmap;
+        }
+    }
+    filt.cb = dispatch;
+
+    esp_err_t e = pkt_sniffer_set_filter(&filt);
+    ESP_LOGI(TAG, "Type Mask = 0x%x   Data Mask = 0x%x   MGMT Mask = 0x%x", filt.filter.type_bitmap, filt.filter.data_subtype_bitmap, filt.filter.mgmt_subtype_bitmap);
+    return e;
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t data_pkt_dumper_open(const pkt_filter_t* filter,
+                               const char* file_name,
+                               const capture_writer_rotate_t* rotate,
+                               uint8_t* handle)
+{
+    if(!one_time_init_done)
+    {
+        lock = xSemaphoreCreateBinary();
+        assert(xSemaphoreGive(lock) == pdTRUE);
+        one_time_init_done = 1;
+    }
+
+    capture_writer_cfg_t cfg = {0};
+    int max_name = DPD_NAME_LEN;
+    if(rotate->max_bytes || rotate->max_secs)
+    {
+        max_name -= CAPTURE_WRITER_ROTATE_SUFFIX_LEN;
+    }
+    if(CAPTURE_WRITER_DEFAULT_INDEX && CAPTURE_WRITER_DEFAULT_BACKEND == CAPTURE_BACKEND_SPIFFS)
+    {
+        max_name -= CAPTURE_INDEX_SUFFIX_LEN;
+    }
+    snprintf(cfg.path, sizeof(cfg.path), "/spiffs/%.*s", max_name, file_name);
+    memcpy(&cfg.rotate, rotate, sizeof(capture_writer_rotate_t));
+
+    cfg.fmt = CAPTURE_WRITER_DEFAULT_FMT;
+    cfg.compress = CAPTURE_WRITER_DEFAULT_COMPRESS;
+    cfg.backend = CAPTURE_WRITER_DEFAULT_BACKEND;
+    cfg.index = CAPTURE_WRITER_DEFAULT_INDEX && cfg.backend == CAPTURE_BACKEND_SPIFFS;
+
+    if(_take_lock(10 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "lock timeout");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint8_t i;
+    for(i = 0; i < MAX_INSTANCES; ++i)
+    {
+        if(!instances[i].open) { break; }
+    }
+
+    if(i == MAX_INSTANCES)
+    {
+        _release_lock();
+        ESP_LOGE(TAG, "All %d dumpers in use", MAX_INSTANCES);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Opening %s .. ", cfg.path);
+    esp_err_t e = capture_writer_open(&cfg, &instances[i].stream);
+    if(e != ESP_OK)
+    {
+        _release_lock();
+        ESP_LOGE(TAG, "Error opening capture stream");
+        return e;
+    }
+
+    memcpy(&instances[i].filter, filter, sizeof(pkt_filter_t));
+    memcpy(instances[i].path, cfg.path, sizeof(cfg.path));
+    memset(&instances[i].stats, 0, sizeof(data_pkt_dumper_stats_t));
+    instances[i].stats.start_us = esp_timer_get_time();
+    instances[i].open = 1;
+    num_open++;
+
+    e = update_sniffer_filter();
+    if(e != ESP_OK)
+    {
+        capture_writer_close(instances[i].stream);
+        instances[i].open = 0;
+        num_open--;
+        _release_lock();
+        return e;
+    }
+
+    _release_lock();
+
+    *handle = i;
+    return ESP_OK;
+}
+
+esp_err_t data_pkt_dumper_close(uint8_t handle)
+{
+    if(_take_lock(10 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "lock timeout");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if(handle >= MAX_INSTANCES || !instances[handle].open)
+    {
+        _release_lock();
+        ESP_LOGE(TAG, "No dumper %d", handle);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    instances[handle].open = 0;
+    num_open--;
+    update_sniffer_filter();
+    esp_err_t e = capture_writer_close(instances[handle].stream);
+
+    _release_lock();
+
+    ESP_LOGI(TAG, "Closed %s after %lu pkts", instances[handle].path, instances[handle].stats.pkts);
     return e;
 }
 
-esp_err_t data_pkt_dumper_fini(void)
+esp_err_t data_pkt_dumper_get_stats(uint8_t handle,
+                                    data_pkt_dumper_stats_t* stats,
+                                    pkt_filter_t* filter,
+                                    char* path)
 {
-    fclose(f);
+    if(handle >= MAX_INSTANCES || !instances[handle].open)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if(stats)  { memcpy(stats, &instances[handle].stats, sizeof(data_pkt_dumper_stats_t)); }
+    if(filter) { memcpy(filter, &instances[handle].filter, sizeof(pkt_filter_t)); }
+    if(path)   { strcpy(path, instances[handle].path); }
+
     return ESP_OK;
-}
\ No newline at end of file
+}
@@ -1,7 +1,86 @@
+//*****************************************************************************
+// Data Pkt Dumper. Dump sniffed frames to pcap files on SPIFFS. Each dumper is
+// an instance with its own file, its own pkt sniffer style filter (types,
+// mgmt and data subtypes, addr matches) and its own stats, so i.e. the QoS
+// data of one BSS and all nearby mgmt frames can be captured into separate
+// files at the same time.
+//
+// |-------------|  one catch all  |----------|  match each  |------------|
+// | Pkt Sniffer |---------------->| Dispatch |------------->| Instance i |--> capture
+// |-------------|     filter      |----------|   instance   |------------|    writer
+//
+// Filters) The sniffer only has a handful of filter slots so the dumper never
+//          takes more than one. Its type / subtype bitmaps are the union of the
+//          open instances and its cb fans each frame out to every instance whose
+//          own filter matches (pkt_sniffer_filter_match).
+//
+// Buffers) Every instance is a capture writer stream, so all instances share
+//          the one writer buffer pool and flush task. The number of instances
+//          open at once is also bounded by CONFIG_CAPTURE_WRITER_MAX_STREAMS.
+//
+// Assumptions) PS_clear also throws away the dumper's sniffer filter. Opening
+//              another instance puts it back.
+//*****************************************************************************
+
 #pragma once
 
 #include "dot11.h"
 #include "esp_err.h"
+#include "pkt_sniffer.h"
+#include "capture_writer.h"
+
+#define DPD_NAME_LEN 23     // Max file name length before suffixes
+
+typedef struct
+{
+    uint32_t pkts;          // Frames handed to the capture writer
+    uint32_t mgmt_pkts;     // ... of which mgmt
+    uint32_t data_pkts;     // ... of which data
+    uint64_t bytes;         // 802.11 bytes accepted by the writer
+    uint32_t drops;         // Frames the writer refused (overruns)
+    uint32_t busy_drops;    // Frames missed while an open / close held the lock
+    int64_t start_us;       // When the instance was opened
+} data_pkt_dumper_stats_t;
+
+//*****************************************************************************
+// data_pkt_dumper_open) Open a capture file through the capture writer and
+//                       start dumping frames that match filter into it.
+//
+// filter) Same semantics as the pkt sniffer filters, see pkt_sniffer.h and
+//         pkt_sniffer_add_type_subtype / pkt_sniffer_add_mac_match. Copied.
+//
+// file_name) Name of the file on SPIFFS, max 23 chars. Cut by 4 when rotating
+//            as the files get a ".NNN" suffix and by 4 more when captures are
+//            indexed (".idx" sidecar).
+//
+// rotate) Roll / ring settings, see capture_writer.h. All 0 for one file.
+//
+// handle) Out param, pass to close / get_stats.
+//
+// Returns) ESP_OK, NO_MEM if all instances are in use, TIMEOUT if the
+//          dumper lock is busy, else capture writer or pkt sniffer errors.
+//*****************************************************************************
+esp_err_t data_pkt_dumper_open(const pkt_filter_t* filter,
+                               const char* file_name,
+                               const capture_writer_rotate_t* rotate,
+                               uint8_t* handle);
+
+//*****************************************************************************
+// data_pkt_dumper_close) Stop dumping into the instance and close its file.
+//                        Frames already buffered still land on flash.
+//
+// Returns) ESP_OK, INVALID_ARG if handle is not open, TIMEOUT if the dumper
+//          lock is busy, else capture writer errors.
+//*****************************************************************************
+esp_err_t data_pkt_dumper_close(uint8_t handle);
 
-esp_err_t data_pkt_dumper_init(data_pkt_subtype_t s,  char* file_name);
-esp_err_t data_pkt_dumper_fini(void);
\ No newline at end of file
+//*****************************************************************************
+// data_pkt_dumper_get_stats) Copy out the stats, filter and path of an
+//                            instance. Any of the out params may be NULL.
+//
+// Returns) ESP_OK, INVALID_ARG if handle is not open.
+//*****************************************************************************
+esp_err_t data_pkt_dumper_get_stats(uint8_t handle,
+                                    data_pkt_dumper_stats_t* stats,
+                                    pkt_filter_t* filter,
+                                    char* path);
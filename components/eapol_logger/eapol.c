@@ -10,7 +10,9 @@
 #include "pkt_sniffer.h"
 #include "dot11.h"
 #include "dot11_data.h"
-#include "pcap.h"
+#include "capture_writer.h"
+#include "capture_time.h"
+#include "repl_mux.h"
 
 static const char* TAG = "EAPOL LOGGER";
 #define EAPOL_MAX_PKT_LEN 256
@@ -33,6 +35,20 @@ uint8_t eapol_02[EAPOL_MAX_PKT_LEN];
 uint8_t eapol_03[EAPOL_MAX_PKT_LEN];
 uint8_t eapol_04[EAPOL_MAX_PKT_LEN];
 
+// Radio meta data and capture time of each of the above, for the radiotap hdr
+typedef struct
+{
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+    uint64_t ts_us;
+} eapol_meta_t;
+
+eapol_meta_t asoc_req_meta;
+eapol_meta_t asoc_res_meta;
+eapol_meta_t eapol_01_meta;
+eapol_meta_t eapol_02_meta;
+eapol_meta_t eapol_03_meta;
+eapol_meta_t eapol_04_meta;
+
 //*****************************************************************************
 // Lock Helpers
 //*****************************************************************************
@@ -129,66 +145,47 @@ esp_err_t eapol_logger_deauth_curr(void)
 // Handling Eapol PKTS
 //*****************************************************************************
 
-static int write_safe(FILE* f, void* buff, int num, char* prompt)
+static int write_pkt_safe(uint8_t stream, void* buff, int num, eapol_meta_t* meta, char* prompt)
 {
-    size_t num_written = fwrite(buff, 1 , num, f);
-    if(num_written != num)
+    if(capture_writer_write_pkt(stream, buff, num, &meta->rx_ctrl, meta->ts_us, 0) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to wrtie %s", prompt);
-        fclose(f);
+        ESP_LOGE(TAG, "Failed to buffer %s", prompt);
         return 1;
     }
-    ESP_LOGI(TAG, "%d bytes written to disk\n", num_written);
-    return 0;
-}
-
-static int write_pkt_safe(FILE* f, void* buff, int num, char* prompt)
-{
-    pcap_pkthdr_t pkt_hdr = {0};
-    pkt_hdr.caplen = num;
-    pkt_hdr.len = num;
-
-    if(write_safe(f, &pkt_hdr, sizeof(pcap_pkthdr_t), prompt)) {return 1;}
-    if(buff)
-    {
-        if(write_safe(f, buff, num, prompt)) {return 1;}
-    }
 
     return 0;
 }
 
+// Called from the sniffer cb with the lock held. The capture writer only
+// copies into RAM here, the actual flash write happens in its flush task.
 static void eapol_dump_to_disk(void)
 {
-    char path[33];
-
-    pcap_file_header_t file_hdr = {0};
-    file_hdr.magic = PCAP_MAGIC;
-    file_hdr.linktype = DOT11_LINK_TYPE;
-    file_hdr.snaplen = 0xffff;
-    file_hdr.version_major = 2;
-    file_hdr.version_minor = 4;
+    capture_writer_cfg_t cfg = {0};
+    uint8_t stream;
 
-    snprintf(path, 32, "/spiffs/%.19s.pkt", ap.ssid);
+    cfg.fmt = CAPTURE_WRITER_DEFAULT_FMT;
+    cfg.compress = CAPTURE_WRITER_DEFAULT_COMPRESS;
+    snprintf(cfg.path, 32, "/spiffs/%.19s.pkt", ap.ssid);
+    snprintf(cfg.ssid, sizeof(cfg.ssid), "%s", (char*) ap.ssid);
     
-    ESP_LOGI(TAG, "Opening %s to writeout eapol pkts", path);
-    FILE* f = fopen(path, "w");
-    if(!f)
+    ESP_LOGI(TAG, "Queueing %s to writeout eapol pkts", cfg.path);
+    if(capture_writer_open(&cfg, &stream) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to open %s - %s", path, strerror(errno));
-        fclose(f);
+        ESP_LOGE(TAG, "Failed to open capture stream for %s", cfg.path);
         return;
     }
 
-    if(write_safe(f, &file_hdr, sizeof(pcap_file_header_t), "pcap header")){return;}
-    if(write_pkt_safe(f, asoc_req, asoc_req_len, "assoc req")){ return; }
-    if(write_pkt_safe(f, asoc_res, asoc_res_len, "assoc res")){ return; }
-    if(write_pkt_safe(f, eapol_01, eapol_01_len, "eapol  01")){ return; }
-    if(write_pkt_safe(f, eapol_02, eapol_02_len, "eapol  02")){ return; }
-    if(write_pkt_safe(f, eapol_03, eapol_03_len, "eapol  03")){ return; }
-    if(write_pkt_safe(f, eapol_04, eapol_04_len, "eapol  04")){ return; }
+    if(write_pkt_safe(stream, asoc_req, asoc_req_len, &asoc_req_meta, "assoc req")){ goto dump_end; }
+    if(write_pkt_safe(stream, asoc_res, asoc_res_len, &asoc_res_meta, "assoc res")){ goto dump_end; }
+    if(write_pkt_safe(stream, eapol_01, eapol_01_len, &eapol_01_meta, "eapol  01")){ goto dump_end; }
+    if(write_pkt_safe(stream, eapol_02, eapol_02_len, &eapol_02_meta, "eapol  02")){ goto dump_end; }
+    if(write_pkt_safe(stream, eapol_03, eapol_03_len, &eapol_03_meta, "eapol  03")){ goto dump_end; }
+    if(write_pkt_safe(stream, eapol_04, eapol_04_len, &eapol_04_meta, "eapol  04")){ goto dump_end; }
     
-    fclose(f);
-    ESP_LOGI(TAG, "Write out of EAPOL pkts successful!");
+    ESP_LOGI(TAG, "Write out of EAPOL pkts queued!");
+
+    dump_end:
+    capture_writer_close(stream);
 }
 
 
@@ -202,6 +199,7 @@ void eapol_cb(void* pkt,
     dot11_header_t* hdr = pkt;
     uint8_t* buffer = NULL;
     uint16_t* len = NULL;
+    eapol_meta_t* meta = NULL;
 
     if(_take_lock()){return;}
 
@@ -209,13 +207,15 @@ void eapol_cb(void* pkt,
     {
         buffer = asoc_res;
         len = &asoc_res_len;
-        ESP_LOGI(TAG, "%s -> assoc res -- len = %d", ap.ssid, rx_ctrl->sig_len - 4);
+        meta = &asoc_res_meta;
+        REPL_MUX_LOG(EAPOL_ASSOC_RES, (char*) ap.ssid, rx_ctrl->sig_len - 4);
     }
     else if(type == PKT_MGMT && subtype.mgmt_subtype == PKT_ASSOC_REQ)
     {
         buffer = asoc_req;
         len = &asoc_req_len;
-        ESP_LOGI(TAG, "%s -> assoc req --  len = %d", ap.ssid, rx_ctrl->sig_len - 4);
+        meta = &asoc_req_meta;
+        REPL_MUX_LOG(EAPOL_ASSOC_REQ, (char*) ap.ssid, rx_ctrl->sig_len - 4);
     }
     else if(type == PKT_DATA && subtype.data_subtype == PKT_QOS_DATA && hdr->protect == 0)
     {
@@ -242,25 +242,29 @@ void eapol_cb(void* pkt,
             { 
                 buffer = eapol_01; 
                 len = &eapol_01_len;
-                ESP_LOGI(TAG, "%s -> eapol 1 -- len = %d", ap.ssid, rx_ctrl->sig_len - 4);
+                meta = &eapol_01_meta;
+                REPL_MUX_LOG(EAPOL_MSG, (char*) ap.ssid, 1, rx_ctrl->sig_len - 4);
             }
             else if(s == 0 && ds == 1) 
             { 
                 buffer = eapol_02; 
                 len = &eapol_02_len;
-                ESP_LOGI(TAG, "%s -> eapol 2 -- len = %d", ap.ssid, rx_ctrl->sig_len - 4);
+                meta = &eapol_02_meta;
+                REPL_MUX_LOG(EAPOL_MSG, (char*) ap.ssid, 2, rx_ctrl->sig_len - 4);
             }
             else if(s == 1 && ds == 2) 
             { 
                 buffer = eapol_03; 
                 len = &eapol_03_len;
-                ESP_LOGI(TAG, "%s -> eapol 3 -- len = %d", ap.ssid, rx_ctrl->sig_len - 4);    
+                meta = &eapol_03_meta;
+                REPL_MUX_LOG(EAPOL_MSG, (char*) ap.ssid, 3, rx_ctrl->sig_len - 4);    
             }
             else if(s == 1 && ds == 1) 
             { 
                 buffer = eapol_04; 
                 len = &eapol_04_len;
-                ESP_LOGI(TAG, "%s -> eapol 4 -- len  = %d", ap.ssid, rx_ctrl->sig_len - 4);
+                meta = &eapol_04_meta;
+                REPL_MUX_LOG(EAPOL_MSG, (char*) ap.ssid, 4, rx_ctrl->sig_len - 4);
             }
         }
     }
@@ -272,7 +276,7 @@ void eapol_cb(void* pkt,
 
     if(*len > 0)
     {
-        ESP_LOGE(TAG, "Recieved Duplicate EAPOL PKTs, overwriting");
+        REPL_MUX_LOG(EAPOL_DUPLICATE);
     }
     else
     {
@@ -281,6 +285,8 @@ void eapol_cb(void* pkt,
 
     memcpy(buffer, (uint8_t*) pkt, rx_ctrl->sig_len - 4);
     *len = rx_ctrl->sig_len - 4;
+    memcpy(&meta->rx_ctrl, rx_ctrl, sizeof(wifi_pkt_rx_ctrl_t));
+    meta->ts_us = capture_time_rx_us(rx_ctrl);
 
     if(captured == 6)
     {
@@ -0,0 +1,503 @@
+#include <string.h>
+
+#include "flash_log.h"
+
+#ifdef ESP_PLATFORM
+    #include "freertos/FreeRTOS.h"
+    #include "freertos/semphr.h"
+    #include "esp_log.h"
+    #include "esp_timer.h"
+
+    static const char* TAG = "FLASH LOG";
+    static SemaphoreHandle_t lock;
+
+    #define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+    #define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+    #define LOCK() xSemaphoreTake(lock, portMAX_DELAY)
+    #define UNLOCK() assert(xSemaphoreGive(lock) == pdTRUE)
+    #define NOW_US() esp_timer_get_time()
+#else
+    #include <stdio.h>
+    #include <time.h>
+
+    static int64_t now_us(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    #define LOGI(fmt, ...) printf("FLASH LOG: " fmt "\n", ##__VA_ARGS__)
+    #define LOGE(fmt, ...) fprintf(stderr, "FLASH LOG: " fmt "\n", ##__VA_ARGS__)
+    #define LOCK()
+    #define UNLOCK()
+    #define NOW_US() now_us()
+#endif
+
+#define REC_SIZE CONFIG_FLASH_LOG_RECORD_SIZE
+#define ERASE_AHEAD CONFIG_FLASH_LOG_ERASE_AHEAD
+
+_Static_assert(sizeof(flash_log_rec_hdr_t) == FLASH_LOG_REC_HDR_LEN, "record header layout");
+
+static flash_log_dev_t dev;
+static uint8_t inited = 0;
+static uint32_t n_sectors;
+static uint8_t erased_ahead;    // Sectors after the head sector known erased
+
+static uint8_t rec[REC_SIZE];   // Staging record, header + payload
+static uint16_t stage_len = 0;
+static uint16_t stage_file;
+static uint8_t staged = 0;
+
+static uint32_t crc_table[256];
+static flash_log_stats_t stats = {0};
+
+//*****************************************************************************
+// Helpers
+//*****************************************************************************
+
+// Standard CRC32 (zlib / ethernet) so host tools can use zlib.crc32
+static void crc_init(void)
+{
+    uint32_t i, j, c;
+    for(i = 0; i < 256; ++i)
+    {
+        c = i;
+        for(j = 0; j < 8; ++j)
+        {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, uint32_t len)
+{
+    crc = ~crc;
+    while(len--)
+    {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t rec_crc(flash_log_rec_hdr_t* h, const uint8_t* payload)
+{
+    uint32_t saved = h->crc;
+    h->crc = 0;
+    uint32_t c = crc32(0, (const uint8_t*) h, sizeof(flash_log_rec_hdr_t));
+    c = crc32(c, payload, h->len);
+    h->crc = saved;
+    return c;
+}
+
+static uint32_t sector_of(uint32_t off)
+{
+    return off / dev.sector_size;
+}
+
+static esp_err_t erase_sector(uint32_t s)
+{
+    esp_err_t e = dev.erase(dev.ctx, s * dev.sector_size, dev.sector_size);
+    if(e != ESP_OK)
+    {
+        LOGE("Failed to erase sector %lu", (unsigned long) s);
+        return e;
+    }
+    stats.erases++;
+    return ESP_OK;
+}
+
+static uint8_t is_erased(uint32_t off, uint32_t len)
+{
+    uint8_t buf[64];
+    uint32_t i, j;
+
+    for(i = 0; i < len; i += sizeof(buf))
+    {
+        uint32_t n = (len - i) < sizeof(buf) ? (len - i) : sizeof(buf);
+        if(dev.read(dev.ctx, off + i, buf, n) != ESP_OK)
+        {
+            return 0;
+        }
+        for(j = 0; j < n; ++j)
+        {
+            if(buf[j] != 0xff) { return 0; }
+        }
+    }
+
+    return 1;
+}
+
+static esp_err_t read_record(uint32_t off, flash_log_rec_hdr_t* h, uint8_t* payload)
+{
+    if(dev.read(dev.ctx, off, h, sizeof(flash_log_rec_hdr_t)) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+
+    if(h->magic == 0xffff && h->seq == 0xffffffff)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if(h->magic != FLASH_LOG_REC_MAGIC ||
+       h->len > FLASH_LOG_PAYLOAD_LEN ||
+       dev.read(dev.ctx, off + FLASH_LOG_REC_HDR_LEN, payload, h->len) != ESP_OK ||
+       rec_crc(h, payload) != h->crc)
+    {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return ESP_OK;
+}
+
+// Move the head onto the start of the next sector. Uses up one of the erase
+// ahead sectors or, if none is ready, erases inline.
+static esp_err_t next_sector(void)
+{
+    stats.head = (sector_of(stats.head) + 1) * dev.sector_size;
+    if(stats.head >= dev.size)
+    {
+        stats.head = 0;
+        stats.wraps++;
+    }
+
+    if(erased_ahead)
+    {
+        erased_ahead--;
+        return ESP_OK;
+    }
+
+    stats.erase_stalls++;
+    return erase_sector(sector_of(stats.head));
+}
+
+// Write the staging record at the head
+static esp_err_t commit(uint8_t type, uint16_t file_id, uint16_t len)
+{
+    flash_log_rec_hdr_t* h = (flash_log_rec_hdr_t*) rec;
+    uint8_t* payload = rec + FLASH_LOG_REC_HDR_LEN;
+
+    h->magic = FLASH_LOG_REC_MAGIC;
+    h->type = type;
+    h->reserved = 0;
+    h->seq = stats.next_seq;
+    h->file_id = file_id;
+    h->len = len;
+    h->crc = rec_crc(h, payload);
+
+    // Leave the unused tail of the payload erased
+    memset(payload + len, 0xff, FLASH_LOG_PAYLOAD_LEN - len);
+
+    esp_err_t e = dev.write(dev.ctx, stats.head, rec, REC_SIZE);
+    if(e != ESP_OK)
+    {
+        stats.write_errors++;
+        LOGE("Failed to write record at 0x%lx", (unsigned long) stats.head);
+    }
+
+    // Even a failed slot is skipped, it may be half programmed
+    stats.next_seq++;
+    stats.records++;
+    stats.pad_bytes += FLASH_LOG_PAYLOAD_LEN - len;
+    stats.head += REC_SIZE;
+    if(stats.head % dev.sector_size == 0)
+    {
+        stats.head -= REC_SIZE;
+        esp_err_t e2 = next_sector();
+        if(e == ESP_OK) { e = e2; }
+    }
+
+    return e;
+}
+
+static esp_err_t commit_stage(void)
+{
+    if(!staged)
+    {
+        return ESP_OK;
+    }
+
+    staged = 0;
+    uint16_t len = stage_len;
+    stage_len = 0;
+    return commit(FLASH_LOG_REC_DATA, stage_file, len);
+}
+
+// Ids count up and wrap, newer of two ids that are less than half the range
+// apart
+static uint16_t newer_id(uint16_t a, uint16_t b)
+{
+    return ((int16_t) (a - b) > 0) ? a : b;
+}
+
+// Find the newest record from the first record of each sector, then walk that
+// sector to the last good record. The next file id is past the newest id of
+// all the records read, not just of the last one, a file opened later may
+// have been closed while an older one kept writing.
+static void scan(void)
+{
+    flash_log_rec_hdr_t h;
+    uint8_t* payload = rec + FLASH_LOG_REC_HDR_LEN;
+    uint32_t s, best = 0;
+    uint32_t best_seq = 0;
+    uint16_t max_file = 0;
+    uint8_t found = 0;
+
+    for(s = 0; s < n_sectors; ++s)
+    {
+        stats.scan_reads++;
+        if(read_record(s * dev.sector_size, &h, payload) != ESP_OK)
+        {
+            continue;
+        }
+
+        max_file = found ? newer_id(max_file, h.file_id) : h.file_id;
+        if(!found || h.seq > best_seq)
+        {
+            best = s;
+            best_seq = h.seq;
+        }
+        found = 1;
+    }
+
+    if(!found)
+    {
+        LOGI("No records found, starting fresh");
+        stats.head = 0;
+        stats.next_seq = 0;
+        stats.next_file_id = 0;
+        return;
+    }
+
+    uint32_t off = best * dev.sector_size;
+    uint32_t end = off + dev.sector_size;
+    uint32_t last_seq = best_seq - 1;
+
+    while(off < end)
+    {
+        stats.scan_reads++;
+        esp_err_t e = read_record(off, &h, payload);
+        if(e != ESP_OK || h.seq != last_seq + 1)
+        {
+            if(e != ESP_ERR_NOT_FOUND || !is_erased(off, REC_SIZE))
+            {
+                stats.torn_records++;
+            }
+            break;
+        }
+
+        last_seq = h.seq;
+        max_file = newer_id(max_file, h.file_id);
+        off += REC_SIZE;
+    }
+
+    stats.head = off;
+    stats.next_seq = last_seq + 1;
+    stats.next_file_id = max_file + 1;
+
+    // A torn record can't be programmed over, start clean in the next sector.
+    // Same if the newest sector is full.
+    if(off >= end || stats.torn_records)
+    {
+        stats.head = ((best + 1) % n_sectors) * dev.sector_size;
+    }
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t flash_log_init(const flash_log_dev_t* d)
+{
+    if(d->sector_size % REC_SIZE || d->size < (ERASE_AHEAD + 2) * d->sector_size)
+    {
+        LOGE("Device does not fit the log");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    #ifdef ESP_PLATFORM
+    if(!lock)
+    {
+        lock = xSemaphoreCreateBinary();
+        assert(xSemaphoreGive(lock) == pdTRUE);
+    }
+    #endif
+
+    memcpy(&dev, d, sizeof(flash_log_dev_t));
+    memset(&stats, 0, sizeof(stats));
+    n_sectors = dev.size / dev.sector_size;
+    erased_ahead = 0;
+    staged = 0;
+    stage_len = 0;
+    crc_init();
+
+    int64_t start = NOW_US();
+    scan();
+
+    // The head sector itself must be erased from the head on
+    if(stats.head % dev.sector_size == 0 && !is_erased(stats.head, dev.sector_size))
+    {
+        erase_sector(sector_of(stats.head));
+    }
+
+    // Sectors ahead may already be erased from before the reset, only erase
+    // the ones that are not
+    while(erased_ahead < ERASE_AHEAD)
+    {
+        uint32_t s = (sector_of(stats.head) + erased_ahead + 1) % n_sectors;
+        if(!is_erased(s * dev.sector_size, dev.sector_size) && erase_sector(s) != ESP_OK)
+        {
+            break;
+        }
+        erased_ahead++;
+    }
+    stats.scan_us = (uint32_t) (NOW_US() - start);
+
+    inited = 1;
+    LOGI("Head at 0x%lx seq %lu, scan took %lu us (%lu reads)",
+         (unsigned long) stats.head,
+         (unsigned long) stats.next_seq,
+         (unsigned long) stats.scan_us,
+         (unsigned long) stats.scan_reads);
+    return ESP_OK;
+}
+
+esp_err_t flash_log_open(const char* name, uint16_t* file_id)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    esp_err_t e = commit_stage();
+
+    uint16_t len = (uint16_t) strnlen(name, FLASH_LOG_NAME_LEN);
+    memcpy(rec + FLASH_LOG_REC_HDR_LEN, name, len);
+    *file_id = stats.next_file_id++;
+    esp_err_t c = commit(FLASH_LOG_REC_OPEN, *file_id, len);
+    if(e == ESP_OK) { e = c; }
+    UNLOCK();
+
+    return e;
+}
+
+esp_err_t flash_log_append(uint16_t file_id, const void* data, uint32_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    esp_err_t e = ESP_OK;
+
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    if(staged && stage_file != file_id)
+    {
+        e = commit_stage();
+    }
+
+    stats.payload_bytes += len;
+    while(len && e == ESP_OK)
+    {
+        uint32_t n = FLASH_LOG_PAYLOAD_LEN - stage_len;
+        if(n > len) { n = len; }
+
+        memcpy(rec + FLASH_LOG_REC_HDR_LEN + stage_len, p, n);
+        stage_len += n;
+        stage_file = file_id;
+        staged = 1;
+        p += n;
+        len -= n;
+
+        if(stage_len == FLASH_LOG_PAYLOAD_LEN)
+        {
+            e = commit_stage();
+        }
+    }
+    UNLOCK();
+
+    return e;
+}
+
+esp_err_t flash_log_sync(void)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    esp_err_t e = commit_stage();
+    UNLOCK();
+
+    return e;
+}
+
+esp_err_t flash_log_close(uint16_t file_id)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The CLOSE goes through the staging record too, whichever capture has
+    // data staged gets it written first
+    LOCK();
+    esp_err_t e = commit_stage();
+    esp_err_t c = commit(FLASH_LOG_REC_CLOSE, file_id, 0);
+    if(e == ESP_OK) { e = c; }
+    UNLOCK();
+
+    return e;
+}
+
+esp_err_t flash_log_maintain(void)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    LOCK();
+    esp_err_t e = ESP_OK;
+    if(erased_ahead < ERASE_AHEAD)
+    {
+        e = erase_sector((sector_of(stats.head) + erased_ahead + 1) % n_sectors);
+        if(e == ESP_OK)
+        {
+            erased_ahead++;
+        }
+    }
+    UNLOCK();
+
+    return e;
+}
+
+esp_err_t flash_log_read_record(uint32_t slot, flash_log_rec_hdr_t* hdr, void* payload)
+{
+    if(!inited)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if(slot >= flash_log_num_slots())
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return read_record(slot * REC_SIZE, hdr, (uint8_t*) payload);
+}
+
+uint32_t flash_log_num_slots(void)
+{
+    return dev.size / REC_SIZE;
+}
+
+flash_log_stats_t* flash_log_get_stats(void)
+{
+    return &stats;
+}
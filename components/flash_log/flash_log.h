@@ -0,0 +1,160 @@
+//*****************************************************************************
+// Flash Log. Append only, log structured capture store written straight into
+// a raw data partition. Going through SPIFFS for high rate capture costs us
+// file system meta data writes, GC stalls and a 32 char path limit. Here the
+// partition is just a ring of fixed size, CRC protected records written in
+// order, so a write is one esp_partition_write and nothing else.
+//
+//   sector 0        sector 1        sector 2        sector 3
+// |---------------|---------------|---------------|---------------|
+// | R R R R R R R | R R R . . . . | erased        | R R R R R R R |
+// |---------------|---------------|---------------|---------------|
+//     newer data    ^ head          erased ahead      oldest data
+//
+// Records) CONFIG_FLASH_LOG_RECORD_SIZE bytes, a 16 byte header then payload.
+//          The header has a monotonic sequence number, the id of the capture
+//          ("file") the record belongs to, its type (OPEN with the capture
+//          name as payload, DATA, CLOSE), the payload length and a CRC32 over
+//          header and payload. A capture is all records of one file id in seq
+//          order. Appends are packed, a partially filled record is staged in
+//          RAM and only written when full or on sync / close.
+//
+// Erase Ahead) CONFIG_FLASH_LOG_ERASE_AHEAD sectors past the head are kept
+//              erased. flash_log_maintain (called when the writer is idle)
+//              does the erasing, so crossing into a new sector normally costs
+//              no erase at all. Only if the writer outruns maintain is the next
+//              sector erased inline, counted as an erase stall.
+//
+// Wraparound) When the head reaches the end of the partition it wraps to the
+//             start and the oldest data is erased ahead of it. The head is
+//             never reset at boot, it carries on where it stopped, so every
+//             sector is erased once per lap and wear is spread evenly.
+//
+// Boot Scan) flash_log_init reads only the first record of every sector to
+//            find the newest sector (highest seq), then walks that one sector
+//            to find the last good record. So recovery costs one record per
+//            sector plus one sector, not a read of the whole partition. A torn
+//            record (bad CRC from a reset mid write) ends the walk and the head
+//            moves on to the next sector.
+//
+// Platforms) The log only talks to a flash_log_dev_t (flash_log_dev.h). On the
+//            esp32 that is the raw partition labeled
+//            CONFIG_FLASH_LOG_PARTITION_LABEL. On Linux host/ builds the log
+//            against a file backed NOR emulator for tests and benchmarks.
+//
+// Assumptions) One writer at a time (the capture writer flush task). On the
+//              esp32 calls are serialized with a lock anyway so REPL commands
+//              can't corrupt the staging record.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "flash_log_dev.h"
+
+#ifndef CONFIG_FLASH_LOG_RECORD_SIZE
+    #define CONFIG_FLASH_LOG_RECORD_SIZE 512
+#endif
+#ifndef CONFIG_FLASH_LOG_ERASE_AHEAD
+    #define CONFIG_FLASH_LOG_ERASE_AHEAD 2
+#endif
+
+#define FLASH_LOG_REC_MAGIC 0x4C46          // "FL"
+#define FLASH_LOG_REC_HDR_LEN 16
+#define FLASH_LOG_PAYLOAD_LEN (CONFIG_FLASH_LOG_RECORD_SIZE - FLASH_LOG_REC_HDR_LEN)
+#define FLASH_LOG_NAME_LEN 32
+
+typedef enum
+{
+    FLASH_LOG_REC_OPEN = 1,     // Payload is the capture name
+    FLASH_LOG_REC_DATA = 2,
+    FLASH_LOG_REC_CLOSE = 3
+} flash_log_rec_type_t;
+
+typedef struct
+{
+    uint16_t magic;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t seq;
+    uint16_t file_id;
+    uint16_t len;               // Payload bytes used
+    uint32_t crc;               // CRC32 of header (crc = 0) + len bytes of payload
+} flash_log_rec_hdr_t;
+
+typedef struct
+{
+    uint32_t head;              // Offset the next record goes to
+    uint32_t next_seq;
+    uint16_t next_file_id;
+    uint32_t records;           // Records written since boot
+    uint64_t payload_bytes;     // Bytes appended since boot
+    uint64_t pad_bytes;         // Payload left unused by sync / close
+    uint32_t erases;
+    uint32_t erase_stalls;      // Sectors erased inline by a write
+    uint32_t wraps;
+    uint32_t write_errors;
+    uint32_t scan_us;           // Time the boot scan took
+    uint32_t scan_reads;        // Records read by the boot scan
+    uint32_t torn_records;      // Bad records found at the head at boot
+} flash_log_stats_t;
+
+//*****************************************************************************
+// flash_log_init) Scan the device, recover the head and get the erase ahead
+//                 sectors ready.
+//
+// dev) Flash to log into. Copied. Size must be at least ERASE_AHEAD + 2
+//      sectors and the sector size a multiple of the record size.
+//
+// Returns) ESP_OK, INVALID_ARG if dev does not fit, else device errors.
+//*****************************************************************************
+esp_err_t flash_log_init(const flash_log_dev_t* dev);
+
+//*****************************************************************************
+// flash_log_open) Start a new capture, writes its OPEN record.
+//
+// name) Up to FLASH_LOG_NAME_LEN chars, used by the host to name the file.
+//
+// file_id) Out param, pass to append and close.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, else device errors.
+//*****************************************************************************
+esp_err_t flash_log_open(const char* name, uint16_t* file_id);
+
+//*****************************************************************************
+// flash_log_append) Append len bytes to the capture. Full records are written
+//                   right away, the rest is staged in RAM.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, else device errors.
+//*****************************************************************************
+esp_err_t flash_log_append(uint16_t file_id, const void* data, uint32_t len);
+
+//*****************************************************************************
+// flash_log_sync) Write out the staged partial record, if any.
+//*****************************************************************************
+esp_err_t flash_log_sync(void);
+
+//*****************************************************************************
+// flash_log_close) Sync and write the CLOSE record of the capture.
+//*****************************************************************************
+esp_err_t flash_log_close(uint16_t file_id);
+
+//*****************************************************************************
+// flash_log_maintain) Erase one sector ahead of the head if fewer than
+//                     ERASE_AHEAD are ready. Call when idle, it may block for
+//                     a sector erase.
+//
+// Returns) ESP_OK, else device errors.
+//*****************************************************************************
+esp_err_t flash_log_maintain(void);
+
+//*****************************************************************************
+// flash_log_read_record) Read and check the record at slot (offset / record
+//                        size). payload must hold FLASH_LOG_PAYLOAD_LEN bytes.
+//
+// Returns) ESP_OK, NOT_FOUND if the slot is erased, INVALID_CRC if it holds a
+//          bad or torn record.
+//*****************************************************************************
+esp_err_t flash_log_read_record(uint32_t slot, flash_log_rec_hdr_t* hdr, void* payload);
+
+uint32_t flash_log_num_slots(void);
+flash_log_stats_t* flash_log_get_stats(void);
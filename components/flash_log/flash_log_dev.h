@@ -0,0 +1,46 @@
+//*****************************************************************************
+// Flash Log Device. The flash log never touches flash directly, it goes
+// through this small NOR flash interface. On the esp32 it is backed by a raw
+// partition (flash_log_dev_esp.c), on Linux by a plain file that behaves like
+// NOR flash (host/flash_log_dev_file.c), so the log can be built, tested and
+// benchmarked on a host.
+//
+// NOR Rules) Erase sets a whole sector to 0xFF. A write can only clear bits,
+//            writing over data that was not erased first ANDs the old and new
+//            bytes. The file emulator enforces this so host runs catch the
+//            same bugs the real flash would.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+    #include "esp_err.h"
+#else
+    typedef int esp_err_t;
+    #define ESP_OK 0
+    #define ESP_FAIL -1
+    #define ESP_ERR_NO_MEM 0x101
+    #define ESP_ERR_INVALID_ARG 0x102
+    #define ESP_ERR_INVALID_STATE 0x103
+    #define ESP_ERR_INVALID_SIZE 0x104
+    #define ESP_ERR_NOT_FOUND 0x105
+    #define ESP_ERR_INVALID_CRC 0x109
+#endif
+
+typedef struct
+{
+    uint32_t size;          // Bytes, a multiple of sector_size
+    uint32_t sector_size;   // Erase unit
+    esp_err_t (*read)(void* ctx, uint32_t off, void* dst, uint32_t len);
+    esp_err_t (*write)(void* ctx, uint32_t off, const void* src, uint32_t len);
+    esp_err_t (*erase)(void* ctx, uint32_t off, uint32_t len);
+    void* ctx;
+} flash_log_dev_t;
+
+//*****************************************************************************
+// flash_log_dev_esp_init) Back dev by the raw data partition with this label.
+//
+// Returns) ESP_OK, NOT_FOUND if there is no such partition.
+//*****************************************************************************
+esp_err_t flash_log_dev_esp_init(flash_log_dev_t* dev, const char* label);
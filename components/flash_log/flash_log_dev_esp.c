@@ -0,0 +1,43 @@
+#include "esp_partition.h"
+#include "esp_log.h"
+
+#include "flash_log_dev.h"
+
+static const char* TAG = "FLASH LOG DEV";
+
+static esp_err_t part_read(void* ctx, uint32_t off, void* dst, uint32_t len)
+{
+    return esp_partition_read((const esp_partition_t*) ctx, off, dst, len);
+}
+
+static esp_err_t part_write(void* ctx, uint32_t off, const void* src, uint32_t len)
+{
+    return esp_partition_write((const esp_partition_t*) ctx, off, src, len);
+}
+
+static esp_err_t part_erase(void* ctx, uint32_t off, uint32_t len)
+{
+    return esp_partition_erase_range((const esp_partition_t*) ctx, off, len);
+}
+
+esp_err_t flash_log_dev_esp_init(flash_log_dev_t* dev, const char* label)
+{
+    const esp_partition_t* p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                        ESP_PARTITION_SUBTYPE_ANY,
+                                                        label);
+    if(!p)
+    {
+        ESP_LOGE(TAG, "No partition labeled %s", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    dev->sector_size = p->erase_size;
+    dev->size = p->size - (p->size % p->erase_size);
+    dev->read = part_read;
+    dev->write = part_write;
+    dev->erase = part_erase;
+    dev->ctx = (void*) p;
+
+    ESP_LOGI(TAG, "%s at 0x%lx, %lu KB", label, p->address, dev->size / 1024);
+    return ESP_OK;
+}
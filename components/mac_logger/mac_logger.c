@@ -14,6 +14,7 @@ static SemaphoreHandle_t lock;
 static ap_t ap_list[CONFIG_MAC_LOGGER_MAX_APS] = { 0 };
 static uint8_t ap_list_len = 0;
 static uint8_t one_time_init_done = 0;
+static mac_logger_new_sta_cb_t new_sta_cb = NULL;
 
 static const char* TAG = "MAC LOGGER";
 
@@ -195,6 +196,12 @@ static inline void create_sta(uint8_t ap_index, uint8_t* sta_mac, int8_t rssi)
     ap_list[ap_index].num_assoc_stas++;
 
     ESP_LOGI(TAG, "STA "MACSTR" added to %s (%d/%d)", MAC2STR(sta_mac), ap_list[ap_index].ssid, ap_list[ap_index].num_assoc_stas, CONFIG_MAC_LOGGER_MAX_STAS);
+
+    mac_logger_new_sta_cb_t cb = new_sta_cb;
+    if(cb)
+    {
+        cb(sta_mac, ap_list[ap_index].bssid);
+    }
 }
 
 //*****************************************************************************
@@ -425,4 +432,10 @@ esp_err_t mac_logger_clear(void)
     ESP_LOGI(TAG, "Cleared Lists");
     _release_lock();
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+esp_err_t mac_logger_set_new_sta_cb(mac_logger_new_sta_cb_t cb)
+{
+    new_sta_cb = cb;
+    return ESP_OK;
+}
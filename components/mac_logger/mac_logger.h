@@ -38,6 +38,8 @@ struct ap
     sta_t stas[CONFIG_MAC_LOGGER_MAX_STAS];
 } typedef ap_t;
 
+typedef void (*mac_logger_new_sta_cb_t)(const uint8_t* sta_mac, const uint8_t* bssid);
+
 
 //*****************************************************************************
 // mac_logger_launch) Create the component wide lock if it hasnt already then
@@ -83,4 +85,15 @@ esp_err_t mac_logger_get_ap(uint8_t ap_index, ap_t* ap);
 // Return) OK            - Successfully cleared the lists
 //         INVALID_STATE - couldn't get lock
 //*****************************************************************************
-esp_err_t mac_logger_clear(void);
\ No newline at end of file
+esp_err_t mac_logger_clear(void);
+
+//*****************************************************************************
+// mac_logger_set_new_sta_cb) Set a hook called each time a new STA is added to
+//                            an AP. It runs in the pkt sniffer cb with the mac
+//                            logger lock held so it must not block.
+//
+// cb) Hook, NULL removes it. Only one hook at a time.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t mac_logger_set_new_sta_cb(mac_logger_new_sta_cb_t cb);
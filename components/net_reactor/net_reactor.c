@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "net_reactor.h"
+
+#ifdef ESP_PLATFORM
+    #include "esp_log.h"
+    #include "esp_timer.h"
+    #include "lwip/sockets.h"
+
+    #include "freertos/FreeRTOS.h"
+    #include "freertos/task.h"
+
+    static const char* TAG = "NET Reactor";
+    static TaskHandle_t task = NULL;
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    #define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+    #define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+    #define NOW_US() esp_timer_get_time()
+    #define SLEEP_MS(ms) vTaskDelay((ms) / portTICK_PERIOD_MS)
+    #define LOCK() portENTER_CRITICAL(&mux)
+    #define UNLOCK() portEXIT_CRITICAL(&mux)
+    #define STACK_FREE() (task ? uxTaskGetStackHighWaterMark(task) : 0)
+#else
+    #include <time.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+
+    static pthread_t task;
+    static pthread_mutex_t mux = PTHREAD_MUTEX_INITIALIZER;
+
+    static int64_t now_us(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    #define LOGI(fmt, ...) printf("NET Reactor: " fmt "\n", ##__VA_ARGS__)
+    #define LOGE(fmt, ...) fprintf(stderr, "NET Reactor: " fmt "\n", ##__VA_ARGS__)
+    #define NOW_US() now_us()
+    #define SLEEP_MS(ms) usleep((ms) * 1000)
+    #define LOCK() pthread_mutex_lock(&mux)
+    #define UNLOCK() pthread_mutex_unlock(&mux)
+    #define STACK_FREE() 0
+#endif
+
+#define MAX_HANDLERS CONFIG_NET_REACTOR_MAX_HANDLERS
+
+static const net_reactor_handler_t* handlers[MAX_HANDLERS];    // Changed under LOCK
+static net_reactor_handler_stats_t h_stats[MAX_HANDLERS];      // Reactor task only
+static net_reactor_stats_t stats;
+static int64_t start_us;
+
+static int ctrl_sock = -1;          // Loopback UDP, in every select
+static int wake_sock = -1;          // ... and what net_reactor_wake sends on
+static struct sockaddr_in ctrl_addr;
+
+//*****************************************************************************
+// Reactor task
+//*****************************************************************************
+
+// Charge a callback that started at t0 to handler slot i
+static void charge(uint8_t i, int64_t t0)
+{
+    uint32_t us = NOW_US() - t0;
+    h_stats[i].calls++;
+    h_stats[i].busy_us += us;
+    if(us > h_stats[i].max_us) { h_stats[i].max_us = us; }
+}
+
+static void reactor_task(void* args)
+{
+    const net_reactor_handler_t* hs[MAX_HANDLERS];
+    fd_set rfds, wfds;
+    int32_t wait = NET_REACTOR_MAX_WAIT_MS;
+    int64_t t0;
+    uint8_t i;
+    (void) args;
+
+    while(1)
+    {
+        LOCK();
+        memcpy(hs, handlers, sizeof(hs));
+        UNLOCK();
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(ctrl_sock, &rfds);
+        int max_fd = ctrl_sock;
+
+        for(i = 0; i < MAX_HANDLERS; ++i)
+        {
+            if(!hs[i]) { continue; }
+
+            t0 = NOW_US();
+            int m = hs[i]->fill(hs[i]->ctx, &rfds, &wfds);
+            charge(i, t0);
+            if(m > max_fd) { max_fd = m; }
+        }
+
+        struct timeval tv = { .tv_sec = wait / 1000, .tv_usec = (wait % 1000) * 1000 };
+        t0 = NOW_US();
+        int n = select(max_fd + 1, &rfds, &wfds, NULL, &tv);
+        stats.wait_us += NOW_US() - t0;
+        if(n < 0)
+        {
+            // Still poll, a handler being killed closes its sockets there
+            LOGE("select failed: %s", strerror(errno));
+            SLEEP_MS(NET_REACTOR_MAX_WAIT_MS);
+            n = 0;
+        }
+
+        if(n > 0 && FD_ISSET(ctrl_sock, &rfds))
+        {
+            uint8_t drain[16];
+            while(recv(ctrl_sock, drain, sizeof(drain), MSG_DONTWAIT) > 0);
+            stats.wakes++;
+        }
+
+        for(i = 0; i < MAX_HANDLERS && n > 0; ++i)
+        {
+            if(!hs[i]) { continue; }
+
+            t0 = NOW_US();
+            hs[i]->ready(hs[i]->ctx, &rfds, &wfds);
+            charge(i, t0);
+        }
+
+        wait = NET_REACTOR_MAX_WAIT_MS;
+        for(i = 0; i < MAX_HANDLERS; ++i)
+        {
+            if(!hs[i]) { continue; }
+
+            t0 = NOW_US();
+            int32_t r = hs[i]->poll(hs[i]->ctx);
+            charge(i, t0);
+
+            if(r == NET_REACTOR_REMOVE)
+            {
+                LOCK();
+                handlers[i] = NULL;
+                stats.handlers--;
+                UNLOCK();
+                LOGI("Handler %s removed", hs[i]->name);
+                continue;
+            }
+
+            if(r < 0)    { r = 0; }
+            if(r < wait) { wait = r; }
+        }
+
+        stats.rounds++;
+    }
+}
+
+#ifndef ESP_PLATFORM
+static void* host_task(void* args)
+{
+    pthread_detach(pthread_self());
+    reactor_task(args);
+    return NULL;
+}
+#endif
+
+// Loopback UDP pair net_reactor_wake breaks the select with. Returns 0 on
+// success.
+static uint8_t create_ctrl_sockets(void)
+{
+    socklen_t len = sizeof(ctrl_addr);
+
+    memset(&ctrl_addr, 0, sizeof(ctrl_addr));
+    ctrl_addr.sin_family = AF_INET;
+    ctrl_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ctrl_addr.sin_port = 0;
+
+    ctrl_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    wake_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(ctrl_sock < 0 || wake_sock < 0 ||
+       bind(ctrl_sock, (struct sockaddr*) &ctrl_addr, sizeof(ctrl_addr)) ||
+       getsockname(ctrl_sock, (struct sockaddr*) &ctrl_addr, &len))
+    {
+        LOGE("Failed to open the wake sockets");
+        if(ctrl_sock >= 0) { close(ctrl_sock); }
+        if(wake_sock >= 0) { close(wake_sock); }
+        ctrl_sock = -1;
+        wake_sock = -1;
+        return 1;
+    }
+
+    fcntl(ctrl_sock, F_SETFL, fcntl(ctrl_sock, F_GETFL, 0) | O_NONBLOCK);
+    return 0;
+}
+
+//*****************************************************************************
+// API Funcs
+//*****************************************************************************
+
+esp_err_t net_reactor_init(void)
+{
+    if(ctrl_sock >= 0)
+    {
+        LOGE("already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if(create_ctrl_sockets())
+    {
+        return ESP_FAIL;
+    }
+
+    start_us = NOW_US();
+    stats.stack_size = CONFIG_NET_REACTOR_STACK_SIZE;
+
+    #ifdef ESP_PLATFORM
+    xTaskCreate(reactor_task, "NET Reactor", CONFIG_NET_REACTOR_STACK_SIZE, NULL,
+                CONFIG_NET_REACTOR_PRIO, &task);
+    if(!task)
+    #else
+    if(pthread_create(&task, NULL, host_task, NULL))
+    #endif
+    {
+        LOGE("Failed to start the reactor task");
+        close(ctrl_sock);
+        close(wake_sock);
+        ctrl_sock = -1;
+        wake_sock = -1;
+        return ESP_ERR_NO_MEM;
+    }
+
+    LOGI("Reactor Task Launched");
+    return ESP_OK;
+}
+
+esp_err_t net_reactor_add(const net_reactor_handler_t* h)
+{
+    if(!h || !h->fill || !h->ready || !h->poll)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(ctrl_sock < 0)
+    {
+        LOGE("not running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint8_t i, slot = MAX_HANDLERS;
+    esp_err_t err = ESP_OK;
+
+    LOCK();
+    for(i = 0; i < MAX_HANDLERS; ++i)
+    {
+        if(handlers[i] == h)                          { err = ESP_ERR_INVALID_STATE; }
+        if(!handlers[i] && slot == MAX_HANDLERS)      { slot = i; }
+    }
+    if(err == ESP_OK && slot == MAX_HANDLERS)
+    {
+        err = ESP_ERR_NO_MEM;
+    }
+    if(err == ESP_OK)
+    {
+        // The slot is not in the task's round yet, its stats are free to reset
+        memset(&h_stats[slot], 0, sizeof(h_stats[slot]));
+        strncpy(h_stats[slot].name, h->name, NET_REACTOR_NAME_LEN - 1);
+        handlers[slot] = h;
+        stats.handlers++;
+    }
+    UNLOCK();
+
+    if(err != ESP_OK)
+    {
+        LOGE("Can not add handler %s", h->name);
+        return err;
+    }
+
+    LOGI("Handler %s added in slot %u", h->name, slot);
+    net_reactor_wake();
+    return ESP_OK;
+}
+
+void net_reactor_wake(void)
+{
+    uint8_t b = 0;
+    if(wake_sock >= 0)
+    {
+        sendto(wake_sock, &b, 1, 0, (struct sockaddr*) &ctrl_addr, sizeof(ctrl_addr));
+    }
+}
+
+esp_err_t net_reactor_get_stats(net_reactor_stats_t* s)
+{
+    if(!s)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *s = stats;
+    s->up_us = (ctrl_sock >= 0) ? NOW_US() - start_us : 0;
+    s->stack_free = STACK_FREE();
+    return ESP_OK;
+}
+
+esp_err_t net_reactor_get_handler_stats(uint8_t i, net_reactor_handler_stats_t* s)
+{
+    if(!s || i >= MAX_HANDLERS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    LOCK();
+    uint8_t on = handlers[i] != NULL;
+    UNLOCK();
+    if(!on)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *s = h_stats[i];
+    return ESP_OK;
+}
@@ -0,0 +1,141 @@
+//*****************************************************************************
+// Net Reactor. One task owns every listening and client socket of the REPL
+// mux, the file server, telemetry and the pcap stream and waits on all of
+// them in a single select. Each protocol plugs in as a handler, a set of
+// callbacks run on the reactor task, instead of keeping a task of its own
+// blocked in accept / recv:
+//
+//             |---------|  fill   |----------------|  ready  |-----------|
+//  handlers ->| Reactor |-------->| select, all    |-------->| Handler's |
+//  (repl mux, |  task   |<--------| sockets, one   |         | sockets   |
+//   file srv, |---------|  poll   |----------------|         |-----------|
+//   telemetry,
+//   pcap stream)
+//
+// Round) Each round the reactor asks every handler for its sockets (fill),
+//        selects on them with the shortest wait any handler asked for, then
+//        runs ready of each handler with the sets and poll of each handler
+//        once. poll is where a handler does its timed work (flushing a batch,
+//        dropping idle clients) and returns how long it can wait. A handler
+//        that returns NET_REACTOR_REMOVE from poll is taken off, after it
+//        closed its sockets.
+//
+// Sockets) A socket a handler opens in ready is not looked at before the next
+//          round, so a handler accepts after serving its ready sockets. A
+//          socket number closed by one handler can come back from accept in
+//          another one in the same round, the sets are only valid for the
+//          sockets the handler put in them.
+//
+// Wake) net_reactor_wake breaks the select from any other task, i.e. a
+//       reader that filled a buffer for a socket the reactor does not wait
+//       on. It sends on a loopback UDP socket, so it must not be called from
+//       the lwip task or a log hook that lwip may run.
+//
+// Blocking) Every handler shares the one task, a callback that blocks holds
+//           all of them up. Work that may block goes to a task of the
+//           handler's own, i.e. REPL commands run on the mux's NET Cmd task
+//           (see repl_mux.h) and file reads on the file server's reader.
+//
+// Stats) CPU time per handler (fill, ready and poll calls), time spent in
+//        select and the stack of the task.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+    #include "esp_err.h"
+    #include "lwip/sockets.h"
+#else
+    #include <sys/select.h>
+
+    #ifndef ESP_OK
+        typedef int esp_err_t;
+        #define ESP_OK 0
+        #define ESP_FAIL -1
+        #define ESP_ERR_NO_MEM 0x101
+        #define ESP_ERR_INVALID_ARG 0x102
+        #define ESP_ERR_INVALID_STATE 0x103
+        #define ESP_ERR_NOT_FOUND 0x105
+    #endif
+
+    #define CONFIG_NET_REACTOR_MAX_HANDLERS 6
+    #define CONFIG_NET_REACTOR_STACK_SIZE 4096
+    #define CONFIG_NET_REACTOR_PRIO 4
+#endif
+
+#define NET_REACTOR_NAME_LEN 16
+#define NET_REACTOR_MAX_WAIT_MS 100     // Longest select, bounds how late a poll can be
+#define NET_REACTOR_FOREVER INT32_MAX   // poll, nothing timed pending
+#define NET_REACTOR_REMOVE -1           // poll, take the handler off
+
+typedef struct
+{
+    const char* name;
+    void* ctx;
+
+    // Add the sockets to wait on to the sets. Returns the biggest one added,
+    // -1 if none.
+    int (*fill)(void* ctx, fd_set* rfds, fd_set* wfds);
+
+    // Serve the sockets of the handler that are set
+    void (*ready)(void* ctx, fd_set* rfds, fd_set* wfds);
+
+    // Timed work. Returns ms until it wants to be polled again,
+    // NET_REACTOR_FOREVER or NET_REACTOR_REMOVE.
+    int32_t (*poll)(void* ctx);
+} net_reactor_handler_t;
+
+typedef struct
+{
+    char name[NET_REACTOR_NAME_LEN];
+    uint32_t calls;                // Of fill, ready and poll
+    uint64_t busy_us;               // Time in them
+    uint32_t max_us;                // Longest single call
+} net_reactor_handler_stats_t;
+
+typedef struct
+{
+    uint32_t rounds;
+    uint32_t wakes;                 // Rounds net_reactor_wake cut short
+    uint64_t up_us;                 // Since init
+    uint64_t wait_us;               // Time in select
+    uint8_t handlers;
+    uint32_t stack_size;
+    uint32_t stack_free;            // Least stack left so far, bytes
+} net_reactor_stats_t;
+
+//*****************************************************************************
+// net_reactor_init) Open the wake sockets and start the reactor task. Called
+//                   once at boot, before any handler is added.
+//
+// Returns) ESP_OK, ESP_ERR_INVALID_STATE if already running, ESP_FAIL if the
+//          wake sockets can not be opened, ESP_ERR_NO_MEM if the task can not
+//          be made.
+//*****************************************************************************
+esp_err_t net_reactor_init(void);
+
+//*****************************************************************************
+// net_reactor_add) Serve a handler from the next round on. h is kept, not
+//                  copied, and must stay valid until its poll removes it.
+//
+// Returns) ESP_OK, ESP_ERR_INVALID_STATE if the reactor is not running or h
+//          is on already, ESP_ERR_INVALID_ARG if a callback is missing,
+//          ESP_ERR_NO_MEM if CONFIG_NET_REACTOR_MAX_HANDLERS are on.
+//*****************************************************************************
+esp_err_t net_reactor_add(const net_reactor_handler_t* h);
+
+//*****************************************************************************
+// net_reactor_wake) Start a new round now. See Wake above.
+//*****************************************************************************
+void net_reactor_wake(void);
+
+esp_err_t net_reactor_get_stats(net_reactor_stats_t* s);
+
+//*****************************************************************************
+// net_reactor_get_handler_stats) Stats of the i-th handler slot.
+//
+// Returns) ESP_OK, ESP_ERR_NOT_FOUND if the slot is empty,
+//          ESP_ERR_INVALID_ARG past the last slot.
+//*****************************************************************************
+esp_err_t net_reactor_get_handler_stats(uint8_t i, net_reactor_handler_stats_t* s);
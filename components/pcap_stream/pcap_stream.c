@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pcap_stream.h"
+#include "pcap.h"
+#include "capture_time.h"
+#include "net_reactor.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+static const char* TAG = "PCAP Stream";
+
+#define RING_SIZE (CONFIG_PCAP_STREAM_RING_KB * 1024)
+#define REC_HDR sizeof(pcap_pkthdr_t)
+#define MAX_REC (REC_HDR + CONFIG_PCAP_STREAM_SNAPLEN)
+#define TX_SIZE (MAX_REC + CONFIG_LWIP_TCP_MSS)     // At least one whole record
+#define MAX_CLIENTS CONFIG_PCAP_STREAM_MAX_CLIENTS
+#define POLL_MS 20                  // Reactor poll period with clients, bounds the stream latency
+
+_Static_assert(RING_SIZE >= 4 * MAX_REC, "pcap stream ring smaller than 4 records");
+
+//*****************************************************************************
+// The ring is addressed with running byte positions and record sequence
+// numbers, a position maps to ring[pos % RING_SIZE] and records may wrap.
+// Positions and sequence numbers are only ever compared by difference so
+// they can wrap too. Everything here is shared between the RX cb and the
+// reactor task and only touched inside the critical section.
+//*****************************************************************************
+
+static uint8_t ring[RING_SIZE];
+static uint32_t head_pos = 0;       // Next record goes here
+static uint32_t tail_pos = 0;       // Oldest record
+static uint32_t head_seq = 0;
+static uint32_t tail_seq = 0;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct
+{
+    uint8_t active;
+    int sock;
+    char ip_addr[16];
+    int64_t start_us;
+    uint32_t pos;                   // Next record to copy out
+    uint32_t seq;
+    uint32_t pkts;
+    uint32_t drops;
+    uint64_t bytes_sent;
+
+    uint8_t tx[TX_SIZE];            // Whole records, tx_off of tx_len sent
+    uint16_t tx_off;
+    uint16_t tx_len;
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+static uint8_t n_clients = 0;
+
+static pcap_stream_cfg_t cfg;
+static uint8_t self_mac[6];
+static uint8_t running = 0;
+static volatile uint8_t serving = 0;        // On the reactor, until the poll after a fini
+static int listen_sock = -1;
+static pcap_stream_stats_t stats;
+
+//*****************************************************************************
+// Ring helpers, called in the critical section
+//*****************************************************************************
+
+static void ring_write(uint32_t pos, const void* src, uint32_t len)
+{
+    uint32_t off = pos % RING_SIZE;
+    uint32_t first = (len < RING_SIZE - off) ? len : RING_SIZE - off;
+
+    memcpy(ring + off, src, first);
+    memcpy(ring, (const uint8_t*) src + first, len - first);
+}
+
+static void ring_read(uint32_t pos, void* dst, uint32_t len)
+{
+    uint32_t off = pos % RING_SIZE;
+    uint32_t first = (len < RING_SIZE - off) ? len : RING_SIZE - off;
+
+    memcpy(dst, ring + off, first);
+    memcpy((uint8_t*) dst + first, ring, len - first);
+}
+
+static uint32_t rec_len_at(uint32_t pos)
+{
+    pcap_pkthdr_t h;
+    ring_read(pos, &h, REC_HDR);
+    return REC_HDR + h.caplen;
+}
+
+//*****************************************************************************
+// RX path
+//*****************************************************************************
+
+static void rx_cb(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t subtype)
+{
+    wifi_pkt_rx_ctrl_t* rx_ctrl = (wifi_pkt_rx_ctrl_t*) meta_data;
+    dot11_header_t* hdr = (dot11_header_t*) pkt;
+    int64_t now = capture_time_rx_us(rx_ctrl);
+
+    // No one to stream to, dont spend the copy
+    if(!running || !n_clients)
+    {
+        return;
+    }
+
+    if(cfg.exclude_self && (!memcmp(hdr->addr1, self_mac, 6) || !memcmp(hdr->addr2, self_mac, 6)))
+    {
+        stats.self_skipped++;
+        return;
+    }
+
+    uint64_t wall_us = capture_time_to_wall(now);
+    pcap_pkthdr_t h;
+    h.ts_sec = (uint32_t) (wall_us / 1000000);
+    h.ts_usec = (uint32_t) (wall_us % 1000000);
+    h.len = rx_ctrl->sig_len;
+    h.caplen = (h.len < CONFIG_PCAP_STREAM_SNAPLEN) ? h.len : CONFIG_PCAP_STREAM_SNAPLEN;
+    uint32_t need = REC_HDR + h.caplen;
+
+    portENTER_CRITICAL(&mux);
+    while(head_pos - tail_pos + need > RING_SIZE)
+    {
+        tail_pos += rec_len_at(tail_pos);
+        tail_seq++;
+        stats.evicted++;
+    }
+
+    ring_write(head_pos, &h, REC_HDR);
+    ring_write(head_pos + REC_HDR, pkt, h.caplen);
+    head_pos += need;
+    head_seq++;
+    stats.pkts++;
+    portEXIT_CRITICAL(&mux);
+}
+
+//*****************************************************************************
+// Reactor handler
+//*****************************************************************************
+
+// Copy whole records from the client cursor into its send buffer. A cursor
+// that was evicted skips ahead to the oldest record left.
+static void fill_tx(client_t* c)
+{
+    portENTER_CRITICAL(&mux);
+    if((int32_t) (c->pos - tail_pos) < 0)
+    {
+        uint32_t skipped = tail_seq - c->seq;
+        c->drops += skipped;
+        stats.drops += skipped;
+        c->pos = tail_pos;
+        c->seq = tail_seq;
+    }
+
+    while(c->pos != head_pos)
+    {
+        uint32_t len = rec_len_at(c->pos);
+        if(c->tx_len + len > TX_SIZE)
+        {
+            break;
+        }
+
+        ring_read(c->pos, c->tx + c->tx_len, len);
+        c->tx_len += len;
+        c->pos += len;
+        c->seq++;
+        c->pkts++;
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+static uint8_t has_data(client_t* c)
+{
+    portENTER_CRITICAL(&mux);
+    uint8_t r = c->tx_len || c->pos != head_pos;
+    portEXIT_CRITICAL(&mux);
+    return r;
+}
+
+static void client_close(client_t* c, const char* why)
+{
+    int64_t ms = (esp_timer_get_time() - c->start_us) / 1000;
+    ESP_LOGI(TAG, "Client %s %s, %llu bytes, %lu pkts, %lu dropped in %lld ms",
+             c->ip_addr, why, c->bytes_sent, c->pkts, c->drops, ms);
+
+    shutdown(c->sock, 0);
+    close(c->sock);
+
+    portENTER_CRITICAL(&mux);
+    c->active = 0;
+    n_clients--;
+    portEXIT_CRITICAL(&mux);
+}
+
+static void client_accept(void)
+{
+    struct sockaddr_in source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    uint8_t i;
+
+    int sock = accept(listen_sock, (struct sockaddr*) &source_addr, &addr_len);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        return;
+    }
+
+    for(i = 0; i < MAX_CLIENTS && clients[i].active; ++i);
+    if(i == MAX_CLIENTS)
+    {
+        ESP_LOGE(TAG, "All %d stream slots busy, refusing connection", MAX_CLIENTS);
+        stats.refused++;
+        close(sock);
+        return;
+    }
+
+    client_t* c = &clients[i];
+    memset(c, 0, sizeof(client_t));
+    c->sock = sock;
+    c->start_us = esp_timer_get_time();
+    inet_ntoa_r(source_addr.sin_addr, c->ip_addr, sizeof(c->ip_addr));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    // The file header, then frames from now on
+    pcap_file_header_t file_hdr = {0};
+    file_hdr.magic = PCAP_MAGIC;
+    file_hdr.version_major = 2;
+    file_hdr.version_minor = 4;
+    file_hdr.snaplen = CONFIG_PCAP_STREAM_SNAPLEN;
+    file_hdr.linktype = DOT11_LINK_TYPE;
+    memcpy(c->tx, &file_hdr, sizeof(file_hdr));
+    c->tx_len = sizeof(file_hdr);
+
+    portENTER_CRITICAL(&mux);
+    c->pos = head_pos;
+    c->seq = head_seq;
+    c->active = 1;
+    n_clients++;
+    portEXIT_CRITICAL(&mux);
+
+    stats.accepted++;
+    ESP_LOGI(TAG, "Client %s streaming in slot %d", c->ip_addr, i);
+}
+
+// Returns 1 if the client is gone
+static uint8_t client_send(client_t* c)
+{
+    if(c->tx_len == 0)
+    {
+        fill_tx(c);
+        if(c->tx_len == 0) { return 0; }
+    }
+
+    int n = send(c->sock, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_DONTWAIT);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    if(n <= 0)
+    {
+        return 1;
+    }
+
+    c->tx_off += n;
+    c->bytes_sent += n;
+    stats.bytes_sent += n;
+    if(c->tx_off == c->tx_len)
+    {
+        c->tx_off = 0;
+        c->tx_len = 0;
+    }
+
+    return 0;
+}
+
+static int open_listen_sock(void)
+{
+    struct sockaddr_in addr = {0};
+    int opt = 1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if(sock < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(CONFIG_PCAP_STREAM_IP);
+    addr.sin_port = htons(CONFIG_PCAP_STREAM_PORT);
+    if(bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || listen(sock, MAX_CLIENTS))
+    {
+        close(sock);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Listening on %s:%d", CONFIG_PCAP_STREAM_IP, CONFIG_PCAP_STREAM_PORT);
+    return sock;
+}
+
+static int ps_fill(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    if(!running)
+    {
+        return -1;
+    }
+
+    int max_fd = listen_sock;
+    FD_SET(listen_sock, rfds);
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        if(!c->active) { continue; }
+
+        // Readable only ever means the client closed or sent junk
+        FD_SET(c->sock, rfds);
+        if(has_data(c)) { FD_SET(c->sock, wfds); }
+        if(c->sock > max_fd) { max_fd = c->sock; }
+    }
+
+    return max_fd;
+}
+
+static void ps_ready(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    if(!running)
+    {
+        return;
+    }
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        uint8_t junk[32];
+        if(!c->active) { continue; }
+
+        if(FD_ISSET(c->sock, rfds) && recv(c->sock, junk, sizeof(junk), MSG_DONTWAIT) <= 0)
+        {
+            client_close(c, "closed");
+        }
+        else if(FD_ISSET(c->sock, wfds) && client_send(c))
+        {
+            client_close(c, "reset");
+        }
+    }
+
+    // Last, a new socket may have the number of one served above
+    if(FD_ISSET(listen_sock, rfds))
+    {
+        client_accept();
+    }
+}
+
+// The RX cb fills the ring without waking the reactor, so while anyone is
+// connected come back every POLL_MS to pick up new records. After a fini
+// close every socket and come off the reactor.
+static int32_t ps_poll(void* ctx)
+{
+    uint8_t i;
+
+    if(!running)
+    {
+        for(i = 0; i < MAX_CLIENTS; ++i)
+        {
+            if(clients[i].active) { client_close(&clients[i], "stream stopped"); }
+        }
+        close(listen_sock);
+        listen_sock = -1;
+        serving = 0;
+        ESP_LOGI(TAG, "Stream exiting");
+        return NET_REACTOR_REMOVE;
+    }
+
+    return n_clients ? POLL_MS : NET_REACTOR_FOREVER;
+}
+
+static const net_reactor_handler_t ps_handler =
+{
+    .name = "pcap_stream",
+    .fill = ps_fill,
+    .ready = ps_ready,
+    .poll = ps_poll,
+};
+
+static esp_err_t update_sniffer_filter(void)
+{
+    pkt_sniffer_filtered_src_t f = {0};
+
+    memcpy(&f.filter, &cfg.filter, sizeof(pkt_filter_t));
+    f.cb = rx_cb;
+
+    esp_err_t e = pkt_sniffer_set_filter(&f);
+    ESP_LOGI(TAG, "Type Mask = 0x%x   Data Mask = 0x%x   MGMT Mask = 0x%x", f.filter.type_bitmap, f.filter.data_subtype_bitmap, f.filter.mgmt_subtype_bitmap);
+    return e;
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t pcap_stream_init(const pcap_stream_cfg_t* c)
+{
+    if(!running && serving)
+    {
+        ESP_LOGE(TAG, "Previous stream still closing");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memcpy(&cfg, c, sizeof(pcap_stream_cfg_t));
+    esp_wifi_get_mac(WIFI_IF_AP, self_mac);
+
+    esp_err_t e = update_sniffer_filter();
+    if(e != ESP_OK || running)
+    {
+        return e;
+    }
+
+    listen_sock = open_listen_sock();
+    if(listen_sock < 0)
+    {
+        ESP_LOGE(TAG, "Failed to open the listening socket");
+        pkt_sniffer_remove_filter(rx_cb);
+        return ESP_FAIL;
+    }
+
+    portENTER_CRITICAL(&mux);
+    head_pos = 0;
+    tail_pos = 0;
+    head_seq = 0;
+    tail_seq = 0;
+    portEXIT_CRITICAL(&mux);
+
+    running = 1;
+    serving = 1;
+    e = net_reactor_add(&ps_handler);
+    if(e != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to put the stream on the reactor");
+        running = 0;
+        serving = 0;
+        close(listen_sock);
+        listen_sock = -1;
+        pkt_sniffer_remove_filter(rx_cb);
+        return e;
+    }
+
+    ESP_LOGI(TAG, "Streaming, %d KB ring  snaplen %d  up to %d clients",
+             CONFIG_PCAP_STREAM_RING_KB, CONFIG_PCAP_STREAM_SNAPLEN, MAX_CLIENTS);
+    return ESP_OK;
+}
+
+esp_err_t pcap_stream_fini(void)
+{
+    if(!running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The next reactor poll closes every socket and takes the stream off
+    running = 0;
+    net_reactor_wake();
+    return pkt_sniffer_remove_filter(rx_cb);
+}
+
+uint8_t pcap_stream_is_running(void)
+{
+    return running;
+}
+
+esp_err_t pcap_stream_get_stats(pcap_stream_stats_t* s,
+                                pcap_stream_client_stats_t* cs,
+                                uint32_t* ring_used)
+{
+    uint8_t i;
+
+    portENTER_CRITICAL(&mux);
+    memcpy(s, &stats, sizeof(pcap_stream_stats_t));
+    if(ring_used) { *ring_used = head_pos - tail_pos; }
+
+    for(i = 0; cs && i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        cs[i].active = c->active;
+        memcpy(cs[i].ip_addr, c->ip_addr, sizeof(cs[i].ip_addr));
+        cs[i].pkts = c->pkts;
+        cs[i].drops = c->drops;
+        cs[i].bytes_sent = c->bytes_sent;
+        cs[i].lag = c->active ? head_pos - c->pos : 0;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return ESP_OK;
+}
@@ -0,0 +1,115 @@
+//*****************************************************************************
+// PCAP Stream. Looking at frames used to mean writing them to flash and then
+// pulling the file over the file server. The pcap stream takes flash out of
+// the loop: frames matching its filter are pushed live, as a standard pcap
+// stream, to every TCP client connected on CONFIG_PCAP_STREAM_PORT. The
+// stream pipes straight into an analyzer:
+//
+//     nc 192.168.4.1 423 | wireshark -k -i -
+//     nc 192.168.4.1 423 | tshark -i -
+//
+// |-------------|  filter  |---------------|  cursor per client  |-------------|
+// | Pkt Sniffer |--------->|   RAM ring    |-------------------->| Net Reactor |--> TCP
+// |-------------|  (RX cb) | pcap records  |                     |   handler   |    clients
+//                          |---------------|                     |-------------|
+//
+// Ring) CONFIG_PCAP_STREAM_RING_KB of RAM holding pcap records (record header
+//       and the frame cut to CONFIG_PCAP_STREAM_SNAPLEN) back to back, exactly
+//       as they go out on the wire. Records are addressed by a running byte
+//       position and sequence number. A frame that does not fit evicts the
+//       oldest records, so the RX cb never waits on a client.
+//
+// Clients) Each client has its own cursor into the ring. The net reactor
+//          copies whole records from the cursor into the client's send buffer
+//          and sends it without blocking, every POLL_MS while anyone is
+//          connected. A client that falls so far behind
+//          that its cursor was evicted skips ahead to the oldest record still
+//          in the ring, the frames skipped are counted as its drops. The
+//          stream stays valid pcap, only whole records are ever skipped. A new
+//          client gets the pcap file header and then the frames from the
+//          moment it connected.
+//
+// Timestamps) From capture_time_to_wall, so unix time once time_set was run,
+//             else time since boot. Link type 802.11 (105), the same records
+//             the capture writer puts in a pcap file.
+//
+// Self) Streaming over the AP makes traffic of its own that the sniffer sees.
+//       With exclude_self frames to or from our AP MAC are not streamed so
+//       the stream does not feed on itself.
+//
+// Assumptions) The sniffer has to share the radio with the AP the client is
+//              on, launch it on the AP channel (1). main does not kill the
+//              sniffer on a STA joining the AP while the stream is running.
+//              PS_clear also throws away the stream sniffer filter.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "pkt_sniffer.h"
+
+typedef struct
+{
+    pkt_filter_t filter;        // Frames streamed, see pkt_sniffer.h
+    uint8_t exclude_self;       // Skip frames to / from our AP MAC
+} pcap_stream_cfg_t;
+
+typedef struct
+{
+    uint32_t pkts;              // Frames put in the ring
+    uint32_t evicted;           // Records pushed out by newer frames
+    uint32_t self_skipped;      // Frames to / from our AP MAC not streamed
+    uint32_t accepted;          // Clients served
+    uint32_t refused;           // Clients refused, all slots busy
+    uint32_t drops;             // Frames clients skipped for lagging, closed clients too
+    uint64_t bytes_sent;        // To all clients, closed ones too
+} pcap_stream_stats_t;
+
+typedef struct
+{
+    uint8_t active;
+    char ip_addr[16];
+    uint32_t pkts;              // Frames sent
+    uint32_t drops;             // Frames skipped, evicted before they were sent
+    uint64_t bytes_sent;
+    uint32_t lag;               // Ring bytes not sent yet
+} pcap_stream_client_stats_t;
+
+//*****************************************************************************
+// pcap_stream_init) Start streaming. The first call opens the listening
+//                   socket and puts the stream on the net reactor. Call again while running to
+//                   change the config, connected clients carry on.
+//
+// cfg) Filter and options. Copied.
+//
+// Returns) ESP_OK, INVALID_STATE if a previous stream is still closing,
+//          NO_MEM if the net reactor has no free handler slot, else pkt
+//          sniffer errors.
+//*****************************************************************************
+esp_err_t pcap_stream_init(const pcap_stream_cfg_t* cfg);
+
+//*****************************************************************************
+// pcap_stream_fini) Stop streaming. The next reactor poll closes every
+//                   client and the listening socket.
+//
+// Returns) ESP_OK, INVALID_STATE if not running.
+//*****************************************************************************
+esp_err_t pcap_stream_fini(void);
+
+//*****************************************************************************
+// Returns) 1 if streaming 0 else
+//*****************************************************************************
+uint8_t pcap_stream_is_running(void);
+
+//*****************************************************************************
+// pcap_stream_get_stats) Copy out the stats.
+//
+// stats) Out param.
+// clients) Out param, CONFIG_PCAP_STREAM_MAX_CLIENTS entries. May be NULL.
+// ring_used) Out param, bytes of the ring in use. May be NULL.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t pcap_stream_get_stats(pcap_stream_stats_t* stats,
+                                pcap_stream_client_stats_t* clients,
+                                uint32_t* ring_used);
@@ -18,7 +18,8 @@ typedef struct
 
 typedef struct  
 {
-    uint64_t ts;      /* time stamp */
+    uint32_t ts_sec;     /* time stamp, seconds */
+    uint32_t ts_usec;    /* time stamp, micro seconds */
     uint32_t caplen;     /* length of portion present */
     uint32_t len;        /* length this packet (off wire) */
 } pcap_pkthdr_t;
\ No newline at end of file
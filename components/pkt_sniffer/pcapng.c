@@ -0,0 +1,159 @@
+#include <string.h>
+
+#include "pcapng.h"
+
+// Radiotap present bits we use, see https://www.radiotap.org/fields/defined
+#define RT_TSFT     0
+#define RT_FLAGS    1
+#define RT_RATE     2
+#define RT_CHANNEL  3
+#define RT_SIGNAL   5
+#define RT_NOISE    6
+#define RT_MCS      19
+
+#define RT_FLAG_SHORT_PRE 0x02
+#define RT_FLAG_FCS       0x10
+
+#define RT_CHAN_CCK  0x0020
+#define RT_CHAN_OFDM 0x0040
+#define RT_CHAN_2GHZ 0x0080
+
+#define RT_MCS_KNOWN_BW   0x01
+#define RT_MCS_KNOWN_MCS  0x02
+#define RT_MCS_KNOWN_GI   0x04
+#define RT_MCS_KNOWN_FEC  0x10
+#define RT_MCS_FLAG_BW40  0x01
+#define RT_MCS_FLAG_SGI   0x04
+#define RT_MCS_FLAG_LDPC  0x10
+
+// Legacy rate index (wifi_phy_rate_t) to radiotap units of 500 Kbps
+static const uint8_t legacy_rate_500k[16] =
+{
+    2, 4, 11, 22, 0, 4, 11, 22, 96, 48, 24, 12, 108, 72, 36, 18
+};
+
+static inline void put16(uint8_t* p, uint16_t v) { memcpy(p, &v, 2); }
+static inline void put32(uint8_t* p, uint32_t v) { memcpy(p, &v, 4); }
+static inline void put64(uint8_t* p, uint64_t v) { memcpy(p, &v, 8); }
+
+static inline uint16_t align(uint16_t off, uint16_t a)
+{
+    return (off + a - 1) & ~(a - 1);
+}
+
+// Build the radiotap header into buf, returns its length. buf must be
+// RADIOTAP_MAX_LEN and zeroed.
+static uint16_t build_radiotap(uint8_t* buf, const wifi_pkt_rx_ctrl_t* rx_ctrl, uint8_t has_fcs)
+{
+    uint32_t present = 0;
+    uint16_t off = 8;
+    uint8_t flags = has_fcs ? RT_FLAG_FCS : 0;
+    uint8_t legacy = (rx_ctrl->sig_mode == 0);
+    uint8_t rate_i = rx_ctrl->rate & 0xf;
+    uint8_t ch = rx_ctrl->channel;
+    uint16_t chan_flags = RT_CHAN_2GHZ;
+
+    if(legacy && rate_i >= 5 && rate_i <= 7)
+    {
+        flags |= RT_FLAG_SHORT_PRE;
+    }
+
+    // TSFT, the MAC timer of the radio when the frame was recieved
+    present |= 1 << RT_TSFT;
+    put64(buf + off, (uint64_t) rx_ctrl->timestamp);
+    off += 8;
+
+    present |= 1 << RT_FLAGS;
+    buf[off++] = flags;
+
+    if(legacy)
+    {
+        present |= 1 << RT_RATE;
+        buf[off++] = legacy_rate_500k[rate_i];
+        chan_flags |= (rate_i < 8) ? RT_CHAN_CCK : RT_CHAN_OFDM;
+    }
+    else
+    {
+        chan_flags |= RT_CHAN_OFDM;
+    }
+
+    present |= 1 << RT_CHANNEL;
+    off = align(off, 2);
+    put16(buf + off, (ch == 14) ? 2484 : (uint16_t) (2407 + 5 * ch));
+    put16(buf + off + 2, chan_flags);
+    off += 4;
+
+    present |= 1 << RT_SIGNAL;
+    buf[off++] = (uint8_t) (int8_t) rx_ctrl->rssi;
+
+    present |= 1 << RT_NOISE;
+    buf[off++] = (uint8_t) (int8_t) rx_ctrl->noise_floor;
+
+    if(!legacy)
+    {
+        present |= 1 << RT_MCS;
+        buf[off++] = RT_MCS_KNOWN_BW | RT_MCS_KNOWN_MCS | RT_MCS_KNOWN_GI | RT_MCS_KNOWN_FEC;
+        buf[off++] = (rx_ctrl->cwb ? RT_MCS_FLAG_BW40 : 0) |
+                     (rx_ctrl->sgi ? RT_MCS_FLAG_SGI : 0) |
+                     (rx_ctrl->fec_coding ? RT_MCS_FLAG_LDPC : 0);
+        buf[off++] = rx_ctrl->mcs;
+    }
+
+    // version 0, pad 0, len, present
+    buf[0] = 0;
+    buf[1] = 0;
+    put16(buf + 2, off);
+    put32(buf + 4, present);
+
+    return off;
+}
+
+uint16_t pcapng_file_header(uint8_t* buf)
+{
+    // Section Header Block
+    put32(buf + 0, PCAPNG_BLOCK_SHB);
+    put32(buf + 4, 28);
+    put32(buf + 8, PCAPNG_BYTE_ORDER_MAGIC);
+    put16(buf + 12, 1);
+    put16(buf + 14, 0);
+    put64(buf + 16, 0xffffffffffffffffULL);  // section length unknown
+    put32(buf + 24, 28);
+
+    // Interface Description Block, no options so us timestamps
+    put32(buf + 28, PCAPNG_BLOCK_IDB);
+    put32(buf + 32, 20);
+    put16(buf + 36, RADIOTAP_LINK_TYPE);
+    put16(buf + 38, 0);
+    put32(buf + 40, 0xffff);
+    put32(buf + 44, 20);
+
+    return PCAPNG_FILE_HDR_LEN;
+}
+
+void pcapng_build_epb(pcapng_epb_t* epb,
+                      uint64_t ts_us,
+                      const wifi_pkt_rx_ctrl_t* rx_ctrl,
+                      uint16_t pkt_len,
+                      uint8_t has_fcs)
+{
+    uint8_t* h = epb->hdr;
+    memset(h, 0, PCAPNG_EPB_MAX_HDR);
+
+    uint16_t rt_len = build_radiotap(h + PCAPNG_EPB_BASE_LEN, rx_ctrl, has_fcs);
+    uint32_t cap_len = rt_len + pkt_len;
+    uint16_t pad = (4 - (cap_len & 3)) & 3;
+    uint32_t total = PCAPNG_EPB_BASE_LEN + cap_len + pad + 4;
+
+    put32(h + 0, PCAPNG_BLOCK_EPB);
+    put32(h + 4, total);
+    put32(h + 8, 0);                          // interface id
+    put32(h + 12, (uint32_t) (ts_us >> 32));
+    put32(h + 16, (uint32_t) ts_us);
+    put32(h + 20, cap_len);
+    put32(h + 24, cap_len);
+    epb->hdr_len = PCAPNG_EPB_BASE_LEN + rt_len;
+
+    memset(epb->trailer, 0, pad);
+    put32(epb->trailer + pad, total);
+    epb->trailer_len = pad + 4;
+}
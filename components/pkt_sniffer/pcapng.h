@@ -0,0 +1,73 @@
+//*****************************************************************************
+// pcapng + radiotap. Classic pcap with LINKTYPE 105 throws away everything the
+// radio told us about a frame. Here we build pcapng blocks where each frame is
+// prefixed by a radiotap header (LINKTYPE 127) carrying the RSSI, noise floor,
+// channel, rate / MCS and TSF from the wifi_pkt_rx_ctrl_t.
+//
+// File Layout)
+//
+//     | SHB | IDB | EPB | EPB | ... | EPB |
+//
+//     SHB - Section Header Block, byte order magic, version 1.0
+//     IDB - Interface Description Block, one interface, LINKTYPE 127,
+//           default timestamp resolution of 1 us
+//     EPB - Enhanced Packet Block, one per frame
+//
+// EPB Layout)
+//
+//     | EPB hdr (28) | radiotap hdr | 802.11 frame | pad to 4 | total len (4) |
+//      \________________ hdr ______/ \_ pkt body _/ \______ trailer ______/
+//
+// The builders below are streaming and allocate nothing, the caller hands in a
+// pcapng_epb_t (fits on the stack) and writes hdr, the frame and trailer as
+// three pieces. All fields are written little endian (the native order of the
+// esp32, the SHB byte order magic tells the reader so).
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_wifi.h"
+
+#define PCAPNG_BLOCK_SHB 0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define RADIOTAP_LINK_TYPE 127
+
+#define PCAPNG_FILE_HDR_LEN 48          // SHB (28) + IDB (20)
+#define PCAPNG_EPB_BASE_LEN 28
+#define RADIOTAP_MAX_LEN 32
+#define PCAPNG_EPB_MAX_HDR (PCAPNG_EPB_BASE_LEN + RADIOTAP_MAX_LEN)
+
+typedef struct
+{
+    uint8_t hdr[PCAPNG_EPB_MAX_HDR];
+    uint16_t hdr_len;
+    uint8_t trailer[8];
+    uint16_t trailer_len;
+} pcapng_epb_t;
+
+//*****************************************************************************
+// pcapng_file_header) Write the SHB and IDB that start a pcapng file.
+//
+// buf) At least PCAPNG_FILE_HDR_LEN bytes.
+//
+// Returns) Number of bytes written i.e. PCAPNG_FILE_HDR_LEN
+//*****************************************************************************
+uint16_t pcapng_file_header(uint8_t* buf);
+
+//*****************************************************************************
+// pcapng_build_epb) Fill in the EPB header (with radiotap) and trailer for a
+//                   frame of pkt_len bytes.
+//
+// ts_us) Capture time in micro seconds.
+// rx_ctrl) Radio meta data from the promiscuous cb.
+// pkt_len) Bytes of 802.11 frame that will be written between hdr and trailer.
+// has_fcs) 1 if the last 4 bytes of the frame are the FCS. Sets the radiotap
+//          flag so wireshark doesnt parse the FCS as payload.
+//*****************************************************************************
+void pcapng_build_epb(pcapng_epb_t* epb,
+                      uint64_t ts_us,
+                      const wifi_pkt_rx_ctrl_t* rx_ctrl,
+                      uint16_t pkt_len,
+                      uint8_t has_fcs);
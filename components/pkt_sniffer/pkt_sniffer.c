@@ -9,6 +9,7 @@
 #include "esp_mac.h"
 
 #include "pkt_sniffer.h"
+#include "repl_mux.h"
 
 static const char* TAG = "PKT SNIFFER";
 
@@ -20,9 +21,9 @@ static SemaphoreHandle_t lock;
 
 pkt_sniffer_stats_t stats = { 0 };
 
-int filter_match(uint8_t i, dot11_header_t* hdr)
+int pkt_sniffer_filter_match(const pkt_filter_t* f, dot11_header_t* hdr)
 {
-    uint8_t mask = (filtered_srcs[i].filter.type_bitmap);
+    uint8_t mask = (f->type_bitmap);
     if(!(((uint8_t)1 << (uint8_t) hdr->type) & mask))
     {
         return 0;
@@ -31,15 +32,15 @@ int filter_match(uint8_t i, dot11_header_t* hdr)
     uint16_t mask16;
     if(hdr->type == PKT_MGMT)
     {
-        mask16 = filtered_srcs[i].filter.mgmt_subtype_bitmap;
+        mask16 = f->mgmt_subtype_bitmap;
     }
     else if(hdr->type == PKT_DATA)
     {
-        mask16 = filtered_srcs[i].filter.data_subtype_bitmap;
+        mask16 = f->data_subtype_bitmap;
     }
     else
     {
-        ESP_LOGE(TAG, "NOT GOOD");
+        REPL_MUX_LOG(SNIFF_BAD_TYPE);
         return 0;
     }
 
@@ -49,31 +50,31 @@ int filter_match(uint8_t i, dot11_header_t* hdr)
     }
 
     uint8_t j;
-    if(filtered_srcs[i].filter.addr_active_bitmap & 0x1)
+    if(f->addr_active_bitmap & 0x1)
     {
         for(j = 0; j < 6; ++j)
         {
-            if(filtered_srcs[i].filter.addr1_match[j] != hdr->addr1[j])
+            if(f->addr1_match[j] != hdr->addr1[j])
             {
                 return 0;
             }
         }
     }
-    if((filtered_srcs[i].filter.addr_active_bitmap >> 1) & 0x1)
+    if((f->addr_active_bitmap >> 1) & 0x1)
     {
         for(j = 0; j < 6; ++j)
         {
-            if(filtered_srcs[i].filter.addr2_match[j] != hdr->addr2[j])
+            if(f->addr2_match[j] != hdr->addr2[j])
             {
                 return 0;
             }
         }
     }
-    if((filtered_srcs[i].filter.addr_active_bitmap >> 2) & 0x1)
+    if((f->addr_active_bitmap >> 2) & 0x1)
     {
         for(j = 0; j < 6; ++j)
         {
-            if(filtered_srcs[i].filter.addr3_match[j] != hdr->addr3[j])
+            if(f->addr3_match[j] != hdr->addr3[j])
             {
                 return 0;
             }
@@ -84,6 +85,11 @@ int filter_match(uint8_t i, dot11_header_t* hdr)
     return 1;
 }
 
+int filter_match(uint8_t i, dot11_header_t* hdr)
+{
+    return pkt_sniffer_filter_match(&filtered_srcs[i].filter, hdr);
+}
+
 //*****************************************************************************
 // First line CB code
 //*****************************************************************************
@@ -96,7 +102,7 @@ static void pkt_sniffer_cb(void* buff, wifi_promiscuous_pkt_type_t type)
 
     if(!xSemaphoreTake(lock, 0))
     {
-        ESP_LOGE(TAG, "Timeout trying to parse packet");
+        REPL_MUX_LOG(SNIFF_PARSE_TIMEOUT);
         return;
     }
 
@@ -115,7 +121,7 @@ static void pkt_sniffer_cb(void* buff, wifi_promiscuous_pkt_type_t type)
     }
     else
     {
-        ESP_LOGE(TAG, "NO GOOD BE HERE");
+        REPL_MUX_LOG(SNIFF_UNKNOWN_TYPE);
     }
 
     // We implicitly assume in our dot11_data.h structs that we never see STA
@@ -123,7 +129,7 @@ static void pkt_sniffer_cb(void* buff, wifi_promiscuous_pkt_type_t type)
     // Log warning if we see this
     if(hdr->ds_status == 3)
     {
-        ESP_LOGE(TAG, "Warning IBSS traffic captured");
+        REPL_MUX_LOG(SNIFF_IBSS);
         assert(xSemaphoreGive(lock) == pdTRUE);
         return;
     }
@@ -131,7 +137,7 @@ static void pkt_sniffer_cb(void* buff, wifi_promiscuous_pkt_type_t type)
 
     if(hdr->htc)
     {
-        ESP_LOGE(TAG, "HTC packet captured");
+        REPL_MUX_LOG(SNIFF_HTC);
         assert(xSemaphoreGive(lock) == pdTRUE);
         return;
     }
@@ -202,7 +208,7 @@ esp_err_t pkt_sniffer_add_type_subtype(pkt_sniffer_filtered_src_t* f,
             f->filter.mgmt_subtype_bitmap |= (1 << (uint8_t) subtype.mgmt_subtype);
         }   
     }
-    else if(type == PKT_DATA || type == PKT_ANY)
+    if(type == PKT_DATA || type == PKT_ANY)
     {
         if(subtype.data_subtype == PKT_DATA_ANY)
         {
@@ -213,7 +219,7 @@ esp_err_t pkt_sniffer_add_type_subtype(pkt_sniffer_filtered_src_t* f,
             f->filter.data_subtype_bitmap |= (1 << (uint8_t) subtype.data_subtype);
         }   
     }
-    else
+    if(type != PKT_MGMT && type != PKT_DATA && type != PKT_ANY)
     {
         ESP_LOGE(TAG, "Invalid type passed to pkt_sniffer_add_type_subtype");
         return ESP_OK;
@@ -275,6 +281,7 @@ esp_err_t pkt_sniffer_add_filter(pkt_sniffer_filtered_src_t* f)
     if(num_filters == CONFIG_PKT_MAX_FILTERS)
     {
         ESP_LOGE(TAG, "Filtered CB list full");
+        assert(xSemaphoreGive(lock) == pdTRUE);
         return ESP_ERR_NO_MEM;
     }
 
@@ -287,6 +294,64 @@ esp_err_t pkt_sniffer_add_filter(pkt_sniffer_filtered_src_t* f)
     return ESP_OK;
 }
 
+esp_err_t pkt_sniffer_remove_filter(pkt_sniffer_cb_t cb)
+{
+    if(!inited){ _pkt_sniffer_init(); }
+
+    if(!xSemaphoreTake(lock, 10 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "Timeout trying to remove filter from list");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint8_t i = 0;
+    while(i < num_filters)
+    {
+        if(filtered_srcs[i].cb == cb)
+        {
+            memmove(&filtered_srcs[i],
+                    &filtered_srcs[i+1],
+                    (num_filters - i - 1) * sizeof(pkt_sniffer_filtered_src_t));
+            --num_filters;
+            continue;
+        }
+        ++i;
+    }
+    assert(xSemaphoreGive(lock) == pdTRUE);
+
+    return ESP_OK;
+}
+
+esp_err_t pkt_sniffer_set_filter(pkt_sniffer_filtered_src_t* f)
+{
+    if(!inited){ _pkt_sniffer_init(); }
+
+    if(!xSemaphoreTake(lock, 10 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "Timeout trying to set filter");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint8_t i;
+    for(i = 0; i < num_filters; ++i)
+    {
+        if(filtered_srcs[i].cb == f->cb) { break; }
+    }
+
+    if(i == CONFIG_PKT_MAX_FILTERS)
+    {
+        ESP_LOGE(TAG, "Filtered CB list full");
+        assert(xSemaphoreGive(lock) == pdTRUE);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memcpy(&filtered_srcs[i], f, sizeof(pkt_sniffer_filtered_src_t));
+    if(i == num_filters) { ++num_filters; }
+    assert(xSemaphoreGive(lock) == pdTRUE);
+
+    return ESP_OK;
+}
+
 esp_err_t pkt_sniffer_clear_filter_list(void)
 {
     if(!inited) { _pkt_sniffer_init(); }
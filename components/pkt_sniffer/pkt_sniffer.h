@@ -80,6 +80,28 @@ pkt_sniffer_stats_t* pkt_sniffer_get_stats(void);
 uint8_t pkt_sniffer_is_running(void);
 
 
+//*****************************************************************************
+// pkt_sniffer_remove_filter) Remove every filter in the list whose call back is
+//                            cb. Lets a module that multiplexes its own
+//                            consumers swap out its one filter.
+//
+// Returns) ESP_OK, otherwise might timeout trying to grab the lock
+//*****************************************************************************
+esp_err_t pkt_sniffer_remove_filter(pkt_sniffer_cb_t cb);
+
+
+//*****************************************************************************
+// pkt_sniffer_set_filter) Put f in place of the filter whose call back is
+//                         f->cb, or add it if there is none. Done under the
+//                         list lock in one step, so no frame is seen with
+//                         neither the old nor the new filter in place.
+//
+// Returns) ESP_OK, NO_MEM if it had to be added and the list is full,
+//          otherwise might timeout trying to grab the lock
+//*****************************************************************************
+esp_err_t pkt_sniffer_set_filter(pkt_sniffer_filtered_src_t* f);
+
+
 //*****************************************************************************
 // pkt_sniffer_clear_filter_list) Clears all the filters, resets it back to 0
 //
@@ -131,6 +153,15 @@ esp_err_t pkt_sniffer_add_mac_match(pkt_sniffer_filtered_src_t* f,
                                     uint8_t addr_num, 
                                     uint8_t* mac);
 
+//*****************************************************************************
+// pkt_sniffer_filter_match) Check a frame against a filter using the same rules
+//                           the sniffer applies to its filter list. For modules
+//                           that fan one sniffer filter out to many consumers.
+//
+// Returns) 1 if the frame header matches f, 0 else
+//*****************************************************************************
+int pkt_sniffer_filter_match(const pkt_filter_t* f, dot11_header_t* hdr);
+
 //*****************************************************************************
 // pkt_sniffer_launch) Given a specific channel and start the pkt_sniffer
 //
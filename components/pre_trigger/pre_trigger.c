@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "pre_trigger.h"
+#include "mac_logger.h"
+#include "capture_time.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char* TAG = "Pre Trigger";
+
+#define RING_SIZE (CONFIG_PRE_TRIGGER_RING_KB * 1024)
+#define WRAP 0xFFFF                 // Record len marking the rest of the ring unused
+#define REC_SIZE(len) ((sizeof(rec_hdr_t) + (len) + 7) & ~7)
+#define MAX_FILES 1000              // trig000 .. trig999
+#define POLL_MS 10                  // Drain task poll while the post window is open
+
+typedef struct
+{
+    uint16_t len;                   // Frame bytes following the header, or WRAP
+    uint16_t reserved;
+    uint32_t reserved2;
+    int64_t ts_us;
+    wifi_pkt_rx_ctrl_t rx_ctrl;
+} rec_hdr_t;
+
+//*****************************************************************************
+// Everything the RX cb and the drain task share is only touched inside the
+// critical section, the same as the capture writer buffer pool.
+//*****************************************************************************
+
+static uint8_t ring[RING_SIZE] __attribute__((aligned(8)));
+static uint32_t head = 0;           // Next record goes here
+static uint32_t tail = 0;           // Oldest record
+static uint32_t used = 0;           // Bytes in use, wasted ring end included
+static uint32_t ring_n = 0;         // Records in the ring
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+static pre_trigger_cfg_t cfg;
+static uint8_t running = 0;
+static uint8_t triggered = 0;
+static int64_t trig_us = 0;
+static int64_t post_end_us = 0;
+static uint32_t pre_n = 0;          // Records in the ring at the trigger
+
+static uint8_t watching = 0;
+static uint8_t watch_bssid[6];
+static uint16_t spike_pps = 0;
+static int64_t spike_win_us = 0;
+static uint16_t spike_win_pkts = 0;
+
+static uint16_t file_num = 0;
+static TaskHandle_t drain_h = NULL;
+static pre_trigger_stats_t stats;
+
+// Drain task copy of the record it is writing, outside the critical section
+static uint8_t scratch[sizeof(rec_hdr_t) + PRE_TRIGGER_MAX_FRAME] __attribute__((aligned(8)));
+
+//*****************************************************************************
+// Ring helpers, called in the critical section. Records never wrap, if one
+// does not fit before the end of the ring the end is marked WRAP and skipped.
+//*****************************************************************************
+
+// Contiguous free bytes at head
+static uint32_t ring_room(void)
+{
+    if(used == 0)
+    {
+        head = 0;
+        tail = 0;
+        return RING_SIZE;
+    }
+
+    if(head > tail)
+    {
+        return RING_SIZE - head;
+    }
+
+    return tail - head;
+}
+
+static rec_hdr_t* ring_reserve(uint32_t need)
+{
+    uint32_t room = ring_room();
+
+    if(room < need && head > tail)
+    {
+        ((rec_hdr_t*) &ring[head])->len = WRAP;
+        used += RING_SIZE - head;
+        head = 0;
+        room = ring_room();
+    }
+
+    return (room >= need) ? (rec_hdr_t*) &ring[head] : NULL;
+}
+
+static void ring_commit(uint32_t need)
+{
+    head += need;
+    used += need;
+    ring_n++;
+    if(head == RING_SIZE)
+    {
+        head = 0;
+    }
+}
+
+static rec_hdr_t* ring_peek(void)
+{
+    if(used == 0)
+    {
+        return NULL;
+    }
+
+    rec_hdr_t* r = (rec_hdr_t*) &ring[tail];
+    if(r->len == WRAP)
+    {
+        used -= RING_SIZE - tail;
+        tail = 0;
+        if(used == 0)
+        {
+            return NULL;
+        }
+        r = (rec_hdr_t*) &ring[0];
+    }
+
+    return r;
+}
+
+static void ring_pop(rec_hdr_t* r)
+{
+    uint32_t n = REC_SIZE(r->len);
+
+    tail += n;
+    used -= n;
+    ring_n--;
+    if(tail == RING_SIZE)
+    {
+        tail = 0;
+    }
+}
+
+//*****************************************************************************
+// RX path
+//*****************************************************************************
+
+static void fire(pre_trigger_reason_t reason, int64_t now)
+{
+    uint8_t wake = 0;
+
+    portENTER_CRITICAL(&mux);
+    stats.triggers[reason]++;
+    if(!triggered)
+    {
+        triggered = 1;
+        trig_us = now;
+        pre_n = ring_n;
+        wake = 1;
+    }
+    else
+    {
+        stats.ignored++;
+    }
+    post_end_us = now + (int64_t) cfg.post_ms * 1000;
+    portEXIT_CRITICAL(&mux);
+
+    if(wake)
+    {
+        xTaskNotifyGive(drain_h);
+    }
+}
+
+static void push(void* pkt, wifi_pkt_rx_ctrl_t* rx_ctrl, int64_t now)
+{
+    uint16_t len = rx_ctrl->sig_len;
+    uint32_t need = REC_SIZE(len);
+    rec_hdr_t* r;
+
+    if(len > PRE_TRIGGER_MAX_FRAME)
+    {
+        stats.big_drops++;
+        return;
+    }
+
+    portENTER_CRITICAL(&mux);
+    while(!(r = ring_reserve(need)))
+    {
+        // Once triggered the drain task owns what is in the ring
+        rec_hdr_t* old = triggered ? NULL : ring_peek();
+        if(!old)
+        {
+            stats.full_drops++;
+            portEXIT_CRITICAL(&mux);
+            return;
+        }
+        ring_pop(old);
+        stats.evicted++;
+    }
+
+    r->len = len;
+    r->ts_us = now;
+    memcpy(&r->rx_ctrl, rx_ctrl, sizeof(wifi_pkt_rx_ctrl_t));
+    memcpy(r + 1, pkt, len);
+    ring_commit(need);
+    stats.pkts++;
+    portEXIT_CRITICAL(&mux);
+}
+
+static void rx_cb(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t subtype)
+{
+    wifi_pkt_rx_ctrl_t* rx_ctrl = (wifi_pkt_rx_ctrl_t*) meta_data;
+    dot11_header_t* hdr = (dot11_header_t*) pkt;
+    int64_t now = capture_time_rx_us(rx_ctrl);
+
+    if(!running)
+    {
+        return;
+    }
+
+    if(watching && type == PKT_MGMT &&
+       (subtype.mgmt_subtype == PKT_ASSOC_REQ || subtype.mgmt_subtype == PKT_REASSOC_REQ) &&
+       !memcmp(hdr->addr1, watch_bssid, 6))
+    {
+        fire(PRE_TRIGGER_ASSOC, now);
+    }
+
+    if(!pkt_sniffer_filter_match(&cfg.filter, hdr))
+    {
+        return;
+    }
+
+    if(spike_pps)
+    {
+        if(now - spike_win_us >= 1000 * 1000)
+        {
+            spike_win_us = now;
+            spike_win_pkts = 0;
+        }
+
+        // Fire once per window, on the first frame over the threshold
+        if(++spike_win_pkts == spike_pps + 1)
+        {
+            fire(PRE_TRIGGER_SPIKE, now);
+        }
+    }
+
+    push(pkt, rx_ctrl, now);
+}
+
+static void on_new_sta(const uint8_t* sta_mac, const uint8_t* bssid)
+{
+    if(running)
+    {
+        fire(PRE_TRIGGER_NEW_STA, esp_timer_get_time());
+    }
+}
+
+//*****************************************************************************
+// Drain Task
+//*****************************************************************************
+
+static esp_err_t open_capture(uint8_t* stream)
+{
+    capture_writer_cfg_t c = {0};
+    struct stat st;
+    uint16_t tries = 0;
+
+    c.fmt = CAPTURE_WRITER_DEFAULT_FMT;
+    c.compress = CAPTURE_WRITER_DEFAULT_COMPRESS;
+    c.backend = CAPTURE_WRITER_DEFAULT_BACKEND;
+    c.index = CAPTURE_WRITER_DEFAULT_INDEX && c.backend == CAPTURE_BACKEND_SPIFFS;
+
+    // Dont truncate an earlier capture, take the next name not on SPIFFS
+    do
+    {
+        snprintf(c.path, sizeof(c.path), "/spiffs/trig%03u", file_num % MAX_FILES);
+        file_num = (file_num + 1) % MAX_FILES;
+    } while(c.backend == CAPTURE_BACKEND_SPIFFS && stat(c.path, &st) == 0 && ++tries < MAX_FILES);
+
+    esp_err_t e = capture_writer_open(&c, stream);
+    if(e == ESP_OK)
+    {
+        memcpy(stats.last_path, c.path, sizeof(stats.last_path));
+        stats.captures++;
+    }
+
+    return e;
+}
+
+// Drop what is older than the pre window, and all but the newest pre_pkts
+static void trim_pre_window(void)
+{
+    int64_t oldest = trig_us - (int64_t) cfg.pre_ms * 1000;
+    rec_hdr_t* r;
+
+    portENTER_CRITICAL(&mux);
+    while((r = ring_peek()) && pre_n &&
+          ((cfg.pre_ms && r->ts_us < oldest) || (cfg.pre_pkts && pre_n > cfg.pre_pkts)))
+    {
+        ring_pop(r);
+        pre_n--;
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+static void drain_task(void* arg)
+{
+    rec_hdr_t* h = (rec_hdr_t*) scratch;
+    uint8_t stream;
+
+    while(1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if(open_capture(&stream) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open a capture file, trigger lost");
+            portENTER_CRITICAL(&mux);
+            triggered = 0;
+            portEXIT_CRITICAL(&mux);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Triggered, writing %s", stats.last_path);
+        trim_pre_window();
+
+        while(1)
+        {
+            uint8_t got = 0;
+            uint8_t done = 0;
+
+            // Finishing is decided in the same critical section a trigger
+            // would extend the window in, so no trigger is lost in between
+            portENTER_CRITICAL(&mux);
+            rec_hdr_t* r = ring_peek();
+            if(r && r->ts_us <= post_end_us)
+            {
+                memcpy(scratch, r, sizeof(rec_hdr_t) + r->len);
+                ring_pop(r);
+                got = 1;
+            }
+            else if(r || esp_timer_get_time() > post_end_us)
+            {
+                triggered = 0;
+                done = 1;
+            }
+            portEXIT_CRITICAL(&mux);
+
+            if(done)
+            {
+                break;
+            }
+
+            if(!got)
+            {
+                vTaskDelay(POLL_MS / portTICK_PERIOD_MS);
+                continue;
+            }
+
+            // Pace ourselves to the writer rather than drop the frame
+            esp_err_t e;
+            while((e = capture_writer_write_pkt(stream, h + 1, h->len, &h->rx_ctrl, h->ts_us, 1)) == ESP_ERR_NO_MEM)
+            {
+                stats.writer_retries++;
+                vTaskDelay(1);
+            }
+
+            if(e != ESP_OK)                { stats.write_errors++; }
+            else if(h->ts_us <= trig_us)   { stats.pre_written++; }
+            else                           { stats.post_written++; }
+        }
+
+        capture_writer_close(stream);
+        ESP_LOGI(TAG, "Capture %s done", stats.last_path);
+    }
+}
+
+// Our sniffer filter is the ring filter plus assoc reqs if a BSSID is watched
+static esp_err_t update_sniffer_filter(void)
+{
+    pkt_sniffer_filtered_src_t f = {0};
+
+    if(!running)
+    {
+        return pkt_sniffer_remove_filter(rx_cb);
+    }
+
+    f.filter.type_bitmap = cfg.filter.type_bitmap;
+    f.filter.mgmt_subtype_bitmap = cfg.filter.mgmt_subtype_bitmap;
+    f.filter.data_subtype_bitmap = cfg.filter.data_subtype_bitmap;
+    if(watching)
+    {
+        f.filter.type_bitmap |= (1 << PKT_MGMT);
+        f.filter.mgmt_subtype_bitmap |= (1 << PKT_ASSOC_REQ) | (1 << PKT_REASSOC_REQ);
+    }
+    f.cb = rx_cb;
+
+    esp_err_t e = pkt_sniffer_set_filter(&f);
+    ESP_LOGI(TAG, "Type Mask = 0x%x   Data Mask = 0x%x   MGMT Mask = 0x%x", f.filter.type_bitmap, f.filter.data_subtype_bitmap, f.filter.mgmt_subtype_bitmap);
+    return e;
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t pre_trigger_init(const pre_trigger_cfg_t* c)
+{
+    if(!drain_h)
+    {
+        xTaskCreate(drain_task,
+                    "pre_trig",
+                    CONFIG_PRE_TRIGGER_STACK_SIZE,
+                    NULL,
+                    CONFIG_PRE_TRIGGER_PRIO,
+                    &drain_h);
+        if(!drain_h)
+        {
+            ESP_LOGE(TAG, "Failed to launch drain task");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    portENTER_CRITICAL(&mux);
+    if(triggered)
+    {
+        portEXIT_CRITICAL(&mux);
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy(&cfg, c, sizeof(pre_trigger_cfg_t));
+    head = 0;
+    tail = 0;
+    used = 0;
+    ring_n = 0;
+    running = 1;
+    portEXIT_CRITICAL(&mux);
+
+    esp_err_t e = update_sniffer_filter();
+    if(e != ESP_OK)
+    {
+        running = 0;
+        return e;
+    }
+
+    ESP_LOGI(TAG, "Armed, %d KB ring  pre %lu ms / %u pkts  post %lu ms",
+             CONFIG_PRE_TRIGGER_RING_KB, cfg.pre_ms, cfg.pre_pkts, cfg.post_ms);
+    return ESP_OK;
+}
+
+esp_err_t pre_trigger_fini(void)
+{
+    if(!running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    running = 0;
+    return pkt_sniffer_remove_filter(rx_cb);
+}
+
+esp_err_t pre_trigger_fire(pre_trigger_reason_t reason)
+{
+    if(!running || reason >= PRE_TRIGGER_N_REASONS)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    fire(reason, esp_timer_get_time());
+    return ESP_OK;
+}
+
+esp_err_t pre_trigger_watch_bssid(const uint8_t* bssid)
+{
+    if(!running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    portENTER_CRITICAL(&mux);
+    watching = 0;
+    if(bssid)
+    {
+        memcpy(watch_bssid, bssid, 6);
+        watching = 1;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return update_sniffer_filter();
+}
+
+esp_err_t pre_trigger_set_spike(uint16_t pkts_per_sec)
+{
+    spike_pps = pkts_per_sec;
+    return ESP_OK;
+}
+
+esp_err_t pre_trigger_set_new_sta(uint8_t enable)
+{
+    return mac_logger_set_new_sta_cb(enable ? on_new_sta : NULL);
+}
+
+esp_err_t pre_trigger_get_stats(pre_trigger_stats_t* s,
+                                uint8_t* is_triggered,
+                                uint32_t* ring_used)
+{
+    portENTER_CRITICAL(&mux);
+    memcpy(s, &stats, sizeof(pre_trigger_stats_t));
+    if(is_triggered) { *is_triggered = triggered; }
+    if(ring_used)    { *ring_used = used; }
+    portEXIT_CRITICAL(&mux);
+
+    return ESP_OK;
+}
@@ -0,0 +1,154 @@
+//*****************************************************************************
+// Pre Trigger Capture. Most of the time we only care about the frames around
+// an event (a STA joining, an assoc to a BSSID we watch, a burst of traffic)
+// but the data pkt dumper can only record everything from the moment it is
+// opened. Here frames matching a filter go into a bounded RAM ring that
+// always holds the recent past. Nothing touches flash until a trigger fires,
+// then the pre trigger window plus a post trigger window are written out as
+// one capture file.
+//
+// |-------------|  filter  |---------------|  trigger   |-------------|
+// | Pkt Sniffer |--------->|   RAM ring    |----------->| Drain Task  |--> capture
+// |-------------|  (RX cb) | last pre_ms / |  (notify)  |-------------|    writer
+//                          |   pre_pkts    |
+//                          |---------------|
+//
+// Ring) CONFIG_PRE_TRIGGER_RING_KB of RAM holding whole records (timestamp,
+//       rx_ctrl and the frame). While armed a frame that does not fit evicts
+//       the oldest ones, so the ring is always the most recent traffic. Once
+//       triggered nothing is evicted any more, the ring turns into a FIFO the
+//       drain task empties and frames that find it full are dropped.
+//
+// Windows) At the trigger the drain task throws away ring frames older than
+//          pre_ms and, if pre_pkts is set, all but the newest pre_pkts. It
+//          then keeps writing frames until post_ms after the trigger. A
+//          trigger during the post window extends it rather than starting a
+//          second capture.
+//
+// Triggers) pre_trigger_fire from anywhere (REPL), an assoc / reassoc request
+//           to a watched BSSID, more than a set number of filtered frames in
+//           one second, or a new STA showing up in the mac logger. Triggers
+//           only set state and wake the drain task so they are safe from the
+//           RX path.
+//
+// Files) Each capture goes through the capture writer as /spiffs/trigNNN with
+//        the writer's default format, compression, index and backend. The
+//        drain task paces itself to the writer's buffer pool, it retries a
+//        frame the pool has no room for instead of dropping it.
+//
+// Assumptions) PS_clear also throws away our sniffer filter, PT_init again to
+//              put it back. The mac logger must be running for the new STA
+//              trigger to ever fire.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "pkt_sniffer.h"
+#include "capture_writer.h"
+
+typedef enum
+{
+    PRE_TRIGGER_MANUAL = 0,     // pre_trigger_fire, i.e. from the REPL
+    PRE_TRIGGER_ASSOC,          // Assoc / reassoc req to the watched BSSID
+    PRE_TRIGGER_SPIKE,          // Filtered frames / sec above the threshold
+    PRE_TRIGGER_NEW_STA,        // Mac logger saw a new STA
+    PRE_TRIGGER_N_REASONS
+} pre_trigger_reason_t;
+
+typedef struct
+{
+    pkt_filter_t filter;        // Frames kept in the ring, see pkt_sniffer.h
+    uint32_t pre_ms;            // Keep this much history at a trigger, 0 = all of the ring
+    uint16_t pre_pkts;          // ... and at most this many frames, 0 = no limit
+    uint32_t post_ms;           // Keep writing this long after the trigger
+} pre_trigger_cfg_t;
+
+typedef struct
+{
+    uint32_t pkts;              // Frames put in the ring
+    uint32_t evicted;           // Old frames pushed out while armed
+    uint32_t full_drops;        // Frames dropped, ring full while triggered
+    uint32_t big_drops;         // Frames bigger than PRE_TRIGGER_MAX_FRAME
+    uint32_t triggers[PRE_TRIGGER_N_REASONS];
+    uint32_t ignored;           // ... of which extended a running capture
+    uint32_t captures;          // Capture files written
+    uint32_t pre_written;       // Frames written from before the trigger
+    uint32_t post_written;      // Frames written after the trigger
+    uint32_t writer_retries;    // Waits for a free capture writer buffer
+    uint32_t write_errors;      // Frames the capture writer refused
+    char last_path[CAPTURE_WRITER_PATH_LEN + 1];
+} pre_trigger_stats_t;
+
+#define PRE_TRIGGER_MAX_FRAME 2048
+
+//*****************************************************************************
+// pre_trigger_init) Start filling the ring. The first call also creates the
+//                   drain task. Call again to change the config, this also
+//                   empties the ring.
+//
+// cfg) Filter and windows. Copied.
+//
+// Returns) ESP_OK, INVALID_STATE if a capture is being written, NO_MEM if the
+//          drain task could not be created, else pkt sniffer errors.
+//*****************************************************************************
+esp_err_t pre_trigger_init(const pre_trigger_cfg_t* cfg);
+
+//*****************************************************************************
+// pre_trigger_fini) Stop filling the ring. A capture already triggered still
+//                   runs to the end of its post window.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t pre_trigger_fini(void);
+
+//*****************************************************************************
+// pre_trigger_fire) Trigger a capture now. Never blocks, safe from a pkt
+//                   sniffer cb.
+//
+// reason) Counted in the stats.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited.
+//*****************************************************************************
+esp_err_t pre_trigger_fire(pre_trigger_reason_t reason);
+
+//*****************************************************************************
+// pre_trigger_watch_bssid) Fire on any assoc / reassoc request sent to bssid.
+//
+// bssid) The AP to watch, NULL stops watching.
+//
+// Returns) ESP_OK, INVALID_STATE if not inited, else pkt sniffer errors.
+//*****************************************************************************
+esp_err_t pre_trigger_watch_bssid(const uint8_t* bssid);
+
+//*****************************************************************************
+// pre_trigger_set_spike) Fire when more than pkts_per_sec filtered frames are
+//                        seen within one second.
+//
+// pkts_per_sec) Threshold, 0 turns the trigger off.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t pre_trigger_set_spike(uint16_t pkts_per_sec);
+
+//*****************************************************************************
+// pre_trigger_set_new_sta) Fire when the mac logger adds a new STA.
+//
+// enable) 1 to hook the mac logger, 0 to unhook.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t pre_trigger_set_new_sta(uint8_t enable);
+
+//*****************************************************************************
+// pre_trigger_get_stats) Copy out the stats.
+//
+// stats) Out param.
+// triggered) Out param, 1 if a capture is being written. May be NULL.
+// ring_used) Out param, bytes of the ring in use. May be NULL.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t pre_trigger_get_stats(pre_trigger_stats_t* stats,
+                                uint8_t* triggered,
+                                uint32_t* ring_used);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "esp_system.h"
@@ -6,8 +7,8 @@
 #include "esp_vfs_dev.h"
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "linenoise/linenoise.h"
 #include "driver/uart.h"
 
@@ -17,26 +18,280 @@
 #include <lwip/netdb.h>
 
 #include "repl_mux.h"
+#include "net_reactor.h"
+
+#define UART_C 0                    // Consumer 0 is the UART, 1 on the sessions
+#define UART_CHANNEL 0
+#define N_CONSUMERS REPL_MUX_N_CONSUMERS
+#define MAX_SESSIONS CONFIG_REPL_MUX_MAX_SESSIONS
+#define MAX_JOBS CONFIG_REPL_MUX_MAX_JOBS
+#define MAX_ROUTES (3 + MAX_JOBS)   // UART In, NET Cmd, the reactor and the jobs
+#define JOB_POLL_MS 100             // wait checks its job this often
+#define NET_CMD_QUEUE (MAX_SESSIONS + MAX_RPC)
+#define HOLD_LAG (RING_SIZE / 2)    // Session output a command may be ahead by
+#define HOLD_MAX_MS 2000            // Longest a command waits on a session that takes nothing
+
+#define RING_SIZE CONFIG_REPL_MUX_RING_SIZE
+#define REC_HDR sizeof(rec_hdr_t)
+#define REC_ALIGN(n) (((n) + 3) & ~3)
+#define MAX_REC (REC_HDR + REC_ALIGN(CONFIG_REPL_MUX_MAX_LOG_MSG))
+#define REC_WRAP 0x01               // Filler up to the end of the ring, no text
+
+#define NET_TX_SIZE CONFIG_LWIP_TCP_MSS
+#define NET_FLUSH_TICKS (CONFIG_REPL_MUX_NET_FLUSH_MS / portTICK_PERIOD_MS)
+
+#define MAX_RPC CONFIG_REPL_MUX_RPC_CLIENTS
+#define RPC_RX_SIZE (REPL_MUX_RPC_HDR + CONFIG_REPL_MUX_MAX_LOG_MSG)  // Biggest request, a CMD
+#define RPC_SEND_TIMEOUT_S 2        // A client that reads no response for this long is dropped
+
+#define MAX_TAGS CONFIG_REPL_MUX_MAX_TAGS
+#define TAG_CREDIT configTICK_RATE_HZ   // Bucket credit of one message
+
+typedef struct
+{
+    uint16_t len;                   // Text bytes, no NULL
+    uint8_t flags;                  // REC_*
+    uint8_t refs;                   // Bit per consumer that still has to send it
+} rec_hdr_t;
+
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "repl mux ring size not a power of 2");
+_Static_assert(RING_SIZE >= 4 * MAX_REC, "repl mux ring smaller than 4 messages");
+_Static_assert(N_CONSUMERS <= 8, "repl mux refs are a uint8_t");
+_Static_assert(NET_TX_SIZE >= 2 * CONFIG_REPL_MUX_MAX_LOG_MSG, "repl mux session buffer under 2 messages");
+_Static_assert(CONFIG_REPL_MUX_RPC_FRAME_SIZE >= REPL_MUX_RPC_HDR + 2 + 255, "repl mux rpc frame under one field");
+_Static_assert(CONFIG_REPL_MUX_NET_CMD_PRIO < CONFIG_NET_REACTOR_PRIO, "NET Cmd must be below the net reactor");
+
+static const char* TAG = "REPL MUX";
 
-#define TTL CONFIG_REPL_MUX_WAIT_MS / portTICK_PERIOD_MS
-#define UART_Q 0
-#define NET_Q 1
+//*****************************************************************************
+// The log ring is addressed with running byte positions, a position maps to
+// ring[pos & (RING_SIZE - 1)]. Records are 4 byte aligned and never wrap, a
+// record that would is preceded by a WRAP filler to the end of the ring. The
+// ring, the consumer state, the routes and the counters are only touched in
+// the critical section, which is held for no more than a memcpy of one
+// message. Consumers copy a record out before they drop their ref, so a
+// consumer that falls behind can have its oldest records taken from under it
+// at any time.
+//*****************************************************************************
 
-struct repl_mux_message
+static uint8_t ring[RING_SIZE] __attribute__((aligned(4)));
+static uint32_t head_pos = 0;       // Next record goes here
+static uint32_t tail_pos = 0;       // Oldest record still referenced
+static uint32_t cursor[N_CONSUMERS];
+static TaskHandle_t consumer_h[N_CONSUMERS];
+static uint8_t level[N_CONSUMERS];  // esp_log_level_t of system logs taken
+static uint8_t active = 0;          // Bit per consumer taking logs
+static uint32_t drops_unreported[N_CONSUMERS];
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static repl_mux_stats_t stats;
+
+typedef struct
 {
-    char log_msg[CONFIG_REPL_MUX_MAX_LOG_MSG];
-} typedef repl_mux_message_t;
+    TaskHandle_t task;
+    uint8_t refs;                   // Consumers the task's logs go to, 0 for all
+    uint8_t hold;                   // Hold the task while a session is far behind
+} route_t;
 
-static const char* TAG = "REPL MUX";
+static route_t routes[MAX_ROUTES];
+static uint8_t hold_stalled = 0;    // Bit per session that took nothing for HOLD_MAX_MS
+
+#ifdef CONFIG_REPL_MUX_TOKENIZED
+static uint8_t tokenized = 1;
+#else
+static uint8_t tokenized = 0;
+#endif
+
+//*****************************************************************************
+// Session slots and RPC clients belong to the net reactor task, both the
+// input and the output side, so a slot is closed and freed in one go. The
+// commands they send are run by NET Cmd, a task below the reactor, so the
+// reactor goes on sending while one runs. Whole lines are copied into its
+// queue, a session whose line finds it full is not read until it has room.
+//*****************************************************************************
+
+typedef enum
+{
+    SESSION_FREE,
+    SESSION_OPEN,
+} session_state_t;
+
+typedef struct
+{
+    uint8_t state;                  // session_state_t
+    uint8_t gen;                    // Bumped per client, NET Cmd skips lines of a gone one
+    int sock;
+    char ip_addr[16];
+
+    char line[CONFIG_REPL_MUX_MAX_LOG_MSG];     // Input up to the next \n
+    uint16_t line_len;
+    uint8_t rx_held;                // A whole line waits for room in the queue, not read
+
+    char tx[NET_TX_SIZE];           // Output batch, tx_off of tx_len sent
+    uint16_t tx_off;
+    uint16_t tx_len;
+    TickType_t tx_first;            // When the oldest byte in tx came in
+    uint8_t tx_blocked;             // Socket full, wait for it to be writable
+} session_t;
+
+static session_t sessions[MAX_SESSIONS];
+static int listen_sock = -1;
+static int rpc_sock = -1;
+
+typedef struct
+{
+    uint8_t rpc;                    // 1 serve RPC client slot, 0 run line for session slot
+    uint8_t slot;
+    uint8_t gen;                    // Of the session the line came from
+    char line[CONFIG_REPL_MUX_MAX_LOG_MSG];
+} net_cmd_t;
+
+static QueueHandle_t net_cmd_q = NULL;
+
+//*****************************************************************************
+// The reactor reads RPC request frames into the client's buffer. Once a whole
+// one is in, the client is handed to NET Cmd, which serves every whole frame
+// where it lies and hands it back, the reactor keeps off its socket until
+// then. While a CMD runs, everything NET Cmd logs goes into the response
+// instead of the ring. Responses are sent blocking, bounded by
+// RPC_SEND_TIMEOUT_S, on NET Cmd too.
+//*****************************************************************************
+
+typedef struct
+{
+    int sock;                       // -1 if the slot is free
+    uint8_t rx[RPC_RX_SIZE];
+    uint16_t rx_len;
+    volatile uint8_t busy;          // NET Cmd has it
+    volatile uint8_t failed;        // NET Cmd could not send, the reactor closes it
+    uint8_t held;                   // A whole frame waits for room in the queue
+} rpc_client_t;
+
+static rpc_client_t rpc_clients[MAX_RPC];
+static uint8_t rpc_tx[CONFIG_REPL_MUX_RPC_FRAME_SIZE];
+static repl_mux_rpc_out_t* volatile rpc_capture = NULL;    // Response of the CMD being run
+static TaskHandle_t rpc_capture_task = NULL;               // NET Cmd
+
+//*****************************************************************************
+// Tags are added to the table the first time they log and never removed, so
+// it is searched without a lock, n_tags only goes up once the entry is
+// filled. Each tag has a token bucket of burst messages that refills at rate
+// per second, kept as credit in 1 / configTICK_RATE_HZ of a message so a
+// tick's worth of refill is a whole number. Buckets and counters are only
+// touched in tag_mux.
+//*****************************************************************************
+
+typedef struct
+{
+    char tag[REPL_MUX_TAG_LEN];
+    const char* seen;               // Last tag pointer that matched, saves the strcmp
+    uint16_t rate;                  // Messages per second, 0 no limit
+    uint16_t burst;
+    uint32_t credit;
+    TickType_t last;                // Tick credit was last brought up to
+    uint32_t passed;
+    uint32_t suppressed;
+    uint32_t unreported;            // Suppressed since the last one let through
+} tag_t;
+
+static tag_t tags[MAX_TAGS];
+static volatile uint8_t n_tags = 0;
+static tag_t tag_other = { .tag = "(other)" };  // Tags the table has no room for
+static uint32_t tags_untracked = 0;
+static portMUX_TYPE tag_mux = portMUX_INITIALIZER_UNLOCKED;
+
+//*****************************************************************************
+// A job is a command run on a task of its own, so the input task that started
+// it goes on reading. Its slot is claimed RUNNING by bg and handed back DONE
+// by the job's task, both in job_mux, right before that task deletes itself.
+// A DONE slot keeps its results for jobs until it is reused, oldest first.
+//*****************************************************************************
 
-static uint8_t queue_active[CONFIG_REPL_MUX_N_QUEUES] = {0};
-static QueueHandle_t qs[CONFIG_REPL_MUX_N_QUEUES];
-static QueueHandle_t client_connected_notifier;
-static uint8_t client_discon = 1;
+typedef enum
+{
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_DONE,
+} job_state_t;
+
+typedef struct
+{
+    volatile uint8_t state;         // job_state_t
+    volatile uint8_t cancel;        // Set by kill, polled by the command
+    uint8_t c;                      // Consumer it was started on, gets its output
+    uint16_t id;
+    TaskHandle_t task;
+    char line[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    int ret;
+    TickType_t start;
+    uint32_t run_ms;                // Set once DONE
+    uint32_t stack_free;            // Least stack left, bytes, set once DONE
+} job_t;
+
+static job_t jobs[MAX_JOBS];
+static uint16_t next_job_id = 1;
+static portMUX_TYPE job_mux = portMUX_INITIALIZER_UNLOCKED;
 
 static uint8_t num_cmds = 0;
 static cmd_t cmd_list[CONFIG_REPL_MUX_MAX_NUM_CMD];
 
+//*****************************************************************************
+// Routes, so the output of a command only goes to the medium it was typed on
+//*****************************************************************************
+
+// hold, the task runs a command and may be held while a session it writes to
+// is far behind, see hold_for_sessions
+static void route_set(TaskHandle_t task, uint8_t refs, uint8_t hold)
+{
+    uint8_t i;
+    portENTER_CRITICAL(&mux);
+    for(i = 0; i < MAX_ROUTES; ++i)
+    {
+        if(routes[i].task == task || (refs && !routes[i].refs))
+        {
+            routes[i].task = task;
+            routes[i].refs = refs;
+            routes[i].hold = hold;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+// Called in the critical section. hold may be NULL.
+static uint8_t route_of(TaskHandle_t task, uint8_t* hold)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_ROUTES; ++i)
+    {
+        if(routes[i].refs && routes[i].task == task)
+        {
+            if(hold) { *hold = routes[i].hold; }
+            return routes[i].refs;
+        }
+    }
+
+    if(hold) { *hold = 0; }
+    return 0;
+}
+
+// Consumer the calling task runs a command for, UART if none
+static uint8_t current_consumer(void)
+{
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+
+    portENTER_CRITICAL(&mux);
+    uint8_t refs = route_of(me, NULL);
+    portEXIT_CRITICAL(&mux);
+
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
+    {
+        if(refs & (1 << c)) { return c; }
+    }
+
+    return UART_C;
+}
+
 //*****************************************************************************
 // Private command table funcs
 //*****************************************************************************
@@ -113,7 +368,7 @@ static int run_cmd(uint8_t index, int argc, char** argv)
     return cmd_list[index].func(argc, argv);
 }
 
-static void run(char* input)
+static int run(char* input)
 {
     char* argv[CONFIG_REPL_MUX_MAX_CMD_ARG];
 
@@ -123,7 +378,7 @@ static void run(char* input)
     if(index < 0)
     {
         ESP_LOGE(TAG, "%s not found", argv[0]);
-        return;
+        return -1;
     }
 
     int ret = run_cmd(index, argc, argv);
@@ -132,6 +387,17 @@ static void run(char* input)
         ESP_LOGE(TAG, "%s returned non zero value", argv[0]);
     }
 
+    return ret;
+}
+
+// Run a line typed on consumer c's medium. Everything the task logs while the
+// command runs goes back to c only.
+static void run_for(uint8_t c, char* input)
+{
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    route_set(me, 1 << c, c != UART_C);
+    run(input);
+    route_set(me, 0, 0);
 }
 
 static int do_help(int argc, char** argv)
@@ -148,271 +414,1607 @@ static int do_help(int argc, char** argv)
 }
 
 //*****************************************************************************
-// UART Q Consumer 
+// Jobs
 //*****************************************************************************
 
-static void uart_consumer(void* args)
+static void job_task(void* args)
 {
-    repl_mux_message_t msg;
+    job_t* j = (job_t*) args;
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    char line[CONFIG_REPL_MUX_MAX_LOG_MSG];
+
+    j->task = me;
+    memcpy(line, j->line, sizeof(line));       // run cuts up its input
+    route_set(me, 1 << j->c, j->c != UART_C);
+    int ret = run(line);
+
+    uint32_t run_ms = (xTaskGetTickCount() - j->start) * portTICK_PERIOD_MS;
+    uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+    esp_log_write(ESP_LOG_INFO, "", "[%u] %s %d after %lu ms, %lu stack bytes never used\n",
+                  j->id, j->cancel ? "cancelled," : "returned",
+                  ret, (unsigned long) run_ms, (unsigned long) stack_free);
+    route_set(me, 0, 0);
+
+    portENTER_CRITICAL(&job_mux);
+    j->ret = ret;
+    j->run_ms = run_ms;
+    j->stack_free = stack_free;
+    j->state = JOB_DONE;
+    portEXIT_CRITICAL(&job_mux);
+
+    vTaskDelete(NULL);
+}
 
-    queue_active[UART_Q] = 1;
-    while(1)
+// Job of id, NULL if it is not in the table any more
+static job_t* job_find(uint16_t id)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_JOBS; ++i)
     {
-        while(xQueueReceive(qs[UART_Q], &msg, 100 / portTICK_PERIOD_MS))
-        {
-            printf(msg.log_msg);
-        }
-
+        if(jobs[i].state != JOB_FREE && jobs[i].id == id) { return &jobs[i]; }
     }
+
+    return NULL;
 }
 
-static void uart_producer(void* args)
+static int do_bg(int argc, char** argv)
 {
-    const uart_config_t uart_config = {
-        .baud_rate = 115200,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .source_clk = UART_SCLK_REF_TICK,
-    };
+    if(argc < 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Usage: bg <cmd> [<args> ...]\n");
+        return -1;
+    }
+
+    // Take a free slot, else the one that finished first
+    job_t* j = NULL;
+    uint8_t i;
+    portENTER_CRITICAL(&job_mux);
+    for(i = 0; i < MAX_JOBS; ++i)
+    {
+        job_t* k = &jobs[i];
+        if(k->state == JOB_FREE) { j = k; break; }
+        if(k->state == JOB_DONE && (!j || k->id < j->id)) { j = k; }
+    }
+    if(j)
+    {
+        j->state = JOB_RUNNING;
+        j->id = next_job_id++;
+    }
+    portEXIT_CRITICAL(&job_mux);
 
-    int channel = 0;
+    if(!j)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "%u jobs already running\n", MAX_JOBS);
+        return -1;
+    }
 
-    uart_param_config(channel, &uart_config);
-    uart_driver_install(channel, 256, 0, 0, NULL, 0);
-    esp_vfs_dev_uart_use_driver(channel);
+    // Put the line back together, build_argv cut it up
+    int n = 0;
+    j->line[0] = 0;
+    for(i = 1; i < argc; ++i)
+    {
+        n += snprintf(j->line + n, sizeof(j->line) - n, (i == 1) ? "%s" : " %s", argv[i]);
+        if(n >= (int) sizeof(j->line)) { break; }
+    }
 
-    linenoiseSetMaxLineLen(CONFIG_REPL_MUX_MAX_LOG_MSG);
-    linenoiseSetDumbMode(1);
-    setvbuf(stdin, NULL, _IONBF, 0);
+    j->cancel = 0;
+    j->c = current_consumer();
+    j->task = NULL;
+    j->ret = 0;
+    j->run_ms = 0;
+    j->stack_free = 0;
+    j->start = xTaskGetTickCount();
+
+    TaskHandle_t h = NULL;
+    xTaskCreate(job_task, "Job", CONFIG_REPL_MUX_JOB_STACK_SIZE, j, CONFIG_REPL_MUX_CONSUMER_PRIO - 1, &h);
+    if(!h)
+    {
+        j->state = JOB_FREE;
+        esp_log_write(ESP_LOG_INFO, "", "Failed to create job task\n");
+        return -1;
+    }
 
-    ESP_LOGI(TAG, "UART Input handelr thread launched");
+    esp_log_write(ESP_LOG_INFO, "", "[%u] %s\n", j->id, j->line);
+    return 0;
+}
 
-    while(1)
+static int do_jobs(int argc, char** argv)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_JOBS; ++i)
     {
-        char* line = linenoise("> ");
-        if(line != NULL && strlen(line) > 0)
+        job_t* j = &jobs[i];
+        job_t copy;
+
+        // A RUNNING job can not get to vTaskDelete while we hold job_mux
+        portENTER_CRITICAL(&job_mux);
+        copy = *j;
+        if(j->state == JOB_RUNNING)
         {
-            run(line);
-            free(line);
+            copy.run_ms = (xTaskGetTickCount() - j->start) * portTICK_PERIOD_MS;
+            copy.stack_free = j->task ? uxTaskGetStackHighWaterMark(j->task) : 0;
         }
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-    }
-}
+        portEXIT_CRITICAL(&job_mux);
 
+        if(copy.state == JOB_FREE) { continue; }
 
-//*****************************************************************************
-// Net Q Consumer
-//*****************************************************************************
+        esp_log_write(ESP_LOG_INFO, "", "[%u] %-9s %4d  %8lu ms  %5lu stack free  %s\n",
+                      copy.id,
+                      (copy.state == JOB_DONE) ? "done" : (copy.cancel ? "stopping" : "running"),
+                      copy.ret,
+                      (unsigned long) copy.run_ms,
+                      (unsigned long) copy.stack_free,
+                      copy.line);
+    }
 
-// Returns listneing soket
-static int create_listening_socket()
-{
-    int listen_sock = -1;
-    struct sockaddr_storage dest_addr;
-    struct sockaddr_in *dest_addr_ip4;
+    return 0;
+}
 
-    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if(listen_sock < 0)
+static int do_wait(int argc, char** argv)
+{
+    if(argc < 2 || argc > 3)
     {
-        ESP_LOGE(TAG, "Failed to open listening socket");
+        esp_log_write(ESP_LOG_INFO, "", "Usage: wait <id> [<max s>]\n");
         return -1;
     }
 
-    dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
-    dest_addr_ip4->sin_addr.s_addr = inet_addr(CONFIG_REPL_MUX_IP);
-    dest_addr_ip4->sin_family = AF_INET;
-    dest_addr_ip4->sin_port = htons(CONFIG_REPL_MUX_PORT);
-    int err = bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    err |= listen(listen_sock, 1);
-    
-    if(err)
+    uint16_t id = strtol(argv[1], NULL, 10);
+    TickType_t max = (argc == 3) ? strtol(argv[2], NULL, 10) * 1000 / portTICK_PERIOD_MS : portMAX_DELAY;
+    TickType_t start = xTaskGetTickCount();
+
+    job_t* j = job_find(id);
+    while(j && j->id == id && j->state == JOB_RUNNING)
     {
-        ESP_LOGE(TAG, "Failed to bind listening socket");
-        return -1;;
+        if(max != portMAX_DELAY && xTaskGetTickCount() - start >= max)
+        {
+            esp_log_write(ESP_LOG_INFO, "", "[%u] still running\n", id);
+            return -1;
+        }
+        vTaskDelay(JOB_POLL_MS / portTICK_PERIOD_MS);
     }
 
-    ESP_LOGI(TAG, "Listening socket bound to %s:%d", CONFIG_REPL_MUX_IP, CONFIG_REPL_MUX_PORT);
-    return listen_sock;
+    if(!j || j->id != id)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "No job %u\n", id);
+        return -1;
+    }
+
+    return j->ret;
 }
 
-static int accept_client(int listen_sock)
+static int do_kill(int argc, char** argv)
 {
-    int client_socket;
-    struct sockaddr_in source_addr;
-    socklen_t addr_len = sizeof(source_addr);
-    char ip_addr[16];
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Usage: kill <id>\n");
+        return -1;
+    }
 
-    client_socket = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-    if (client_socket < 0)
+    uint16_t id = strtol(argv[1], NULL, 10);
+    job_t* j = job_find(id);
+    if(!j || j->state != JOB_RUNNING)
     {
-        ESP_LOGE(TAG, "Unable to accept connection: %s", strerror(errno));
+        esp_log_write(ESP_LOG_INFO, "", "No running job %u\n", id);
         return -1;
     }
-    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, ip_addr, 16);
-    ESP_LOGI(TAG, "Client Connected %s - Starting Session", ip_addr);
 
-    return client_socket;
+    j->cancel = 1;
+    esp_log_write(ESP_LOG_INFO, "", "[%u] asked to stop\n", id);
+    return 0;
 }
 
-static void net_consumer(void* args)
+//*****************************************************************************
+// Log ring. Each message is formatted once and put in the ring with a ref bit
+// for each consumer it goes to: the one a command was typed on for command
+// output, else every consumer whose level takes it. Each consumer walks the
+// ring with its own cursor and drops its bit once it copied the record out,
+// the last one out frees it.
+//*****************************************************************************
+
+static rec_hdr_t* hdr_at(uint32_t pos)
 {
-    repl_mux_message_t msg;
-    int listen_sock = -1;
-    int client_socket = -1;
+    return (rec_hdr_t*) (ring + (pos & (RING_SIZE - 1)));
+}
 
-    // This is considered early init task. If it fails blow everything up
-    listen_sock = create_listening_socket();
-    assert(listen_sock > -1);
-    
-    while(1)
+static char* text_at(uint32_t pos)
+{
+    return (char*) hdr_at(pos) + REC_HDR;
+}
+
+static uint32_t rec_size(const rec_hdr_t* h)
+{
+    return REC_HDR + REC_ALIGN(h->len);
+}
+
+// Called in the critical section
+static void free_records(void)
+{
+    while(tail_pos != head_pos && hdr_at(tail_pos)->refs == 0)
     {
-        client_socket = accept_client(listen_sock);
-        if(client_socket == -1)
-        {
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-            continue;
-        }
+        tail_pos += rec_size(hdr_at(tail_pos));
+    }
+}
 
-        queue_active[NET_Q] = 1;
-        
-        client_discon = 0;
-        if(!xQueueSend(client_connected_notifier, &client_socket, 0))
-        {   
-            ESP_LOGE(TAG, "Failed to push on client_connected_notifier");
-        }
+// Called in the critical section, drop consumer c's ref on the record at its
+// cursor
+static void unref_next(uint8_t c)
+{
+    rec_hdr_t* h = hdr_at(cursor[c]);
+    h->refs &= ~(1 << c);
+    cursor[c] += rec_size(h);
+    free_records();
+}
 
-        while(!client_discon)
-        {
-            while(xQueueReceive(qs[NET_Q], &msg, 100 / portTICK_PERIOD_MS))
-            {
-                if(send(client_socket, msg.log_msg, strlen(msg.log_msg), 0) <= 0)
-                {
-                    ESP_LOGI(TAG, "client disonnected");
-                    client_discon = 1;
-                    break;
-                }
-            }
-        }
+// Called in the critical section. Move consumer c's cursor to its next record.
+// Records not for c do not wait for it, so they may be freed behind tail
+// while its cursor still points at them.
+static void skip_others(uint8_t c)
+{
+    if((int32_t) (cursor[c] - tail_pos) < 0)
+    {
+        cursor[c] = tail_pos;
+    }
 
-        shutdown(client_socket, 0);
-        close(client_socket);
-        queue_active[NET_Q] = 0;
+    while(cursor[c] != head_pos && !(hdr_at(cursor[c])->refs & (1 << c)))
+    {
+        cursor[c] += rec_size(hdr_at(cursor[c]));
     }
 }
 
-static void net_producer(void* args)
+// Called in the critical section. Push the oldest record out from under the
+// consumers that have not sent it yet, they are the ones furthest behind.
+// Counted as their drops.
+static void evict_oldest(void)
 {
-    int client_socket = -1;
-    repl_mux_message_t msg;
-
-    while(1)
+    rec_hdr_t* h = hdr_at(tail_pos);
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
     {
-        client_socket = -1;
-        xQueueReceive(client_connected_notifier, &client_socket, portMAX_DELAY);
-        if(client_socket == -1)
+        if(h->refs & (1 << c))
         {
-            continue;
+            cursor[c] = tail_pos + rec_size(h);
+            if(!(h->flags & REC_WRAP))
+            {
+                drops_unreported[c]++;
+                stats.consumer[c].dropped++;
+            }
         }
+    }
+
+    if(!(h->flags & REC_WRAP)) { stats.dropped++; }
+    h->refs = 0;
+    free_records();
+}
 
-        while(!client_discon)
+// Called in the critical section
+static uint8_t level_refs(uint8_t lvl)
+{
+    uint8_t refs = 0;
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
+    {
+        if((active & (1 << c)) && level[c] >= lvl)
         {
-            ssize_t recv_len = recv(client_socket, &msg, CONFIG_REPL_MUX_MAX_LOG_MSG, 0);
-            if(recv_len > 0)
-            {
-                msg.log_msg[recv_len-1] = 0;
-                run(msg.log_msg);
-            }
-            else if(recv_len <= 0)
-            {
-                ESP_LOGI(TAG, "client disconnected");
-                client_discon = 1;
-                break;
-            }
+            refs |= (1 << c);
         }
     }
+
+    return refs;
 }
 
-//*****************************************************************************
-// REPL MUX Q Publisher
-//*****************************************************************************
+// Ring bytes consumer c has not sent yet, 0 if it is not attached
+static uint32_t consumer_lag(uint8_t c)
+{
+    uint32_t lag = 0;
+    portENTER_CRITICAL(&mux);
+    if(active & (1 << c))
+    {
+        skip_others(c);
+        lag = head_pos - cursor[c];
+    }
+    portEXIT_CRITICAL(&mux);
 
-static int log_publisher(const char* string, va_list arg_list)
+    return lag;
+}
+
+// A command writes into the ring much faster than the reactor, which is not
+// woken by a log, sends it to a session, so a long listing would push its own
+// start out. The task running it waits here, waking the reactor, while a
+// session it writes to is more than HOLD_LAG behind. A session that takes
+// nothing for HOLD_MAX_MS is given up on until it catches up, it then loses
+// its oldest output like any slow consumer.
+static void hold_for_sessions(uint8_t refs)
 {
-    uint8_t i;
-    repl_mux_message_t msg;
-    for(i = 0; i < CONFIG_REPL_MUX_N_QUEUES; ++i)
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
     {
-        if(queue_active[i])
+        if(c == UART_C || !(refs & (1 << c))) { continue; }
+
+        uint32_t waited = 0;
+        while(consumer_lag(c) > HOLD_LAG)
         {
-            vsnprintf(msg.log_msg, CONFIG_REPL_MUX_MAX_LOG_MSG, string, arg_list);
-            if(!xQueueSend(qs[i], (void*) &msg, TTL))
+            if((hold_stalled & (1 << c)) || waited >= HOLD_MAX_MS)
             {
-                printf("REPL MUX QUEUE FULL!!\n");
+                portENTER_CRITICAL(&mux);
+                hold_stalled |= (1 << c);
+                portEXIT_CRITICAL(&mux);
+                break;
             }
+            net_reactor_wake();
+            vTaskDelay(1);
+            waited += portTICK_PERIOD_MS;
+        }
+        if(consumer_lag(c) <= HOLD_LAG)
+        {
+            portENTER_CRITICAL(&mux);
+            hold_stalled &= ~(1 << c);
+            portEXIT_CRITICAL(&mux);
         }
     }
-
-    return 0;
 }
 
-//*****************************************************************************
-// API Funcs
-//*****************************************************************************
-
-esp_err_t repl_mux_register(char* name, char* desc, cmd_func_t func)
+// Put len bytes in the ring for the consumers it goes to. Never waits, if
+// there is no room the oldest records are pushed out from under whichever
+// consumer is furthest behind, so a slow medium only loses its own backlog and
+// never holds up the others or the caller.
+static void ring_publish(const char* msg, uint16_t len, uint8_t lvl)
 {
-    if(num_cmds == CONFIG_REPL_MUX_MAX_NUM_CMD)
+    uint32_t need = REC_HDR + REC_ALIGN(len);
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    uint8_t hold;
+    uint8_t c;
+
+    if(rpc_capture && me == rpc_capture_task)
     {
-        ESP_LOGE(TAG, "Command Table Full");
-        return ESP_ERR_INVALID_STATE;
+        repl_mux_rpc_put_text(rpc_capture, REPL_MUX_RPC_F_TEXT, msg, len);
+        return;
     }
 
-    strncpy(cmd_list[num_cmds].name, name, CONFIG_REPL_MUX_NAME_LEN-1);
-    strncpy(cmd_list[num_cmds].desc, desc, CONFIG_REPL_MUX_DESC_LEN-1 );
-    cmd_list[num_cmds].func = func;
-    num_cmds++;
+    portENTER_CRITICAL(&mux);
+    uint8_t refs = route_of(me, &hold);
+    refs = refs ? (refs & active) : level_refs(lvl);
+    if(refs)
+    {
+        uint32_t to_end = RING_SIZE - (head_pos & (RING_SIZE - 1));
+        uint32_t pad = (to_end < need) ? to_end : 0;
+        while(RING_SIZE - (head_pos - tail_pos) < pad + need)
+        {
+            evict_oldest();
+        }
 
-    ESP_LOGI(TAG, "Command Added %s (%d/%d)", name, num_cmds, CONFIG_REPL_MUX_MAX_NUM_CMD);
+        rec_hdr_t* h;
+        if(pad)
+        {
+            h = hdr_at(head_pos);
+            h->len = pad - REC_HDR;
+            h->flags = REC_WRAP;
+            h->refs = refs;
+            head_pos += pad;
+        }
 
-    return ESP_OK;
-}
+        h = hdr_at(head_pos);
+        h->len = len;
+        h->flags = 0;
+        h->refs = refs;
+        memcpy(text_at(head_pos), msg, len);
+        head_pos += need;
 
-esp_err_t repl_mux_init(void)
-{
-    uint8_t i;
-    for(i = 0; i < CONFIG_REPL_MUX_N_QUEUES; ++i)
+        stats.published++;
+        if(head_pos - tail_pos > stats.ring_peak) { stats.ring_peak = head_pos - tail_pos; }
+    }
+    portEXIT_CRITICAL(&mux);
+
+    TaskHandle_t woken = NULL;
+    for(c = 0; c < N_CONSUMERS; ++c)
     {
-        qs[i] = xQueueCreate(CONFIG_REPL_MUX_Q_SIZE, sizeof(repl_mux_message_t));
-        if(qs[i] == 0)
+        if((refs & (1 << c)) && consumer_h[c] && consumer_h[c] != woken)
         {
-            return ESP_ERR_NO_MEM;
+            woken = consumer_h[c];
+            xTaskNotifyGive(woken);
         }
     }
 
-    client_connected_notifier = xQueueCreate(1, sizeof(int));
-    if(client_connected_notifier == 0)
+    if(hold)
     {
-        return ESP_ERR_NO_MEM;
+        hold_for_sessions(refs);
     }
+}
 
-    TaskHandle_t h;
-    xTaskCreate(uart_producer,
-            "UART In",
-            CONFIG_REPL_MUX_STACK_SIZE,
+// Start taking logs from now on, to be woken is task, NULL for one that polls
+static void ring_attach(uint8_t c, TaskHandle_t task, const char* name)
+{
+    portENTER_CRITICAL(&mux);
+    consumer_h[c] = task;
+    cursor[c] = head_pos;
+    level[c] = ESP_LOG_VERBOSE;
+    drops_unreported[c] = 0;
+    hold_stalled &= ~(1 << c);
+    memset(&stats.consumer[c], 0, sizeof(stats.consumer[c]));
+    strncpy(stats.consumer[c].name, name, sizeof(stats.consumer[c].name) - 1);
+    stats.consumer[c].active = 1;
+    active |= (1 << c);
+    portEXIT_CRITICAL(&mux);
+}
+
+// Stop taking logs and let go of everything not sent yet
+static void ring_detach(uint8_t c)
+{
+    portENTER_CRITICAL(&mux);
+    active &= ~(1 << c);
+    stats.consumer[c].active = 0;
+    skip_others(c);
+    while(cursor[c] != head_pos)
+    {
+        unref_next(c);
+        skip_others(c);
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+// Copy the next message of consumer c to out, CONFIG_REPL_MUX_MAX_LOG_MSG
+// bytes, and let go of it. Returns its length, or -1 if there is none. Once c
+// has caught up, messages it missed are returned in drops.
+static int ring_copy(uint8_t c, char* out, uint32_t* drops)
+{
+    int len = -1;
+    *drops = 0;
+
+    portENTER_CRITICAL(&mux);
+    skip_others(c);
+    while(cursor[c] != head_pos && (hdr_at(cursor[c])->flags & REC_WRAP))
+    {
+        unref_next(c);
+        skip_others(c);
+    }
+    if(cursor[c] != head_pos)
+    {
+        repl_mux_consumer_stats_t* cs = &stats.consumer[c];
+        if(head_pos - cursor[c] > cs->lag_peak) { cs->lag_peak = head_pos - cursor[c]; }
+
+        len = hdr_at(cursor[c])->len;
+        memcpy(out, text_at(cursor[c]), len);
+        unref_next(c);
+        cs->msgs++;
+    }
+    else
+    {
+        *drops = drops_unreported[c];
+        drops_unreported[c] = 0;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return len;
+}
+
+// Consumer c wrote len bytes to its medium in one go
+static void count_send(uint8_t c, uint32_t len)
+{
+    portENTER_CRITICAL(&mux);
+    stats.consumer[c].sends++;
+    stats.consumer[c].bytes += len;
+    portEXIT_CRITICAL(&mux);
+}
+
+// The note a consumer sends in place of the messages it missed
+static int drop_note(char* out, int cap, uint32_t drops)
+{
+    int n = snprintf(out, cap, "REPL MUX: %lu messages dropped, too far behind\n", (unsigned long) drops);
+    return (n < cap) ? n : cap - 1;
+}
+
+//*****************************************************************************
+// Tag limits
+//*****************************************************************************
+
+// Called in tag_mux
+static void tag_limit(tag_t* t, uint16_t rate, uint16_t burst)
+{
+    t->rate = rate;
+    t->burst = burst ? burst : 1;
+    t->credit = (uint32_t) t->burst * TAG_CREDIT;
+    t->last = xTaskGetTickCount();
+}
+
+static int tag_match(const tag_t* t, const char* tag)
+{
+    return strncmp(t->tag, tag, REPL_MUX_TAG_LEN - 1) == 0;
+}
+
+// Entry of tag, added with the default limit the first time it is seen. Tags
+// the table has no room for share one entry. With cache the pointer that
+// matched is kept so the next call with it skips the strcmp, only for tags
+// that are static strings, the tags of log calls.
+static tag_t* tag_lookup(const char* tag, uint8_t cache)
+{
+    uint8_t n = n_tags;
+    uint8_t i;
+    for(i = 0; cache && i < n; ++i)
+    {
+        if(tags[i].seen == tag) { return &tags[i]; }
+    }
+
+    for(i = 0; i < n; ++i)
+    {
+        if(tag_match(&tags[i], tag))
+        {
+            if(cache) { tags[i].seen = tag; }
+            return &tags[i];
+        }
+    }
+
+    tag_t* t = &tag_other;
+    portENTER_CRITICAL(&tag_mux);
+    for(i = n; i < n_tags; ++i)                 // Added since we looked
+    {
+        if(tag_match(&tags[i], tag)) { break; }
+    }
+
+    if(i < n_tags)
+    {
+        t = &tags[i];
+    }
+    else if(n_tags < MAX_TAGS)
+    {
+        t = &tags[n_tags];
+        strncpy(t->tag, tag, REPL_MUX_TAG_LEN - 1);
+        tag_limit(t, CONFIG_REPL_MUX_TAG_RATE, CONFIG_REPL_MUX_TAG_BURST);
+        n_tags++;
+    }
+    else
+    {
+        tags_untracked++;
+    }
+    portEXIT_CRITICAL(&tag_mux);
+
+    return t;
+}
+
+// Tag of a log call
+static tag_t* tag_find(const char* tag)
+{
+    return tag_lookup(tag, 1);
+}
+
+// Tag given by a caller, i.e. typed in, whose buffer may be reused for
+// another tag right after
+static tag_t* tag_find_nocache(const char* tag)
+{
+    return tag_lookup(tag, 0);
+}
+
+// Take a message from t's bucket. Returns how many were suppressed since the
+// last one let through, -1 if this one is suppressed too.
+static int32_t tag_take(tag_t* t)
+{
+    TickType_t now = xTaskGetTickCount();
+    int32_t missed = -1;
+
+    portENTER_CRITICAL(&tag_mux);
+    if(t->rate)
+    {
+        uint32_t cap = (uint32_t) t->burst * TAG_CREDIT;
+        uint32_t ticks = now - t->last;
+        t->last = now;
+        t->credit = (ticks > cap / t->rate) ? cap : t->credit + ticks * t->rate;
+        if(t->credit > cap) { t->credit = cap; }
+    }
+
+    if(!t->rate || t->credit >= TAG_CREDIT)
+    {
+        if(t->rate) { t->credit -= TAG_CREDIT; }
+        t->passed++;
+        missed = t->unreported;
+        t->unreported = 0;
+    }
+    else
+    {
+        t->suppressed++;
+        t->unreported++;
+    }
+    portEXIT_CRITICAL(&tag_mux);
+
+    return missed;
+}
+
+// Tag of an ESP_LOGx call from its format, "<color><L> (%u) %s: ...", and its
+// first two args, the time stamp and the tag. NULL if the format is not one.
+// arg_list is left untouched.
+static const char* log_tag(const char* fmt, va_list arg_list)
+{
+    const char* p = fmt;
+    if(*p == '\033')
+    {
+        p = strchr(p, 'm');
+        if(!p) { return NULL; }
+        ++p;
+    }
+
+    if(!*p || !strchr("EWIDV", *p) || strncmp(p + 1, " (%", 3)) { return NULL; }
+    p = strchr(p + 4, ')');
+    if(!p || strncmp(p, ") %s: ", 6)) { return NULL; }
+
+    va_list args;
+    va_copy(args, arg_list);
+    if(p[-1] == 's') { va_arg(args, const char*); }     // System time stamp
+    else             { va_arg(args, uint32_t); }
+    const char* tag = va_arg(args, const char*);
+    va_end(args);
+
+    return tag;
+}
+
+// The note put in the ring ahead of the first message of a tag let through
+// after some were suppressed
+static void tag_note(const char* tag, uint32_t missed, uint8_t lvl)
+{
+    char msg[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    int n = snprintf(msg, sizeof(msg), "REPL MUX: %lu \"%s\" messages suppressed, rate limited\n",
+                     (unsigned long) missed, tag);
+    if(n < 0) { return; }
+    if(n > CONFIG_REPL_MUX_MAX_LOG_MSG - 1) { n = CONFIG_REPL_MUX_MAX_LOG_MSG - 1; }
+
+    ring_publish(msg, n, lvl);
+}
+
+static int do_mux_stats(int argc, char** argv)
+{
+    repl_mux_stats_t s;
+    uint32_t used;
+    repl_mux_get_stats(&s, &used);
+
+    esp_log_write(ESP_LOG_INFO, "", "published %lu  dropped %lu  ring %lu / %lu bytes, peak %lu\n",
+                  (unsigned long) s.published, (unsigned long) s.dropped,
+                  (unsigned long) used, (unsigned long) RING_SIZE, (unsigned long) s.ring_peak);
+
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
+    {
+        repl_mux_consumer_stats_t* cs = &s.consumer[c];
+        if(!cs->active) { continue; }
+
+        esp_log_write(ESP_LOG_INFO, "", "%u %-15s level %u  msgs %lu  dropped %lu  sends %lu  bytes/send %lu  lag %lu  peak %lu\n",
+                      c, cs->name, cs->level,
+                      (unsigned long) cs->msgs,
+                      (unsigned long) cs->dropped,
+                      (unsigned long) cs->sends,
+                      (unsigned long) (cs->sends ? cs->bytes / cs->sends : 0),
+                      (unsigned long) cs->lag,
+                      (unsigned long) cs->lag_peak);
+    }
+
+    return 0;
+}
+
+static int do_log_sub(int argc, char** argv)
+{
+    const char* letters = "NEWIDV";
+    uint8_t c = current_consumer();
+
+    if(argc == 2 && strlen(argv[1]) == 1 && strchr(letters, argv[1][0]))
+    {
+        portENTER_CRITICAL(&mux);
+        level[c] = strchr(letters, argv[1][0]) - letters;
+        portEXIT_CRITICAL(&mux);
+    }
+    else if(argc != 1)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Usage: log_sub [N|E|W|I|D|V]\n");
+        return -1;
+    }
+
+    esp_log_write(ESP_LOG_INFO, "", "consumer %u takes system logs up to %c\n", c, letters[level[c]]);
+    return 0;
+}
+
+static int do_tlog(int argc, char** argv)
+{
+    if(argc == 2 && (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0))
+    {
+        repl_mux_set_tokenized(strcmp(argv[1], "on") == 0);
+    }
+    else if(argc != 1)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Usage: tlog [on|off]\n");
+        return -1;
+    }
+
+    esp_log_write(ESP_LOG_INFO, "", "tokenized logs %s, table %08lx, %u tokens\n",
+                  tokenized ? "on" : "off",
+                  (unsigned long) repl_mux_token_hash(),
+                  REPL_MUX_N_TOKENS);
+    return 0;
+}
+
+static int do_log_tag(int argc, char** argv)
+{
+    const char* letters = "NEWIDV";
+    const char* usage = "Usage: log_tag [<tag> <N|E|W|I|D|V|-> [<per sec> [<burst>]]], _ for a space in tag\n";
+
+    if(argc == 1)
+    {
+        repl_mux_tag_stats_t t;
+        uint8_t i;
+        for(i = 0; repl_mux_get_tag_stats(i, &t) == ESP_OK; ++i)
+        {
+            esp_log_write(ESP_LOG_INFO, "", "%-20s %c  %5u/s burst %-5u passed %-8lu suppressed %lu\n",
+                          t.tag, letters[t.level], t.rate, t.burst,
+                          (unsigned long) t.passed, (unsigned long) t.suppressed);
+        }
+        esp_log_write(ESP_LOG_INFO, "", "%u / %u tags, %lu logs of tags with no room\n",
+                      i, MAX_TAGS, (unsigned long) tags_untracked);
+        return 0;
+    }
+
+    if(argc > 5 || argc < 3 || strlen(argv[2]) != 1 || !strchr("NEWIDV-", argv[2][0]))
+    {
+        esp_log_write(ESP_LOG_INFO, "", "%s", usage);
+        return -1;
+    }
+
+    char* c;
+    for(c = argv[1]; *c; ++c)
+    {
+        if(*c == '_') { *c = ' '; }
+    }
+
+    if(argv[2][0] != '-')
+    {
+        esp_log_level_set(argv[1], strchr(letters, argv[2][0]) - letters);
+    }
+
+    tag_t* t = tag_find_nocache(argv[1]);
+    if(t == &tag_other)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "tag table full\n");
+        return -1;
+    }
+
+    if(argc >= 4)
+    {
+        uint16_t rate = strtol(argv[3], NULL, 10);
+        uint16_t burst = (argc == 5) ? strtol(argv[4], NULL, 10) : 2 * rate;
+        repl_mux_set_tag_limit(argv[1], rate, burst);
+    }
+
+    esp_log_write(ESP_LOG_INFO, "", "%s: level %c, %u/s burst %u\n",
+                  t->tag, letters[esp_log_level_get(t->tag)], t->rate, t->burst);
+    return 0;
+}
+
+//*****************************************************************************
+// UART Consumer 
+//*****************************************************************************
+
+// Token frames are binary, stdout would put a CR before every 0x0A byte in
+// them. They go to the driver as is, behind whatever text stdout still holds.
+static void uart_write(const char* text, int len)
+{
+    if(len && text[0] == REPL_MUX_TOKEN_MARK)
+    {
+        fflush(stdout);
+        uart_write_bytes(UART_CHANNEL, text, len);
+        return;
+    }
+
+    fwrite(text, 1, len, stdout);
+}
+
+static void uart_consumer(void* args)
+{
+    char text[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    uint32_t drops;
+    int len;
+
+    ring_attach(UART_C, xTaskGetCurrentTaskHandle(), "uart");
+    while(1)
+    {
+        while((len = ring_copy(UART_C, text, &drops)) >= 0)
+        {
+            uart_write(text, len);
+            count_send(UART_C, len);
+        }
+
+        if(drops)
+        {
+            len = drop_note(text, sizeof(text), drops);
+            fwrite(text, 1, len, stdout);
+            count_send(UART_C, len);
+            continue;
+        }
+
+        ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS);
+    }
+}
+
+static void uart_producer(void* args)
+{
+    const uart_config_t uart_config = {
+        .baud_rate = 115200,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .source_clk = UART_SCLK_REF_TICK,
+    };
+
+    uart_param_config(UART_CHANNEL, &uart_config);
+    uart_driver_install(UART_CHANNEL, 256, 0, 0, NULL, 0);
+    esp_vfs_dev_uart_use_driver(UART_CHANNEL);
+
+    linenoiseSetMaxLineLen(CONFIG_REPL_MUX_MAX_LOG_MSG);
+    linenoiseSetDumbMode(1);
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    ESP_LOGI(TAG, "UART Input handelr thread launched");
+
+    while(1)
+    {
+        char* line = linenoise("> ");
+        if(line != NULL && strlen(line) > 0)
+        {
+            run_for(UART_C, line);
+            free(line);
+        }
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+}
+
+
+//*****************************************************************************
+// Net sessions, a handler of the net reactor. It accepts clients, reads their
+// lines and queues them for NET Cmd, and batches each session's logs and
+// sends them without blocking, a session whose socket is full keeps its batch
+// until it is writable, the others go on.
+//*****************************************************************************
+
+// Returns listneing soket
+static int create_listening_socket(uint16_t port, int backlog)
+{
+    int listen_sock = -1;
+    struct sockaddr_storage dest_addr;
+    struct sockaddr_in *dest_addr_ip4;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if(listen_sock < 0)
+    {
+        ESP_LOGE(TAG, "Failed to open listening socket");
+        return -1;
+    }
+
+    dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
+    dest_addr_ip4->sin_addr.s_addr = inet_addr(CONFIG_REPL_MUX_IP);
+    dest_addr_ip4->sin_family = AF_INET;
+    dest_addr_ip4->sin_port = htons(port);
+    int err = bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    err |= listen(listen_sock, backlog);
+    
+    if(err)
+    {
+        ESP_LOGE(TAG, "Failed to bind listening socket");
+        return -1;;
+    }
+
+    ESP_LOGI(TAG, "Listening socket bound to %s:%d", CONFIG_REPL_MUX_IP, port);
+    return listen_sock;
+}
+
+static void session_close(uint8_t i)
+{
+    session_t* s = &sessions[i];
+
+    ring_detach(1 + i);
+    shutdown(s->sock, 0);
+    close(s->sock);
+    s->state = SESSION_FREE;
+    ESP_LOGI(TAG, "Session %u (%s) disconnected", i, s->ip_addr);
+}
+
+static void session_accept(void)
+{
+    struct sockaddr_in source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to accept connection: %s", strerror(errno));
+        return;
+    }
+
+    uint8_t i;
+    for(i = 0; i < MAX_SESSIONS; ++i)
+    {
+        if(sessions[i].state == SESSION_FREE) { break; }
+    }
+
+    if(i == MAX_SESSIONS)
+    {
+        ESP_LOGE(TAG, "All %d sessions busy, refusing client", MAX_SESSIONS);
+        shutdown(sock, 0);
+        close(sock);
+        return;
+    }
+
+    session_t* s = &sessions[i];
+    s->sock = sock;
+    inet_ntoa_r(source_addr.sin_addr, s->ip_addr, sizeof(s->ip_addr));
+    s->gen++;
+    s->line_len = 0;
+    s->rx_held = 0;
+    s->tx_off = 0;
+    s->tx_len = 0;
+    s->tx_blocked = 0;
+
+    ring_attach(1 + i, NULL, s->ip_addr);
+    s->state = SESSION_OPEN;
+    ESP_LOGI(TAG, "Client Connected %s - Starting Session %u", s->ip_addr, i);
+
+    if(tokenized)
+    {
+        TaskHandle_t me = xTaskGetCurrentTaskHandle();
+        route_set(me, 1 << (1 + i), 0);
+        REPL_MUX_LOG(TOKEN_TABLE, repl_mux_token_hash(), REPL_MUX_N_TOKENS);
+        route_set(me, 0, 0);
+    }
+}
+
+// Queue every whole line session i sent for NET Cmd. A line that finds the
+// queue full stays put and the socket is not read until it went.
+static void session_dispatch(uint8_t i)
+{
+    session_t* s = &sessions[i];
+    net_cmd_t cmd;
+
+    s->rx_held = 0;
+    while(s->line_len)
+    {
+        char* nl = memchr(s->line, '\n', s->line_len);
+        uint16_t n = nl ? nl - s->line : s->line_len;
+        if(!nl && s->line_len < CONFIG_REPL_MUX_MAX_LOG_MSG - 1)
+        {
+            return;
+        }
+
+        // A line that fills the buffer is run as it is
+        uint16_t used = nl ? n + 1 : s->line_len;
+        if(n && s->line[n-1] == '\r') { --n; }
+
+        if(n)
+        {
+            cmd.rpc = 0;
+            cmd.slot = i;
+            cmd.gen = s->gen;
+            memcpy(cmd.line, s->line, n);
+            cmd.line[n] = 0;
+            if(xQueueSend(net_cmd_q, &cmd, 0) != pdTRUE)
+            {
+                s->rx_held = 1;
+                return;
+            }
+        }
+
+        memmove(s->line, s->line + used, s->line_len - used);
+        s->line_len -= used;
+    }
+}
+
+// Read what the client sent and queue every whole line of it
+static void session_recv(uint8_t i)
+{
+    session_t* s = &sessions[i];
+
+    ssize_t r = recv(s->sock, s->line + s->line_len, CONFIG_REPL_MUX_MAX_LOG_MSG - 1 - s->line_len, 0);
+    if(r <= 0)
+    {
+        session_close(i);
+        return;
+    }
+    s->line_len += r;
+
+    session_dispatch(i);
+}
+
+static int rpc_send(void* ctx, const uint8_t* frame, int len)
+{
+    rpc_client_t* cl = (rpc_client_t*) ctx;
+    while(len > 0)
+    {
+        ssize_t r = send(cl->sock, frame, len, 0);
+        if(r <= 0)
+        {
+            return -1;
+        }
+        frame += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static void rpc_close(uint8_t i)
+{
+    ESP_LOGI(TAG, "RPC client %u disconnected", i);
+    shutdown(rpc_clients[i].sock, 0);
+    close(rpc_clients[i].sock);
+    rpc_clients[i].sock = -1;
+    rpc_clients[i].failed = 0;
+    rpc_clients[i].held = 0;
+}
+
+static void rpc_accept(void)
+{
+    int sock = accept(rpc_sock, NULL, NULL);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to accept RPC connection: %s", strerror(errno));
+        return;
+    }
+
+    uint8_t i;
+    for(i = 0; i < MAX_RPC; ++i)
+    {
+        if(rpc_clients[i].sock < 0) { break; }
+    }
+
+    if(i == MAX_RPC)
+    {
+        ESP_LOGE(TAG, "All %d RPC clients busy, refusing client", MAX_RPC);
+        shutdown(sock, 0);
+        close(sock);
+        return;
+    }
+
+    struct timeval tv = { .tv_sec = RPC_SEND_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    rpc_clients[i].sock = sock;
+    rpc_clients[i].rx_len = 0;
+    rpc_clients[i].busy = 0;
+    rpc_clients[i].failed = 0;
+    rpc_clients[i].held = 0;
+    ESP_LOGI(TAG, "RPC client %u connected", i);
+}
+
+// Hand client i to NET Cmd once a whole request is in. If the queue is full
+// it is held, the socket is not read until it went.
+static void rpc_dispatch(uint8_t i)
+{
+    rpc_client_t* cl = &rpc_clients[i];
+    net_cmd_t cmd = { .rpc = 1, .slot = i };
+
+    int len = repl_mux_rpc_frame_len(cl->rx, cl->rx_len);
+    cl->held = 0;
+    if(!len || len > cl->rx_len)
+    {
+        return;
+    }
+
+    cl->busy = 1;
+    if(xQueueSend(net_cmd_q, &cmd, 0) != pdTRUE)
+    {
+        cl->busy = 0;
+        cl->held = 1;
+    }
+}
+
+// Read what the client sent, NET Cmd serves the whole requests
+static void rpc_recv(uint8_t i)
+{
+    rpc_client_t* cl = &rpc_clients[i];
+
+    ssize_t r = recv(cl->sock, cl->rx + cl->rx_len, RPC_RX_SIZE - cl->rx_len, 0);
+    if(r <= 0)
+    {
+        rpc_close(i);
+        return;
+    }
+    cl->rx_len += r;
+
+    int len = repl_mux_rpc_frame_len(cl->rx, cl->rx_len);
+    if(len > RPC_RX_SIZE)
+    {
+        ESP_LOGE(TAG, "RPC request of %d bytes, more than %d", len, RPC_RX_SIZE);
+        rpc_close(i);
+        return;
+    }
+
+    rpc_dispatch(i);
+}
+
+// Fill session i's batch from the ring and send it once it is full or its
+// oldest byte waited NET_FLUSH_TICKS, so a burst goes out in MSS sized
+// segments and a single line still goes out promptly. Returns ms until it
+// wants to be looked at again. Nothing wakes the reactor for a new log, so an
+// empty batch is looked at again after the flush time.
+static int32_t session_send(uint8_t i)
+{
+    session_t* s = &sessions[i];
+    uint8_t c = 1 + i;
+    uint32_t drops = 0;
+    int len;
+
+    while(NET_TX_SIZE - s->tx_len >= CONFIG_REPL_MUX_MAX_LOG_MSG)
+    {
+        len = ring_copy(c, s->tx + s->tx_len, &drops);
+        if(len < 0 && drops)
+        {
+            len = drop_note(s->tx + s->tx_len, CONFIG_REPL_MUX_MAX_LOG_MSG, drops);
+        }
+        if(len < 0)
+        {
+            break;
+        }
+
+        if(!s->tx_len) { s->tx_first = xTaskGetTickCount(); }
+        s->tx_len += len;
+    }
+
+    if(s->tx_off == s->tx_len)
+    {
+        return CONFIG_REPL_MUX_NET_FLUSH_MS;
+    }
+
+    TickType_t held = xTaskGetTickCount() - s->tx_first;
+    uint8_t full = NET_TX_SIZE - s->tx_len < CONFIG_REPL_MUX_MAX_LOG_MSG;
+    if(!full && !s->tx_off && held < NET_FLUSH_TICKS)
+    {
+        return (NET_FLUSH_TICKS - held) * portTICK_PERIOD_MS;
+    }
+
+    int r = send(s->sock, s->tx + s->tx_off, s->tx_len - s->tx_off, MSG_DONTWAIT);
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        s->tx_blocked = 1;
+        return NET_REACTOR_FOREVER;
+    }
+    if(r <= 0)
+    {
+        session_close(i);
+        return NET_REACTOR_FOREVER;
+    }
+
+    count_send(c, r);
+    s->tx_off += r;
+    if(s->tx_off < s->tx_len)
+    {
+        s->tx_blocked = 1;
+        return NET_REACTOR_FOREVER;
+    }
+
+    s->tx_off = 0;
+    s->tx_len = 0;
+    return 0;
+}
+
+static int net_fill(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    int max_fd = (listen_sock > rpc_sock) ? listen_sock : rpc_sock;
+    FD_SET(listen_sock, rfds);
+    FD_SET(rpc_sock, rfds);
+
+    uint8_t i;
+    for(i = 0; i < MAX_SESSIONS; ++i)
+    {
+        session_t* s = &sessions[i];
+        if(s->state != SESSION_OPEN) { continue; }
+
+        if(!s->rx_held) { FD_SET(s->sock, rfds); }
+        if(s->tx_blocked) { FD_SET(s->sock, wfds); }
+        if(s->sock > max_fd) { max_fd = s->sock; }
+    }
+
+    for(i = 0; i < MAX_RPC; ++i)
+    {
+        rpc_client_t* cl = &rpc_clients[i];
+        if(cl->sock >= 0 && !cl->busy && !cl->held && !cl->failed)
+        {
+            FD_SET(cl->sock, rfds);
+            if(rpc_clients[i].sock > max_fd) { max_fd = rpc_clients[i].sock; }
+        }
+    }
+
+    return max_fd;
+}
+
+static void net_ready(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_SESSIONS; ++i)
+    {
+        session_t* s = &sessions[i];
+        if(s->state == SESSION_OPEN && FD_ISSET(s->sock, wfds))
+        {
+            s->tx_blocked = 0;
+        }
+        if(s->state == SESSION_OPEN && FD_ISSET(s->sock, rfds))
+        {
+            session_recv(i);
+        }
+    }
+
+    for(i = 0; i < MAX_RPC; ++i)
+    {
+        rpc_client_t* cl = &rpc_clients[i];
+        if(cl->sock >= 0 && !cl->busy && FD_ISSET(cl->sock, rfds))
+        {
+            rpc_recv(i);
+        }
+    }
+
+    // Last, a new socket may have the number of one served above
+    if(FD_ISSET(listen_sock, rfds))
+    {
+        session_accept();
+    }
+
+    if(FD_ISSET(rpc_sock, rfds))
+    {
+        rpc_accept();
+    }
+}
+
+static int32_t net_poll(void* ctx)
+{
+    int32_t wait = NET_REACTOR_FOREVER;
+
+    uint8_t i;
+    for(i = 0; i < MAX_SESSIONS; ++i)
+    {
+        session_t* s = &sessions[i];
+        if(s->state == SESSION_OPEN && s->rx_held)
+        {
+            session_dispatch(i);
+            if(s->rx_held && CONFIG_REPL_MUX_NET_FLUSH_MS < wait) { wait = CONFIG_REPL_MUX_NET_FLUSH_MS; }
+        }
+        if(s->state == SESSION_OPEN && !s->tx_blocked)
+        {
+            int32_t t = session_send(i);
+            if(t < wait) { wait = t; }
+        }
+    }
+
+    // NET Cmd hands a client back with a wake
+    for(i = 0; i < MAX_RPC; ++i)
+    {
+        rpc_client_t* cl = &rpc_clients[i];
+        if(cl->sock < 0 || cl->busy)
+        {
+            continue;
+        }
+
+        if(cl->failed)
+        {
+            rpc_close(i);
+            continue;
+        }
+
+        rpc_dispatch(i);
+        if(cl->held && CONFIG_REPL_MUX_NET_FLUSH_MS < wait) { wait = CONFIG_REPL_MUX_NET_FLUSH_MS; }
+    }
+
+    return wait;
+}
+
+static const net_reactor_handler_t net_handler =
+{
+    .name = "repl_mux",
+    .fill = net_fill,
+    .ready = net_ready,
+    .poll = net_poll,
+};
+
+//*****************************************************************************
+// NET Cmd, runs the lines typed on the sessions and serves the RPC clients
+// the reactor hands it, one at a time. It is below the reactor so the
+// reactor goes on sending the output while a command runs.
+//*****************************************************************************
+
+// Serve every whole request client i has in, then hand it back
+static void rpc_serve(uint8_t i)
+{
+    rpc_client_t* cl = &rpc_clients[i];
+    int len;
+
+    while((len = repl_mux_rpc_frame_len(cl->rx, cl->rx_len)) && len <= cl->rx_len)
+    {
+        if(repl_mux_rpc_handle(cl->rx, len, rpc_tx, sizeof(rpc_tx), rpc_send, cl))
+        {
+            cl->failed = 1;
+            break;
+        }
+
+        memmove(cl->rx, cl->rx + len, cl->rx_len - len);
+        cl->rx_len -= len;
+    }
+
+    cl->busy = 0;
+    net_reactor_wake();
+}
+
+static void net_cmd_task(void* args)
+{
+    net_cmd_t cmd;
+
+    while(1)
+    {
+        xQueueReceive(net_cmd_q, &cmd, portMAX_DELAY);
+
+        if(cmd.rpc)
+        {
+            rpc_serve(cmd.slot);
+            continue;
+        }
+
+        // Lines of a client that went are not run for the next one
+        session_t* s = &sessions[cmd.slot];
+        if(s->state == SESSION_OPEN && s->gen == cmd.gen)
+        {
+            run_for(1 + cmd.slot, cmd.line);
+        }
+    }
+}
+
+//*****************************************************************************
+// RPC ops served by the mux, run on NET Cmd
+//*****************************************************************************
+
+static int rpc_cmd(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    char cmd[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    if(len < 1 || len > CONFIG_REPL_MUX_MAX_LOG_MSG - 1)
+    {
+        return REPL_MUX_RPC_BAD_REQ;
+    }
+
+    memcpy(cmd, body, len);
+    cmd[len] = 0;
+
+    rpc_capture_task = xTaskGetCurrentTaskHandle();
+    rpc_capture = out;
+    int ret = run(cmd);
+    rpc_capture = NULL;
+
+    repl_mux_rpc_put_i32(out, REPL_MUX_RPC_F_RET, ret);
+    return REPL_MUX_RPC_OK;
+}
+
+static int rpc_cmds(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    uint8_t i;
+    for(i = 0; i < num_cmds; ++i)
+    {
+        repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_NAME, cmd_list[i].name, strlen(cmd_list[i].name));
+        repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_DESC, cmd_list[i].desc, strlen(cmd_list[i].desc));
+    }
+
+    return REPL_MUX_RPC_OK;
+}
+
+//*****************************************************************************
+// REPL MUX Publisher
+//*****************************************************************************
+
+static esp_log_level_t token_level(char l)
+{
+    switch(l)
+    {
+        case 'E': return ESP_LOG_ERROR;
+        case 'W': return ESP_LOG_WARN;
+        case 'I': return ESP_LOG_INFO;
+        case 'D': return ESP_LOG_DEBUG;
+        default:  return ESP_LOG_VERBOSE;
+    }
+}
+
+// Text mode of a token, the line ESP_LOGx would have made
+static int token_text(char* out, const repl_mux_token_t* t, uint32_t ms, va_list args)
+{
+    const int cap = CONFIG_REPL_MUX_MAX_LOG_MSG - 1;     // Room for the \n
+    int n = snprintf(out, cap, "%c (%lu) %s: ", t->level, (unsigned long) ms, t->tag);
+    if(n < 0) { n = 0; }
+    if(n > cap - 1) { n = cap - 1; }
+
+    int r = vsnprintf(out + n, cap - n, t->fmt, args);
+    if(r > 0) { n += r; }
+    if(n > cap - 1) { n = cap - 1; }
+
+    out[n++] = '\n';
+    return n;
+}
+
+// Level of a formatted ESP_LOGx line from its letter, after the color code if
+// it has one. Lines without one, from esp_log_write, count as INFO.
+static uint8_t text_level(const char* msg, int n)
+{
+    int i = 0;
+    if(n && msg[0] == '\033')
+    {
+        while(i < n && msg[i] != 'm') { ++i; }
+        ++i;
+    }
+
+    if(i + 2 < n && msg[i+1] == ' ' && msg[i+2] == '(' && strchr("EWIDV", msg[i]))
+    {
+        return token_level(msg[i]);
+    }
+
+    return ESP_LOG_INFO;
+}
+
+// Format on the caller's stack, outside the critical section, then copy the
+// text into the ring once for all consumers. Never blocks, the RX path logs
+// through here too. The arg list is consumed exactly once.
+static int log_publisher(const char* string, va_list arg_list)
+{
+    if(!active)
+    {
+        return 0;
+    }
+
+    // Limits are checked before any formatting, a suppressed log costs a
+    // table walk and a critical section
+    const char* tag = log_tag(string, arg_list);
+    int32_t missed = tag ? tag_take(tag_find(tag)) : 0;
+    if(missed < 0)
+    {
+        return 0;
+    }
+
+    char msg[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    int n = vsnprintf(msg, sizeof(msg), string, arg_list);
+    if(n < 0) { n = 0; }
+    if(n > CONFIG_REPL_MUX_MAX_LOG_MSG - 1) { n = CONFIG_REPL_MUX_MAX_LOG_MSG - 1; }
+
+    uint8_t lvl = text_level(msg, n);
+    if(missed) { tag_note(tag, missed, lvl); }
+    ring_publish(msg, n, lvl);
+    return n;
+}
+
+//*****************************************************************************
+// API Funcs
+//*****************************************************************************
+
+void repl_mux_tlog(uint16_t id, ...)
+{
+    if(!active || id >= REPL_MUX_N_TOKENS)
+    {
+        return;
+    }
+
+    const repl_mux_token_t* t = &repl_mux_tokens[id];
+    if(esp_log_level_get(t->tag) < token_level(t->level))
+    {
+        return;
+    }
+
+    int32_t missed = tag_take(tag_find(t->tag));
+    if(missed < 0)
+    {
+        return;
+    }
+    if(missed) { tag_note(t->tag, missed, token_level(t->level)); }
+
+    char msg[CONFIG_REPL_MUX_MAX_LOG_MSG];
+    uint32_t ms = esp_log_timestamp();
+    va_list args;
+    va_start(args, id);
+    int n = tokenized ? repl_mux_token_pack((uint8_t*) msg, sizeof(msg), id, ms, args)
+                      : token_text(msg, t, ms, args);
+    va_end(args);
+
+    ring_publish(msg, n, token_level(t->level));
+}
+
+void repl_mux_set_tokenized(uint8_t on)
+{
+    tokenized = on ? 1 : 0;
+    if(tokenized)
+    {
+        REPL_MUX_LOG(TOKEN_TABLE, repl_mux_token_hash(), REPL_MUX_N_TOKENS);
+    }
+}
+
+esp_err_t repl_mux_get_stats(repl_mux_stats_t* s, uint32_t* ring_used)
+{
+    portENTER_CRITICAL(&mux);
+    uint8_t c;
+    for(c = 0; c < N_CONSUMERS; ++c)
+    {
+        if(active & (1 << c)) { skip_others(c); }
+        stats.consumer[c].lag = (active & (1 << c)) ? head_pos - cursor[c] : 0;
+        stats.consumer[c].level = level[c];
+    }
+    *s = stats;
+    if(ring_used) { *ring_used = head_pos - tail_pos; }
+    portEXIT_CRITICAL(&mux);
+
+    return ESP_OK;
+}
+
+uint8_t repl_mux_cancelled(void)
+{
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    uint8_t i;
+    for(i = 0; i < MAX_JOBS; ++i)
+    {
+        if(jobs[i].state == JOB_RUNNING && jobs[i].task == me)
+        {
+            return jobs[i].cancel;
+        }
+    }
+
+    return 0;
+}
+
+esp_err_t repl_mux_set_tag_limit(const char* tag, uint16_t rate, uint16_t burst)
+{
+    if(!tag || !*tag)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    tag_t* t = tag_find_nocache(tag);
+    if(t == &tag_other)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    portENTER_CRITICAL(&tag_mux);
+    tag_limit(t, rate, burst);
+    portEXIT_CRITICAL(&tag_mux);
+
+    return ESP_OK;
+}
+
+esp_err_t repl_mux_get_tag_stats(uint8_t i, repl_mux_tag_stats_t* s)
+{
+    if(i >= n_tags)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    tag_t* t = &tags[i];
+    portENTER_CRITICAL(&tag_mux);
+    memcpy(s->tag, t->tag, REPL_MUX_TAG_LEN);
+    s->rate = t->rate;
+    s->burst = t->burst;
+    s->passed = t->passed;
+    s->suppressed = t->suppressed;
+    portEXIT_CRITICAL(&tag_mux);
+    s->level = esp_log_level_get(s->tag);
+
+    return ESP_OK;
+}
+
+esp_err_t repl_mux_register(char* name, char* desc, cmd_func_t func)
+{
+    if(num_cmds == CONFIG_REPL_MUX_MAX_NUM_CMD)
+    {
+        ESP_LOGE(TAG, "Command Table Full");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    strncpy(cmd_list[num_cmds].name, name, CONFIG_REPL_MUX_NAME_LEN-1);
+    strncpy(cmd_list[num_cmds].desc, desc, CONFIG_REPL_MUX_DESC_LEN-1 );
+    cmd_list[num_cmds].func = func;
+    num_cmds++;
+
+    ESP_LOGI(TAG, "Command Added %s (%d/%d)", name, num_cmds, CONFIG_REPL_MUX_MAX_NUM_CMD);
+
+    return ESP_OK;
+}
+
+esp_err_t repl_mux_init(void)
+{
+    TaskHandle_t h;
+    xTaskCreate(uart_producer,
+            "UART In",
+            CONFIG_REPL_MUX_STACK_SIZE,
             NULL,
             CONFIG_REPL_MUX_CONSUMER_PRIO - 1,
             &h);
     assert(h);
 
-    xTaskCreate(net_producer,
-                "NET in",
-                CONFIG_REPL_MUX_STACK_SIZE,
-                NULL,
-                CONFIG_REPL_MUX_CONSUMER_PRIO - 1,
-                &h);
-    assert(&h);
-
     xTaskCreate(uart_consumer,
                 "UART Out", 
                 CONFIG_REPL_MUX_STACK_SIZE, 
@@ -421,19 +2023,49 @@ esp_err_t repl_mux_init(void)
                 &h);
     assert(h);
 
-    xTaskCreate(net_consumer,
-                "NET Out",
-                CONFIG_REPL_MUX_STACK_SIZE, 
-                NULL, 
-                CONFIG_REPL_MUX_CONSUMER_PRIO,
+    net_cmd_q = xQueueCreate(NET_CMD_QUEUE, sizeof(net_cmd_t));
+    assert(net_cmd_q);
+
+    xTaskCreate(net_cmd_task,
+                "NET Cmd",
+                CONFIG_REPL_MUX_NET_CMD_STACK_SIZE,
+                NULL,
+                CONFIG_REPL_MUX_NET_CMD_PRIO,
                 &h);
     assert(h);
 
+    // This is considered early init. If it fails blow everything up
+    listen_sock = create_listening_socket(CONFIG_REPL_MUX_PORT, MAX_SESSIONS);
+    assert(listen_sock > -1);
+    rpc_sock = create_listening_socket(CONFIG_REPL_MUX_RPC_PORT, MAX_RPC);
+    assert(rpc_sock > -1);
+
+    uint8_t i;
+    for(i = 0; i < MAX_RPC; ++i)
+    {
+        rpc_clients[i].sock = -1;
+    }
+    ESP_ERROR_CHECK(net_reactor_add(&net_handler));
 
-    
     esp_log_set_vprintf(log_publisher);
 
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_CMD, rpc_cmd);
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_CMDS, rpc_cmds);
+
     ESP_ERROR_CHECK(repl_mux_register("help", "print desc of each cmd", &do_help));
+    ESP_ERROR_CHECK(repl_mux_register("bg", "run a command as a job, the REPL stays free. bg <cmd> [<args>]", &do_bg));
+    ESP_ERROR_CHECK(repl_mux_register("jobs", "list jobs with their run time and least stack left", &do_jobs));
+    ESP_ERROR_CHECK(repl_mux_register("wait", "wait for a job to finish. wait <id> [<max s>]", &do_wait));
+    ESP_ERROR_CHECK(repl_mux_register("kill", "ask a job to stop. kill <id>", &do_kill));
+    ESP_ERROR_CHECK(repl_mux_register("mux_stats", "log ring use and messages sent / dropped per medium", &do_mux_stats));
+    ESP_ERROR_CHECK(repl_mux_register("log_sub", "system log level this session takes. log_sub [N|E|W|I|D|V]", &do_log_sub));
+    ESP_ERROR_CHECK(repl_mux_register("log_tag", "tag level and rate. log_tag [<tag> <lvl|-> [<per s> [<burst>]]]", &do_log_tag));
+    ESP_ERROR_CHECK(repl_mux_register("tlog", "tokenized hot path logs, see host/log_decode. tlog [on|off]", &do_tlog));
+
+    if(tokenized)
+    {
+        REPL_MUX_LOG(TOKEN_TABLE, repl_mux_token_hash(), REPL_MUX_N_TOKENS);
+    }
 
     return ESP_OK;
 }
\ No newline at end of file
@@ -1,12 +1,12 @@
 #pragma once
 
 // The repl mux overwrites the base logging function such that when ever any
-// component logs our function gets called instead. We then copy each log 
-// message to a queue to be sent out on different mediums. The two mediums we
+// component logs our function gets called instead. We format each log message
+// once into a shared ring to be sent out on different mediums. The mediums we
 // support at the moment are:
 //
 //    * UART
-//    * Wifi / TCP
+//    * Wifi / TCP, up to CONFIG_REPL_MUX_MAX_SESSIONS clients at once
 //
 // Each medium also has an input handler that reads input. The input is
 // compared to a table of registered commands. If the input matches then the
@@ -16,33 +16,115 @@
 // The flow looks something like this)
 //
 //                                              
-//             esp_log_set_vprintf
-//                    |                     
-//                    |                 |-------|    |--------------|
-//                    V            |--->| Net Q |--->| Net Consumer |--> Sock Send
-//             |---------------|---|    |-------|    |--------------|
-// ESP_LOG --->| log_publisher |
-//             |---------------|---|    |--------|    |---------------|
-//                                 |--->| UART Q |--->| UART Consumer |--> Printf
-//                                      |--------|    |---------------|
-//
-// 
+//             esp_log_set_vprintf                 cursor per session
+//                    |                       |----------------------->| Reactor |--> Session 0..N
+//                    V                       |                        |---------|    sends
+//             |---------------|  vsnprintf  |----------|
+// ESP_LOG --->| log_publisher |------------>| Log Ring |
+//             |---------------|    once     |----------|
+//                                            |              |---------------|
+//                                            |- uart cursor>| UART Consumer |--> stdout
+//                                                           |---------------|
+//
+// Log Ring) CONFIG_REPL_MUX_RING_SIZE bytes of variable length records, a
+//           small header and the text, back to back. A record carries a bit
+//           for each consumer it goes to and each consumer clears its bit
+//           once it copied the text out. The record is freed when the last
+//           bit goes. A session that is not connected is not in the mask so
+//           it holds nothing.
+//
+// Routing) Logs made by the task running a command, while it runs, only go
+//          to the consumer the command was typed on, so a command typed on a
+//          session does not flood the UART or the other sessions. Every
+//          other log goes to each consumer whose level takes it, set per
+//          consumer with log_sub (default V, everything).
+//
+// Non blocking) log_publisher formats on the caller's stack and only holds a
+//               critical section to copy the text in, it never waits. Logs
+//               from the promiscuous RX cb add no latency to the packet path.
+//               When the ring is full the oldest records are pushed out from
+//               under the consumer furthest behind, so a slow session only
+//               loses its own backlog and never holds up the others or the
+//               UART. Once a consumer has caught up it sends "N messages
+//               dropped" in place of what it missed. See mux_stats.
+//
+// Sessions) The mux's sockets are served by the net reactor (see
+//           net_reactor.h) next to the file server's. The reactor accepts
+//           clients and reads whole lines from each into its own input
+//           buffer, and queues them for NET Cmd, a task below the reactor
+//           that runs them one at a time. It copies each session's logs into
+//           its own MSS sized buffer and sends it, without blocking, when it
+//           is full or its oldest line waited CONFIG_REPL_MUX_NET_FLUSH_MS. A
+//           big dump goes out in full segments, a session whose socket is
+//           full keeps its buffer until select says it is writable while the
+//           others go on. The reactor is not woken by a log, it looks at the
+//           ring every CONFIG_REPL_MUX_NET_FLUSH_MS while a session is open.
+//           A command writing to a session more than half the ring ahead of
+//           what was sent is held, and wakes the reactor, until the session
+//           caught up, so a long listing is not pushed out of the ring by
+//           its own tail. A client that takes nothing for 2 s is not waited
+//           on again until it caught up.
+//
 // |------------|
-// | Net Input  |---|
+// | NET Cmd    |---|
 // |------------|   |
 //                  |---> Command Table Look Up ---> Parse args ---> cmd(argc, argv)
-// |------------|   |
-// | UART Input |---|
-// |------------|
+// |------------|   |                                    |
+// | UART Input |---|                                    | bg
+// |------------|                                        V
+//                                                 |-----------|
+//                                                 | Job task  |---> cmd(argc, argv)
+//                                                 |-----------|
+//
+// RPC) Tools talk to CONFIG_REPL_MUX_RPC_PORT instead of scraping the text
+//      REPL. The reactor reads it next to the sessions and NET Cmd serves
+//      the requests, a request frame is a command line to run or a query,
+//      the response is typed fields. The output of a command run over RPC
+//      goes in its response and nowhere else. See repl_mux_rpc.h and
+//      host/rpc.
+//
+// Jobs) A command runs on the input task it was typed on, UART In or NET
+//       Cmd, so a long one holds up that medium, over TCP every session and
+//       RPC client. "bg <cmd>" runs it on a task of its own instead, up to
+//       CONFIG_REPL_MUX_MAX_JOBS at once, and its output still goes back to
+//       the medium it was typed on. jobs lists them with their run time
+//       and the least stack they had left, wait blocks until one finishes and
+//       kill asks one to stop. Stopping is cooperative, a command that loops
+//       checks repl_mux_cancelled and returns early.
+//
+// Tag limits) log_publisher reads the tag of an ESP_LOGx call out of its args
+//             and checks it against a per tag token bucket before any
+//             formatting, so a tag that fires thousands of times a second
+//             costs little more than the table walk and only gets its own
+//             lines dropped. Every tag starts at CONFIG_REPL_MUX_TAG_RATE per
+//             second with bursts of CONFIG_REPL_MUX_TAG_BURST. The first
+//             line let through after some were suppressed comes after a note
+//             of how many. Levels per tag are set with esp_log_level_set, which
+//             ESP-IDF checks before the call reaches us. See log_tag.
+//
+// Tokenized logs) Hot paths log with REPL_MUX_LOG and a row of the token
+//                 table instead of ESP_LOGx. With tlog on, or
+//                 CONFIG_REPL_MUX_TOKENIZED, only the id and the raw args go
+//                 in the ring and host/log_decode makes the text, see
+//                 repl_mux_token.h. With it off the same line ESP_LOGx would
+//                 print is formatted on the device.
 //
 // **NOTE**
 //    - printf only sends traffic over UART
 //    - ESP_LOGE, etc adds debug level, tag and time stamp and will send 
 //      through the REPL MUX
 //    - use esp_log_write for generic log messages that go through the mux
-//      without adding all the extra stuff
+//      without adding all the extra stuff, they are not rate limited
+//    - a job runs alongside whatever else is typed, commands that share state
+//      should not be run as jobs next to each other
+//    - tags are told apart by their text. The tag pointer of a log call that
+//      once matched is taken to keep pointing at the same text, so only
+//      static tags are cached, a tag given to repl_mux_set_tag_limit or
+//      log_tag is always compared by its text
 
 #include "esp_err.h"
+#include "repl_mux_token.h"
+#include "repl_mux_rpc.h"
 
 typedef int (*cmd_func_t)(int argc, char**argv);
 
@@ -55,18 +137,112 @@ typedef struct
 } cmd_t;
 
 //*****************************************************************************
-// repl_mux_init) Create Qs for the UART and wifi mediums. Launch the consumer
-//                tasks that push log messages over the UART and wifi mediums.
-//                We overwrite the base logging function. The consumer tasks
-//                are responible for initing the medium they wish to talk over.
+// repl_mux_init) Launch the UART tasks and hand the wifi medium to the net
+//                reactor, which must be running (net_reactor_init).
+//                We overwrite the base logging function. The UART tasks
+//                are responible for initing the medium they talk over.
 //
 // Returns) always ESP_OK or it crashes the system
 //*****************************************************************************
 esp_err_t repl_mux_init(void);
 
 
+#define REPL_MUX_N_CONSUMERS (1 + CONFIG_REPL_MUX_MAX_SESSIONS)     // UART, then the sessions
+
+typedef struct
+{
+    uint8_t active;
+    uint8_t level;                  // esp_log_level_t of system logs taken
+    char name[16];                  // "uart" or the client IP
+    uint32_t msgs;                  // Messages sent
+    uint32_t dropped;               // Messages pushed out before they were sent
+    uint32_t sends;                 // Writes to the medium, a batch of msgs on net
+    uint64_t bytes;
+    uint32_t lag;                   // Ring bytes not sent yet
+    uint32_t lag_peak;
+} repl_mux_consumer_stats_t;
+
+typedef struct
+{
+    uint32_t published;             // Messages put in the ring
+    uint32_t dropped;               // Messages pushed out before every consumer sent them
+    uint32_t ring_peak;             // Most ring bytes in use
+    repl_mux_consumer_stats_t consumer[REPL_MUX_N_CONSUMERS];
+} repl_mux_stats_t;
+
+#define REPL_MUX_TAG_LEN 24                 // Longer tags are told apart by this much
+
+typedef struct
+{
+    char tag[REPL_MUX_TAG_LEN];
+    uint8_t level;                  // esp_log_level_get of the tag
+    uint16_t rate;                  // Messages per second let through, 0 no limit
+    uint16_t burst;                 // Messages let through back to back
+    uint32_t passed;
+    uint32_t suppressed;
+} repl_mux_tag_stats_t;
+
 //*****************************************************************************
 // repl_mux_register)  
 //
 //*****************************************************************************
-esp_err_t repl_mux_register(char* name, char* desc, cmd_func_t func);
\ No newline at end of file
+esp_err_t repl_mux_register(char* name, char* desc, cmd_func_t func);
+
+//*****************************************************************************
+// REPL_MUX_LOG) Log a row of the token table, i.e.
+//
+//                   REPL_MUX_LOG(EAPOL_MSG, ssid, 2, len);
+//
+//               The level of the row is checked against the level of its tag
+//               as ESP_LOGx does.
+//*****************************************************************************
+#define REPL_MUX_LOG(name, ...) repl_mux_tlog(REPL_MUX_TOK_##name, ##__VA_ARGS__)
+
+void repl_mux_tlog(uint16_t id, ...);
+
+//*****************************************************************************
+// repl_mux_set_tokenized) Send REPL_MUX_LOGs as tokens (1) or as text (0).
+//                         Turning it on logs the table hash for the decoder.
+//*****************************************************************************
+void repl_mux_set_tokenized(uint8_t on);
+
+//*****************************************************************************
+// repl_mux_get_stats) Copy out the stats.
+//
+// stats) Out param.
+// ring_used) Out param, bytes of the log ring in use. May be NULL.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t repl_mux_get_stats(repl_mux_stats_t* stats, uint32_t* ring_used);
+
+//*****************************************************************************
+// repl_mux_cancelled) For commands that run for a while. Returns 1 once kill
+//                     was called on the job running the calling task, the
+//                     command should then clean up and return. Always 0
+//                     outside of a job.
+//*****************************************************************************
+uint8_t repl_mux_cancelled(void);
+
+//*****************************************************************************
+// repl_mux_set_tag_limit) Rate limit the logs of a tag, ESP_LOGx and
+//                         REPL_MUX_LOG alike. Adds the tag to the table if
+//                         it has not logged yet.
+//
+// tag) i.e. "EAPOL LOGGER". Compared by its text, the buffer may be reused.
+// rate) Messages per second let through, 0 for no limit.
+// burst) Messages let through back to back, at least 1.
+//
+// Returns) ESP_OK, INVALID_ARG if tag is NULL or empty, NO_MEM if the tag
+//          table is full.
+//*****************************************************************************
+esp_err_t repl_mux_set_tag_limit(const char* tag, uint16_t rate, uint16_t burst);
+
+//*****************************************************************************
+// repl_mux_get_tag_stats) Copy out the limit and counters of the i'th tag,
+//                         in the order they were first seen. Iterate from 0
+//                         until NOT_FOUND.
+//
+// Returns) ESP_OK, NOT_FOUND past the end.
+//*****************************************************************************
+esp_err_t repl_mux_get_tag_stats(uint8_t i, repl_mux_tag_stats_t* stats);
@@ -0,0 +1,234 @@
+#include <string.h>
+
+#include "repl_mux_rpc.h"
+
+#define MAX_FIELD 255
+
+static int do_ping(const uint8_t* body, int len, repl_mux_rpc_out_t* out);
+
+static repl_mux_rpc_handler_t handlers[REPL_MUX_RPC_N_OPS] =
+{
+    [REPL_MUX_RPC_OP_PING] = do_ping,
+};
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t kind;
+    const char* name;
+} field_t;
+
+#define REPL_MUX_RPC_FIELD_ROW(name, id, kind) { id, kind, #name },
+static const field_t fields[] =
+{
+    REPL_MUX_RPC_FIELDS(REPL_MUX_RPC_FIELD_ROW)
+};
+#undef REPL_MUX_RPC_FIELD_ROW
+
+//*****************************************************************************
+// Frames
+//*****************************************************************************
+
+static void put_u16(uint8_t* b, uint16_t v)
+{
+    b[0] = v; b[1] = v >> 8;
+}
+
+static uint16_t get_u16(const uint8_t* b)
+{
+    return b[0] | (b[1] << 8);
+}
+
+// Send what is in out as one frame
+static int flush(repl_mux_rpc_out_t* out, uint8_t status)
+{
+    put_u16(out->buf, out->len - 2);
+    put_u16(out->buf + 2, out->id);
+    out->buf[4] = out->op;
+    out->buf[5] = status;
+
+    if(!out->err && out->send(out->ctx, out->buf, out->len))
+    {
+        out->err = 1;
+    }
+
+    out->len = REPL_MUX_RPC_HDR;
+    return out->err ? -1 : 0;
+}
+
+static int do_ping(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_TEXT, (const char*) body, len);
+    return REPL_MUX_RPC_OK;
+}
+
+//*****************************************************************************
+// API Funcs
+//*****************************************************************************
+
+int repl_mux_rpc_register(uint8_t op, repl_mux_rpc_handler_t handler)
+{
+    if(op >= REPL_MUX_RPC_N_OPS)
+    {
+        return -1;
+    }
+
+    handlers[op] = handler;
+    return 0;
+}
+
+int repl_mux_rpc_frame_len(const uint8_t* buf, int have)
+{
+    if(have < 2)
+    {
+        return 0;
+    }
+
+    return get_u16(buf) + 2;
+}
+
+int repl_mux_rpc_handle(const uint8_t* frame,
+                        int len,
+                        uint8_t* buf,
+                        int cap,
+                        repl_mux_rpc_send_t send,
+                        void* ctx)
+{
+    repl_mux_rpc_out_t out =
+    {
+        .buf = buf,
+        .cap = cap,
+        .len = REPL_MUX_RPC_HDR,
+        .send = send,
+        .ctx = ctx,
+    };
+
+    if(len < REPL_MUX_RPC_HDR)
+    {
+        return flush(&out, REPL_MUX_RPC_BAD_REQ);
+    }
+
+    out.id = get_u16(frame + 2);
+    out.op = frame[4];
+
+    int status = REPL_MUX_RPC_BAD_OP;
+    if(out.op < REPL_MUX_RPC_N_OPS && handlers[out.op])
+    {
+        status = handlers[out.op](frame + REPL_MUX_RPC_HDR, len - REPL_MUX_RPC_HDR, &out);
+    }
+
+    return flush(&out, status);
+}
+
+int repl_mux_rpc_put(repl_mux_rpc_out_t* out, uint8_t type, const void* val, int len)
+{
+    if(len > MAX_FIELD) { len = MAX_FIELD; }
+    if(out->len + 2 + len > out->cap && flush(out, REPL_MUX_RPC_MORE))
+    {
+        return -1;
+    }
+
+    out->buf[out->len] = type;
+    out->buf[out->len + 1] = len;
+    if(len) { memcpy(out->buf + out->len + 2, val, len); }
+    out->len += 2 + len;
+
+    return out->err ? -1 : 0;
+}
+
+int repl_mux_rpc_put_u8(repl_mux_rpc_out_t* out, uint8_t type, uint8_t v)
+{
+    return repl_mux_rpc_put(out, type, &v, 1);
+}
+
+int repl_mux_rpc_put_u32(repl_mux_rpc_out_t* out, uint8_t type, uint32_t v)
+{
+    uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+    return repl_mux_rpc_put(out, type, b, 4);
+}
+
+int repl_mux_rpc_put_u64(repl_mux_rpc_out_t* out, uint8_t type, uint64_t v)
+{
+    uint8_t b[8];
+    uint8_t i;
+    for(i = 0; i < 8; ++i) { b[i] = v >> (8 * i); }
+    return repl_mux_rpc_put(out, type, b, 8);
+}
+
+int repl_mux_rpc_put_i32(repl_mux_rpc_out_t* out, uint8_t type, int32_t v)
+{
+    return repl_mux_rpc_put_u32(out, type, (uint32_t) v);
+}
+
+int repl_mux_rpc_put_text(repl_mux_rpc_out_t* out, uint8_t type, const char* s, int len)
+{
+    do
+    {
+        int n = (len > MAX_FIELD) ? MAX_FIELD : len;
+        if(repl_mux_rpc_put(out, type, s, n)) { return -1; }
+        s += n;
+        len -= n;
+    } while(len > 0);
+
+    return 0;
+}
+
+int repl_mux_rpc_next(const uint8_t** p,
+                      const uint8_t* end,
+                      uint8_t* type,
+                      const uint8_t** val,
+                      uint8_t* len)
+{
+    const uint8_t* f = *p;
+    if(f >= end)
+    {
+        return 0;
+    }
+
+    if(end - f < 2 || end - f < 2 + f[1])
+    {
+        return -1;
+    }
+
+    *type = f[0];
+    *len = f[1];
+    *val = f + 2;
+    *p = f + 2 + f[1];
+    return 1;
+}
+
+uint64_t repl_mux_rpc_uint(const uint8_t* val, uint8_t len)
+{
+    uint64_t v = 0;
+    uint8_t i;
+    for(i = 0; i < len && i < 8; ++i)
+    {
+        v |= (uint64_t) val[i] << (8 * i);
+    }
+    return v;
+}
+
+int64_t repl_mux_rpc_int(const uint8_t* val, uint8_t len)
+{
+    uint64_t v = repl_mux_rpc_uint(val, len);
+    if(len && len < 8 && (val[len - 1] & 0x80))
+    {
+        v |= ~0ull << (8 * len);
+    }
+    return (int64_t) v;
+}
+
+const char* repl_mux_rpc_field_name(uint8_t type, uint8_t* kind)
+{
+    uint8_t i;
+    for(i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        if(fields[i].id == type)
+        {
+            if(kind) { *kind = fields[i].kind; }
+            return fields[i].name;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,203 @@
+//*****************************************************************************
+// REPL MUX RPC. A binary request / response channel for tools, next to the
+// text REPL. A tool sends one frame per call and gets back typed fields
+// instead of scraping log lines, so a dump of the MAC logger is one response
+// rather than hundreds of lines. This file and repl_mux_rpc.c are plain C so
+// the host client (host/rpc_client.h) builds from the exact same source:
+//
+//                  |--------------|  frame   |--------|  handler  |---------|
+// host/rpc ------->| RPC port,    |--------->| Disp-  |---------->| op's    |
+//          <-------| NET Cmd task |<---------| atch   |<----------| handler |
+//                  |--------------|  frames  |--------|  fields   |---------|
+//
+// Frame) Every request and response is one frame, little endian:
+//
+//        | len (16) | id (16) | op | status | body ...            |
+//                   |<----------- len bytes ------------------->|
+//
+//        The client picks the id and the device echoes it and the op. The
+//        status of a request is 0.
+//
+// Body) A request body is per op, i.e. the command line of CMD. A response
+//       body is a list of fields, | type | len | value |, values little
+//       endian. Integers come at their natural size, the reader takes any
+//       len of 1 to 8. A field list too big for one frame is sent as several,
+//       all but the last with status MORE, and the reader joins them.
+//
+// Ops) PING, CMD and CMDS are served by repl_mux. The query ops are served by
+//      whoever registers them with repl_mux_rpc_register, main does SNIFF and
+//      APS. An op nobody registered gets BAD_OP.
+//
+// Fields) Listed in REPL_MUX_RPC_FIELDS with the kind of their value so a
+//         client can print any response. An AP field starts a group, the
+//         fields after it up to the next AP belong to that AP.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#define REPL_MUX_RPC_HDR 6                  // len, id, op and status
+#define REPL_MUX_RPC_MAX_FRAME (0xffff + 2)
+
+typedef enum
+{
+    REPL_MUX_RPC_OP_PING,                   // Body echoed back as a TEXT field
+    REPL_MUX_RPC_OP_CMD,                    // Run a command line, TEXT of its output then RET
+    REPL_MUX_RPC_OP_CMDS,                   // NAME and DESC of each command
+    REPL_MUX_RPC_OP_SNIFF,                  // Packet sniffer counters
+    REPL_MUX_RPC_OP_APS,                    // MAC logger table, an AP group per AP
+    REPL_MUX_RPC_N_OPS
+} repl_mux_rpc_op_t;
+
+typedef enum
+{
+    REPL_MUX_RPC_OK,
+    REPL_MUX_RPC_MORE,                      // More frames of this response follow
+    REPL_MUX_RPC_BAD_OP,
+    REPL_MUX_RPC_BAD_REQ,                   // Body not valid for the op
+    REPL_MUX_RPC_FAIL,                      // The handler could not do it
+} repl_mux_rpc_status_t;
+
+typedef enum
+{
+    REPL_MUX_RPC_K_TEXT,
+    REPL_MUX_RPC_K_UINT,
+    REPL_MUX_RPC_K_INT,
+    REPL_MUX_RPC_K_HEX,                     // Unsigned, shown in hex
+    REPL_MUX_RPC_K_MAC,                     // 6 bytes
+    REPL_MUX_RPC_K_U64S,                    // Array of 8 byte counters
+    REPL_MUX_RPC_K_STA,                     // 6 byte MAC and signed RSSI
+} repl_mux_rpc_kind_t;
+
+// X(name, id, kind)
+#define REPL_MUX_RPC_FIELDS(X) \
+    X(TEXT,             1,  REPL_MUX_RPC_K_TEXT) \
+    X(RET,              2,  REPL_MUX_RPC_K_INT)  \
+    X(NAME,             3,  REPL_MUX_RPC_K_TEXT) \
+    X(DESC,             4,  REPL_MUX_RPC_K_TEXT) \
+    X(PKTS,             16, REPL_MUX_RPC_K_UINT) \
+    X(DATA_PKTS,        17, REPL_MUX_RPC_K_UINT) \
+    X(MGMT_PKTS,        18, REPL_MUX_RPC_K_UINT) \
+    X(DATA_SUBTYPES,    19, REPL_MUX_RPC_K_U64S) \
+    X(MGMT_SUBTYPES,    20, REPL_MUX_RPC_K_U64S) \
+    X(SNIFF_SECS,       21, REPL_MUX_RPC_K_UINT) \
+    X(SNIFF_RUNNING,    22, REPL_MUX_RPC_K_UINT) \
+    X(AP,               32, REPL_MUX_RPC_K_UINT) \
+    X(SSID,             33, REPL_MUX_RPC_K_TEXT) \
+    X(BSSID,            34, REPL_MUX_RPC_K_MAC)  \
+    X(CHANNEL,          35, REPL_MUX_RPC_K_UINT) \
+    X(RSSI,             36, REPL_MUX_RPC_K_INT)  \
+    X(GROUP_CIPHER,     37, REPL_MUX_RPC_K_HEX)  \
+    X(PAIRWISE_CIPHER,  38, REPL_MUX_RPC_K_HEX)  \
+    X(AKM,              39, REPL_MUX_RPC_K_HEX)  \
+    X(PMF,              40, REPL_MUX_RPC_K_HEX)  \
+    X(STA,              41, REPL_MUX_RPC_K_STA)
+
+#define REPL_MUX_RPC_FIELD_ENUM(name, id, kind) REPL_MUX_RPC_F_##name = id,
+typedef enum
+{
+    REPL_MUX_RPC_FIELDS(REPL_MUX_RPC_FIELD_ENUM)
+} repl_mux_rpc_field_t;
+#undef REPL_MUX_RPC_FIELD_ENUM
+
+// Sends a whole frame. Returns 0, or -1 if the peer is gone.
+typedef int (*repl_mux_rpc_send_t)(void* ctx, const uint8_t* frame, int len);
+
+// Field writer of one response. The handler only adds fields, the frames are
+// cut and sent for it.
+typedef struct
+{
+    uint8_t* buf;
+    int cap;                        // Bytes of buf, the most one frame takes
+    int len;                        // Bytes of the frame being built
+    uint16_t id;
+    uint8_t op;
+    repl_mux_rpc_send_t send;
+    void* ctx;
+    int err;                        // A send failed, the rest is dropped
+} repl_mux_rpc_out_t;
+
+// Serves one op. body is the request body. Returns a repl_mux_rpc_status_t.
+typedef int (*repl_mux_rpc_handler_t)(const uint8_t* body, int len, repl_mux_rpc_out_t* out);
+
+//*****************************************************************************
+// repl_mux_rpc_register) Serve op with handler, replacing any it had. PING
+//                        is served from the start.
+//
+// Returns) 0, -1 if op is out of range.
+//*****************************************************************************
+int repl_mux_rpc_register(uint8_t op, repl_mux_rpc_handler_t handler);
+
+//*****************************************************************************
+// repl_mux_rpc_frame_len) Length of the frame at the start of buf.
+//
+// have) Bytes in buf.
+//
+// Returns) Frame length once the header is in, 0 before. Bigger than have
+//          while the body is still coming.
+//*****************************************************************************
+int repl_mux_rpc_frame_len(const uint8_t* buf, int have);
+
+//*****************************************************************************
+// repl_mux_rpc_handle) Run the handler of a request frame and send its
+//                      response, in as many frames as it takes.
+//
+// frame) The whole request.
+// len) Its repl_mux_rpc_frame_len.
+// buf) Response frames are built here.
+// cap) Bytes of buf, at least REPL_MUX_RPC_HDR + 2 + 255.
+// send) Sends each response frame.
+//
+// Returns) 0, -1 if a send failed.
+//*****************************************************************************
+int repl_mux_rpc_handle(const uint8_t* frame,
+                        int len,
+                        uint8_t* buf,
+                        int cap,
+                        repl_mux_rpc_send_t send,
+                        void* ctx);
+
+//*****************************************************************************
+// repl_mux_rpc_put) Add a field to a response. Values over 255 bytes are cut.
+//
+// Returns) 0, -1 if a send failed.
+//*****************************************************************************
+int repl_mux_rpc_put(repl_mux_rpc_out_t* out, uint8_t type, const void* val, int len);
+
+// Integers at their natural size, little endian
+int repl_mux_rpc_put_u8(repl_mux_rpc_out_t* out, uint8_t type, uint8_t v);
+int repl_mux_rpc_put_u32(repl_mux_rpc_out_t* out, uint8_t type, uint32_t v);
+int repl_mux_rpc_put_u64(repl_mux_rpc_out_t* out, uint8_t type, uint64_t v);
+int repl_mux_rpc_put_i32(repl_mux_rpc_out_t* out, uint8_t type, int32_t v);
+
+//*****************************************************************************
+// repl_mux_rpc_put_text) Add text as fields of type, 255 bytes a field. A
+//                        reader joins fields of the same type back together.
+//
+// Returns) 0, -1 if a send failed.
+//*****************************************************************************
+int repl_mux_rpc_put_text(repl_mux_rpc_out_t* out, uint8_t type, const char* s, int len);
+
+//*****************************************************************************
+// repl_mux_rpc_next) Walk the fields of a response body.
+//
+// p) Cursor, start of the body at first, moved past the field.
+// end) End of the body.
+// type, val, len) Out params, the field.
+//
+// Returns) 1 with a field, 0 at the end, -1 if the body is cut short.
+//*****************************************************************************
+int repl_mux_rpc_next(const uint8_t** p,
+                      const uint8_t* end,
+                      uint8_t* type,
+                      const uint8_t** val,
+                      uint8_t* len);
+
+// Value of an integer field of 1 to 8 bytes
+uint64_t repl_mux_rpc_uint(const uint8_t* val, uint8_t len);
+int64_t repl_mux_rpc_int(const uint8_t* val, uint8_t len);
+
+//*****************************************************************************
+// repl_mux_rpc_field_name) Name and kind of a field type, NULL if unknown.
+//*****************************************************************************
+const char* repl_mux_rpc_field_name(uint8_t type, uint8_t* kind);
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "repl_mux_token.h"
+
+#define REPL_MUX_TOKEN_ROW(name, level, tag, fmt) { level, tag, fmt },
+const repl_mux_token_t repl_mux_tokens[REPL_MUX_N_TOKENS] =
+{
+    REPL_MUX_TOKENS(REPL_MUX_TOKEN_ROW)
+};
+#undef REPL_MUX_TOKEN_ROW
+
+#define MAX_FRAME (255 + 2)
+#define MAX_SPEC 24
+
+typedef enum
+{
+    ARG_INT,                        // 4 bytes
+    ARG_INT64,                      // 8 bytes
+    ARG_DOUBLE,                     // 8 bytes
+    ARG_STR,                        // Length byte and chars
+    ARG_PTR,                        // 4 bytes
+} arg_kind_t;
+
+typedef struct
+{
+    arg_kind_t kind;
+    const char* start;              // The '%'
+    const char* mod;                // Length modifier, after flags, width, prec
+    uint8_t mod_len;
+    char conv;
+} conv_t;
+
+//*****************************************************************************
+// Format walking, shared by pack and format so both agree on the args
+//*****************************************************************************
+
+// Find the next conversion at or after *p and move *p past it. "%%" is
+// skipped as text. Returns 0 at the end of the format or at a conversion we
+// do not handle, the args stop there.
+static int next_conv(const char** p, conv_t* c)
+{
+    const char* s = *p;
+    while(1)
+    {
+        s = strchr(s, '%');
+        if(!s) { return 0; }
+        if(s[1] != '%') { break; }
+        s += 2;
+    }
+
+    c->start = s++;
+    while(*s && strchr("-+ #0", *s)) { ++s; }
+    while(*s >= '0' && *s <= '9') { ++s; }
+    if(*s == '.')
+    {
+        ++s;
+        while(*s >= '0' && *s <= '9') { ++s; }
+    }
+
+    c->mod = s;
+    while(*s && strchr("hljztL", *s)) { ++s; }
+    c->mod_len = s - c->mod;
+    c->conv = *s;
+
+    switch(c->conv)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            c->kind = ((c->mod_len == 2 && c->mod[0] == 'l') || (c->mod_len && c->mod[0] == 'j'))
+                      ? ARG_INT64 : ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            c->kind = ARG_DOUBLE;
+            break;
+        case 's':
+            c->kind = ARG_STR;
+            break;
+        case 'p':
+            c->kind = ARG_PTR;
+            break;
+        default:
+            return 0;
+    }
+
+    *p = s + 1;
+    return 1;
+}
+
+static void put_u32(uint8_t* b, uint32_t v)
+{
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t* b)
+{
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t* b)
+{
+    return get_u32(b) | ((uint64_t) get_u32(b + 4) << 32);
+}
+
+// Pull an integer arg of the size its length modifier says
+static uint64_t arg_int(const conv_t* c, va_list* args)
+{
+    if(c->kind == ARG_INT64) { return va_arg(*args, long long); }
+    if(c->mod_len == 1 && c->mod[0] == 'l') { return va_arg(*args, long); }
+    if(c->mod_len == 1 && c->mod[0] == 'z') { return va_arg(*args, size_t); }
+    if(c->mod_len == 1 && c->mod[0] == 't') { return va_arg(*args, ptrdiff_t); }
+    return va_arg(*args, int);
+}
+
+//*****************************************************************************
+// Text helpers, n never passes cap - 1 so out stays NULL terminated
+//*****************************************************************************
+
+static int append(char* out, int cap, int n, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int r = vsnprintf(out + n, cap - n, fmt, args);
+    va_end(args);
+
+    if(r < 0) { return n; }
+    return (n + r < cap) ? n + r : cap - 1;
+}
+
+// Literal text of the format from s to e, "%%" prints one '%'
+static int append_text(char* out, int cap, int n, const char* s, const char* e)
+{
+    while(s < e && n < cap - 1)
+    {
+        out[n++] = *s;
+        s += (s[0] == '%' && s[1] == '%') ? 2 : 1;
+    }
+    out[n] = 0;
+    return n;
+}
+
+//*****************************************************************************
+// API Funcs
+//*****************************************************************************
+
+uint32_t repl_mux_token_hash(void)
+{
+    uint32_t h = 2166136261u;
+    uint16_t i;
+    for(i = 0; i < REPL_MUX_N_TOKENS; ++i)
+    {
+        const repl_mux_token_t* t = &repl_mux_tokens[i];
+        const char* parts[2] = { t->tag, t->fmt };
+        h = (h ^ (uint8_t) t->level) * 16777619u;
+
+        uint8_t j;
+        for(j = 0; j < 2; ++j)
+        {
+            const char* s = parts[j];
+            do { h = (h ^ (uint8_t) *s) * 16777619u; } while(*s++);
+        }
+    }
+
+    return h;
+}
+
+int repl_mux_token_pack(uint8_t* out, int cap, uint16_t id, uint32_t ms, va_list args)
+{
+    if(id >= REPL_MUX_N_TOKENS || cap < REPL_MUX_TOKEN_HDR)
+    {
+        return 0;
+    }
+    if(cap > MAX_FRAME) { cap = MAX_FRAME; }
+
+    va_list ap;
+    va_copy(ap, args);
+
+    int n = REPL_MUX_TOKEN_HDR;
+    const char* p = repl_mux_tokens[id].fmt;
+    conv_t c;
+    while(next_conv(&p, &c))
+    {
+        if(c.kind == ARG_INT || c.kind == ARG_PTR)
+        {
+            uint32_t v = (c.kind == ARG_PTR) ? (uint32_t) (uintptr_t) va_arg(ap, void*)
+                                             : (uint32_t) arg_int(&c, &ap);
+            if(n + 4 > cap) { break; }
+            put_u32(out + n, v);
+            n += 4;
+        }
+        else if(c.kind == ARG_INT64 || c.kind == ARG_DOUBLE)
+        {
+            uint64_t v;
+            if(c.kind == ARG_DOUBLE)
+            {
+                double d = va_arg(ap, double);
+                memcpy(&v, &d, 8);
+            }
+            else
+            {
+                v = arg_int(&c, &ap);
+            }
+
+            if(n + 8 > cap) { break; }
+            put_u32(out + n, v);
+            put_u32(out + n + 4, v >> 32);
+            n += 8;
+        }
+        else
+        {
+            const char* s = va_arg(ap, const char*);
+            if(!s) { s = "(null)"; }
+
+            uint8_t l = 0;
+            while(l < REPL_MUX_TOKEN_MAX_STR && s[l]) { ++l; }
+            if(n + 1 + l > cap) { break; }
+            out[n] = l;
+            memcpy(out + n + 1, s, l);
+            n += 1 + l;
+        }
+    }
+    va_end(ap);
+
+    out[0] = REPL_MUX_TOKEN_MARK;
+    out[1] = n - 2;
+    out[2] = id;
+    out[3] = id >> 8;
+    put_u32(out + 4, ms);
+
+    return n;
+}
+
+int repl_mux_token_format(char* out, int cap, const uint8_t* frame, int len)
+{
+    if(cap < 1 || len < REPL_MUX_TOKEN_HDR || frame[0] != REPL_MUX_TOKEN_MARK || frame[1] + 2 != len)
+    {
+        return -1;
+    }
+
+    uint16_t id = frame[2] | (frame[3] << 8);
+    if(id >= REPL_MUX_N_TOKENS)
+    {
+        return -1;
+    }
+
+    const repl_mux_token_t* t = &repl_mux_tokens[id];
+    const uint8_t* a = frame + REPL_MUX_TOKEN_HDR;
+    const uint8_t* end = frame + len;
+
+    out[0] = 0;
+    int n = append(out, cap, 0, "%c (%" PRIu32 ") %s: ", t->level, get_u32(frame + 4), t->tag);
+
+    const char* p = t->fmt;
+    const char* text = p;
+    conv_t c;
+    while(next_conv(&p, &c))
+    {
+        n = append_text(out, cap, n, text, c.start);
+        text = p;
+
+        // Flags, width and precision as given, the length at the host's size
+        char spec[MAX_SPEC];
+        int flags_len = c.mod - c.start;
+        if(flags_len > MAX_SPEC - 4) { flags_len = MAX_SPEC - 4; }
+        memcpy(spec, c.start, flags_len);
+        spec[flags_len] = 0;
+        if(c.kind == ARG_INT64) { strcat(spec, "ll"); }
+        strncat(spec, &c.conv, 1);
+
+        if((c.kind == ARG_INT || c.kind == ARG_PTR) && end - a >= 4)
+        {
+            uint32_t v = get_u32(a);
+            a += 4;
+            if(c.kind == ARG_PTR)       { n = append(out, cap, n, "0x%08" PRIx32, v); }
+            else if(c.conv == 'd' || c.conv == 'i') { n = append(out, cap, n, spec, (int32_t) v); }
+            else                        { n = append(out, cap, n, spec, v); }
+        }
+        else if(c.kind == ARG_INT64 && end - a >= 8)
+        {
+            uint64_t v = get_u64(a);
+            a += 8;
+            if(c.conv == 'd' || c.conv == 'i') { n = append(out, cap, n, spec, (long long) v); }
+            else                               { n = append(out, cap, n, spec, (unsigned long long) v); }
+        }
+        else if(c.kind == ARG_DOUBLE && end - a >= 8)
+        {
+            uint64_t v = get_u64(a);
+            double d;
+            memcpy(&d, &v, 8);
+            a += 8;
+            n = append(out, cap, n, spec, d);
+        }
+        else if(c.kind == ARG_STR && end - a >= 1 && end - a >= 1 + a[0])
+        {
+            char s[REPL_MUX_TOKEN_MAX_STR + 1];
+            memcpy(s, a + 1, a[0] > REPL_MUX_TOKEN_MAX_STR ? REPL_MUX_TOKEN_MAX_STR : a[0]);
+            s[a[0] > REPL_MUX_TOKEN_MAX_STR ? REPL_MUX_TOKEN_MAX_STR : a[0]] = 0;
+            a += 1 + a[0];
+            n = append(out, cap, n, spec, s);
+        }
+        else
+        {
+            a = end;
+            n = append(out, cap, n, "?");
+        }
+    }
+
+    n = append_text(out, cap, n, text, text + strlen(text));
+    return append(out, cap, n, "\n");
+}
@@ -0,0 +1,110 @@
+//*****************************************************************************
+// REPL MUX Tokens. Hot path logs do not have to be formatted on the device.
+// A tokenized log puts the id of its format string and its raw arguments in
+// the log ring and the host turns them back into text with the same table.
+// This file and repl_mux_token.c are plain C so host/log_decode builds from
+// the exact same source as the firmware:
+//
+//   REPL_MUX_LOG(SNIFF_HTC)                  REPL_MUX_TOKENS table
+//        |                                          |        |
+//        V                                          V        V
+// |---------------|  pack  |----------|  UART  |------------------|
+// | repl_mux_tlog |------->| Log Ring |--/TCP->| host/log_decode  |--> text
+// |---------------|        |----------|        |------------------|
+//
+// Table) Add a log by adding a row to REPL_MUX_TOKENS. The row gives the name
+//        REPL_MUX_LOG is called with, the level as the ESP_LOGx letter, the
+//        tag and the format. Ids are the row numbers, so firmware and decoder
+//        have to be built from the same table. Token 0 carries a hash of the
+//        table that the decoder checks against its own.
+//
+// Frame) A tokenized log goes out as one binary frame mixed in with the text
+//        logs. Text logs never hold a NULL byte, so the NULL marks a frame:
+//
+//        | 0x00 | len | id (LE 16) | ms (LE 32) | args ...          |
+//                      |<-------------- len bytes -------------->|
+//
+//        Any byte can be in a frame, 0x0A too, so the UART writes frames
+//        straight to the driver and not through stdout, which would turn
+//        each 0x0A into CR LF.
+//
+// Args) Packed in format order, little endian and at their device size:
+//       integers 4 bytes, ll / j 8 bytes, floating point as an 8 byte double,
+//       %p 4 bytes and %s a length byte and that many chars. Args that do not
+//       fit the frame are left off and the decoder prints them as ?.
+//
+// Assumptions) Formats do not use * widths or precisions or %n. The args of a
+//              REPL_MUX_LOG must match the table format exactly, the compiler
+//              can not check them.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#define REPL_MUX_TOKEN_MARK 0x00
+#define REPL_MUX_TOKEN_HDR 8            // Marker, len, id and ms
+#define REPL_MUX_TOKEN_MAX_STR 32       // Chars of a %s arg kept
+
+// X(name, level, tag, fmt)
+#define REPL_MUX_TOKENS(X) \
+    X(TOKEN_TABLE,          'I', "REPL MUX",    "token table %08" PRIx32 ", %u tokens") \
+    X(SNIFF_BAD_TYPE,       'E', "PKT SNIFFER", "NOT GOOD") \
+    X(SNIFF_PARSE_TIMEOUT,  'E', "PKT SNIFFER", "Timeout trying to parse packet") \
+    X(SNIFF_UNKNOWN_TYPE,   'E', "PKT SNIFFER", "NO GOOD BE HERE") \
+    X(SNIFF_IBSS,           'E', "PKT SNIFFER", "Warning IBSS traffic captured") \
+    X(SNIFF_HTC,            'E', "PKT SNIFFER", "HTC packet captured") \
+    X(EAPOL_ASSOC_RES,      'I', "EAPOL LOGGER", "%s -> assoc res -- len = %d") \
+    X(EAPOL_ASSOC_REQ,      'I', "EAPOL LOGGER", "%s -> assoc req --  len = %d") \
+    X(EAPOL_MSG,            'I', "EAPOL LOGGER", "%s -> eapol %d -- len = %d") \
+    X(EAPOL_DUPLICATE,      'E', "EAPOL LOGGER", "Recieved Duplicate EAPOL PKTs, overwriting")
+
+#define REPL_MUX_TOKEN_ENUM(name, level, tag, fmt) REPL_MUX_TOK_##name,
+typedef enum
+{
+    REPL_MUX_TOKENS(REPL_MUX_TOKEN_ENUM)
+    REPL_MUX_N_TOKENS
+} repl_mux_token_id_t;
+#undef REPL_MUX_TOKEN_ENUM
+
+typedef struct
+{
+    char level;                         // E, W, I, D or V
+    const char* tag;
+    const char* fmt;
+} repl_mux_token_t;
+
+extern const repl_mux_token_t repl_mux_tokens[REPL_MUX_N_TOKENS];
+
+//*****************************************************************************
+// repl_mux_token_hash) FNV-1a over every level, tag and format of the table.
+//*****************************************************************************
+uint32_t repl_mux_token_hash(void);
+
+//*****************************************************************************
+// repl_mux_token_pack) Build the frame of a tokenized log.
+//
+// out) Frame goes here.
+// cap) Bytes of out, at most 255 + 2 are used.
+// id) Row of the table.
+// ms) Time stamp.
+// args) Args of the row's format.
+//
+// Returns) Frame length, 0 if the id is out of range or cap is smaller than a
+//          frame header.
+//*****************************************************************************
+int repl_mux_token_pack(uint8_t* out, int cap, uint16_t id, uint32_t ms, va_list args);
+
+//*****************************************************************************
+// repl_mux_token_format) Turn a frame back into the text line ESP_LOGx would
+//                        have printed, "E (ms) TAG: msg\n". NULL terminated.
+//
+// out) Text goes here.
+// cap) Bytes of out.
+// frame) Frame, starting at the marker.
+// len) Bytes of the frame.
+//
+// Returns) Length of the text, -1 if the frame is not valid.
+//*****************************************************************************
+int repl_mux_token_format(char* out, int cap, const uint8_t* frame, int len);
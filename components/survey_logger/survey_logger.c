@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "survey_logger.h"
+#include "pkt_sniffer.h"
+#include "capture_writer.h"
+#include "capture_time.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char* TAG = "Survey Logger";
+
+#define BLOCK_PKTS CONFIG_SURVEY_BLOCK_PKTS
+#define BLOCK_US ((int64_t) CONFIG_SURVEY_BLOCK_MS * 1000)
+
+// Worst case bytes one frame adds to a block: 3 new MACs and full varints
+#define MAX_FRAME_COST (3 * 6 + 5 + 3 + 2 + 8)
+
+typedef struct
+{
+    survey_block_hdr_t hdr;
+    uint8_t macs[SURVEY_MAX_MACS][6];
+    uint16_t last_seq[SURVEY_MAX_MACS];     // Per transmitter, for the SEQ deltas
+    uint8_t ts_col[BLOCK_PKTS * 5];
+    uint8_t fc_col[BLOCK_PKTS];
+    uint8_t flags_col[BLOCK_PKTS];
+    uint8_t a1_col[BLOCK_PKTS];
+    uint8_t a2_col[BLOCK_PKTS];
+    uint8_t a3_col[BLOCK_PKTS];
+    uint8_t seq_col[BLOCK_PKTS * 3];
+    uint8_t len_col[BLOCK_PKTS * 2];
+    uint8_t rssi_col[BLOCK_PKTS];
+    uint8_t rate_col[BLOCK_PKTS];
+    uint8_t chan_col[BLOCK_PKTS];
+    uint8_t* cols[SURVEY_N_COLS];
+    int64_t base_us;                // Monotonic, hdr.base_us is wall clock
+    int64_t last_us;
+    uint32_t size;                          // Encoded bytes so far
+} block_t;
+
+static block_t blk;
+static uint8_t open = 0;
+static uint8_t stream;
+static pkt_filter_t filter;
+static char path[CAPTURE_WRITER_PATH_LEN + 1];
+static survey_logger_stats_t stats;
+static SemaphoreHandle_t lock;
+static uint8_t one_time_init_done = 0;
+
+//*****************************************************************************
+// Lock Helpers. The RX cb only tries the lock so the RX path is never held up
+// by an open or close on the REPL.
+//*****************************************************************************
+
+static uint8_t _take_lock(TickType_t wait)
+{
+    if(!one_time_init_done)
+    {
+        ESP_LOGE(TAG, "in take lock, not inited");
+        return 1;
+    }
+
+    if(!xSemaphoreTake(lock, wait))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void _release_lock(void)
+{
+    assert(xSemaphoreGive(lock) == pdTRUE);
+}
+
+//*****************************************************************************
+// Block encoding. Called with the lock held.
+//*****************************************************************************
+
+static void put_varint(survey_col_t c, uint32_t v)
+{
+    uint8_t* p = blk.cols[c] + blk.hdr.col_len[c];
+
+    while(v >= 0x80)
+    {
+        *p++ = (uint8_t) v | 0x80;
+        v >>= 7;
+        blk.hdr.col_len[c]++;
+    }
+    *p = (uint8_t) v;
+    blk.hdr.col_len[c]++;
+}
+
+static void put_byte(survey_col_t c, uint8_t v)
+{
+    blk.cols[c][blk.hdr.col_len[c]++] = v;
+}
+
+static void reset_block(void)
+{
+    memset(&blk.hdr, 0, sizeof(survey_block_hdr_t));
+    blk.hdr.magic = SURVEY_BLOCK_MAGIC;
+    blk.size = sizeof(survey_block_hdr_t);
+}
+
+// Index of mac in the table, adding it if new. SURVEY_NO_MAC if full.
+static uint8_t mac_index(const uint8_t* mac)
+{
+    uint8_t i;
+
+    for(i = 0; i < blk.hdr.n_macs; ++i)
+    {
+        if(!memcmp(blk.macs[i], mac, 6))
+        {
+            return i;
+        }
+    }
+
+    if(blk.hdr.n_macs == SURVEY_MAX_MACS)
+    {
+        return SURVEY_NO_MAC;
+    }
+
+    memcpy(blk.macs[i], mac, 6);
+    blk.last_seq[i] = 0;
+    blk.hdr.n_macs++;
+    return i;
+}
+
+static uint8_t macs_fit(const dot11_header_t* hdr)
+{
+    const uint8_t* addrs[3] = { hdr->addr1, hdr->addr2, hdr->addr3 };
+    uint8_t need = 0;
+    uint8_t i, a;
+
+    // Upper bound, a MAC repeated in the header is counted twice
+    for(a = 0; a < 3; ++a)
+    {
+        for(i = 0; i < blk.hdr.n_macs; ++i)
+        {
+            if(!memcmp(blk.macs[i], addrs[a], 6)) { break; }
+        }
+        if(i == blk.hdr.n_macs) { need++; }
+    }
+
+    return blk.hdr.n_macs + need <= SURVEY_MAX_MACS;
+}
+
+static void seal_block(void)
+{
+    capture_writer_iov_t iov[SURVEY_N_COLS + 2];
+    uint8_t c;
+
+    if(blk.hdr.n_pkts == 0)
+    {
+        return;
+    }
+
+    iov[0].base = &blk.hdr;
+    iov[0].len = sizeof(survey_block_hdr_t);
+    iov[1].base = blk.macs;
+    iov[1].len = blk.hdr.n_macs * 6;
+    for(c = 0; c < SURVEY_N_COLS; ++c)
+    {
+        iov[c + 2].base = blk.cols[c];
+        iov[c + 2].len = blk.hdr.col_len[c];
+    }
+
+    if(capture_writer_writev(stream, iov, SURVEY_N_COLS + 2) == ESP_OK)
+    {
+        stats.blocks++;
+        stats.block_bytes += blk.size;
+    }
+    else
+    {
+        stats.drops += blk.hdr.n_pkts;
+    }
+
+    reset_block();
+}
+
+static void encode(dot11_header_t* hdr, wifi_pkt_rx_ctrl_t* rx_ctrl, int64_t now)
+{
+    uint8_t* raw = (uint8_t*) hdr;
+    uint8_t full_hdr = rx_ctrl->sig_len >= sizeof(dot11_header_t);
+    uint8_t a[3] = { SURVEY_NO_MAC, SURVEY_NO_MAC, SURVEY_NO_MAC };
+    uint16_t seq = 0;
+    uint8_t c;
+
+    if(blk.hdr.n_pkts)
+    {
+        // A gap too long for a 32 bit delta also starts a new block
+        uint8_t seal = blk.hdr.n_pkts == BLOCK_PKTS ||
+                       blk.size + MAX_FRAME_COST > CONFIG_CAPTURE_WRITER_BUF_SIZE ||
+                       now - blk.base_us > BLOCK_US ||
+                       now - blk.last_us > UINT32_MAX;
+
+        if(!seal && full_hdr && !macs_fit(hdr))
+        {
+            stats.mac_seals++;
+            seal = 1;
+        }
+
+        if(seal)
+        {
+            seal_block();
+        }
+    }
+
+    if(blk.hdr.n_pkts == 0)
+    {
+        blk.hdr.base_us = capture_time_to_wall(now);
+        blk.base_us = now;
+        blk.last_us = now;
+    }
+
+    if(full_hdr)
+    {
+        a[0] = mac_index(hdr->addr1);
+        a[1] = mac_index(hdr->addr2);
+        a[2] = mac_index(hdr->addr3);
+        memcpy(&seq, raw + 22, 2);
+    }
+
+    put_varint(SURVEY_COL_TS, (uint32_t) (now - blk.last_us));
+    put_byte(SURVEY_COL_FC, raw[0]);
+    put_byte(SURVEY_COL_FLAGS, raw[1]);
+    put_byte(SURVEY_COL_A1, a[0]);
+    put_byte(SURVEY_COL_A2, a[1]);
+    put_byte(SURVEY_COL_A3, a[2]);
+
+    // Zigzag so small steps back (retries, reordering) stay one byte
+    uint16_t prev = (a[1] != SURVEY_NO_MAC) ? blk.last_seq[a[1]] : 0;
+    int16_t d = (int16_t) (seq - prev);
+    put_varint(SURVEY_COL_SEQ, (uint16_t) ((d << 1) ^ (d >> 15)));
+    if(a[1] != SURVEY_NO_MAC)
+    {
+        blk.last_seq[a[1]] = seq;
+    }
+
+    put_varint(SURVEY_COL_LEN, rx_ctrl->sig_len);
+    put_byte(SURVEY_COL_RSSI, (uint8_t) (int8_t) rx_ctrl->rssi);
+    put_byte(SURVEY_COL_RATE, rx_ctrl->sig_mode ? (0x80 | rx_ctrl->mcs) : rx_ctrl->rate);
+    put_byte(SURVEY_COL_CHAN, rx_ctrl->channel);
+
+    blk.last_us = now;
+    blk.hdr.n_pkts++;
+
+    uint32_t size = sizeof(survey_block_hdr_t) + blk.hdr.n_macs * 6;
+    for(c = 0; c < SURVEY_N_COLS; ++c)
+    {
+        size += blk.hdr.col_len[c];
+    }
+    blk.size = size;
+}
+
+//*****************************************************************************
+// RX path
+//*****************************************************************************
+
+static void rx_cb(void* pkt, void* meta_data, pkt_type_t type, pkt_subtype_t subtype)
+{
+    wifi_pkt_rx_ctrl_t* rx_ctrl = (wifi_pkt_rx_ctrl_t*) meta_data;
+    int64_t now = capture_time_rx_us(rx_ctrl);
+
+    if(_take_lock(0)){ return; }
+
+    if(open && rx_ctrl->sig_len >= 2 && pkt_sniffer_filter_match(&filter, (dot11_header_t*) pkt))
+    {
+        encode((dot11_header_t*) pkt, rx_ctrl, now);
+        stats.pkts++;
+        stats.frame_bytes += rx_ctrl->sig_len;
+    }
+
+    _release_lock();
+}
+
+//*****************************************************************************
+// API funcs
+//*****************************************************************************
+
+esp_err_t survey_logger_open(const pkt_filter_t* f,
+                             const char* file_name,
+                             const capture_writer_rotate_t* rotate)
+{
+    if(!one_time_init_done)
+    {
+        lock = xSemaphoreCreateBinary();
+        assert(xSemaphoreGive(lock) == pdTRUE);
+        one_time_init_done = 1;
+
+        blk.cols[SURVEY_COL_TS] = blk.ts_col;
+        blk.cols[SURVEY_COL_FC] = blk.fc_col;
+        blk.cols[SURVEY_COL_FLAGS] = blk.flags_col;
+        blk.cols[SURVEY_COL_A1] = blk.a1_col;
+        blk.cols[SURVEY_COL_A2] = blk.a2_col;
+        blk.cols[SURVEY_COL_A3] = blk.a3_col;
+        blk.cols[SURVEY_COL_SEQ] = blk.seq_col;
+        blk.cols[SURVEY_COL_LEN] = blk.len_col;
+        blk.cols[SURVEY_COL_RSSI] = blk.rssi_col;
+        blk.cols[SURVEY_COL_RATE] = blk.rate_col;
+        blk.cols[SURVEY_COL_CHAN] = blk.chan_col;
+    }
+
+    capture_writer_cfg_t cfg = {0};
+    int max_name = SURVEY_NAME_LEN;
+    if(rotate->max_bytes || rotate->max_secs)
+    {
+        max_name -= CAPTURE_WRITER_ROTATE_SUFFIX_LEN;
+    }
+    snprintf(cfg.path, sizeof(cfg.path), "/spiffs/%.*s", max_name, file_name);
+    memcpy(&cfg.rotate, rotate, sizeof(capture_writer_rotate_t));
+
+    survey_file_hdr_t fh = {0};
+    fh.magic = SURVEY_FILE_MAGIC;
+    fh.version = SURVEY_VERSION;
+    fh.n_cols = SURVEY_N_COLS;
+    fh.start_us = capture_time_to_wall(esp_timer_get_time());
+
+    cfg.fmt = CAPTURE_FMT_RAW;
+    memcpy(cfg.file_hdr, &fh, sizeof(fh));
+    cfg.file_hdr_len = sizeof(fh);
+    // Columnar blocks are laid out for the LZ codec
+#if CONFIG_SURVEY_COMPRESS
+    cfg.compress = 1;
+#else
+    cfg.compress = 0;
+#endif
+    cfg.backend = CAPTURE_WRITER_DEFAULT_BACKEND;
+
+    if(_take_lock(10 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "lock timeout");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if(open)
+    {
+        _release_lock();
+        ESP_LOGE(TAG, "Survey already open");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ESP_LOGI(TAG, "Opening %s .. ", cfg.path);
+    esp_err_t e = capture_writer_open(&cfg, &stream);
+    if(e != ESP_OK)
+    {
+        _release_lock();
+        ESP_LOGE(TAG, "Error opening capture stream");
+        return e;
+    }
+
+    memcpy(&filter, f, sizeof(pkt_filter_t));
+    memcpy(path, cfg.path, sizeof(path));
+    memset(&stats, 0, sizeof(survey_logger_stats_t));
+    stats.start_us = esp_timer_get_time();
+    reset_block();
+    open = 1;
+
+    pkt_sniffer_filtered_src_t filt = {0};
+    filt.filter.type_bitmap = f->type_bitmap;
+    filt.filter.mgmt_subtype_bitmap = f->mgmt_subtype_bitmap;
+    filt.filter.data_subtype_bitmap = f->data_subtype_bitmap;
+    filt.cb = rx_cb;
+
+    e = pkt_sniffer_add_filter(&filt);
+    if(e != ESP_OK)
+    {
+        capture_writer_close(stream);
+        open = 0;
+    }
+
+    _release_lock();
+    return e;
+}
+
+esp_err_t survey_logger_close(void)
+{
+    if(_take_lock(10 / portTICK_PERIOD_MS))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if(!open)
+    {
+        _release_lock();
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    pkt_sniffer_remove_filter(rx_cb);
+    seal_block();
+    open = 0;
+    esp_err_t e = capture_writer_close(stream);
+
+    _release_lock();
+
+    ESP_LOGI(TAG, "Closed %s after %lu pkts in %lu blocks", path, stats.pkts, stats.blocks);
+    return e;
+}
+
+esp_err_t survey_logger_get_stats(survey_logger_stats_t* s, char* p)
+{
+    if(!open)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memcpy(s, &stats, sizeof(survey_logger_stats_t));
+    if(p)
+    {
+        memcpy(p, path, sizeof(path));
+    }
+
+    return ESP_OK;
+}
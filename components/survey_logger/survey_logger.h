@@ -0,0 +1,145 @@
+//*****************************************************************************
+// Survey Logger. For surveys that run for hours we dont want payloads at all,
+// only who talked to whom, when, how loud and how much. The survey logger
+// keeps the 802.11 header fields and radio meta data of every frame that
+// matches its filter and packs them into columnar blocks. A frame costs about
+// 10 bytes on flash instead of the hundreds a pcap record takes.
+//
+// |-------------|  filter  |----------------|  block full  |----------------|
+// | Pkt Sniffer |--------->| Column buffers |------------->| Capture Writer |--> file
+// |-------------|  (RX cb) | + MAC table    |   (writev)   | (LZ, rotation) |
+//                          |----------------|              |----------------|
+//
+// Columns) Each frame adds one entry to each column, encoded as it arrives:
+//
+//     TS    - varint, us since the previous frame of the block, from the
+//             radio's rx timestamp (see capture_time.h)
+//     FC    - frame control byte 0 (version, type, subtype)
+//     FLAGS - frame control byte 1 (DS bits, retry, pwr mgt, protected ...)
+//     A1-A3 - one byte each, index into the block's MAC table, 0xFF = none
+//     SEQ   - varint, zigzag delta of the seq ctrl field against the last one
+//             seen from the same transmitter (A2) in this block
+//     LEN   - varint, frame length incl FCS
+//     RSSI  - signed dBm
+//     RATE  - wifi_phy_rate_t for legacy frames, 0x80 | MCS for HT
+//     CHAN  - primary channel
+//
+// Blocks) A block is one capture writer record, so it is never split in the
+//         file. It is sealed after CONFIG_SURVEY_BLOCK_PKTS frames, when the
+//         MAC table (SURVEY_MAX_MACS) is full, when the next frame might not
+//         fit in a writer buffer, or when the block is older than
+//         CONFIG_SURVEY_BLOCK_MS (checked as frames arrive). Grouping the
+//         bytes of a field together gives the capture writer's LZ codec long
+//         runs of near identical bytes (channel, rate, flags, small deltas)
+//         on top of the dictionary and delta coding. CONFIG_SURVEY_COMPRESS
+//         (on by default) compiles the codec in and compresses every survey,
+//         whatever CONFIG_CAPTURE_WRITER_COMPRESS_DEFAULT says for pkt
+//         captures. Without it the blocks are written as they are.
+//
+// File Layout)
+//
+//     | survey_file_hdr_t | block | block | ... |
+//
+//     block = | survey_block_hdr_t | MAC table (n_macs x 6) | col 0 | ... | col 10 |
+//
+//     All fields little endian. col_len in the block header gives the byte
+//     length of each column. scripts/survey_decode.py expands a file (after
+//     inflating it) into CSV or into a header only radiotap pcap.
+//
+// Assumptions) One survey at a time. PS_clear also throws away the survey
+//              sniffer filter.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "pkt_sniffer.h"
+#include "capture_writer.h"
+
+#define SURVEY_FILE_MAGIC 0x46535743    // "CWSF"
+#define SURVEY_BLOCK_MAGIC 0x56535743   // "CWSV"
+#define SURVEY_VERSION 1
+#define SURVEY_MAX_MACS 64
+#define SURVEY_NO_MAC 0xFF
+#define SURVEY_NAME_LEN 23              // Max file name length before suffixes
+
+typedef enum
+{
+    SURVEY_COL_TS = 0,
+    SURVEY_COL_FC,
+    SURVEY_COL_FLAGS,
+    SURVEY_COL_A1,
+    SURVEY_COL_A2,
+    SURVEY_COL_A3,
+    SURVEY_COL_SEQ,
+    SURVEY_COL_LEN,
+    SURVEY_COL_RSSI,
+    SURVEY_COL_RATE,
+    SURVEY_COL_CHAN,
+    SURVEY_N_COLS
+} survey_col_t;
+
+typedef struct
+{
+    uint32_t magic;                     // SURVEY_FILE_MAGIC
+    uint16_t version;
+    uint16_t n_cols;
+    uint64_t start_us;                  // When the survey was opened, wall clock
+} survey_file_hdr_t;
+
+typedef struct
+{
+    uint32_t magic;                     // SURVEY_BLOCK_MAGIC
+    uint16_t n_pkts;
+    uint8_t n_macs;
+    uint8_t reserved;
+    uint64_t base_us;                   // Wall clock time of the first frame
+    uint16_t col_len[SURVEY_N_COLS];
+    uint16_t reserved2;
+} survey_block_hdr_t;
+
+typedef struct
+{
+    uint32_t pkts;                      // Frames encoded
+    uint32_t blocks;                    // Blocks handed to the capture writer
+    uint64_t frame_bytes;               // 802.11 bytes the frames had
+    uint64_t block_bytes;               // Encoded bytes, before the writer's LZ
+    uint32_t drops;                     // Frames lost with blocks the writer refused
+    uint32_t mac_seals;                 // Blocks sealed early by a full MAC table
+    int64_t start_us;
+} survey_logger_stats_t;
+
+//*****************************************************************************
+// survey_logger_open) Open the survey file through the capture writer and
+//                     start encoding frames that match filter.
+//
+// filter) Same semantics as the pkt sniffer filters, see pkt_sniffer.h. Copied.
+//
+// file_name) Name of the file on SPIFFS, max SURVEY_NAME_LEN chars, cut by 4
+//            when rotating (".NNN" suffix).
+//
+// rotate) Roll / ring settings, see capture_writer.h. All 0 for one file.
+//
+// Returns) ESP_OK, INVALID_STATE if a survey is already open, else capture
+//          writer or pkt sniffer errors.
+//*****************************************************************************
+esp_err_t survey_logger_open(const pkt_filter_t* filter,
+                             const char* file_name,
+                             const capture_writer_rotate_t* rotate);
+
+//*****************************************************************************
+// survey_logger_close) Seal the current block and close the file.
+//
+// Returns) ESP_OK, INVALID_STATE if no survey is open.
+//*****************************************************************************
+esp_err_t survey_logger_close(void);
+
+//*****************************************************************************
+// survey_logger_get_stats) Copy out the stats.
+//
+// stats) Out param.
+// path) Out param, CAPTURE_WRITER_PATH_LEN + 1 bytes, may be NULL.
+//
+// Returns) ESP_OK, INVALID_STATE if no survey is open.
+//*****************************************************************************
+esp_err_t survey_logger_get_stats(survey_logger_stats_t* stats, char* path);
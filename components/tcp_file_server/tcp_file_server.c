@@ -1,288 +1,1466 @@
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <dirent.h>
+#include <sys/stat.h>
 
-#include "esp_system.h"
-#include "esp_log.h"
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include <lwip/netdb.h>
+#include "tcp_file_server.h"
+#include "capture_index.h"
+#include "capture_catalog.h"
+#include "net_reactor.h"
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#ifdef ESP_PLATFORM
+    #include "esp_system.h"
+    #include "esp_log.h"
+    #include "esp_timer.h"
+    #include "esp_rom_crc.h"
+    #include "lwip/err.h"
+    #include "lwip/sockets.h"
+    #include "lwip/sys.h"
+    #include <lwip/netdb.h>
 
-#include "tcp_file_server.h"
+    #include "freertos/FreeRTOS.h"
+    #include "freertos/task.h"
+
+    static const char* TAG = "TCP File Server";
+    static TaskHandle_t reader_task;
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    #define LOGI(...) ESP_LOGI(TAG, __VA_ARGS__)
+    #define LOGE(...) ESP_LOGE(TAG, __VA_ARGS__)
+    #define NOW_US() esp_timer_get_time()
+    #define SLEEP_MS(ms) vTaskDelay((ms) / portTICK_PERIOD_MS)
+    #define CRC32(crc, p, len) esp_rom_crc32_le(crc, p, len)
+    #define LOCK() portENTER_CRITICAL(&mux)
+    #define UNLOCK() portEXIT_CRITICAL(&mux)
+    #define WAKE_READER() xTaskNotifyGive(reader_task)
+    #define WAIT_READER(ms) ulTaskNotifyTake(pdTRUE, (ms) / portTICK_PERIOD_MS)
+    #define MSS CONFIG_LWIP_TCP_MSS
+#else
+    #include <time.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <semaphore.h>
+    #include <sys/socket.h>
+    #include <sys/select.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
 
-static const char* TAG = "TCP File Server";
+    static pthread_t reader_task;
+    static pthread_mutex_t mux = PTHREAD_MUTEX_INITIALIZER;
+    static sem_t reader_sem;
 
+    static int64_t now_us(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
 
-#define MAX_FILES 32
+    // Same zlib / ethernet CRC the esp32 ROM computes
+    static uint32_t crc32_sw(uint32_t crc, const uint8_t* p, uint32_t len)
+    {
+        uint8_t j;
+        crc = ~crc;
+        while(len--)
+        {
+            crc ^= *p++;
+            for(j = 0; j < 8; ++j)
+            {
+                crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+            }
+        }
+        return ~crc;
+    }
+
+    static void wait_reader(uint32_t ms)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long) ms * 1000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        sem_timedwait(&reader_sem, &ts);
+    }
+
+    #define LOGI(fmt, ...) printf("TCP File Server: " fmt "\n", ##__VA_ARGS__)
+    #define LOGE(fmt, ...) fprintf(stderr, "TCP File Server: " fmt "\n", ##__VA_ARGS__)
+    #define NOW_US() now_us()
+    #define SLEEP_MS(ms) usleep((ms) * 1000)
+    #define CRC32(crc, p, len) crc32_sw(crc, p, len)
+    #define inet_ntoa_r(addr, buf, len) inet_ntop(AF_INET, &(addr), buf, len)
+    #define LOCK() pthread_mutex_lock(&mux)
+    #define UNLOCK() pthread_mutex_unlock(&mux)
+    #define WAKE_READER() sem_post(&reader_sem)
+    #define WAIT_READER(ms) wait_reader(ms)
+    #define MSS 1440                // CONFIG_LWIP_TCP_MSS of the board
+#endif
+
+
+#define MAX_FILES CONFIG_CAPTURE_CATALOG_MAX_FILES
 #define MAX_PATH_LEN 32
+#define FULL_PATH_LEN (MAX_PATH_LEN + 1 + CAPTURE_CATALOG_NAME_LEN)
+#define MSG_HDR_LEN sizeof(tcp_file_server_msg_t)
+#define BUF_SIZE (CONFIG_TCP_SERVER_BUF_SEGS * MSS)     // Whole segments, v2 DATA header included
+#define N_BUFS CONFIG_TCP_SERVER_READ_AHEAD_BUFS
+#define DEPTH ((N_BUFS < 3) ? N_BUFS : 3)               // Buffers one session may hold
+#define CTRL_SIZE (MSG_HDR_LEN + sizeof(tcp_file_server_entry_t) + sizeof(tcp_file_server_meta_t) + \
+                   TCP_FILE_SERVER_NAME_LEN)
+#define CRC_CHUNK 1024
+#define RX_SIZE (MSG_HDR_LEN + sizeof(tcp_file_server_get_t) + TCP_FILE_SERVER_NAME_LEN)
+#define MAX_CONNS CONFIG_TCP_SERVER_MAX_CLIENTS
+#define TIMEOUT_US ((int64_t) CONFIG_TCP_SERVER_CLIENT_TIMEOUT_MS * 1000)
+#define SELECT_MS 100               // Reader period when nothing is asked of it, bounds its exit
+#define READER_EXIT_MS (4 * SELECT_MS)  // Longest launch waits on the reader of the last run
+
+_Static_assert(BUF_SIZE <= UINT16_MAX, "read ahead buffer length is a uint16_t");
+_Static_assert(CTRL_SIZE >= 1 + MAX_PATH_LEN, "v1 path does not fit the control buffer");
+_Static_assert(MSG_HDR_LEN == 8, "v2 message header layout");
+_Static_assert(MAX_FILES < TCP_FILE_SERVER_QUERY_REQ, "v1 file index is one byte, 255 is a query");
+_Static_assert(sizeof(((tcp_file_server_meta_t*) 0)->ssid) == CAPTURE_CATALOG_SSID_LEN + 1 &&
+               sizeof(((tcp_file_server_meta_t*) 0)->bssids) == sizeof(((capture_catalog_entry_t*) 0)->bssids),
+               "v2 meta layout follows the catalog");
+
+typedef enum
+{
+    SCAN_NONE = 0,                  // Catalog entries still going out
+    SCAN_DIR,                       // Reading the mount for files not in the catalog
+    SCAN_DONE,
+} list_scan_t;
+
+typedef enum
+{
+    CONN_FREE = 0,
+    CONN_SEND_N,                    // N Files going out
+    CONN_WAIT_N,                    // Waiting for the N echo
+    CONN_SEND_PATHS,                // Path table going out, one path per chunk
+    CONN_WAIT_REQ,                  // Waiting for a file index or query
+    CONN_SEND_FILE,                 // Requested path then the whole file
+    CONN_SEND_QUERY,                // Requested path then the matching spans
+    CONN_V2_WAIT,                   // v2, waiting for a request
+    CONN_V2_LIST,                   // v2, an ENTRY per file, CRCs computed in between
+    CONN_V2_DATA,                   // v2, DATA of the requested range
+    CONN_V2_END,                    // v2, LIST_END / DATA_END / ERROR going out
+    CONN_CLOSING,                   // Socket closed, slot freed once the reader let go
+} conn_state_t;
+
+//*****************************************************************************
+// Per connection state. Everything a session needs lives here, so sessions
+// are independent of each other, including the path table each client was
+// shown when it connected.
+//
+// While a session streams (SEND_FILE, SEND_QUERY, V2_DATA) the reader task
+// owns f, idx and the range fields and the loop only touches tx and the fifo
+// of filled read ahead buffers. fifo, streaming, rd_busy, rd_done and closing
+// are shared and change under LOCK.
+//*****************************************************************************
+
+typedef struct
+{
+    conn_state_t state;
+    int sock;
+    uint8_t v2;
+    char ip_addr[16];
+    int64_t start_us;
+    int64_t last_us;                // Last progress, for the timeout
+    uint32_t bytes_sent;
+    uint8_t eof;                    // All of the answer was queued
+
+    uint8_t tx[CTRL_SIZE];          // Control message being sent, tx_off of tx_len out
+    uint16_t tx_off;
+    uint16_t tx_len;
+    uint16_t buf_off;               // Sent of the head read ahead buffer
+    uint8_t rx[RX_SIZE];
+    uint8_t rx_len;
 
-static TaskHandle_t handler_task;
-static int client_socket;
-static int listen_sock;
-static char ip_addr[16];
-static int running = 0;
+    uint8_t fifo[DEPTH];            // Read ahead buffers filled for this session, in order
+    uint8_t fifo_head;
+    uint8_t fifo_n;
+    uint8_t streaming;              // Reader may fill buffers for this session
+    uint8_t rd_busy;                // Reader is filling a buffer for this session
+    uint8_t rd_done;                // Reader hit the end of the answer
+    uint8_t closing;
+    int64_t xfer_us;                // Start of the transfer, for the throughput log
+    uint32_t xfer_bytes;
+
+    uint16_t ids[MAX_FILES];        // Catalog ids of the path table this client was shown
+    uint8_t num_paths;
+    uint8_t cursor;                 // Next path of the table to send
+    uint8_t file;                   // Requested file
+
+    FILE* f;
+    FILE* idx;                      // Sidecar index, queries only
+    tcp_file_server_query_t query;
+    uint32_t pos;                   // Offset of f, saves seeks between adjacent spans
+    uint32_t run_off;               // Range of f being sent
+    uint32_t run_len;
+    uint16_t n_spans;
+    uint16_t n_match;
+
+    uint16_t list_pos;              // v2 listing, next catalog entry
+    uint8_t list_meta;              // ... and if ENTRYs carry the meta data
+    uint8_t list_scan;              // ... then files the catalog has no room for, list_scan_t
+    DIR* dir;
+    uint32_t n_files;
+    capture_catalog_entry_t entry;  // File being listed
+    char name[TCP_FILE_SERVER_NAME_LEN + 1];    // File being sent
+    uint32_t size;                  // v2 file being listed or sent
+    int64_t mtime;
+    uint32_t crc;
+    tcp_file_server_get_t get;      // v2 range being sent, len clipped to the file
+    uint32_t remaining;
+} conn_t;
+
+//*****************************************************************************
+// CRCs of the v2 listing, so a file is only read through again once it
+// changed. Replaced round robin when full.
+//*****************************************************************************
+
+typedef struct
+{
+    char name[TCP_FILE_SERVER_NAME_LEN + 1];
+    uint32_t size;
+    int64_t mtime;
+    uint32_t crc;
+} crc_cache_t;
+
+static int listen_sock = -1;
+static int listen_sock_v2 = -1;
+static volatile int running = 0;    // Launched and not killed
+static volatile int serving = 0;    // On the reactor, until the poll after a kill
+static volatile int reader_alive = 0;   // Reader task started and not yet out of its loop
 static char MOUNT_PATH[MAX_PATH_LEN + 1];
-static char path_index[MAX_FILES * (MAX_PATH_LEN+1)];
-static uint8_t num_paths = 0;
-static uint8_t file_to_send = 0;
+static conn_t conns[MAX_CONNS];
+static crc_cache_t crc_cache[MAX_FILES];
+static uint8_t crc_cache_next = 0;
+static uint8_t crc_buf[CRC_CHUNK];  // Listing CRCs, loop only
+
+// Read ahead pool, shared by every streaming session
+static uint8_t bufs[N_BUFS][BUF_SIZE];
+static uint16_t buf_len[N_BUFS];
+static uint8_t free_bufs[N_BUFS];
+static uint8_t n_free = 0;
 
 //*****************************************************************************
-// TCP File Server Comm Protocol helpers. Return values are 1 if bad and need
-// to reset client socket connection 0 good.
+// Session helpers
 //*****************************************************************************
 
-static uint8_t send_N()
+// Free the slot of a closed session. Returns 0 if the reader is still in a
+// read for it, the reactor then tries again on a later poll.
+static uint8_t conn_reap(conn_t* c)
 {
-    // ESP_LOGI(TAG, "send_N  N=%d", num_paths);
-    if(send(client_socket, &num_paths, 1, 0) != 1)
+    LOCK();
+    uint8_t busy = c->rd_busy;
+    UNLOCK();
+    if(busy)
     {
-        return 1;
+        return 0;
+    }
+
+    if(c->f)   { fclose(c->f); }
+    if(c->idx) { fclose(c->idx); }
+    if(c->dir) { closedir(c->dir); }
+
+    LOCK();
+    memset(c, 0, sizeof(conn_t));
+    UNLOCK();
+    return 1;
+}
+
+// Close the socket now and take the session away from the reader. A read in
+// flight is not waited out, the reactor must not sleep, the slot stays
+// CLOSING until the reader let go of it and a poll reaps it.
+static void conn_close(conn_t* c, const char* why)
+{
+    LOCK();
+    c->closing = 1;
+    while(c->fifo_n)
+    {
+        free_bufs[n_free++] = c->fifo[c->fifo_head];
+        c->fifo_head = (c->fifo_head + 1) % DEPTH;
+        c->fifo_n--;
+    }
+    c->streaming = 0;
+    UNLOCK();
+
+    int64_t ms = (NOW_US() - c->start_us) / 1000;
+    LOGI("Client %s %s, %lu bytes in %lld ms", c->ip_addr, why,
+         (unsigned long) c->bytes_sent, (long long) ms);
+
+    shutdown(c->sock, 0);
+    close(c->sock);
+    c->sock = -1;
+    c->state = CONN_CLOSING;
+
+    conn_reap(c);
+}
+
+static void put_path(conn_t* c, uint8_t i)
+{
+    capture_catalog_entry_t e;
+    char path[FULL_PATH_LEN + 1];
+
+    memset(c->tx, 0, 33);
+    c->tx[0] = i;
+
+    // A file deleted since the table was taken goes out as an empty path
+    if(capture_catalog_find_id(c->ids[i], &e) == ESP_OK)
+    {
+        snprintf(path, sizeof(path), "%s/%s", MOUNT_PATH, e.name);
+        memcpy(c->tx + 1, path, strnlen(path, MAX_PATH_LEN));
     }
+    c->tx_len = 33;
+}
+
+// Take the path table of the session from the catalog, no FS access
+static void index_files(conn_t* c)
+{
+    capture_catalog_entry_t e;
+    c->num_paths = 0;
 
-    return 0;    
+    while(c->num_paths < MAX_FILES && capture_catalog_get(c->num_paths, &e) == ESP_OK)
+    {
+        c->ids[c->num_paths++] = e.id;
+    }
 }
 
-static uint8_t get_N()
+static uint8_t span_matches(conn_t* c, capture_index_entry_t* e)
 {
-    uint8_t x;
-    size_t num_recv = recv(client_socket, &x, 1, 0);
-    if(num_recv != 1 || x != num_paths)
+    tcp_file_server_query_t* q = &c->query;
+    uint8_t j;
+
+    if((q->flags & TCP_FILE_SERVER_QUERY_TIME) &&
+       (e->last_us < q->t_start_us || e->first_us > q->t_end_us))
+    {
+        return 0;
+    }
+
+    if(!(q->flags & TCP_FILE_SERVER_QUERY_BSSID) || (e->flags & CAPTURE_INDEX_BSSID_OVERFLOW))
     {
         return 1;
     }
 
+    for(j = 0; j < e->n_bssids && j < CAPTURE_INDEX_MAX_BSSIDS; ++j)
+    {
+        if(!memcmp(e->bssids[j], q->bssid, 6))
+        {
+            return 1;
+        }
+    }
+
     return 0;
 }
 
-static uint8_t send_indexed_path(uint8_t i)
+// Open the sidecar index of the requested capture. The file header is the
+// first range sent, the spans that match the query follow.
+static uint8_t open_query(conn_t* c, const char* path)
 {
-    uint8_t buff[33] = {0};
-    buff[0] = i;
-    uint8_t len = strlen(path_index + i*(MAX_PATH_LEN+1));
-    memcpy(buff + 1, path_index + i*(MAX_PATH_LEN+1), len);
+    char idx_path[FULL_PATH_LEN + CAPTURE_INDEX_SUFFIX_LEN + 1];
+    capture_index_hdr_t h;
 
-    if(send(client_socket, buff, 33, 0) != 33)
+    snprintf(idx_path, sizeof(idx_path), "%s%s", path, CAPTURE_INDEX_SUFFIX);
+    c->idx = fopen(idx_path, "r");
+    c->f = fopen(path, "r");
+    if(!c->idx || !c->f)
     {
+        LOGE("In open_query - Failed to open %s or its index", path);
         return 1;
     }
 
+    if(fread(&h, 1, sizeof(h), c->idx) != sizeof(h) ||
+       h.magic != CAPTURE_INDEX_MAGIC ||
+       h.entry_len != sizeof(capture_index_entry_t))
+    {
+        LOGE("In open_query - Bad index %s", idx_path);
+        return 1;
+    }
+
+    c->pos = 0;
+    c->run_off = 0;
+    c->run_len = h.data_hdr_len;
     return 0;
 }
 
-static uint8_t send_file_paths()
+// Next piece of a query answer, up to len bytes into buf. Returns bytes read,
+// 0 when done. A buffer holds at most one span, so short reads are normal.
+static uint16_t fill_query(conn_t* c, uint8_t* buf, uint16_t len)
 {
-    uint8_t i;
-    for(i = 0; i < num_paths; ++i)
+    capture_index_entry_t e;
+
+    while(c->run_len == 0)
+    {
+        if(fread(&e, 1, sizeof(e), c->idx) != sizeof(e))
+        {
+            LOGI("Query matched %d/%d spans", c->n_match, c->n_spans);
+            return 0;
+        }
+
+        c->n_spans++;
+        if(span_matches(c, &e))
+        {
+            c->n_match++;
+            c->run_off = e.offset;
+            c->run_len = e.len;
+        }
+    }
+
+    if(c->pos != c->run_off)
+    {
+        if(fseek(c->f, c->run_off, SEEK_SET)) { return 0; }
+        c->pos = c->run_off;
+    }
+
+    size_t n = (c->run_len < len) ? c->run_len : len;
+    n = fread(buf, 1, n, c->f);
+    c->pos += n;
+    c->run_off += n;
+    c->run_len = n ? c->run_len - n : 0;
+    return n;
+}
+
+//*****************************************************************************
+// Read ahead. One reader task does every flash read of the streaming states
+// into a shared pool of buffers, each a whole number of TCP segments, while
+// the loop sends the buffers it filled before. A session holds at most DEPTH
+// buffers and the reader serves sessions round robin, so one fast client can
+// not take the whole pool.
+//*****************************************************************************
+
+static uint8_t is_streaming(conn_t* c)
+{
+    return c->state == CONN_SEND_FILE || c->state == CONN_SEND_QUERY ||
+           c->state == CONN_V2_DATA;
+}
+
+// Hand the session's files to the reader
+static void start_stream(conn_t* c, conn_state_t state)
+{
+    c->xfer_us = NOW_US();
+    c->xfer_bytes = 0;
+
+    c->state = state;
+
+    LOCK();
+    c->rd_done = 0;
+    c->streaming = 1;
+    UNLOCK();
+    WAKE_READER();
+}
+
+// Fill buf with the next piece of the answer. Returns its length, 0 at the end
+static uint16_t reader_fill(conn_t* c, uint8_t* buf)
+{
+    tcp_file_server_msg_t m = { .type = TCP_FILE_SERVER_MSG_DATA };
+    uint32_t n;
+
+    switch(c->state)
+    {
+        case CONN_SEND_FILE:
+            return fread(buf, 1, BUF_SIZE, c->f);
+
+        case CONN_SEND_QUERY:
+            return fill_query(c, buf, BUF_SIZE);
+
+        case CONN_V2_DATA:
+            // A short read means the file shrank, DATA_END says how much went
+            n = (c->remaining < BUF_SIZE - MSG_HDR_LEN) ? c->remaining : BUF_SIZE - MSG_HDR_LEN;
+            n = n ? fread(buf + MSG_HDR_LEN, 1, n, c->f) : 0;
+            if(n == 0)
+            {
+                return 0;
+            }
+
+            c->crc = CRC32(c->crc, buf + MSG_HDR_LEN, n);
+            c->remaining -= n;
+            m.len = n;
+            memcpy(buf, &m, MSG_HDR_LEN);
+            return MSG_HDR_LEN + n;
+
+        default:
+            return 0;
+    }
+}
+
+static void reader_task_fn(void* args)
+{
+    uint8_t rr = 0;
+    uint8_t i, b = 0;
+    (void) args;
+
+    // Runs until the handler is off the reactor, not just stopping, so
+    // WAKE_READER stays safe
+    while(serving)
     {
-        if(send_indexed_path(i)){ return 1; }
+        conn_t* c = NULL;
+
+        LOCK();
+        for(i = 0; i < MAX_CONNS && n_free; ++i)
+        {
+            conn_t* x = &conns[(rr + i) % MAX_CONNS];
+            if(x->streaming && !x->closing && !x->rd_done && !x->rd_busy && x->fifo_n < DEPTH)
+            {
+                c = x;
+                c->rd_busy = 1;
+                b = free_bufs[--n_free];
+                rr = (rr + i + 1) % MAX_CONNS;
+                break;
+            }
+        }
+        UNLOCK();
+
+        if(!c)
+        {
+            WAIT_READER(SELECT_MS);
+            continue;
+        }
+
+        uint16_t len = reader_fill(c, bufs[b]);
+
+        LOCK();
+        uint8_t first = c->fifo_n == 0;
+        if(c->closing)
+        {
+            free_bufs[n_free++] = b;        // The reactor reaps the slot
+        }
+        else if(len)
+        {
+            buf_len[b] = len;
+            c->fifo[(c->fifo_head + c->fifo_n) % DEPTH] = b;
+            c->fifo_n++;
+        }
+        else
+        {
+            free_bufs[n_free++] = b;
+            c->rd_done = 1;
+        }
+        c->rd_busy = 0;
+        UNLOCK();
+
+        // The loop only waits on a session whose fifo was empty, a filled
+        // buffer is waiting to go out, or on a closed one to let go of
+        if(first)
+        {
+            net_reactor_wake();
+        }
     }
 
+    // Last touch of anything shared, launch may start the next reader now
+    reader_alive = 0;
+
+    #ifdef ESP_PLATFORM
+    vTaskDelete(NULL);
+    #endif
+}
+
+#ifndef ESP_PLATFORM
+static void* host_reader(void* args)
+{
+    pthread_detach(pthread_self());
+    reader_task_fn(args);
+    return NULL;
+}
+#endif
+
+//*****************************************************************************
+// Protocol v2 helpers
+//*****************************************************************************
+
+static void put_msg(conn_t* c, uint8_t type, const void* payload, uint32_t len)
+{
+    tcp_file_server_msg_t m = { .type = type, .len = len };
+    memcpy(c->tx, &m, MSG_HDR_LEN);
+    memcpy(c->tx + MSG_HDR_LEN, payload, len);
+    c->tx_len = MSG_HDR_LEN + len;
+}
+
+// Answer the request with an error, the session carries on
+static void put_error(conn_t* c, esp_err_t e)
+{
+    int32_t code = e;
+    put_msg(c, TCP_FILE_SERVER_MSG_ERROR, &code, sizeof(code));
+    c->state = CONN_V2_END;
+}
+
+static void put_entry(conn_t* c)
+{
+    tcp_file_server_entry_t e = { .size = c->size, .crc32 = c->crc };
+    uint32_t name_len = strlen(c->name);
+    uint32_t meta_len = c->list_meta ? sizeof(tcp_file_server_meta_t) : 0;
+    tcp_file_server_msg_t m = { .type = TCP_FILE_SERVER_MSG_ENTRY, .len = sizeof(e) + meta_len + name_len };
+    uint8_t* p = c->tx;
+
+    memcpy(p, &m, MSG_HDR_LEN);
+    p += MSG_HDR_LEN;
+    memcpy(p, &e, sizeof(e));
+    p += sizeof(e);
+
+    if(meta_len)
+    {
+        tcp_file_server_meta_t meta = {0};
+        meta.created = c->entry.created;
+        meta.records = c->entry.records;
+        meta.flags = c->entry.flags;
+        meta.fmt = c->entry.fmt;
+        meta.n_bssids = c->entry.n_bssids;
+        memcpy(meta.bssids, c->entry.bssids, sizeof(meta.bssids));
+        memcpy(meta.ssid, c->entry.ssid, sizeof(meta.ssid));
+        memcpy(p, &meta, meta_len);
+        p += meta_len;
+    }
+
+    memcpy(p, c->name, name_len);
+    c->tx_len = MSG_HDR_LEN + m.len;
+    c->n_files++;
+}
+
+static uint8_t crc_cache_get(conn_t* c)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_FILES; ++i)
+    {
+        crc_cache_t* e = &crc_cache[i];
+        if(!strcmp(e->name, c->name) && e->size == c->size && e->mtime == c->mtime)
+        {
+            c->crc = e->crc;
+            return 1;
+        }
+    }
     return 0;
 }
 
-static uint8_t get_file_index()
+static void crc_cache_put(conn_t* c)
 {
     uint8_t i;
-    uint8_t num_recv = recv(client_socket, &i, 1, 0);
-    if(num_recv != 1 || i >= num_paths)
+    for(i = 0; i < MAX_FILES && strcmp(crc_cache[i].name, c->name); ++i);
+    if(i == MAX_FILES)
+    {
+        i = crc_cache_next;
+        crc_cache_next = (crc_cache_next + 1) % MAX_FILES;
+    }
+
+    strcpy(crc_cache[i].name, c->name);
+    crc_cache[i].size = c->size;
+    crc_cache[i].mtime = c->mtime;
+    crc_cache[i].crc = c->crc;
+}
+
+// Full path of c->name, 0 if it is on the mount, size and mtime filled in.
+// A file the catalog has no room for is served from a stat of it.
+static uint8_t find_name(conn_t* c, char* path, size_t path_len)
+{
+    struct stat st;
+
+    // Longer names are refused below, before path is looked at
+    snprintf(path, path_len, "%s/%.*s", MOUNT_PATH, CAPTURE_CATALOG_NAME_LEN, c->name);
+    if(capture_catalog_find(c->name, &c->entry) == ESP_OK)
+    {
+        c->size = c->entry.size;
+        c->mtime = c->entry.mtime;
+        return 0;
+    }
+
+    if(c->name[0] == '.' || strlen(c->name) > CAPTURE_CATALOG_NAME_LEN ||
+       stat(path, &st) || !S_ISREG(st.st_mode))
     {
-        file_to_send = 0;
         return 1;
     }
 
-    file_to_send = i;
+    memset(&c->entry, 0, sizeof(c->entry));
+    c->entry.flags = CAPTURE_CATALOG_FOREIGN;
+    c->size = st.st_size;
+    c->mtime = st.st_mtime;
     return 0;
 }
 
-// returns a 1 if the error caused should reset the tcp connection
-static void send_data(void)
+// Queue the ENTRY of c->name, or start reading it through for a CRC the
+// catalog does not have and that is not cached. Returns 0 if neither, the
+// file could not be opened and is left out.
+static uint8_t list_file(conn_t* c)
 {
-    uint8_t tx_buffer[256];
-    char path[33];
-    FILE* f = fopen(path_index+file_to_send*(MAX_PATH_LEN+1), "r");
+    char path[FULL_PATH_LEN + 1];
 
-    if(!f)
+    // The writer keeps the CRC of what it wrote, only files it did not
+    // write or lost power on are read through here
+    if(c->entry.flags & CAPTURE_CATALOG_CRC)
     {
-        ESP_LOGE(TAG, "In send_data - Failed to open %s", path);
-        return;
+        c->crc = c->entry.crc32;
+        put_entry(c);
+        return 1;
     }
 
-    size_t num_read = 0;
-    int still_sending = 1;
-    while(still_sending)
+    if(crc_cache_get(c))
     {
-        num_read = fread(tx_buffer, 1, 256, f);
-        if(num_read < 256)
+        put_entry(c);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%.*s", MOUNT_PATH, CAPTURE_CATALOG_NAME_LEN, c->name);
+    c->f = fopen(path, "r");
+    if(c->f)
+    {
+        c->crc = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Next file of the mount the catalog does not list, into c->name. Returns 0
+// at the end of the directory. One stat per file.
+static uint8_t scan_next(conn_t* c)
+{
+    char path[FULL_PATH_LEN + 1];
+    capture_catalog_entry_t e;
+    struct dirent* d;
+    struct stat st;
+
+    while((d = readdir(c->dir)) != NULL)
+    {
+        if(d->d_name[0] == '.' || strlen(d->d_name) > CAPTURE_CATALOG_NAME_LEN ||
+           capture_catalog_find(d->d_name, &e) == ESP_OK)
         {
-            still_sending = 0;
+            continue;
         }
 
-        ESP_LOGI(TAG, "Sending %d bytes ...", num_read);
-        if( send(client_socket, tx_buffer, num_read, 0) < 1)
+        snprintf(path, sizeof(path), "%s/%s", MOUNT_PATH, d->d_name);
+        if(stat(path, &st) || !S_ISREG(st.st_mode))
         {
-            ESP_LOGE(TAG, "In handle_file_req - Failed to send file data");
-            break;
+            continue;
         }
+
+        strcpy(c->name, d->d_name);
+        memset(&c->entry, 0, sizeof(c->entry));
+        c->entry.flags = CAPTURE_CATALOG_FOREIGN;
+        c->size = st.st_size;
+        c->mtime = st.st_mtime;
+        return 1;
     }
 
-    fclose(f);
+    return 0;
 }
 
-// Returns a 1 if the error caused should reset the tcp connection
-static uint8_t index_files(void)
+// Next step of a listing. Queues an ENTRY, or reads one chunk of a file the
+// catalog has no CRC for and that is not cached (nothing queued), or queues
+// LIST_END. Catalog entries go first. If the catalog ever ran out of room
+// the mount is scanned after them for the files it does not list, so those
+// can still be found and fetched.
+static void list_step(conn_t* c)
 {
-    DIR *d;
-    struct dirent *dir;
-    num_paths = 0;
+    capture_catalog_stats_t stats;
+
+    if(c->f)
+    {
+        size_t n = fread(crc_buf, 1, CRC_CHUNK, c->f);
+        c->crc = CRC32(c->crc, crc_buf, n);
+        c->last_us = NOW_US();
+        if(n)
+        {
+            return;
+        }
 
-    d = opendir(MOUNT_PATH);
-    if(d)
+        fclose(c->f);
+        c->f = NULL;
+        crc_cache_put(c);
+        put_entry(c);
+        return;
+    }
+
+    while(c->list_scan == SCAN_NONE && capture_catalog_get(c->list_pos, &c->entry) == ESP_OK)
     {
-        while((dir = readdir(d))!=NULL)
+        c->list_pos++;
+        strcpy(c->name, c->entry.name);
+        c->size = c->entry.size;
+        c->mtime = c->entry.mtime;
+        if(list_file(c))
         {
-            sprintf( path_index +num_paths*(MAX_PATH_LEN+1),  
-                      "%s/%s", 
-                      MOUNT_PATH, 
-                      dir->d_name );
-            ++num_paths;
-            // ESP_LOGI(TAG, "Indexed file %s", path_index + (num_paths-1)*(MAX_PATH_LEN+1));
-            if(num_paths == MAX_FILES)
+            return;
+        }
+    }
+
+    if(c->list_scan == SCAN_NONE)
+    {
+        capture_catalog_get_stats(&stats);
+        c->dir = stats.untracked ? opendir(MOUNT_PATH) : NULL;
+        c->list_scan = c->dir ? SCAN_DIR : SCAN_DONE;
+    }
+
+    while(c->list_scan == SCAN_DIR && scan_next(c))
+    {
+        if(list_file(c))
+        {
+            return;
+        }
+    }
+
+    if(c->dir)
+    {
+        closedir(c->dir);
+        c->dir = NULL;
+    }
+    c->list_scan = SCAN_DONE;
+
+    put_msg(c, TCP_FILE_SERVER_MSG_LIST_END, &c->n_files, sizeof(c->n_files));
+    c->state = CONN_V2_END;
+}
+
+static void v2_request(conn_t* c, tcp_file_server_msg_t* m, uint8_t* payload)
+{
+    char path[FULL_PATH_LEN + 1];
+    c->eof = 0;
+
+    if(m->type == TCP_FILE_SERVER_MSG_LIST)
+    {
+        c->list_pos = 0;
+        c->list_scan = SCAN_NONE;
+        c->list_meta = m->len && (payload[0] & TCP_FILE_SERVER_LIST_META);
+        c->n_files = 0;
+        c->state = CONN_V2_LIST;
+        return;
+    }
+
+    if(m->type != TCP_FILE_SERVER_MSG_GET || m->len <= sizeof(tcp_file_server_get_t))
+    {
+        put_error(c, ESP_ERR_INVALID_ARG);
+        return;
+    }
+
+    uint32_t name_len = m->len - sizeof(tcp_file_server_get_t);
+
+    memcpy(&c->get, payload, sizeof(tcp_file_server_get_t));
+    memcpy(c->name, payload + sizeof(tcp_file_server_get_t), name_len);
+    c->name[name_len] = 0;
+    if(strlen(c->name) != name_len || strchr(c->name, '/') || find_name(c, path, sizeof(path)))
+    {
+        put_error(c, ESP_ERR_NOT_FOUND);
+        return;
+    }
+
+    if(c->get.offset > c->size)
+    {
+        put_error(c, ESP_ERR_INVALID_ARG);
+        return;
+    }
+    if(c->get.len == 0 || c->get.len > c->size - c->get.offset)
+    {
+        c->get.len = c->size - c->get.offset;
+    }
+
+    c->f = fopen(path, "r");
+    if(c->f && fseek(c->f, c->get.offset, SEEK_SET))
+    {
+        fclose(c->f);
+        c->f = NULL;
+    }
+    if(!c->f)
+    {
+        put_error(c, ESP_FAIL);
+        return;
+    }
+
+    LOGI("%s [%lu +%lu] requested by %s ... sending", c->name,
+         (unsigned long) c->get.offset, (unsigned long) c->get.len, c->ip_addr);
+    c->crc = 0;
+    c->remaining = c->get.len;
+    start_stream(c, CONN_V2_DATA);
+}
+
+//*****************************************************************************
+// Per connection state machine. advance runs when the connection has nothing
+// left to send and either queues the next message or moves to the next state,
+// recv_req runs when a waiting connection is readable. Both return 1 if the
+// session is over.
+//*****************************************************************************
+
+static uint8_t advance(conn_t* c)
+{
+    switch(c->state)
+    {
+        case CONN_SEND_N:
+            c->state = CONN_WAIT_N;
+            return 0;
+
+        case CONN_SEND_PATHS:
+            if(c->cursor < c->num_paths)
             {
-                num_paths = 0;
-                return 1;
+                put_path(c, c->cursor++);
+                return 0;
             }
+            c->state = CONN_WAIT_REQ;
+            return 0;
+
+        case CONN_V2_LIST:
+            list_step(c);
+            return 0;
+
+        case CONN_V2_END:
+            c->state = CONN_V2_WAIT;
+            c->eof = 1;
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+// Returns how many bytes of rx the request being received needs in total
+static uint8_t rx_need(conn_t* c)
+{
+    if(c->v2)
+    {
+        tcp_file_server_msg_t m;
+        if(c->rx_len < MSG_HDR_LEN)
+        {
+            return MSG_HDR_LEN;
         }
-        closedir(d);
+        memcpy(&m, c->rx, MSG_HDR_LEN);
+        return (m.len > RX_SIZE - MSG_HDR_LEN) ? 0 : MSG_HDR_LEN + m.len;
+    }
+
+    // A query index byte is followed by the query itself
+    if(c->state == CONN_WAIT_REQ && c->rx_len && c->rx[0] == TCP_FILE_SERVER_QUERY_REQ)
+    {
+        return 1 + sizeof(tcp_file_server_query_t);
+    }
+    return 1;
+}
+
+static uint8_t recv_req(conn_t* c)
+{
+    char path[FULL_PATH_LEN + 1];
+    uint8_t need = rx_need(c);
+    if(need == 0)
+    {
+        LOGE("Request from %s too long", c->ip_addr);
+        return 1;
+    }
+
+    int n = recv(c->sock, c->rx + c->rx_len, need - c->rx_len, MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        return 1;
+    }
+    if(n < 0)
+    {
+        return 0;
+    }
+
+    c->rx_len += n;
+    c->last_us = NOW_US();
+
+    need = rx_need(c);
+    if(need == 0)
+    {
+        LOGE("Request from %s too long", c->ip_addr);
+        return 1;
+    }
+    if(c->rx_len < need)
+    {
+        return 0;
+    }
+    c->rx_len = 0;
+
+    if(c->v2)
+    {
+        tcp_file_server_msg_t m;
+        memcpy(&m, c->rx, MSG_HDR_LEN);
+        v2_request(c, &m, c->rx + MSG_HDR_LEN);
+        return 0;
+    }
+
+    if(c->state == CONN_WAIT_N)
+    {
+        if(c->rx[0] != c->num_paths) { return 1; }
+
+        LOGI("Files Indexed, Client %s Synced - Presenting Files", c->ip_addr);
+        c->cursor = 0;
+        c->state = CONN_SEND_PATHS;
+        return 0;
+    }
+
+    uint8_t is_query = c->rx[0] == TCP_FILE_SERVER_QUERY_REQ;
+    if(is_query)
+    {
+        memcpy(&c->query, c->rx + 1, sizeof(tcp_file_server_query_t));
+        c->file = c->query.index;
     }
     else
+    {
+        c->file = c->rx[0];
+    }
+
+    if(c->file >= c->num_paths)
     {
         return 1;
     }
 
+    if(capture_catalog_find_id(c->ids[c->file], &c->entry) != ESP_OK)
+    {
+        LOGE("(%d) was deleted since %s was shown it", c->file, c->ip_addr);
+        return 1;
+    }
+    strcpy(c->name, c->entry.name);
+    snprintf(path, sizeof(path), "%s/%s", MOUNT_PATH, c->name);
+
+    LOGI("(%d) %s requested by %s ... sending", c->file, path, c->ip_addr);
+
+    if(is_query)
+    {
+        if(open_query(c, path)) { return 1; }
+    }
+    else
+    {
+        c->f = fopen(path, "r");
+        if(!c->f)
+        {
+            LOGE("Failed to open %s", path);
+            return 1;
+        }
+    }
+
+    // The requested path goes out ahead of the data
+    put_path(c, c->file);
+    start_stream(c, is_query ? CONN_SEND_QUERY : CONN_SEND_FILE);
     return 0;
 }
 
-static uint8_t create_listening_socket()
+// The reader is done with a streaming session. Log the throughput, then v1
+// is over and v2 closes the range with DATA_END.
+static uint8_t end_stream(conn_t* c)
 {
-    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if(listen_sock < 0)
+    int64_t ms = (NOW_US() - c->xfer_us) / 1000;
+    LOGI("%s: %lu bytes in %lld ms, %lu KB/s", c->name,
+         (unsigned long) c->xfer_bytes, (long long) ms,
+         (unsigned long) ((uint64_t) c->xfer_bytes * 1000 / 1024 / (ms ? ms : 1)));
+
+    if(!c->v2)
     {
-        ESP_LOGE(TAG, "Failed to open listening socket");
+        c->eof = 1;
         return 1;
     }
 
+    tcp_file_server_data_end_t end = {
+        .offset = c->get.offset,
+        .len = c->get.len - c->remaining,
+        .crc32 = c->crc,
+        .size = c->size
+    };
+    put_msg(c, TCP_FILE_SERVER_MSG_DATA_END, &end, sizeof(end));
+
+    LOCK();
+    c->streaming = 0;
+    UNLOCK();
+    c->state = CONN_V2_END;
+    fclose(c->f);
+    c->f = NULL;
+    return 0;
+}
+
+// Send what is left of the control message, else of the head read ahead
+// buffer, queueing the next control message first if a non streaming session
+// has none. At most one send per connection per loop so every download gets
+// its turn.
+static uint8_t send_chunk(conn_t* c)
+{
+    uint8_t* p;
+    uint16_t len;
+    int16_t b = -1;
+
+    if(c->tx_len == 0 && !is_streaming(c))
+    {
+        if(advance(c)) { return 1; }
+    }
+
+    if(c->tx_len)
+    {
+        p = c->tx + c->tx_off;
+        len = c->tx_len - c->tx_off;
+    }
+    else if(is_streaming(c))
+    {
+        LOCK();
+        uint8_t n_bufs = c->fifo_n;
+        uint8_t done = c->rd_done;
+        b = c->fifo[c->fifo_head];
+        UNLOCK();
+
+        if(n_bufs == 0)
+        {
+            return done ? end_stream(c) : 0;
+        }
+        p = bufs[b] + c->buf_off;
+        len = buf_len[b] - c->buf_off;
+    }
+    else
+    {
+        return 0;
+    }
+
+    int n = send(c->sock, p, len, MSG_DONTWAIT);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    if(n <= 0)
+    {
+        LOGE("Failed to send to %s", c->ip_addr);
+        return 1;
+    }
+
+    c->bytes_sent += n;
+    c->last_us = NOW_US();
+
+    if(b < 0)
+    {
+        c->tx_off += n;
+        if(c->tx_off == c->tx_len)
+        {
+            c->tx_off = 0;
+            c->tx_len = 0;
+        }
+        return 0;
+    }
+
+    c->xfer_bytes += n;
+    c->buf_off += n;
+    if(c->buf_off == buf_len[b])
+    {
+        // Buffer out, back to the pool for the reader
+        c->buf_off = 0;
+        LOCK();
+        c->fifo_head = (c->fifo_head + 1) % DEPTH;
+        c->fifo_n--;
+        free_bufs[n_free++] = b;
+        UNLOCK();
+        WAKE_READER();
+    }
+
+    return 0;
+}
+
+// Whether the loop should wait for the socket to be writable. A streaming
+// session with nothing read ahead waits on the reader instead.
+static uint8_t is_sending(conn_t* c)
+{
+    if(is_streaming(c))
+    {
+        LOCK();
+        uint8_t ready = c->tx_len || c->fifo_n || c->rd_done;
+        UNLOCK();
+        return ready;
+    }
+
+    return c->state == CONN_SEND_N || c->state == CONN_SEND_PATHS ||
+           c->state == CONN_V2_LIST || c->state == CONN_V2_END;
+}
+
+//*****************************************************************************
+// Listening sockets and the reactor handler
+//*****************************************************************************
+
+static int create_listening_socket(uint16_t port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if(sock < 0)
+    {
+        LOGE("Failed to open listening socket");
+        return -1;
+    }
+
     int opt = 1;
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    ESP_LOGI(TAG, "Listening Socket Created");
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    LOGI("Listening Socket Created");
 
     struct sockaddr_storage dest_addr;
     struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
+    memset(&dest_addr, 0, sizeof(dest_addr));
     dest_addr_ip4->sin_addr.s_addr = inet_addr(CONFIG_TCP_SERVER_IP);
     dest_addr_ip4->sin_family = AF_INET;
-    dest_addr_ip4->sin_port = htons(CONFIG_TCP_SERVER_PORT);
-    int err = bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    err |= listen(listen_sock, 1);
-    
+    dest_addr_ip4->sin_port = htons(port);
+    int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    err |= listen(sock, MAX_CONNS);
+
     if(err)
     {
-        ESP_LOGE(TAG, "Failed to bind listening socket");
-        return 1;
+        LOGE("Failed to bind listening socket");
+        close(sock);
+        return -1;
     }
 
-    ESP_LOGI(TAG, "Listening socket bound to %s:%d", CONFIG_TCP_SERVER_IP, CONFIG_TCP_SERVER_PORT);
-    return 0;
+    LOGI("Listening socket bound to %s:%d", CONFIG_TCP_SERVER_IP, port);
+    return sock;
+}
+
+static void close_listening_sockets(void)
+{
+    if(listen_sock >= 0)    { close(listen_sock); }
+    if(listen_sock_v2 >= 0) { close(listen_sock_v2); }
+    listen_sock = -1;
+    listen_sock_v2 = -1;
 }
 
-static uint8_t accept_client_connection(void)
+static void accept_client_connection(int lsock, uint8_t v2)
 {
     struct sockaddr_in source_addr;
     socklen_t addr_len = sizeof(source_addr);
+    uint8_t i;
 
-    client_socket = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-    if (client_socket < 0) {
-        ESP_LOGE(TAG, "Unable to accept connection: %s", strerror(errno));
-        return 1;
+    int sock = accept(lsock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        LOGE("Unable to accept connection: %s", strerror(errno));
+        return;
     }
 
-    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, ip_addr, 16);
-    ESP_LOGI(TAG, "Client Connected %s - Starting Session", ip_addr);
-    return 0;
+    for(i = 0; i < MAX_CONNS && conns[i].state != CONN_FREE; ++i);
+    if(i == MAX_CONNS)
+    {
+        LOGE("All %d client slots busy, refusing connection", MAX_CONNS);
+        close(sock);
+        return;
+    }
+
+    conn_t* c = &conns[i];
+    LOCK();
+    memset(c, 0, sizeof(conn_t));
+    UNLOCK();
+    c->sock = sock;
+    c->v2 = v2;
+    c->start_us = NOW_US();
+    c->last_us = c->start_us;
+    inet_ntoa_r(source_addr.sin_addr, c->ip_addr, 16);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    LOGI("Client Connected %s - Starting v%d Session in slot %d", c->ip_addr, v2 ? 2 : 1, i);
+
+    if(v2)
+    {
+        c->state = CONN_V2_WAIT;
+        c->eof = 1;
+        return;
+    }
+
+    c->state = CONN_SEND_N;
+    index_files(c);
+    c->tx[0] = c->num_paths;
+    c->tx_len = 1;
 }
 
-// Init the listening socket, bind it to our static IP and port
-static void client_handler_task(void* args)
+// Every session that can make progress on its socket. A streaming session
+// with nothing to send waits on the reader instead.
+static int fs_fill(void* ctx, fd_set* rfds, fd_set* wfds)
 {
-    running = 1;
+    uint8_t i;
+    (void) ctx;
+    if(!running)
+    {
+        return -1;
+    }
+
+    int max_fd = (listen_sock > listen_sock_v2) ? listen_sock : listen_sock_v2;
+    FD_SET(listen_sock, rfds);
+    FD_SET(listen_sock_v2, rfds);
+
+    for(i = 0; i < MAX_CONNS; ++i)
+    {
+        conn_t* c = &conns[i];
+        if(c->state == CONN_FREE || c->state == CONN_CLOSING) { continue; }
+
+        uint8_t tx = is_sending(c);
+        if(!tx && is_streaming(c)) { continue; }    // Waiting on the reader
+
+        FD_SET(c->sock, tx ? wfds : rfds);
+        if(c->sock > max_fd) { max_fd = c->sock; }
+    }
+
+    return max_fd;
+}
+
+static void fs_ready(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    (void) ctx;
+    if(!running)
+    {
+        return;
+    }
 
-    if(create_listening_socket()) {running = 0;}
-    
-    while(running)
+    for(i = 0; i < MAX_CONNS; ++i)
     {
-        if( accept_client_connection() ) {continue;}
+        conn_t* c = &conns[i];
+        if(c->state == CONN_FREE || c->state == CONN_CLOSING) { continue; }
+
+        uint8_t done = 0;
+        if(FD_ISSET(c->sock, rfds))
+        {
+            done = recv_req(c);
+        }
+        else if(FD_ISSET(c->sock, wfds))
+        {
+            done = send_chunk(c);
+        }
 
+        if(done)
+        {
+            conn_close(c, c->eof ? "done" : "reset");
+        }
+    }
 
-        if( index_files() ) { goto cleanup; }
-        if( send_N() )      { goto cleanup; }
-        if( get_N()  )      { goto cleanup; }
+    // Last, a new socket may have the number of one served above
+    if(FD_ISSET(listen_sock, rfds))
+    {
+        accept_client_connection(listen_sock, 0);
+    }
+    if(FD_ISSET(listen_sock_v2, rfds))
+    {
+        accept_client_connection(listen_sock_v2, 1);
+    }
+}
 
-        ESP_LOGI(TAG, "Files Indexed, Client Synced - Presenting Files");
+// Drop sessions past the timeout and reap closed ones the reader let go of.
+// After a kill close every session and the listening sockets, all on the
+// reactor task, and come off it once every slot is free.
+static int32_t fs_poll(void* ctx)
+{
+    uint8_t i;
+    uint8_t closing = 0;
+    int64_t now = NOW_US();
+    (void) ctx;
 
-        if( send_file_paths() )               { goto cleanup; }
-        if( get_file_index()  )               { goto cleanup; }
-        if( send_indexed_path(file_to_send) ) { goto cleanup; }
-            
-        ESP_LOGI(TAG, "(%d) %s requested ... sending", file_to_send, path_index + file_to_send*(MAX_PATH_LEN+1));
+    for(i = 0; i < MAX_CONNS; ++i)
+    {
+        conn_t* c = &conns[i];
+        if(c->state == CONN_FREE) { continue; }
 
-        send_data();
+        if(c->state == CONN_CLOSING)
+        {
+            conn_reap(c);
+        }
+        else if(!running)
+        {
+            conn_close(c, "reset, server killed");
+        }
+        else if(now - c->last_us > TIMEOUT_US)
+        {
+            conn_close(c, "timed out");
+        }
 
-        // Clean up sesion resources
-        cleanup:
-        ESP_LOGI(TAG, "Client Connection Reset");
-        shutdown(client_socket, 0);
-        close(client_socket);
+        if(c->state == CONN_CLOSING) { closing = 1; }
     }
 
-    // Clean up listening socket resources including this task. We force the
-    // client to disconnect from the Soc AP here (if it that isnt what caused)
-    // us to get here.
-    running = 0;
-    close(listen_sock);
-    ESP_LOGI(TAG, "TCP File Server Task Exiting ...");
-    vTaskDelete(NULL);
+    // The reader wakes the loop when it lets go, the wait is a backstop
+    if(closing)
+    {
+        return SELECT_MS;
+    }
+    if(running)
+    {
+        return NET_REACTOR_FOREVER;
+    }
+
+    close_listening_sockets();
+    serving = 0;            // Lets the reader exit, the loop wakes it no more
+    LOGI("TCP File Server Exiting ...");
+    return NET_REACTOR_REMOVE;
 }
 
+static const net_reactor_handler_t fs_handler =
+{
+    .name = "tcp_file_server",
+    .fill = fs_fill,
+    .ready = fs_ready,
+    .poll = fs_poll,
+};
+
 //*****************************************************************************
 // Start and Stop API funcs
 //*****************************************************************************
 
 esp_err_t tcp_file_server_launch(char* mount_path)
 {
-    if(running)
+    if(running || serving)
+    {
+        LOGE("already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The reader of the last run can still be in its wait or a read after
+    // the handler left the reactor, a second one would share its sessions
+    uint32_t waited;
+    for(waited = 0; reader_alive && waited < READER_EXIT_MS; waited += 10)
     {
-        ESP_LOGE(TAG, "already running");
+        SLEEP_MS(10);
+    }
+    if(reader_alive)
+    {
+        LOGE("reader of the last run still exiting");
         return ESP_ERR_INVALID_STATE;
     }
-    if(strnlen(mount_path, 32) > 32)
+
+    if(strnlen(mount_path, MAX_PATH_LEN + 1) > MAX_PATH_LEN)
     {
-        ESP_LOGE(TAG, "File system mount path passed to long");
+        LOGE("File system mount path passed to long");
         return ESP_ERR_INVALID_ARG;
     }
 
+    // Listings come out of the catalog. main inits it at boot, a host build
+    // gets it here.
+    esp_err_t err = capture_catalog_init(mount_path);
+    if(err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+    {
+        LOGE("No catalog of %s", mount_path);
+        return err;
+    }
+
     strcpy(MOUNT_PATH, mount_path);
-    memset(&handler_task, 0, sizeof(TaskHandle_t));
-    xTaskCreate(client_handler_task, "tcp_server", 4096, NULL, CONFIG_TCP_SERVER_PRIO, &handler_task);
-    
-    if(!handler_task)
+
+    uint8_t i;
+    for(i = 0; i < N_BUFS; ++i)
+    {
+        free_bufs[i] = i;
+    }
+    n_free = N_BUFS;
+
+    listen_sock = create_listening_socket(CONFIG_TCP_SERVER_PORT);
+    listen_sock_v2 = create_listening_socket(CONFIG_TCP_SERVER_V2_PORT);
+    if(listen_sock < 0 || listen_sock_v2 < 0)
+    {
+        close_listening_sockets();
+        return ESP_FAIL;
+    }
+
+    #ifndef ESP_PLATFORM
+    sem_init(&reader_sem, 0, 0);
+    #endif
+
+    serving = 1;
+    running = 1;
+    reader_alive = 1;
+
+    #ifdef ESP_PLATFORM
+    if(xTaskCreate(reader_task_fn, "tcp_server_rd", 3072, NULL, CONFIG_TCP_SERVER_PRIO, &reader_task) != pdPASS)
+    #else
+    if(pthread_create(&reader_task, NULL, host_reader, NULL))
+    #endif
     {
-        ESP_LOGE(TAG,"Failed to start TCP File Server Task");
+        LOGE("Failed to start the read ahead task");
+        reader_alive = 0;
+        running = 0;
+        serving = 0;
+        close_listening_sockets();
         return ESP_ERR_NO_MEM;
     }
 
-    ESP_LOGI(TAG, "TCP File Server Task Launched");
+    // The sessions are served by the reactor from here on
+    err = net_reactor_add(&fs_handler);
+    if(err != ESP_OK)
+    {
+        LOGE("Failed to put the TCP File Server on the reactor");
+        running = 0;
+        serving = 0;
+        close_listening_sockets();
+        return err;
+    }
+
+    LOGI("TCP File Server Launched");
     return ESP_OK;
 }
 
@@ -290,13 +1468,13 @@ esp_err_t tcp_file_server_kill(void)
 {
     if(!running)
     {
-        ESP_LOGE(TAG, "not running");
+        LOGE("not running");
         return ESP_ERR_INVALID_STATE;
     }
 
+    // The next poll of the handler closes every socket itself
     running = 0;
-    close(client_socket);
-    close(listen_sock);
+    net_reactor_wake();
 
     return ESP_OK;
 }
@@ -306,6 +1484,7 @@ esp_err_t tcp_file_server_kill(void)
 // REPL test driver functions
 //*****************************************************************************
 
+#ifdef ESP_PLATFORM
 int do_tcp_file_server_launch(int argc, char** argv)
 {
     if(argc != 2)
@@ -323,4 +1502,5 @@ int do_tcp_file_server_kill(int argc, char** argv)
 {
     ESP_ERROR_CHECK(tcp_file_server_kill());
     return 0;
-}
\ No newline at end of file
+}
+#endif
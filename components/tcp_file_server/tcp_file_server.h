@@ -1,52 +1,79 @@
 //*****************************************************************************
-// TCP File Server. The main state machine driving this component is rather 
-// simple. When a station connects we launch a task that opens a tcp server
-// listneing port. Upon connection of a tcp client we simply stop listening
-// and handle that client. This implies we can have only a single client at
-// a time. Now in TCP session the loop is simple. Send all the files on the
-// device and wait for a response in the form of requested file. If the file
-// exits send it and go back to sending the list of files.
+// TCP File Server. When a station connects we open a tcp server listening
+// port and hand it to the net reactor (see net_reactor.h), whose one select
+// loop serves every client session next to the REPL's sockets. Up to
+// CONFIG_TCP_SERVER_MAX_CLIENTS sessions run at once, a client beyond that is
+// closed right after accept. In each session the loop is simple. Send all
+// the files on the device and wait for a response in the form of requested
+// file. If the file exits send it and close the session.
 //
 // |-------------|    |----------------------------|    |---------------------|
-// | API Launch  |--->| Launch Client Handler Task |--->| Open Listening Port |
+// | API Launch  |--->| Open Listening Port        |--->| Add Reactor Handler |
 // |-------------|    |----------------------------|    |---------------------|
 //                                                              |
-//                                                              |
-//                                                              |
 //                                                              V
-// |-----------------|    |----------------------|    |---------------------|
-// | Fufil File Reqs |<---| Present Stored Files |<---|    Accept Conn      |
-// |-----------------|    |----------------------|    |---------------------|
-//          |                                                    ^ 
-//          |                                                    |
-//          |                                                    |
-//          V                                                    |
-// |--------------------------|                                  |
-// | Handle Client Disconnect |----------------------------------- 
-// |--------------------------|
-//
-//
-// Failures) If anything happens in the first row i.e. we cant launch the conn 
-//           handler or can't open the listening port, this indicates very bad 
-//           system / config failures beyond our control and we simply kill the
-//           the tcp server task
-//
-//           Once the Listening port is opened, failures can be handled by the
-//           catch all of "handle client disconnect" that frees up any client
-//           resources and returns to the listening state.
-//
-//           A STA disconnect event will not interrupt the starting of the
-//           client handler task or the starting of the listening port. Once
-//           the listening port is open, a client disconnect will trigger a
-//           graceful shutdown of the client handle thread and the listening
-//           port.
+//                    |--------------------------------------------------------|
+//                    |                 reactor select loop                    |
+//                    |--------------------------------------------------------|
+//                       |  readable          |  readable / writable   | poll
+//                       V                    V                        V
+//               |-------------|    |--------------------|    |----------------|
+//               | Accept Conn |    | Step that session's|    | Drop sessions  |
+//               | into a slot |    | state machine      |    | past timeout   |
+//               |-------------|    |--------------------|    |----------------|
+//
+// Sessions) Each session is a small state machine over non blocking sockets:
+//
+//     SEND_N -> WAIT_N -> SEND_PATHS -> WAIT_REQ -> SEND_FILE or SEND_QUERY
+//
+//           The path table and the v2 listing come out of the capture catalog
+//           (see capture_catalog.h), so sessions do not scan the FS. A v1
+//           session keeps the catalog ids of the table it was shown, files
+//           created or deleted after that do not shift its indexes. Files
+//           created while the catalog was full are not in it: a v2 listing
+//           then scans the mount after the catalog entries for them, and a
+//           v2 GET of a name the catalog does not know stats the file. v1
+//           only sees catalog files.
+//
+//           A session never blocks the loop. Sending sessions get at most one
+//           send per pass, so a fast client can not starve a slow one and a
+//           stalled client only holds its own slot. Each session has its own
+//           path table, file handles and a byte counter that is logged when it
+//           closes. A session that makes no progress for
+//           CONFIG_TCP_SERVER_CLIENT_TIMEOUT_MS is dropped. A closed session
+//           whose file the reader is still reading keeps its slot until the
+//           read is done, the loop never waits for it.
+//
+// Read Ahead) File data is never read by the loop. A reader task fills a pool
+//           of CONFIG_TCP_SERVER_READ_AHEAD_BUFS buffers, each
+//           CONFIG_TCP_SERVER_BUF_SEGS TCP segments long, for the downloading
+//           sessions round robin, while the loop sends the ones filled before.
+//           Flash reads and wifi sends so overlap instead of taking turns, and
+//           every send hands lwip whole segments. The reader wakes the loop
+//           with net_reactor_wake. The end of each transfer logs its
+//           bytes, time and KB/s.
+//
+//                |--------|  fill  |-------------|  send  |--------|
+//                | Reader |------->| Buffer Pool |------->|  Loop  |
+//                |--------|        |-------------|        |--------|
+//                     ^                                        |
+//                     |------------ buffer sent, free ---------|
+//
+// Failures) If anything happens in the first row i.e. we can't open the
+//           listening port or start the reader, this indicates very bad
+//           system / config failures beyond our control and launch fails
+//           without serving anything.
+//
+//           Once the Listening port is opened, failures only reset the session
+//           they happen in, freeing its slot and file handles.
 //
 // State) The state is rather small for this component:
-//            -> Task and Task Handler
-//            -> Two sockets, one listening one active client session
-//            -> indicator variable "running"
-//            -> IP Addr of conneted session
-//            -> The path to search for files
+//            -> The reactor handler and indicator variables "running" and
+//               "serving", a kill is finished by the handler's next poll
+//            -> The listening sockets
+//            -> The reader task and its buffer pool
+//            -> A fixed table of session slots (socket, IP, state, files)
+//            -> The path to search for files, listed by the capture catalog
 //
 // Assumptions) We assume the esp wifi module is properly inited. And we are
 //              on the same network as a client wishing to connect.
@@ -69,18 +96,18 @@
 //          File Path N-1 [N-1, d_0, ... , d_31]
 //   ----------------------------------------------->
 //
-//                      File i [i]
+//              File i [i] or Query [255, q_0, ... , q_23]
 //   <-----------------------------------------------
 //
 //            File Path i [i, d_0, ... , d_31]
 //   ----------------------------------------------->
 //
-//            File Data [d_0, ... , d_255]
+//            File Data [d_0, ... , d_n-1]
 //   ------------------------------------------------>
 //
 //                         ....
 //
-//            File Data [d_0, ... , d_n-1]
+//            File Data [d_0, ... , d_m-1]
 //   ------------------------------------------------>
 //
 //                        Close
@@ -93,21 +120,176 @@
 //                   no NULL char. Note index is only valid for one transaction
 //                   i.e. Alive -> CRC. 33 bytes always.
 //    - File i     : One byte with file index.
-//    - File Data  : 256 bytes of file data, up until last message which could 
-//                   be 1 to 256 bytes.                        
+//    - File Data  : The rest of the stream is file data, the session closes
+//                   after the last byte. It goes out in read ahead buffers, so
+//                   clients must not rely on any chunking.
+//    - Query      : Instead of a file index the client can send 255 followed
+//                   by a tcp_file_server_query_t. The server then reads the
+//                   sidecar index of file q.index (see capture_index.h) and
+//                   the File Data is the capture file header followed by only
+//                   the spans that overlap the time window and / or saw the
+//                   BSSID. The result is itself a valid capture file, and the
+//                   cost of the transfer scales with what matched, not with
+//                   the size of the capture. Pull the .idx file first to see
+//                   what time range and BSSIDs a capture holds.
+//
+// Protocol v2) Served next to v1 on CONFIG_TCP_SERVER_V2_PORT (422). Every
+//              message in both directions is a tcp_file_server_msg_t header
+//              (type, payload len) and its payload, all little endian. A
+//              session serves any number of requests until the client closes.
+//
+//  SERVER                                                      CLIENT
+//
+//                        LIST [flags]
+//   <-----------------------------------------------------------
+//
+//       ENTRY [size, crc32, (meta), name]  (one per file, no limit)
+//   ----------------------------------------------------------->
+//
+//                       LIST_END [n_files]
+//   ----------------------------------------------------------->
+//
+//                   GET [offset, len, name]
+//   <-----------------------------------------------------------
+//
+//    DATA [d_0, ... , d_n-1]  (a read ahead buffer less the 8 byte header)
+//   ----------------------------------------------------------->
+//
+//                             ....
+//
+//            DATA_END [offset, len, crc32 of range, size]
+//   ----------------------------------------------------------->
+//
+//    - Names      : File names relative to the mount path, no '/' allowed.
+//    - CRC32      : zlib / ethernet CRC of the whole file in ENTRY, of the
+//                   bytes sent in DATA_END. The listing CRCs come from the
+//                   catalog, the capture writer computes them as it writes.
+//                   Files it did not write have theirs computed a chunk at a
+//                   time between other sessions' sends and cached by name,
+//                   size and mtime, so listing again is cheap.
+//    - Meta       : LIST with TCP_FILE_SERVER_LIST_META in its optional flags
+//                   byte gets a tcp_file_server_meta_t in every ENTRY with the
+//                   catalog's creation time, record count, SSID and BSSIDs.
+//    - Resume     : A client that lost a transfer GETs again from the offset
+//                   it got to and checks the whole file against the listing
+//                   CRC. A len of 0 means to the end of the file.
+//    - Errors     : ERROR [esp_err_t] answers a bad request, the session
+//                   stays open.
+//
+//              host/ builds the server for Linux together with a reference
+//              client (fs_client) that lists, pulls and resumes.
 //*****************************************************************************
 
 #pragma once
-#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+    #include "esp_err.h"
+#else
+    typedef int esp_err_t;
+    #define ESP_OK 0
+    #define ESP_FAIL -1
+    #define ESP_ERR_NO_MEM 0x101
+    #define ESP_ERR_INVALID_ARG 0x102
+    #define ESP_ERR_INVALID_STATE 0x103
+    #define ESP_ERR_NOT_FOUND 0x105
+
+    #ifndef CONFIG_TCP_SERVER_IP
+        #define CONFIG_TCP_SERVER_IP "127.0.0.1"
+    #endif
+    #ifndef CONFIG_TCP_SERVER_PORT
+        #define CONFIG_TCP_SERVER_PORT 4200
+    #endif
+    #ifndef CONFIG_TCP_SERVER_V2_PORT
+        #define CONFIG_TCP_SERVER_V2_PORT 4220
+    #endif
+    #define CONFIG_TCP_SERVER_PRIO 5
+    #define CONFIG_TCP_SERVER_MAX_CLIENTS 4
+    #define CONFIG_TCP_SERVER_CLIENT_TIMEOUT_MS 10000
+    #define CONFIG_TCP_SERVER_READ_AHEAD_BUFS 6
+    #define CONFIG_TCP_SERVER_BUF_SEGS 2
+#endif
+
+#define TCP_FILE_SERVER_QUERY_REQ 0xff
+#define TCP_FILE_SERVER_QUERY_TIME 0x01     // Match on t_start_us .. t_end_us
+#define TCP_FILE_SERVER_QUERY_BSSID 0x02    // Match on bssid
+
+typedef struct
+{
+    uint8_t index;          // File index from the file path list
+    uint8_t flags;          // TCP_FILE_SERVER_QUERY_*, 0 = whole capture
+    uint8_t bssid[6];
+    uint64_t t_start_us;    // Inclusive, same time base as the index
+    uint64_t t_end_us;
+} tcp_file_server_query_t;
+
+#define TCP_FILE_SERVER_NAME_LEN 64         // Max v2 file name
+#define TCP_FILE_SERVER_LIST_META 0x01      // LIST flag, ENTRYs carry tcp_file_server_meta_t
+
+typedef enum
+{
+    TCP_FILE_SERVER_MSG_LIST = 0x01,        // Client, optional uint8_t flags
+    TCP_FILE_SERVER_MSG_GET = 0x02,         // Client, tcp_file_server_get_t + name
+    TCP_FILE_SERVER_MSG_ENTRY = 0x81,       // tcp_file_server_entry_t + (meta) + name
+    TCP_FILE_SERVER_MSG_LIST_END = 0x82,    // uint32_t n_files
+    TCP_FILE_SERVER_MSG_DATA = 0x83,        // File bytes
+    TCP_FILE_SERVER_MSG_DATA_END = 0x84,    // tcp_file_server_data_end_t
+    TCP_FILE_SERVER_MSG_ERROR = 0xFF,       // int32_t esp_err_t
+} tcp_file_server_msg_type_t;
+
+typedef struct
+{
+    uint8_t type;           // tcp_file_server_msg_type_t
+    uint8_t reserved;
+    uint16_t reserved2;
+    uint32_t len;           // Payload bytes following the header
+} tcp_file_server_msg_t;
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;           // 0 = to the end of the file
+} tcp_file_server_get_t;
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t crc32;
+} tcp_file_server_entry_t;
+
+// Catalog meta data of a file, see capture_catalog.h
+typedef struct
+{
+    uint32_t created;       // Unix secs, secs since boot if the clock was not set
+    uint32_t records;       // Records written, frames for pcap(ng)
+    uint8_t flags;          // CAPTURE_CATALOG_*
+    uint8_t fmt;            // capture_writer_fmt_t
+    uint8_t n_bssids;
+    uint8_t reserved;
+    uint8_t bssids[4][6];
+    char ssid[33];          // May be empty
+    uint8_t reserved2[3];
+} tcp_file_server_meta_t;
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t len;           // Bytes sent
+    uint32_t crc32;         // Of the bytes sent
+    uint32_t size;          // File size when the range was read
+} tcp_file_server_data_end_t;
 
 //*****************************************************************************
-// tcp_file_server) Creates the file server handler task. Assumes the wifi
-//                  esp driver is inited.
+// tcp_file_server) Opens the listening ports and puts the file server on the
+//                  net reactor. Assumes the wifi esp driver is inited and
+//                  net_reactor_init was called.
 //
 // mount_path) Path to look for files to send over the network. Checks len.
 //
-// Returns ESP_OK if task created, mount path is good and could succesfully
-//         start the server.
+// Returns ESP_OK if the handler is on the reactor, mount path is good and
+//         could succesfully start the server. A launch right after a kill
+//         waits for the read ahead task of the last run to exit, INVALID_STATE
+//         if it does not within a few hundred ms.
 //*****************************************************************************
 esp_err_t tcp_file_server_launch(char* mount_path);
 
@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "telemetry.h"
+#include "net_reactor.h"
+#include "capture_writer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "lwip/sockets.h"
+
+static const char* TAG = "Telemetry";
+
+#define MAX_CLIENTS CONFIG_TELEMETRY_MAX_CLIENTS
+#define MAX_TASKS CONFIG_TELEMETRY_MAX_TASKS
+#define TX_SIZE CONFIG_TELEMETRY_CLIENT_BUF
+
+// Fits a TASKS record, the longest, and a sample of every field
+#define REC_SIZE (64 + MAX_TASKS * (5 + 1 + TELEMETRY_TASK_NAME_LEN + 2))
+
+_Static_assert(MAX_TASKS <= TELEMETRY_MAX_TASKS, "more tasks than a reader takes");
+_Static_assert(TX_SIZE >= REC_SIZE + 16, "telemetry client buffer smaller than HELLO and TASKS");
+_Static_assert(REC_SIZE <= CONFIG_CAPTURE_WRITER_BUF_SIZE, "telemetry record bigger than a capture writer buffer");
+
+typedef struct
+{
+    int sock;                       // -1 when free
+    char ip_addr[16];
+    uint8_t sync_due;               // HELLO or TASKS was dropped, send both again
+    uint32_t records;
+    uint32_t drops;
+    uint64_t bytes_sent;
+
+    uint8_t tx[TX_SIZE];            // Whole records, tx_off of tx_len sent
+    uint16_t tx_off;
+    uint16_t tx_len;
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+static int listen_sock = -1;
+static volatile uint8_t running = 0;        // Launched and not killed
+static volatile uint8_t serving = 0;        // On the reactor, until the poll after a kill
+static volatile uint32_t interval_ms = CONFIG_TELEMETRY_INTERVAL_MS;
+static volatile uint8_t hello_due = 0;      // Interval changed
+static telemetry_source_t source = NULL;
+static telemetry_stats_t stats;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t rec[REC_SIZE];               // Record being built, reactor task only
+static uint32_t seq;
+static int64_t next_us;                     // When the next sample is due
+
+static uint8_t flash_on = 0;
+static uint8_t flash_stream;                // Capture writer stream on the flash log
+
+// Tasks of the last sample
+static uint8_t n_tasks;
+static uint32_t task_id[MAX_TASKS];
+static char task_name[MAX_TASKS][TELEMETRY_TASK_NAME_LEN];
+static uint32_t task_rt[MAX_TASKS];         // Run time counter
+static uint16_t task_cpu[MAX_TASKS];        // 1/1000 of a core over the interval
+static uint32_t total_rt;
+static uint8_t have_rt;                     // task_rt and total_rt are of the last sample
+static uint8_t cpu_ok;                      // task_cpu is over one interval, else no tasks go out
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+static TaskStatus_t status[MAX_TASKS];
+#endif
+
+//*****************************************************************************
+// Records
+//*****************************************************************************
+
+static int build_hello(void)
+{
+    telemetry_enc_t e;
+    telemetry_enc_begin(&e, rec, sizeof(rec), TELEMETRY_REC_HELLO);
+    telemetry_enc_u32(&e, TELEMETRY_MAGIC);
+    telemetry_enc_u8(&e, TELEMETRY_VERSION);
+    telemetry_enc_varint(&e, interval_ms);
+    return telemetry_enc_end(&e);
+}
+
+static int build_tasks(void)
+{
+    telemetry_enc_t e;
+    uint8_t i;
+
+    telemetry_enc_begin(&e, rec, sizeof(rec), TELEMETRY_REC_TASKS);
+    telemetry_enc_list(&e);
+    for(i = 0; cpu_ok && i < n_tasks; ++i)
+    {
+        uint8_t len = strnlen(task_name[i], TELEMETRY_TASK_NAME_LEN);
+        telemetry_enc_item(&e);
+        telemetry_enc_varint(&e, task_id[i]);
+        telemetry_enc_u8(&e, len);
+        telemetry_enc_bytes(&e, task_name[i], len);
+    }
+    return telemetry_enc_end(&e);
+}
+
+// Queue a whole record on a client, or drop it whole if it does not fit
+static void client_put(client_t* c, const uint8_t* r, int len)
+{
+    if(c->tx_len - c->tx_off + len > TX_SIZE)
+    {
+        c->drops++;
+        stats.drops++;
+        if(r[1] != TELEMETRY_REC_SAMPLE) { c->sync_due = 1; }
+        return;
+    }
+
+    if(c->tx_len + len > TX_SIZE)
+    {
+        memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        c->tx_len -= c->tx_off;
+        c->tx_off = 0;
+    }
+
+    memcpy(c->tx + c->tx_len, r, len);
+    c->tx_len += len;
+    c->records++;
+}
+
+// The capture writer buffers the record and its flush task does the flash
+// work, the reactor never waits on flash
+static void flash_put(const uint8_t* r, int len)
+{
+    if(capture_writer_write(flash_stream, r, (uint16_t) len, NULL, 0) != ESP_OK) { stats.flash_errors++; }
+    else                                                                         { stats.flash_bytes += len; }
+}
+
+static void flash_close(void)
+{
+    if(!flash_on)
+    {
+        return;
+    }
+
+    capture_writer_close(flash_stream);
+    flash_on = 0;
+}
+
+// The record in rec, to every client and the flash capture
+static void emit(int len)
+{
+    uint8_t i;
+    if(len < 0)
+    {
+        ESP_LOGE(TAG, "record type %u does not fit %d bytes", rec[1], REC_SIZE);
+        return;
+    }
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        if(clients[i].sock >= 0) { client_put(&clients[i], rec, len); }
+    }
+    if(flash_on)
+    {
+        flash_put(rec, len);
+    }
+}
+
+// HELLO and TASKS, what a client needs before its first sample. A drop sets
+// sync_due again, to retry once the buffer drained.
+static void client_sync(client_t* c)
+{
+    c->sync_due = 0;
+
+    int len = build_hello();
+    if(len > 0) { client_put(c, rec, len); }
+    len = build_tasks();
+    if(len > 0) { client_put(c, rec, len); }
+}
+
+//*****************************************************************************
+// Sampling
+//*****************************************************************************
+
+// Refresh the task table from the FreeRTOS run time counters. Returns 1 if a
+// task showed up that was not in the last sample.
+static uint8_t sample_tasks(void)
+{
+    #if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total;
+    uint16_t cpu[MAX_TASKS];
+    uint8_t fresh = 0;
+    UBaseType_t i, j, n;
+
+    n = uxTaskGetSystemState(status, MAX_TASKS, &total);
+    if(n == 0)
+    {
+        // More tasks than the table holds, FreeRTOS fills in none then
+        stats.tasks_missed += uxTaskGetNumberOfTasks();
+        n_tasks = 0;
+        have_rt = 0;
+        cpu_ok = 0;
+        return 0;
+    }
+
+    uint32_t dt = (uint32_t) total - total_rt;
+    for(i = 0; i < n; ++i)
+    {
+        // A new task ran all of its run time in the interval
+        uint32_t rt = status[i].ulRunTimeCounter;
+        for(j = 0; j < n_tasks && task_id[j] != status[i].xTaskNumber; ++j);
+        if(j == n_tasks) { fresh = 1; }
+        else             { rt -= task_rt[j]; }
+        cpu[i] = dt ? (uint16_t) ((uint64_t) rt * 1000 / dt) : 0;
+    }
+
+    for(i = 0; i < n; ++i)
+    {
+        task_id[i] = status[i].xTaskNumber;
+        task_rt[i] = status[i].ulRunTimeCounter;
+        task_cpu[i] = cpu[i];
+        strncpy(task_name[i], status[i].pcTaskName, TELEMETRY_TASK_NAME_LEN);
+    }
+    n_tasks = n;
+    total_rt = total;
+
+    // Without the counters of the last sample the run time above is since
+    // boot, not over the interval. This sample only sets the baseline.
+    cpu_ok = have_rt;
+    have_rt = 1;
+    return fresh;
+    #else
+    return 0;
+    #endif
+}
+
+static void sample(int64_t now)
+{
+    telemetry_enc_t e;
+    uint8_t i;
+
+    if(sample_tasks())
+    {
+        emit(build_tasks());
+    }
+
+    telemetry_enc_begin(&e, rec, sizeof(rec), TELEMETRY_REC_SAMPLE);
+    telemetry_enc_varint(&e, seq++);
+    telemetry_enc_varint(&e, now / 1000);
+
+    telemetry_enc_list(&e);
+    telemetry_enc_field(&e, TELEMETRY_F_HEAP_FREE, esp_get_free_heap_size());
+    telemetry_enc_field(&e, TELEMETRY_F_HEAP_MIN, esp_get_minimum_free_heap_size());
+    telemetry_enc_field(&e, TELEMETRY_F_HEAP_LARGEST, heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    telemetry_enc_field(&e, TELEMETRY_F_TASKS, uxTaskGetNumberOfTasks());
+    if(source)
+    {
+        source(&e);
+    }
+
+    telemetry_enc_list(&e);
+    for(i = 0; i < n_tasks; ++i)
+    {
+        telemetry_enc_item(&e);
+        telemetry_enc_varint(&e, task_id[i]);
+        telemetry_enc_varint(&e, task_cpu[i]);
+    }
+
+    emit(telemetry_enc_end(&e));
+}
+
+//*****************************************************************************
+// Sockets and the reactor handler
+//*****************************************************************************
+
+static int create_listening_socket(void)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Failed to open listening socket");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_addr.s_addr = inet_addr(CONFIG_TELEMETRY_IP);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONFIG_TELEMETRY_PORT);
+    if(bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || listen(sock, MAX_CLIENTS))
+    {
+        ESP_LOGE(TAG, "Failed to bind listening socket");
+        close(sock);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Listening socket bound to %s:%d", CONFIG_TELEMETRY_IP, CONFIG_TELEMETRY_PORT);
+    return sock;
+}
+
+static void client_close(client_t* c, const char* why)
+{
+    ESP_LOGI(TAG, "Client %s closed, %s", c->ip_addr, why);
+    close(c->sock);
+
+    portENTER_CRITICAL(&mux);
+    c->sock = -1;
+    portEXIT_CRITICAL(&mux);
+}
+
+static void client_accept(void)
+{
+    struct sockaddr_in source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    uint8_t i;
+
+    int sock = accept(listen_sock, (struct sockaddr*) &source_addr, &addr_len);
+    if(sock < 0)
+    {
+        ESP_LOGE(TAG, "Unable to accept connection: %s", strerror(errno));
+        return;
+    }
+
+    for(i = 0; i < MAX_CLIENTS && clients[i].sock >= 0; ++i);
+    if(i == MAX_CLIENTS)
+    {
+        ESP_LOGE(TAG, "All %d client slots busy, refusing connection", MAX_CLIENTS);
+        stats.refused++;
+        close(sock);
+        return;
+    }
+
+    client_t* c = &clients[i];
+    portENTER_CRITICAL(&mux);
+    c->sock = sock;
+    inet_ntoa_r(source_addr.sin_addr, c->ip_addr, sizeof(c->ip_addr));
+    c->records = 0;
+    c->drops = 0;
+    c->bytes_sent = 0;
+    c->tx_off = 0;
+    c->tx_len = 0;
+    portEXIT_CRITICAL(&mux);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    stats.accepted++;
+    client_sync(c);
+    ESP_LOGI(TAG, "Client Connected %s in slot %u", c->ip_addr, i);
+}
+
+// Returns 1 if the client went away
+static uint8_t client_send(client_t* c)
+{
+    int n = send(c->sock, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_DONTWAIT);
+    if(n < 0)
+    {
+        return errno != EAGAIN && errno != EWOULDBLOCK;
+    }
+
+    c->tx_off += n;
+    c->bytes_sent += n;
+    stats.bytes_sent += n;
+    if(c->tx_off == c->tx_len)
+    {
+        c->tx_off = 0;
+        c->tx_len = 0;
+    }
+    return 0;
+}
+
+// Clients send nothing, anything readable is a close or junk to skip
+static uint8_t client_recv(client_t* c)
+{
+    uint8_t junk[32];
+    int n = recv(c->sock, junk, sizeof(junk), MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static int tm_fill(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    if(!running)
+    {
+        return -1;
+    }
+
+    int max_fd = listen_sock;
+    FD_SET(listen_sock, rfds);
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        if(c->sock < 0) { continue; }
+
+        FD_SET(c->sock, rfds);
+        if(c->tx_len > c->tx_off) { FD_SET(c->sock, wfds); }
+        if(c->sock > max_fd) { max_fd = c->sock; }
+    }
+
+    return max_fd;
+}
+
+static void tm_ready(void* ctx, fd_set* rfds, fd_set* wfds)
+{
+    uint8_t i;
+    if(!running)
+    {
+        return;
+    }
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        if(c->sock < 0) { continue; }
+
+        if(FD_ISSET(c->sock, rfds) && client_recv(c))
+        {
+            client_close(c, "done");
+        }
+        else if(FD_ISSET(c->sock, wfds) && client_send(c))
+        {
+            client_close(c, "reset");
+        }
+    }
+
+    // Last, a new socket may have the number of one served above
+    if(FD_ISSET(listen_sock, rfds))
+    {
+        client_accept();
+    }
+}
+
+// Take the samples that are due. After a kill close every client, the
+// listening socket and the flash capture, all on the reactor task, and come
+// off it.
+static int32_t tm_poll(void* ctx)
+{
+    uint8_t i;
+    int64_t now = esp_timer_get_time();
+
+    if(!running)
+    {
+        for(i = 0; i < MAX_CLIENTS; ++i)
+        {
+            if(clients[i].sock >= 0) { client_close(&clients[i], "telemetry killed"); }
+        }
+        close(listen_sock);
+        listen_sock = -1;
+        flash_close();
+        serving = 0;
+        ESP_LOGI(TAG, "Telemetry Exiting ...");
+        return NET_REACTOR_REMOVE;
+    }
+
+    if(hello_due)
+    {
+        hello_due = 0;
+        emit(build_hello());
+        next_us = now;
+    }
+
+    for(i = 0; i < MAX_CLIENTS; ++i)
+    {
+        if(clients[i].sock >= 0 && clients[i].sync_due) { client_sync(&clients[i]); }
+    }
+
+    int64_t period = (int64_t) interval_ms * 1000;
+    if(now >= next_us)
+    {
+        int64_t t0 = esp_timer_get_time();
+        sample(now);
+        uint32_t dt = esp_timer_get_time() - t0;
+
+        stats.samples++;
+        stats.sample_us = dt;
+        if(dt > stats.sample_us_max) { stats.sample_us_max = dt; }
+
+        // Keep the grid, unless we fell a whole period behind
+        next_us += period;
+        if(next_us <= now) { next_us = now + period; }
+    }
+
+    return (int32_t) ((next_us - now + 999) / 1000);
+}
+
+static const net_reactor_handler_t tm_handler =
+{
+    .name = "telemetry",
+    .fill = tm_fill,
+    .ready = tm_ready,
+    .poll = tm_poll,
+};
+
+//*****************************************************************************
+// API Funcs
+//*****************************************************************************
+
+esp_err_t telemetry_set_source(telemetry_source_t src)
+{
+    source = src;
+    return ESP_OK;
+}
+
+esp_err_t telemetry_launch(const telemetry_cfg_t* cfg)
+{
+    uint32_t ms = cfg->interval_ms ? cfg->interval_ms : CONFIG_TELEMETRY_INTERVAL_MS;
+    uint8_t i;
+
+    if(ms < TELEMETRY_MIN_INTERVAL_MS || ms > TELEMETRY_MAX_INTERVAL_MS)
+    {
+        ESP_LOGE(TAG, "interval %lu ms out of range", ms);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(running || serving)
+    {
+        ESP_LOGE(TAG, "already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    listen_sock = create_listening_socket();
+    if(listen_sock < 0)
+    {
+        return ESP_FAIL;
+    }
+
+    if(cfg->flash)
+    {
+        capture_writer_cfg_t c = {0};
+        c.fmt = CAPTURE_FMT_RAW;
+        c.backend = CAPTURE_BACKEND_FLASH_LOG;
+        strcpy(c.path, TELEMETRY_FLASH_NAME);
+
+        esp_err_t e = capture_writer_open(&c, &flash_stream);
+        if(e != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open the flash capture");
+            close(listen_sock);
+            listen_sock = -1;
+            return e;
+        }
+    }
+    flash_on = cfg->flash;
+
+    portENTER_CRITICAL(&mux);
+    memset(&stats, 0, sizeof(stats));
+    for(i = 0; i < MAX_CLIENTS; ++i) { clients[i].sock = -1; }
+    portEXIT_CRITICAL(&mux);
+
+    interval_ms = ms;
+    hello_due = 0;
+    seq = 0;
+    n_tasks = 0;
+    total_rt = 0;
+    have_rt = 0;
+    cpu_ok = 0;
+    next_us = esp_timer_get_time();
+    if(flash_on)
+    {
+        emit(build_hello());
+    }
+
+    running = 1;
+    serving = 1;
+    esp_err_t e = net_reactor_add(&tm_handler);
+    if(e != ESP_OK)
+    {
+        running = 0;
+        serving = 0;
+        close(listen_sock);
+        listen_sock = -1;
+        flash_close();
+        return e;
+    }
+
+    ESP_LOGI(TAG, "Sampling every %lu ms%s", ms, flash_on ? ", to flash too" : "");
+    return ESP_OK;
+}
+
+esp_err_t telemetry_kill(void)
+{
+    if(!running)
+    {
+        ESP_LOGE(TAG, "not running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    running = 0;
+    net_reactor_wake();
+    return ESP_OK;
+}
+
+esp_err_t telemetry_set_interval(uint32_t ms)
+{
+    if(ms < TELEMETRY_MIN_INTERVAL_MS || ms > TELEMETRY_MAX_INTERVAL_MS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(!running)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    interval_ms = ms;
+    hello_due = 1;
+    net_reactor_wake();
+    return ESP_OK;
+}
+
+uint8_t telemetry_is_running(void)
+{
+    return running;
+}
+
+esp_err_t telemetry_get_stats(telemetry_stats_t* s, telemetry_client_stats_t* cs)
+{
+    uint8_t i;
+
+    portENTER_CRITICAL(&mux);
+    memcpy(s, &stats, sizeof(telemetry_stats_t));
+    s->interval_ms = interval_ms;
+
+    for(i = 0; cs && i < MAX_CLIENTS; ++i)
+    {
+        client_t* c = &clients[i];
+        cs[i].active = serving && c->sock >= 0;
+        memcpy(cs[i].ip_addr, c->ip_addr, sizeof(cs[i].ip_addr));
+        cs[i].records = c->records;
+        cs[i].drops = c->drops;
+        cs[i].bytes_sent = c->bytes_sent;
+        cs[i].queued = c->tx_len - c->tx_off;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return ESP_OK;
+}
@@ -0,0 +1,147 @@
+//*****************************************************************************
+// Telemetry. Samples the health of the system every interval, heap, per task
+// CPU and the counters and queue depths of the capture services, and streams
+// each sample as a compact binary record (telemetry_rec.h) to TCP clients on
+// CONFIG_TELEMETRY_PORT, and optionally into the flash log. host/tlm_decode
+// turns the stream back into a table of series or CSV.
+//
+//                 |---------|  sample  |--------|  records  |------------|
+//  heap, tasks -->| Reactor |--------->| client |---------->| TCP :425   |
+//  sources     -->|  poll   |          |  bufs  |           |------------|
+//  (main)         |         |--------------------------->  | cap writer |
+//                 |---------|                               |------------|
+//
+// Sampling) Done in the poll of a net reactor handler (net_reactor.h), no
+//           task of its own. A sample is taken every interval_ms, which can
+//           be changed while running. The service samples the heap and the
+//           tasks itself. Everything else comes from a source callback main
+//           registers, so telemetry does not depend on the components it
+//           reports on, bar the capture writer it writes its flash capture
+//           through. The source runs on the reactor task and must not block.
+//
+// Tasks) CPU per task is the growth of the FreeRTOS run time counter of the
+//        task over the interval, needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+//        Without it samples carry no tasks. With more tasks than
+//        CONFIG_TELEMETRY_MAX_TASKS FreeRTOS reports none, that sample
+//        carries no tasks and they are counted as missed. The first sample,
+//        and the first after such a miss, only takes the counters to measure
+//        the next interval from and carries no tasks either.
+//        Names go out in a TASKS record to each new client and whenever a
+//        new task shows up, samples only carry task ids.
+//
+// Clients) Up to CONFIG_TELEMETRY_MAX_CLIENTS, a client gets HELLO and TASKS
+//          on connect then every sample. Each has a send buffer of whole
+//          records, a record that does not fit a slow client is dropped for
+//          that client alone. Samples stand on their own so a drop only loses
+//          a point of the series.
+//
+// Flash) With cfg.flash the records also go into the flash log capture
+//        "telemetry", needs CONFIG_CAPTURE_WRITER_FLASH_LOG. It is a RAW
+//        capture writer stream, records are appended to its RAM buffer and
+//        the writer's flush task does the flash programs and erases, so the
+//        reactor never waits on flash. Like any quiet stream its buffer lands
+//        every CONFIG_CAPTURE_WRITER_FLUSH_MS. A record the writer has no
+//        buffer for is counted in flash_errors. Pull the capture with
+//        scripts/flash_log_extract.py and read it with tlm_decode -f. When
+//        the log wrapped over its start the decoder skips to the first whole
+//        record.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "telemetry_rec.h"
+
+#define TELEMETRY_MIN_INTERVAL_MS 10
+#define TELEMETRY_MAX_INTERVAL_MS 3600000
+#define TELEMETRY_FLASH_NAME "telemetry"
+
+//*****************************************************************************
+// Source of the sample fields the service does not sample itself. Puts them
+// with telemetry_enc_field, using the field ids of
+// TELEMETRY_FIELDS.
+//*****************************************************************************
+typedef void (*telemetry_source_t)(telemetry_enc_t* e);
+
+typedef struct
+{
+    uint32_t interval_ms;       // 0 for CONFIG_TELEMETRY_INTERVAL_MS
+    uint8_t flash;              // Also write the records to the flash log
+} telemetry_cfg_t;
+
+typedef struct
+{
+    uint32_t samples;
+    uint32_t interval_ms;
+    uint32_t sample_us;         // Time the last sample took
+    uint32_t sample_us_max;
+    uint32_t tasks_missed;      // Tasks not reported, more than CONFIG_TELEMETRY_MAX_TASKS
+    uint32_t accepted;          // Clients served
+    uint32_t refused;           // Clients refused, all slots busy
+    uint32_t drops;             // Records slow clients did not get, closed clients too
+    uint64_t bytes_sent;        // To all clients, closed ones too
+    uint64_t flash_bytes;       // Handed to the flash capture
+    uint32_t flash_errors;      // Records the capture writer dropped
+} telemetry_stats_t;
+
+typedef struct
+{
+    uint8_t active;
+    char ip_addr[16];
+    uint32_t records;           // Records sent
+    uint32_t drops;             // Records that did not fit the send buffer
+    uint64_t bytes_sent;
+    uint32_t queued;            // Bytes in the send buffer
+} telemetry_client_stats_t;
+
+//*****************************************************************************
+// telemetry_set_source) Set the source of the app fields, NULL for none. Can
+//                       be set before launch.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t telemetry_set_source(telemetry_source_t src);
+
+//*****************************************************************************
+// telemetry_launch) Open the listening socket and start sampling on the net
+//                   reactor, opening the flash capture if asked for.
+//
+// cfg) Interval and options. Copied.
+//
+// Returns) ESP_OK, INVALID_ARG for an interval out of range, INVALID_STATE if
+//          running or a previous run is still closing, FAIL if the socket can
+//          not be opened, else capture writer (INVALID_ARG without the flash
+//          log backend) and net reactor errors.
+//*****************************************************************************
+esp_err_t telemetry_launch(const telemetry_cfg_t* cfg);
+
+//*****************************************************************************
+// telemetry_kill) Stop sampling. The reactor closes every client, the
+//                 listening socket and the flash capture after its round.
+//
+// Returns) ESP_OK, INVALID_STATE if not running.
+//*****************************************************************************
+esp_err_t telemetry_kill(void);
+
+//*****************************************************************************
+// telemetry_set_interval) Change the sampling interval, from the next sample
+//                         on. Clients get a new HELLO with it.
+//
+// Returns) ESP_OK, INVALID_ARG out of range, INVALID_STATE if not running.
+//*****************************************************************************
+esp_err_t telemetry_set_interval(uint32_t interval_ms);
+
+//*****************************************************************************
+// Returns) 1 if sampling 0 else
+//*****************************************************************************
+uint8_t telemetry_is_running(void);
+
+//*****************************************************************************
+// telemetry_get_stats) Copy out the stats.
+//
+// stats) Out param.
+// clients) Out param, CONFIG_TELEMETRY_MAX_CLIENTS entries. May be NULL.
+//
+// Returns) ESP_OK
+//*****************************************************************************
+esp_err_t telemetry_get_stats(telemetry_stats_t* stats, telemetry_client_stats_t* clients);
@@ -0,0 +1,207 @@
+#include <string.h>
+
+#include "telemetry_rec.h"
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t kind;
+    const char* name;
+} field_t;
+
+#define TELEMETRY_FIELD_ROW(name, id, kind) { id, kind, #name },
+static const field_t fields[] =
+{
+    TELEMETRY_FIELDS(TELEMETRY_FIELD_ROW)
+};
+#undef TELEMETRY_FIELD_ROW
+
+//*****************************************************************************
+// Encoder
+//*****************************************************************************
+
+static uint8_t room(telemetry_enc_t* e, int n)
+{
+    if(e->len + n > e->cap)
+    {
+        e->err = 1;
+    }
+    return !e->err;
+}
+
+void telemetry_enc_begin(telemetry_enc_t* e, uint8_t* buf, int cap, uint8_t type)
+{
+    e->buf = buf;
+    e->cap = cap;
+    e->len = 0;
+    e->err = 0;
+    e->count_at = -1;
+
+    if(room(e, TELEMETRY_REC_HDR))
+    {
+        buf[0] = TELEMETRY_SYNC;
+        buf[1] = type;
+        e->len = TELEMETRY_REC_HDR;
+    }
+}
+
+void telemetry_enc_u8(telemetry_enc_t* e, uint8_t v)
+{
+    if(room(e, 1)) { e->buf[e->len++] = v; }
+}
+
+void telemetry_enc_u32(telemetry_enc_t* e, uint32_t v)
+{
+    uint8_t i;
+    if(!room(e, 4)) { return; }
+    for(i = 0; i < 4; ++i) { e->buf[e->len++] = v >> (8 * i); }
+}
+
+void telemetry_enc_varint(telemetry_enc_t* e, uint64_t v)
+{
+    do
+    {
+        if(!room(e, 1)) { return; }
+        e->buf[e->len++] = (v & 0x7f) | ((v > 0x7f) ? 0x80 : 0);
+        v >>= 7;
+    } while(v);
+}
+
+void telemetry_enc_bytes(telemetry_enc_t* e, const void* p, int len)
+{
+    if(room(e, len))
+    {
+        memcpy(e->buf + e->len, p, len);
+        e->len += len;
+    }
+}
+
+void telemetry_enc_list(telemetry_enc_t* e)
+{
+    e->count_at = e->len;
+    telemetry_enc_u8(e, 0);
+}
+
+void telemetry_enc_item(telemetry_enc_t* e)
+{
+    if(e->err || e->count_at < 0) { return; }
+    if(e->buf[e->count_at] == 0xff) { e->err = 1; return; }
+    e->buf[e->count_at]++;
+}
+
+int telemetry_enc_end(telemetry_enc_t* e)
+{
+    int body = e->len - TELEMETRY_REC_HDR;
+    if(e->err || body > 0xffff)
+    {
+        return -1;
+    }
+
+    e->buf[2] = body;
+    e->buf[3] = body >> 8;
+    return e->len;
+}
+
+void telemetry_enc_field(telemetry_enc_t* e, uint8_t field, uint64_t v)
+{
+    telemetry_enc_item(e);
+    telemetry_enc_u8(e, field);
+    telemetry_enc_varint(e, v);
+}
+
+//*****************************************************************************
+// Parser
+//*****************************************************************************
+
+int telemetry_rec_len(const uint8_t* buf, int have)
+{
+    if(have < 1)
+    {
+        return 0;
+    }
+    if(buf[0] != TELEMETRY_SYNC)
+    {
+        return -1;
+    }
+    if(have < TELEMETRY_REC_HDR)
+    {
+        return 0;
+    }
+
+    int body = buf[2] | (buf[3] << 8);
+    if(buf[1] < TELEMETRY_REC_HELLO || buf[1] > TELEMETRY_REC_SAMPLE || body > TELEMETRY_MAX_BODY)
+    {
+        return -1;
+    }
+
+    return TELEMETRY_REC_HDR + body;
+}
+
+int telemetry_get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v)
+{
+    const uint8_t* b = *p;
+    uint8_t shift = 0;
+
+    *v = 0;
+    while(b < end && shift < 64)
+    {
+        *v |= (uint64_t) (*b & 0x7f) << shift;
+        if(!(*b++ & 0x80))
+        {
+            *p = b;
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+int telemetry_parse_sample(const uint8_t* body, int len, telemetry_sample_t* s)
+{
+    const uint8_t* p = body;
+    const uint8_t* end = body + len;
+    uint64_t v;
+    uint8_t i;
+
+    if(telemetry_get_varint(&p, end, &v)) { return -1; }
+    s->seq = v;
+    if(telemetry_get_varint(&p, end, &v)) { return -1; }
+    s->t_ms = v;
+
+    if(p >= end || *p > TELEMETRY_MAX_FIELDS) { return -1; }
+    s->n_fields = *p++;
+    for(i = 0; i < s->n_fields; ++i)
+    {
+        if(p >= end) { return -1; }
+        s->field[i] = *p++;
+        if(telemetry_get_varint(&p, end, &s->value[i])) { return -1; }
+    }
+
+    if(p >= end || *p > TELEMETRY_MAX_TASKS) { return -1; }
+    s->n_tasks = *p++;
+    for(i = 0; i < s->n_tasks; ++i)
+    {
+        if(telemetry_get_varint(&p, end, &v)) { return -1; }
+        s->task[i] = v;
+        if(telemetry_get_varint(&p, end, &v)) { return -1; }
+        s->cpu[i] = v;
+    }
+
+    return (p == end) ? 0 : -1;
+}
+
+const char* telemetry_field_name(uint8_t field, uint8_t* kind)
+{
+    uint8_t i;
+    for(i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        if(fields[i].id == field)
+        {
+            if(kind) { *kind = fields[i].kind; }
+            return fields[i].name;
+        }
+    }
+
+    return NULL;
+}
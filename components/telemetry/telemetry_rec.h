@@ -0,0 +1,164 @@
+//*****************************************************************************
+// Telemetry records. The binary format the telemetry service (telemetry.h)
+// streams and writes to flash, and the encoder and parser of it. This file
+// and telemetry_rec.c are plain C so the host decoder (host/tlm_decode)
+// builds from the exact same source.
+//
+// Stream) Records back to back, the same on the TCP port and in the flash
+//         log capture. Every record starts with a sync byte so a reader that
+//         comes in mid record, i.e. a flash capture the log wrapped over,
+//         skips ahead to the next one:
+//
+//         | sync 0xA5 | type | len (16) | body ...      |
+//                                       |<- len bytes ->|
+//
+// Values) Integers are LEB128 varints, 7 bits a byte low first. Counters go out as their running value, not a delta,
+//         so every sample stands on its own and a lost record loses nothing
+//         but its own point. The reader takes rates from two samples.
+//
+// HELLO) First record of every stream. | magic (32) | version | interval_ms |
+//
+// TASKS) Names of the task ids the samples use, sent after HELLO and again
+//        each time the set of tasks changes.
+//        | n | n x (id, name len, name) |
+//
+// SAMPLE) | seq | t_ms | n | n x (field, value) | m | m x (task id, cpu) |
+//         t_ms is time since boot. cpu is the task's share of one core over
+//         the last interval in 1/1000, so the tasks of a dual core add up to
+//         2000. Fields are listed in TELEMETRY_FIELDS, a sample only carries
+//         those its sources know.
+//*****************************************************************************
+
+#pragma once
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC 0x314d4c54          // "TLM1"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_SYNC 0xA5
+#define TELEMETRY_REC_HDR 4                 // sync, type, len
+#define TELEMETRY_MAX_BODY 2048             // Longest body a reader takes
+#define TELEMETRY_MAX_FIELDS 64             // Fields one sample carries at most
+#define TELEMETRY_MAX_TASKS 64              // ... and tasks
+#define TELEMETRY_TASK_NAME_LEN 16
+
+typedef enum
+{
+    TELEMETRY_REC_HELLO = 1,
+    TELEMETRY_REC_TASKS,
+    TELEMETRY_REC_SAMPLE,
+} telemetry_rec_type_t;
+
+typedef enum
+{
+    TELEMETRY_K_GAUGE,                      // Level, shown as it is
+    TELEMETRY_K_COUNTER,                    // Running count, shown as a rate
+} telemetry_kind_t;
+
+// X(name, id, kind)
+#define TELEMETRY_FIELDS(X) \
+    X(HEAP_FREE,        1,  TELEMETRY_K_GAUGE)   \
+    X(HEAP_MIN,         2,  TELEMETRY_K_GAUGE)   \
+    X(HEAP_LARGEST,     3,  TELEMETRY_K_GAUGE)   \
+    X(TASKS,            4,  TELEMETRY_K_GAUGE)   \
+    X(PKTS,             16, TELEMETRY_K_COUNTER) \
+    X(DATA_PKTS,        17, TELEMETRY_K_COUNTER) \
+    X(MGMT_PKTS,        18, TELEMETRY_K_COUNTER) \
+    X(SNIFF_RUNNING,    19, TELEMETRY_K_GAUGE)   \
+    X(APS,              20, TELEMETRY_K_GAUGE)   \
+    X(STAS,             21, TELEMETRY_K_GAUGE)   \
+    X(CW_BUFFERED,      32, TELEMETRY_K_GAUGE)   \
+    X(CW_WRITTEN,       33, TELEMETRY_K_COUNTER) \
+    X(CW_OVERRUNS,      34, TELEMETRY_K_COUNTER) \
+    X(MUX_RING,         35, TELEMETRY_K_GAUGE)   \
+    X(MUX_DROPPED,      36, TELEMETRY_K_COUNTER) \
+    X(LS_RING,          37, TELEMETRY_K_GAUGE)   \
+    X(LS_DROPS,         38, TELEMETRY_K_COUNTER)
+
+#define TELEMETRY_FIELD_ENUM(name, id, kind) TELEMETRY_F_##name = id,
+typedef enum
+{
+    TELEMETRY_FIELDS(TELEMETRY_FIELD_ENUM)
+} telemetry_field_t;
+#undef TELEMETRY_FIELD_ENUM
+
+// Record being written. A write that does not fit sets err, the record is
+// then dropped whole by telemetry_enc_end.
+typedef struct
+{
+    uint8_t* buf;
+    int cap;
+    int len;
+    int err;
+    int count_at;                   // Offset of the n of the list being written
+} telemetry_enc_t;
+
+// A parsed SAMPLE
+typedef struct
+{
+    uint32_t seq;
+    uint32_t t_ms;
+    uint8_t n_fields;
+    uint8_t field[TELEMETRY_MAX_FIELDS];
+    uint64_t value[TELEMETRY_MAX_FIELDS];
+    uint8_t n_tasks;
+    uint32_t task[TELEMETRY_MAX_TASKS];
+    uint16_t cpu[TELEMETRY_MAX_TASKS];
+} telemetry_sample_t;
+
+//*****************************************************************************
+// telemetry_enc_begin) Start a record of type in buf, cap bytes.
+//*****************************************************************************
+void telemetry_enc_begin(telemetry_enc_t* e, uint8_t* buf, int cap, uint8_t type);
+
+void telemetry_enc_u8(telemetry_enc_t* e, uint8_t v);
+void telemetry_enc_u32(telemetry_enc_t* e, uint32_t v);
+void telemetry_enc_varint(telemetry_enc_t* e, uint64_t v);
+void telemetry_enc_bytes(telemetry_enc_t* e, const void* p, int len);
+
+//*****************************************************************************
+// telemetry_enc_list / telemetry_enc_item) Start a list with its count byte,
+//                                          then count each item put in it.
+//                                          Up to 255 items.
+//*****************************************************************************
+void telemetry_enc_list(telemetry_enc_t* e);
+void telemetry_enc_item(telemetry_enc_t* e);
+
+//*****************************************************************************
+// telemetry_enc_end) Fill in the length of the record.
+//
+// Returns) Bytes of the whole record, -1 if it did not fit.
+//*****************************************************************************
+int telemetry_enc_end(telemetry_enc_t* e);
+
+// Field of a SAMPLE, inside its field list
+void telemetry_enc_field(telemetry_enc_t* e, uint8_t field, uint64_t v);
+
+//*****************************************************************************
+// telemetry_rec_len) Length of the record at the start of buf.
+//
+// have) Bytes in buf.
+//
+// Returns) Record length once the header is in, bigger than have while the
+//          body is still coming. 0 before the header is in. -1 if buf does
+//          not start with a record header, drop a byte and look again.
+//*****************************************************************************
+int telemetry_rec_len(const uint8_t* buf, int have);
+
+//*****************************************************************************
+// telemetry_get_varint) Read a varint at *p, not past end, and move past it.
+//
+// Returns) 0, -1 if cut short.
+//*****************************************************************************
+int telemetry_get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v);
+
+//*****************************************************************************
+// telemetry_parse_sample) Parse the body of a SAMPLE.
+//
+// Returns) 0, -1 if the body is cut short, too long or has too many entries.
+//*****************************************************************************
+int telemetry_parse_sample(const uint8_t* body, int len, telemetry_sample_t* s);
+
+//*****************************************************************************
+// telemetry_field_name) Name and kind of a field id, NULL if unknown.
+//*****************************************************************************
+const char* telemetry_field_name(uint8_t field, uint8_t* kind);
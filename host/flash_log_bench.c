@@ -0,0 +1,206 @@
+//*****************************************************************************
+// Host benchmark / self test of the flash log against the file backed NOR
+// emulator. Writes synthetic capture data the way the capture writer does
+// (buffer sized appends with idle time in between for erase ahead), then
+// checks boot recovery, torn record recovery, wear across laps and that
+// captures written side by side keep their data and ids apart.
+//
+// Flash time is modeled from the flash op counts with typical numbers for the
+// 4MB SPI NOR on the dev boards (page program 0.7 ms / 256 B, sector erase
+// 45 ms), host CPU time is measured. For comparison the same data is written
+// through stdio into a file on the host file system, a stand-in for the
+// SPIFFS path. Run FL_bench on the target for the real SPIFFS numbers.
+//
+// usage: flash_log_bench [<partition KB> <MB to write> <emulator file> <fs file>]
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flash_log.h"
+#include "flash_log_dev_file.h"
+
+#define SECTOR 4096
+#define CHUNK 4096
+#define PROG_US_PER_256 700
+#define ERASE_US 45000
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Something that looks like a buffer of pcapng frames: repeating headers with
+// counting sequence numbers and noisy payload
+static void fill_chunk(uint8_t* buf, uint32_t n, uint32_t* seq)
+{
+    uint32_t i;
+    for(i = 0; i < n; ++i)
+    {
+        if(i % 128 < 24) { buf[i] = (uint8_t) (0x88 + (i % 128)); }
+        else if(i % 128 < 26) { buf[i] = (uint8_t) (*seq >> ((i & 1) * 8)); }
+        else { buf[i] = (uint8_t) rand(); }
+        if(i % 128 == 127) { (*seq)++; }
+    }
+}
+
+static int fail(const char* what)
+{
+    fprintf(stderr, "FAIL: %s\n", what);
+    return 1;
+}
+
+// Gather the DATA payload of capture id from the records at slot on, until
+// the first erased slot. Returns the bytes gathered.
+static uint32_t read_capture(uint32_t slot, uint16_t id, uint8_t* out, uint32_t max)
+{
+    static uint8_t payload[FLASH_LOG_PAYLOAD_LEN];
+    flash_log_rec_hdr_t h;
+    uint32_t n = 0;
+
+    while(flash_log_read_record(slot, &h, payload) == ESP_OK)
+    {
+        if(h.type == FLASH_LOG_REC_DATA && h.file_id == id && n + h.len <= max)
+        {
+            memcpy(out + n, payload, h.len);
+            n += h.len;
+        }
+        slot = (slot + 1) % flash_log_num_slots();
+    }
+
+    return n;
+}
+
+// Close one capture while another has a partial record staged, then reboot
+// with the older capture the last one to write
+static int check_interleaved(flash_log_dev_t* dev, const char* emu_path, uint32_t size)
+{
+    uint8_t a[300], got[sizeof(a)];
+    uint16_t id_a, id_b, id_c;
+    uint32_t i;
+
+    for(i = 0; i < sizeof(a); ++i) { a[i] = (uint8_t) (i * 13 + 1); }
+
+    flash_log_stats_t* s = flash_log_get_stats();
+    uint32_t start = s->head / CONFIG_FLASH_LOG_RECORD_SIZE;
+    if(flash_log_open("a", &id_a) != ESP_OK || flash_log_open("b", &id_b) != ESP_OK) { return fail("interleaved open"); }
+    if(flash_log_append(id_a, a, 100) != ESP_OK) { return fail("interleaved append"); }
+    if(flash_log_close(id_b) != ESP_OK) { return fail("interleaved close"); }
+    if(flash_log_append(id_a, a + 100, 200) != ESP_OK || flash_log_sync() != ESP_OK) { return fail("interleaved append"); }
+
+    if(read_capture(start, id_a, got, sizeof(got)) != sizeof(a) || memcmp(a, got, sizeof(a)))
+    {
+        return fail("closing one capture damaged the staged data of another");
+    }
+
+    flash_log_dev_file_fini(dev);
+    flash_log_dev_file_init(dev, emu_path, size, SECTOR);
+    if(flash_log_init(dev) != ESP_OK) { return fail("reinit after interleave"); }
+    if(flash_log_open("c", &id_c) != ESP_OK) { return fail("open after interleave"); }
+    printf("interleave) a %u b %u, after reboot %u\n", id_a, id_b, id_c);
+    if(id_c == id_a || id_c == id_b) { return fail("file id reused after reboot"); }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t part_kb = argc > 1 ? atoi(argv[1]) : 1024;
+    uint32_t mb = argc > 2 ? atoi(argv[2]) : 8;
+    const char* emu_path = argc > 3 ? argv[3] : "flash_log_emu.bin";
+    const char* fs_path = argc > 4 ? argv[4] : "flash_log_fs.bin";
+    uint32_t total = mb * 1024 * 1024;
+    uint8_t chunk[CHUNK];
+    uint32_t seq = 0;
+    uint16_t file_id;
+    flash_log_dev_t dev;
+
+    remove(emu_path);
+    if(flash_log_dev_file_init(&dev, emu_path, part_kb * 1024, SECTOR) != ESP_OK) { return fail("emulator init"); }
+    if(flash_log_init(&dev) != ESP_OK) { return fail("log init"); }
+    if(flash_log_open("bench", &file_id) != ESP_OK) { return fail("open"); }
+
+    // Flash log path
+    int64_t cpu = 0, t;
+    uint32_t done;
+    for(done = 0; done < total; done += CHUNK)
+    {
+        fill_chunk(chunk, CHUNK, &seq);
+        t = now_us();
+        if(flash_log_append(file_id, chunk, CHUNK) != ESP_OK) { return fail("append"); }
+        cpu += now_us() - t;
+
+        // Idle time between buffers, the flush task erases ahead here
+        flash_log_maintain();
+    }
+    flash_log_close(file_id);
+
+    flash_log_stats_t* s = flash_log_get_stats();
+    flash_log_dev_file_stats_t* ds = flash_log_dev_file_get_stats(&dev);
+    uint64_t model_us = ds->bytes_programmed / 256 * PROG_US_PER_256 + (uint64_t) ds->erases * ERASE_US;
+
+    printf("\nflash log) %u MB into a %u KB partition, %u byte records\n", mb, part_kb, CONFIG_FLASH_LOG_RECORD_SIZE);
+    printf("  records %u  pad %llu B  wraps %u  erases %u  erase stalls %u\n",
+           s->records, (unsigned long long) s->pad_bytes, s->wraps, s->erases, s->erase_stalls);
+    printf("  programmed %llu B  write amp %.3f  NOR violations %u\n",
+           (unsigned long long) ds->bytes_programmed,
+           (double) ds->bytes_programmed / total,
+           ds->nor_violations);
+    printf("  wear per sector min %u max %u\n", ds->min_sector_erases, ds->max_sector_erases);
+    printf("  host cpu %.1f us/MB  modeled flash %.0f KB/s\n",
+           (double) cpu / mb,
+           (double) total / 1024 / ((double) model_us / 1e6));
+
+    if(ds->nor_violations) { return fail("wrote over data that was not erased"); }
+    if(ds->max_sector_erases - ds->min_sector_erases > 1) { return fail("uneven wear"); }
+
+    // Reboot, the head must come back exactly where it was
+    uint32_t want_seq = s->next_seq;
+    uint32_t want_head = s->head;
+    flash_log_dev_file_fini(&dev);
+    flash_log_dev_file_init(&dev, emu_path, part_kb * 1024, SECTOR);
+    if(flash_log_init(&dev) != ESP_OK) { return fail("reinit"); }
+    printf("\nreboot) scan %u us, %u record reads of %u slots\n",
+           s->scan_us, s->scan_reads, flash_log_num_slots());
+    if(s->next_seq != want_seq || s->head != want_head) { return fail("head not recovered"); }
+
+    // Tear a record at the head as if we reset mid write
+    uint8_t torn[FLASH_LOG_REC_HDR_LEN];
+    memset(torn, 0, sizeof(torn));
+    dev.write(dev.ctx, s->head, torn, sizeof(torn));
+    want_head = ((s->head / SECTOR) + 1) * SECTOR % (part_kb * 1024);
+    flash_log_dev_file_fini(&dev);
+    flash_log_dev_file_init(&dev, emu_path, part_kb * 1024, SECTOR);
+    if(flash_log_init(&dev) != ESP_OK) { return fail("reinit after tear"); }
+    printf("torn)   %u torn record, head moved to 0x%x\n", s->torn_records, s->head);
+    if(s->torn_records != 1 || s->head != want_head || s->next_seq != want_seq) { return fail("torn record recovery"); }
+
+    if(flash_log_open("after", &file_id) != ESP_OK || flash_log_close(file_id) != ESP_OK) { return fail("write after tear"); }
+    if(flash_log_dev_file_get_stats(&dev)->nor_violations) { return fail("wrote over data after tear"); }
+    if(check_interleaved(&dev, emu_path, part_kb * 1024)) { return 1; }
+    flash_log_dev_file_fini(&dev);
+
+    // Same data through stdio into one file, the file system path
+    FILE* f = fopen(fs_path, "wb");
+    if(!f) { return fail("fs open"); }
+    setvbuf(f, NULL, _IONBF, 0);
+    seq = 0;
+    cpu = 0;
+    for(done = 0; done < total; done += CHUNK)
+    {
+        fill_chunk(chunk, CHUNK, &seq);
+        t = now_us();
+        if(fwrite(chunk, 1, CHUNK, f) != CHUNK) { return fail("fs write"); }
+        cpu += now_us() - t;
+    }
+    fclose(f);
+    remove(fs_path);
+    printf("\nhost fs) %.1f us/MB through stdio (host file system, not SPIFFS)\n", (double) cpu / mb);
+
+    printf("\nPASS\n");
+    return 0;
+}
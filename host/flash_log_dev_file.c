@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash_log_dev_file.h"
+
+typedef struct
+{
+    FILE* f;
+    uint32_t sector_size;
+    uint32_t* sector_erases;
+    flash_log_dev_file_stats_t stats;
+} file_dev_t;
+
+static esp_err_t file_read(void* ctx, uint32_t off, void* dst, uint32_t len)
+{
+    file_dev_t* d = (file_dev_t*) ctx;
+
+    if(fseek(d->f, off, SEEK_SET) || fread(dst, 1, len, d->f) != len)
+    {
+        return ESP_FAIL;
+    }
+    d->stats.bytes_read += len;
+    return ESP_OK;
+}
+
+static esp_err_t file_write(void* ctx, uint32_t off, const void* src, uint32_t len)
+{
+    file_dev_t* d = (file_dev_t*) ctx;
+    uint8_t old[4096];
+    const uint8_t* s = (const uint8_t*) src;
+
+    while(len)
+    {
+        uint32_t n = len < sizeof(old) ? len : sizeof(old);
+        uint32_t i;
+
+        if(file_read(ctx, off, old, n))
+        {
+            return ESP_FAIL;
+        }
+
+        // NOR can only clear bits
+        for(i = 0; i < n; ++i)
+        {
+            if((old[i] & s[i]) != s[i])
+            {
+                d->stats.nor_violations++;
+            }
+            old[i] &= s[i];
+        }
+
+        if(fseek(d->f, off, SEEK_SET) || fwrite(old, 1, n, d->f) != n)
+        {
+            return ESP_FAIL;
+        }
+        d->stats.bytes_read -= n;
+        d->stats.bytes_programmed += n;
+
+        off += n;
+        s += n;
+        len -= n;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t file_erase(void* ctx, uint32_t off, uint32_t len)
+{
+    file_dev_t* d = (file_dev_t*) ctx;
+    uint8_t ff[4096];
+
+    if(off % d->sector_size || len % d->sector_size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(ff, 0xff, sizeof(ff));
+    if(fseek(d->f, off, SEEK_SET))
+    {
+        return ESP_FAIL;
+    }
+
+    uint32_t i;
+    for(i = 0; i < len; i += sizeof(ff))
+    {
+        uint32_t n = (len - i) < sizeof(ff) ? (len - i) : sizeof(ff);
+        if(fwrite(ff, 1, n, d->f) != n)
+        {
+            return ESP_FAIL;
+        }
+    }
+
+    for(i = off / d->sector_size; i < (off + len) / d->sector_size; ++i)
+    {
+        d->sector_erases[i]++;
+        d->stats.erases++;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t flash_log_dev_file_init(flash_log_dev_t* dev, const char* path, uint32_t size, uint32_t sector_size)
+{
+    file_dev_t* d = calloc(1, sizeof(file_dev_t));
+    if(!d || size % sector_size)
+    {
+        free(d);
+        return ESP_ERR_NO_MEM;
+    }
+
+    d->sector_size = sector_size;
+    d->sector_erases = calloc(size / sector_size, sizeof(uint32_t));
+
+    d->f = fopen(path, "r+b");
+    long cur = -1;
+    if(d->f && !fseek(d->f, 0, SEEK_END))
+    {
+        cur = ftell(d->f);
+    }
+
+    if(cur != (long) size)
+    {
+        if(d->f) { fclose(d->f); }
+        d->f = fopen(path, "w+b");
+        if(!d->f)
+        {
+            free(d->sector_erases);
+            free(d);
+            return ESP_FAIL;
+        }
+
+        uint8_t ff[4096];
+        memset(ff, 0xff, sizeof(ff));
+        uint32_t i;
+        for(i = 0; i < size; i += sizeof(ff))
+        {
+            fwrite(ff, 1, sizeof(ff) < size - i ? sizeof(ff) : size - i, d->f);
+        }
+        fflush(d->f);
+    }
+
+    dev->size = size;
+    dev->sector_size = sector_size;
+    dev->read = file_read;
+    dev->write = file_write;
+    dev->erase = file_erase;
+    dev->ctx = d;
+
+    return ESP_OK;
+}
+
+void flash_log_dev_file_fini(flash_log_dev_t* dev)
+{
+    file_dev_t* d = (file_dev_t*) dev->ctx;
+
+    fclose(d->f);
+    free(d->sector_erases);
+    free(d);
+    dev->ctx = NULL;
+}
+
+flash_log_dev_file_stats_t* flash_log_dev_file_get_stats(flash_log_dev_t* dev)
+{
+    file_dev_t* d = (file_dev_t*) dev->ctx;
+    uint32_t i, n = dev->size / dev->sector_size;
+
+    d->stats.max_sector_erases = 0;
+    d->stats.min_sector_erases = UINT32_MAX;
+    for(i = 0; i < n; ++i)
+    {
+        if(d->sector_erases[i] > d->stats.max_sector_erases) { d->stats.max_sector_erases = d->sector_erases[i]; }
+        if(d->sector_erases[i] < d->stats.min_sector_erases) { d->stats.min_sector_erases = d->sector_erases[i]; }
+    }
+
+    return &d->stats;
+}
@@ -0,0 +1,28 @@
+//*****************************************************************************
+// File backed NOR flash emulator for the flash log, see flash_log_dev.h. Also
+// counts what the real chip would have had to do so host benchmarks can talk
+// about flash work and wear, not just host CPU time.
+//*****************************************************************************
+
+#pragma once
+#include "flash_log_dev.h"
+
+typedef struct
+{
+    uint64_t bytes_read;
+    uint64_t bytes_programmed;
+    uint32_t erases;
+    uint32_t nor_violations;    // Writes that tried to set a 0 bit back to 1
+    uint32_t max_sector_erases; // Wear of the most erased sector
+    uint32_t min_sector_erases; // ... and the least
+} flash_log_dev_file_stats_t;
+
+//*****************************************************************************
+// flash_log_dev_file_init) Back dev by a file of size bytes. A new file (or one
+//                          of the wrong size) starts out erased.
+//
+// Returns) ESP_OK, FAIL if the file could not be opened, NO_MEM.
+//*****************************************************************************
+esp_err_t flash_log_dev_file_init(flash_log_dev_t* dev, const char* path, uint32_t size, uint32_t sector_size);
+void flash_log_dev_file_fini(flash_log_dev_t* dev);
+flash_log_dev_file_stats_t* flash_log_dev_file_get_stats(flash_log_dev_t* dev);
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Pull a file through the host build of the tcp file server with fs_client,
+# cut the first pull short and check the resumed pull comes out whole. The
+# listing comes from the capture catalog and has to hold more than the 32
+# files the old directory scan choked on. There are more files than the
+# catalog's 64 entries, the ones it has no room for must still be listed and
+# served.
+set -e
+DIR=/tmp/fs_check
+rm -rf $DIR && mkdir -p $DIR/root
+head -c 1500000 /dev/urandom > $DIR/root/capture.pcap
+head -c 100 /dev/urandom > $DIR/root/small
+for i in $(seq 1 80); do echo $i > $DIR/root/f$i; done
+
+./fs_server $DIR/root > $DIR/server.log 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+[ "$(./fs_client ls | wc -l)" -eq 82 ]
+./fs_client ls -l > $DIR/ls.txt
+grep -q "capture.pcap" $DIR/ls.txt && head -3 $DIR/ls.txt
+./fs_client -n 400000 get capture.pcap $DIR/out.pcap || [ $? -eq 2 ]
+./fs_client get capture.pcap $DIR/out.pcap
+cmp $DIR/root/capture.pcap $DIR/out.pcap
+./fs_client get small $DIR/small
+cmp $DIR/root/small $DIR/small
+for i in $(seq 1 80); do
+    rm -f $DIR/f
+    ./fs_client get f$i $DIR/f > /dev/null
+    cmp $DIR/root/f$i $DIR/f
+done
+if ./fs_client get missing $DIR/missing; then exit 1; fi
+echo "fs_check: PASS"
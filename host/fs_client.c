@@ -0,0 +1,379 @@
+//*****************************************************************************
+// Reference client for the tcp file server v2 protocol (see
+// components/tcp_file_server/tcp_file_server.h).
+//
+//   ls          - List files with size and CRC32. -l adds the catalog meta
+//                 data, creation time, records, flags, SSID and BSSIDs.
+//   get         - Pull a file. If <out> already holds the start of it the pull
+//                 resumes from there, and a dropped connection is retried
+//                 from where it got to. The finished file is checked against
+//                 the CRC32 of the listing.
+//
+// -n <bytes> stops a get after that many bytes, as if the link dropped, so
+// resume can be tested.
+//
+// usage: fs_client [-s <ip>] [-p <port>] ls [-l]
+//        fs_client [-s <ip>] [-p <port>] [-n <bytes>] get <name> [<out>]
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tcp_file_server.h"
+#include "capture_catalog.h"
+
+#define RETRIES 5
+#define RETRY_S 1
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, uint32_t len)
+{
+    uint8_t j;
+    crc = ~crc;
+    while(len--)
+    {
+        crc ^= *p++;
+        for(j = 0; j < 8; ++j)
+        {
+            crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+static const char* server_ip = "127.0.0.1";
+static uint16_t server_port = CONFIG_TCP_SERVER_V2_PORT;
+static uint8_t buf[65536];
+
+//*****************************************************************************
+// Messages
+//*****************************************************************************
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    addr.sin_addr.s_addr = inet_addr(server_ip);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        fprintf(stderr, "connect %s:%d: %s\n", server_ip, server_port, strerror(errno));
+        if(sock >= 0) { close(sock); }
+        return -1;
+    }
+    return sock;
+}
+
+static int recv_all(int sock, void* p, uint32_t len)
+{
+    uint8_t* b = (uint8_t*) p;
+    while(len)
+    {
+        ssize_t n = recv(sock, b, len, 0);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_msg(int sock, uint8_t type, const void* p1, uint32_t l1, const void* p2, uint32_t l2)
+{
+    tcp_file_server_msg_t m = { .type = type, .len = l1 + l2 };
+    if(send(sock, &m, sizeof(m), 0) != sizeof(m) ||
+       (l1 && send(sock, p1, l1, 0) != (ssize_t) l1) ||
+       (l2 && send(sock, p2, l2, 0) != (ssize_t) l2))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Next message, payload into buf. Returns the type or -1.
+static int recv_msg(int sock, uint32_t* len)
+{
+    tcp_file_server_msg_t m;
+    if(recv_all(sock, &m, sizeof(m)) || m.len >= sizeof(buf) || recv_all(sock, buf, m.len))
+    {
+        return -1;
+    }
+    *len = m.len;
+    return m.type;
+}
+
+//*****************************************************************************
+// Commands
+//*****************************************************************************
+
+static void print_meta(const tcp_file_server_meta_t* m, const char* name)
+{
+    char when[24], flags[5];
+    time_t t = m->created;
+    struct tm tm;
+    uint8_t j;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime_r(&t, &tm));
+    flags[0] = (m->flags & CAPTURE_CATALOG_OPEN) ? 'o' : '-';
+    flags[1] = (m->flags & CAPTURE_CATALOG_SIDECAR) ? 'i' : '-';
+    flags[2] = (m->flags & CAPTURE_CATALOG_COMPRESSED) ? 'z' : '-';
+    flags[3] = (m->flags & CAPTURE_CATALOG_FOREIGN) ? 'f' : '-';
+    flags[4] = 0;
+
+    printf("  %s  %8u  %s  %s", when, m->records, flags, name);
+    if(m->ssid[0])
+    {
+        printf("  \"%.32s\"", m->ssid);
+    }
+    for(j = 0; j < m->n_bssids && j < 4; ++j)
+    {
+        printf("%s%02x:%02x:%02x:%02x:%02x:%02x", j ? "," : "  ",
+               m->bssids[j][0], m->bssids[j][1], m->bssids[j][2],
+               m->bssids[j][3], m->bssids[j][4], m->bssids[j][5]);
+    }
+    printf("%s\n", (m->flags & CAPTURE_CATALOG_BSSID_OVERFLOW) ? ",..." : "");
+}
+
+// Lists the server, prints it if name is NULL, else fills in that file's
+// size and CRC. Returns 0 if found / listed.
+static int list(int sock, const char* name, uint32_t* size, uint32_t* crc, int meta)
+{
+    tcp_file_server_entry_t e;
+    tcp_file_server_meta_t m;
+    uint32_t len, hdr_len = sizeof(e) + (meta ? sizeof(m) : 0);
+    uint8_t flags = meta ? TCP_FILE_SERVER_LIST_META : 0;
+    int found = name ? -1 : 0;
+
+    if(send_msg(sock, TCP_FILE_SERVER_MSG_LIST, &flags, meta ? 1 : 0, NULL, 0))
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        int type = recv_msg(sock, &len);
+        if(type == TCP_FILE_SERVER_MSG_LIST_END)
+        {
+            return found;
+        }
+        if(type != TCP_FILE_SERVER_MSG_ENTRY || len < hdr_len)
+        {
+            fprintf(stderr, "bad listing\n");
+            return -1;
+        }
+
+        memcpy(&e, buf, sizeof(e));
+        buf[len] = 0;
+        char* n = (char*) buf + hdr_len;
+        if(!name && meta)
+        {
+            memcpy(&m, buf + sizeof(e), sizeof(m));
+            printf("%10u  %08x", e.size, e.crc32);
+            print_meta(&m, n);
+        }
+        else if(!name)
+        {
+            printf("%10u  %08x  %s\n", e.size, e.crc32, n);
+        }
+        else if(!strcmp(n, name))
+        {
+            *size = e.size;
+            *crc = e.crc32;
+            found = 0;
+        }
+    }
+}
+
+// Pull [offset, size) of name into f. Returns bytes written, -1 on a lost
+// connection, -2 if the server refused.
+static int64_t get_range(int sock, const char* name, FILE* f, uint32_t offset, int64_t max_bytes)
+{
+    tcp_file_server_get_t g = { .offset = offset, .len = 0 };
+    tcp_file_server_data_end_t end;
+    uint32_t len, crc = 0;
+    int64_t got = 0;
+
+    if(send_msg(sock, TCP_FILE_SERVER_MSG_GET, &g, sizeof(g), name, strlen(name)))
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        int type = recv_msg(sock, &len);
+        if(type == TCP_FILE_SERVER_MSG_DATA)
+        {
+            if(max_bytes >= 0 && got + len > max_bytes)
+            {
+                len = max_bytes - got;
+                fwrite(buf, 1, len, f);
+                got += len;
+                printf("stopping after %lld bytes\n", (long long) got);
+                return -1;
+            }
+            fwrite(buf, 1, len, f);
+            crc = crc32(crc, buf, len);
+            got += len;
+        }
+        else if(type == TCP_FILE_SERVER_MSG_DATA_END && len == sizeof(end))
+        {
+            memcpy(&end, buf, sizeof(end));
+            if(end.len != got || end.crc32 != crc)
+            {
+                fprintf(stderr, "range check failed\n");
+                return -2;
+            }
+            return got;
+        }
+        else if(type == TCP_FILE_SERVER_MSG_ERROR && len == sizeof(int32_t))
+        {
+            int32_t e;
+            memcpy(&e, buf, sizeof(e));
+            fprintf(stderr, "server error 0x%x\n", e);
+            return -2;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+}
+
+static int file_crc(const char* path, uint32_t* crc)
+{
+    FILE* f = fopen(path, "rb");
+    size_t n;
+    if(!f)
+    {
+        return -1;
+    }
+    *crc = 0;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        *crc = crc32(*crc, buf, n);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int get(const char* name, const char* out, int64_t max_bytes)
+{
+    uint32_t size = 0, crc = 0, local_crc = 0;
+    struct stat st;
+    int tries;
+
+    for(tries = 0; tries <= RETRIES; ++tries)
+    {
+        if(tries)
+        {
+            sleep(RETRY_S);
+        }
+
+        int sock = connect_server();
+        if(sock < 0)
+        {
+            continue;
+        }
+
+        if(list(sock, name, &size, &crc, 0))
+        {
+            fprintf(stderr, "%s not on the server\n", name);
+            close(sock);
+            return 1;
+        }
+
+        uint32_t have = stat(out, &st) ? 0 : (uint32_t) st.st_size;
+        if(have > size)
+        {
+            have = 0;
+        }
+        if(have)
+        {
+            printf("resuming %s at %u of %u\n", name, have, size);
+        }
+
+        FILE* f = fopen(out, have ? "r+b" : "wb");
+        if(!f)
+        {
+            fprintf(stderr, "open %s: %s\n", out, strerror(errno));
+            close(sock);
+            return 1;
+        }
+        fseek(f, have, SEEK_SET);
+
+        int64_t got = get_range(sock, name, f, have, max_bytes);
+        fclose(f);
+        close(sock);
+
+        if(got == -2)
+        {
+            return 1;
+        }
+        if(got < 0)
+        {
+            if(max_bytes >= 0)
+            {
+                return 2;
+            }
+            continue;
+        }
+
+        if(file_crc(out, &local_crc) || local_crc != crc)
+        {
+            fprintf(stderr, "%s: CRC %08x, listing says %08x\n", out, local_crc, crc);
+            return 1;
+        }
+        printf("%s: %u bytes, CRC %08x ok\n", out, size, crc);
+        return 0;
+    }
+
+    fprintf(stderr, "giving up after %d retries\n", RETRIES);
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    int64_t max_bytes = -1;
+    int opt, meta = 0;
+
+    while((opt = getopt(argc, argv, "s:p:n:l")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': server_ip = optarg; break;
+            case 'p': server_port = (uint16_t) atoi(optarg); break;
+            case 'n': max_bytes = atoll(optarg); break;
+            case 'l': meta = 1; break;
+            default: goto usage;
+        }
+    }
+
+    if(optind < argc && !strcmp(argv[optind], "ls"))
+    {
+        int sock = connect_server();
+        int r = (sock < 0) ? 1 : (list(sock, NULL, NULL, NULL, meta) != 0);
+        if(sock >= 0) { close(sock); }
+        return r;
+    }
+    if(optind + 1 < argc && !strcmp(argv[optind], "get"))
+    {
+        const char* name = argv[optind + 1];
+        return get(name, (optind + 2 < argc) ? argv[optind + 2] : name, max_bytes);
+    }
+
+    usage:
+    fprintf(stderr, "usage: fs_client [-s <ip>] [-p <port>] ls [-l]\n"
+                    "       fs_client [-s <ip>] [-p <port>] [-n <bytes>] get <name> [<out>]\n");
+    return 1;
+}
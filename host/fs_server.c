@@ -0,0 +1,65 @@
+//*****************************************************************************
+// Linux build of the tcp file server, serving a local directory on
+// 127.0.0.1 (v1 on 4200, v2 on 4220 unless overridden at build time) from
+// the net reactor like on the board. Used with fs_client to test the
+// protocol without a board. The reactor stats are printed on exit.
+//
+// usage: fs_server <dir>
+//*****************************************************************************
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "tcp_file_server.h"
+#include "net_reactor.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: fs_server <dir>\n");
+        return 1;
+    }
+
+    // A client closing mid send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if(net_reactor_init() != ESP_OK || tcp_file_server_launch(argv[1]) != ESP_OK)
+    {
+        return 1;
+    }
+
+    while(!stop)
+    {
+        sleep(1);
+    }
+
+    net_reactor_stats_t s;
+    net_reactor_handler_stats_t h;
+    uint8_t i;
+    net_reactor_get_stats(&s);
+    printf("reactor: %u rounds, %u wakes, %.1f%% of %llu ms in select\n",
+           s.rounds, s.wakes, s.up_us ? 100.0 * s.wait_us / s.up_us : 0.0,
+           (unsigned long long) s.up_us / 1000);
+    for(i = 0; i < CONFIG_NET_REACTOR_MAX_HANDLERS; ++i)
+    {
+        if(net_reactor_get_handler_stats(i, &h) != ESP_OK) { continue; }
+        printf("  %-16s %u calls, %llu us, max %u us\n", h.name, h.calls,
+               (unsigned long long) h.busy_us, h.max_us);
+    }
+
+    tcp_file_server_kill();
+    usleep(300 * 1000);
+    return 0;
+}
@@ -0,0 +1,192 @@
+//*****************************************************************************
+// Decoder of the repl mux log stream (see components/repl_mux/repl_mux_token.h).
+// Reads the UART or REPL TCP output, passes text logs through and turns the
+// tokenized frames back into the lines ESP_LOGx would have printed, with the
+// token table this was built with. Warns if the device reports a different
+// table.
+//
+//   nc 192.168.4.1 421 | log_decode
+//   log_decode < uart.log
+//
+// -t runs a self test of pack and format instead.
+//
+// usage: log_decode [-t] [<file>]
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "repl_mux_token.h"
+
+#define MAX_LINE 512
+
+static int pack(uint8_t* out, int cap, uint16_t id, ...)
+{
+    va_list args;
+    va_start(args, id);
+    int n = repl_mux_token_pack(out, cap, id, 1234, args);
+    va_end(args);
+    return n;
+}
+
+static int expect(const uint8_t* frame, int len, const char* want)
+{
+    char line[MAX_LINE];
+    int n = repl_mux_token_format(line, sizeof(line), frame, len);
+    if(n < 0 || strcmp(line, want))
+    {
+        fprintf(stderr, "log_decode: got \"%s\" want \"%s\"\n", n < 0 ? "(invalid)" : line, want);
+        return 1;
+    }
+    return 0;
+}
+
+static int decode(FILE* in, FILE* out);
+
+// A frame full of 0x0A bytes between text lines has to come out of the
+// stream decoder whole, the text around it untouched
+static int stream_test(void)
+{
+    const char want[] = "boot\nI (1034) EAPOL LOGGER: ab\ncd -> eapol 10 -- len = 10\nafter\n";
+    char got[sizeof(want) + 16] = {0};
+    uint8_t f[64];
+
+    int n = pack(f, sizeof(f), REPL_MUX_TOK_EAPOL_MSG, "ab\ncd", 10, 10);
+    f[4] = 0x0a; f[5] = 0x04; f[6] = 0; f[7] = 0;
+
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    if(!in || !out) { return 1; }
+    fputs("boot\n", in);
+    fwrite(f, 1, n, in);
+    fputs("after\n", in);
+    rewind(in);
+
+    decode(in, out);
+    rewind(out);
+    size_t got_len = fread(got, 1, sizeof(got) - 1, out);
+    fclose(in);
+    fclose(out);
+
+    if(got_len != sizeof(want) - 1 || memcmp(got, want, got_len))
+    {
+        fprintf(stderr, "log_decode: stream got \"%s\" want \"%s\"\n", got, want);
+        return 1;
+    }
+    return 0;
+}
+
+static int self_test(void)
+{
+    uint8_t f[300];
+    int n, fail = 0;
+
+    n = pack(f, sizeof(f), REPL_MUX_TOK_SNIFF_HTC);
+    fail |= (n != REPL_MUX_TOKEN_HDR);
+    fail |= expect(f, n, "E (1234) PKT SNIFFER: HTC packet captured\n");
+
+    n = pack(f, sizeof(f), REPL_MUX_TOK_EAPOL_MSG, "home-net", 3, 121);
+    fail |= (n != REPL_MUX_TOKEN_HDR + 1 + 8 + 4 + 4);
+    fail |= expect(f, n, "I (1234) EAPOL LOGGER: home-net -> eapol 3 -- len = 121\n");
+
+    n = pack(f, sizeof(f), REPL_MUX_TOK_TOKEN_TABLE, (uint32_t) 0xdeadbeef, 7u);
+    fail |= expect(f, n, "I (1234) REPL MUX: token table deadbeef, 7 tokens\n");
+
+    // Args that do not fit are left off and print as ?
+    n = pack(f, REPL_MUX_TOKEN_HDR + 9 + 4, REPL_MUX_TOK_EAPOL_MSG, "home-net", -1, 121);
+    fail |= expect(f, n, "I (1234) EAPOL LOGGER: home-net -> eapol -1 -- len = ?\n");
+
+    // Broken frames
+    fail |= (repl_mux_token_format((char*) f + 200, 64, f, n - 1) != -1);
+    f[2] = 0xff; f[3] = 0xff;
+    fail |= (repl_mux_token_format((char*) f + 200, 64, f, n) != -1);
+    fail |= (pack(f, sizeof(f), REPL_MUX_N_TOKENS) != 0);
+
+    fail |= stream_test();
+
+    printf("log_decode: %u tokens, table %08x, self test %s\n",
+           REPL_MUX_N_TOKENS, repl_mux_token_hash(), fail ? "FAIL" : "PASS");
+    return fail;
+}
+
+static int decode(FILE* in, FILE* out)
+{
+    uint32_t hash = repl_mux_token_hash();
+    uint8_t frame[256 + 2];
+    char line[MAX_LINE];
+    int c;
+
+    while((c = getc(in)) != EOF)
+    {
+        if(c != REPL_MUX_TOKEN_MARK)
+        {
+            putc(c, out);
+            continue;
+        }
+
+        int len = getc(in);
+        if(len == EOF) { break; }
+
+        frame[0] = c;
+        frame[1] = len;
+        if(fread(frame + 2, 1, len, in) != (size_t) len) { break; }
+
+        int n = repl_mux_token_format(line, sizeof(line), frame, len + 2);
+        if(n < 0)
+        {
+            fprintf(out, "<bad frame, %d bytes>\n", len + 2);
+            continue;
+        }
+        fputs(line, out);
+
+        uint16_t id = frame[2] | (frame[3] << 8);
+        uint32_t dev_hash = frame[8] | (frame[9] << 8) | (frame[10] << 16) | ((uint32_t) frame[11] << 24);
+        if(id == REPL_MUX_TOK_TOKEN_TABLE && len + 2 >= REPL_MUX_TOKEN_HDR + 4 && dev_hash != hash)
+        {
+            fprintf(out, "log_decode: WARNING device token table %08x, ours %08x, rebuild from the firmware's tree\n",
+                   dev_hash, hash);
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while((opt = getopt(argc, argv, "t")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': return self_test();
+            default: goto usage;
+        }
+    }
+
+    if(optind == argc)
+    {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        return decode(stdin, stdout);
+    }
+
+    if(optind == argc - 1)
+    {
+        FILE* f = fopen(argv[optind], "rb");
+        if(!f)
+        {
+            perror(argv[optind]);
+            return 1;
+        }
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        int r = decode(f, stdout);
+        fclose(f);
+        return r;
+    }
+
+    usage:
+    fprintf(stderr, "usage: log_decode [-t] [<file>]\n");
+    return 1;
+}
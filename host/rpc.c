@@ -0,0 +1,263 @@
+//*****************************************************************************
+// Command line client of the repl mux RPC channel (see
+// components/repl_mux/repl_mux_rpc.h and rpc_client.h).
+//
+//   ping        - Round trip, the device echoes the text back.
+//   cmds        - Name and description of every REPL command.
+//   cmd         - Run a REPL command, print its output and return value.
+//   sniff       - Packet sniffer counters.
+//   aps         - The MAC logger table, APs with their STAs.
+//
+// -t runs a self test instead. A child serves the RPC ops from the same
+// dispatch code as the firmware, with canned handlers, over a socketpair.
+//
+// usage: rpc [-s <ip>] [-p <port>] ping [<text>] | cmds | cmd <line> | sniff | aps
+//        rpc -t
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "rpc_client.h"
+
+#define DEFAULT_PORT 424
+#define TEST_FRAME 300                  // Small frames so responses need several
+
+static uint8_t resp[1 << 20];
+
+//*****************************************************************************
+// Self test
+//*****************************************************************************
+
+static int send_frame(void* ctx, const uint8_t* frame, int len)
+{
+    int sock = *(int*) ctx;
+    while(len > 0)
+    {
+        ssize_t r = send(sock, frame, len, MSG_NOSIGNAL);
+        if(r <= 0) { return -1; }
+        frame += r;
+        len -= r;
+    }
+    return 0;
+}
+
+// Output of a long command, many lines
+static int test_cmd(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    char line[64];
+    int i;
+    for(i = 0; i < 100; ++i)
+    {
+        int n = snprintf(line, sizeof(line), "%.*s line %d\n", len, (const char*) body, i);
+        repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_TEXT, line, n);
+    }
+    repl_mux_rpc_put_i32(out, REPL_MUX_RPC_F_RET, -7);
+    return REPL_MUX_RPC_OK;
+}
+
+static int test_aps(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    uint8_t bssid[6] = { 0xaa, 0xbb, 0xcc, 0x00, 0x00, 0x00 };
+    uint8_t sta[7] = { 0x02, 0x11, 0x22, 0x33, 0x44, 0x00, (uint8_t) -60 };
+    int8_t rssi = -42;
+    uint8_t i, j;
+    (void) body;
+    (void) len;
+    for(i = 0; i < 2; ++i)
+    {
+        bssid[5] = i;
+        repl_mux_rpc_put_u8(out, REPL_MUX_RPC_F_AP, i);
+        repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_SSID, "home-net", 8);
+        repl_mux_rpc_put(out, REPL_MUX_RPC_F_BSSID, bssid, 6);
+        repl_mux_rpc_put(out, REPL_MUX_RPC_F_RSSI, &rssi, 1);
+        repl_mux_rpc_put_u32(out, REPL_MUX_RPC_F_AKM, 0x000fac02);
+        for(j = 0; j < 3; ++j)
+        {
+            sta[5] = j;
+            repl_mux_rpc_put(out, REPL_MUX_RPC_F_STA, sta, 7);
+        }
+    }
+    return REPL_MUX_RPC_OK;
+}
+
+static void test_server(int sock)
+{
+    static uint8_t req[REPL_MUX_RPC_MAX_FRAME];
+    uint8_t tx[TEST_FRAME];
+
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_CMD, test_cmd);
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_APS, test_aps);
+
+    while(1)
+    {
+        if(recv(sock, req, 2, MSG_WAITALL) != 2) { break; }
+        int len = repl_mux_rpc_frame_len(req, 2);
+        if(len > 2 && recv(sock, req + 2, len - 2, MSG_WAITALL) != len - 2) { break; }
+        if(repl_mux_rpc_handle(req, len, tx, sizeof(tx), send_frame, &sock)) { break; }
+    }
+    close(sock);
+    _exit(0);
+}
+
+static int self_test(void)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        close(sv[0]);
+        test_server(sv[1]);
+    }
+    close(sv[1]);
+
+    rpc_client_t* cl = malloc(sizeof(*cl));
+    rpc_client_attach(cl, sv[0]);
+
+    int fail = 0;
+    int len, st;
+    const uint8_t* p;
+    const uint8_t* v;
+    uint8_t type, n;
+
+    // Ping echoes
+    st = rpc_client_call(cl, REPL_MUX_RPC_OP_PING, "hello", 5, resp, sizeof(resp), &len);
+    fail |= (st != REPL_MUX_RPC_OK || len != 7 || resp[0] != REPL_MUX_RPC_F_TEXT || memcmp(resp + 2, "hello", 5));
+
+    // A command's output takes several frames and is joined back up
+    st = rpc_client_call(cl, REPL_MUX_RPC_OP_CMD, "dump", 4, resp, sizeof(resp), &len);
+    fail |= (st != REPL_MUX_RPC_OK || cl->frames < 5);
+    {
+        char text[4096];
+        int tn = 0, lines = 0;
+        int64_t ret = 0;
+        p = resp;
+        while(repl_mux_rpc_next(&p, resp + len, &type, &v, &n) > 0)
+        {
+            if(type == REPL_MUX_RPC_F_TEXT) { memcpy(text + tn, v, n); tn += n; }
+            if(type == REPL_MUX_RPC_F_RET) { ret = repl_mux_rpc_int(v, n); }
+        }
+        text[tn] = 0;
+        char* s;
+        for(s = text; (s = strchr(s, '\n')); ++s) { ++lines; }
+        fail |= (lines != 100 || ret != -7 || !strstr(text, "dump line 99\n"));
+    }
+
+    // Grouped fields
+    st = rpc_client_call(cl, REPL_MUX_RPC_OP_APS, NULL, 0, resp, sizeof(resp), &len);
+    {
+        int aps = 0, stas = 0, rssi_ok = 0;
+        p = resp;
+        while(repl_mux_rpc_next(&p, resp + len, &type, &v, &n) > 0)
+        {
+            if(type == REPL_MUX_RPC_F_AP) { aps++; }
+            if(type == REPL_MUX_RPC_F_STA && n == 7 && (int8_t) v[6] == -60) { stas++; }
+            if(type == REPL_MUX_RPC_F_RSSI && repl_mux_rpc_int(v, n) == -42) { rssi_ok++; }
+        }
+        fail |= (st != REPL_MUX_RPC_OK || aps != 2 || stas != 6 || rssi_ok != 2);
+    }
+
+    // Ops nobody serves
+    st = rpc_client_call(cl, REPL_MUX_RPC_OP_SNIFF, NULL, 0, resp, sizeof(resp), &len);
+    fail |= (st != REPL_MUX_RPC_BAD_OP || len != 0);
+    st = rpc_client_call(cl, 200, NULL, 0, resp, sizeof(resp), &len);
+    fail |= (st != REPL_MUX_RPC_BAD_OP);
+
+    // Cut short fields are caught
+    uint8_t cut[] = { REPL_MUX_RPC_F_TEXT, 10, 'a' };
+    p = cut;
+    fail |= (repl_mux_rpc_next(&p, cut + sizeof(cut), &type, &v, &n) != -1);
+
+    rpc_client_close(cl);
+    free(cl);
+    waitpid(pid, NULL, 0);
+
+    printf("rpc: self test %s\n", fail ? "FAIL" : "PASS");
+    return fail;
+}
+
+//*****************************************************************************
+// Main
+//*****************************************************************************
+
+int main(int argc, char** argv)
+{
+    const char* ip = "192.168.4.1";
+    uint16_t port = DEFAULT_PORT;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:p:t")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 't': return self_test();
+            default: goto usage;
+        }
+    }
+
+    if(optind == argc)
+    {
+        goto usage;
+    }
+
+    const char* what = argv[optind];
+    char body[256] = "";
+    int i, op;
+
+    // The rest of the args are the body, space separated
+    for(i = optind + 1; i < argc; ++i)
+    {
+        if(i > optind + 1) { strncat(body, " ", sizeof(body) - strlen(body) - 1); }
+        strncat(body, argv[i], sizeof(body) - strlen(body) - 1);
+    }
+
+    if(!strcmp(what, "ping"))       { op = REPL_MUX_RPC_OP_PING; }
+    else if(!strcmp(what, "cmds"))  { op = REPL_MUX_RPC_OP_CMDS; }
+    else if(!strcmp(what, "cmd"))   { op = REPL_MUX_RPC_OP_CMD; }
+    else if(!strcmp(what, "sniff")) { op = REPL_MUX_RPC_OP_SNIFF; }
+    else if(!strcmp(what, "aps"))   { op = REPL_MUX_RPC_OP_APS; }
+    else                            { goto usage; }
+
+    rpc_client_t* cl = malloc(sizeof(*cl));
+    if(rpc_client_open(cl, ip, port))
+    {
+        free(cl);
+        return 1;
+    }
+
+    int len;
+    int st = rpc_client_call(cl, op, body, strlen(body), resp, sizeof(resp), &len);
+    rpc_client_close(cl);
+    free(cl);
+
+    if(st < 0)
+    {
+        fprintf(stderr, "rpc: connection lost\n");
+        return 1;
+    }
+
+    rpc_client_print(stdout, resp, len);
+    if(st != REPL_MUX_RPC_OK)
+    {
+        fprintf(stderr, "rpc: status %d\n", st);
+        return 1;
+    }
+    return 0;
+
+    usage:
+    fprintf(stderr, "usage: rpc [-s <ip>] [-p <port>] ping [<text>] | cmds | cmd <line> | sniff | aps\n"
+                    "       rpc -t\n");
+    return 1;
+}
@@ -0,0 +1,166 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpc_client.h"
+
+static int recv_all(int sock, uint8_t* p, int len)
+{
+    while(len > 0)
+    {
+        ssize_t r = recv(sock, p, len, 0);
+        if(r <= 0) { return -1; }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int send_all(int sock, const uint8_t* p, int len)
+{
+    while(len > 0)
+    {
+        ssize_t r = send(sock, p, len, MSG_NOSIGNAL);
+        if(r <= 0) { return -1; }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int rpc_client_open(rpc_client_t* cl, const char* ip, uint16_t port)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        fprintf(stderr, "connect %s:%d: %s\n", ip, port, strerror(errno));
+        if(sock >= 0) { close(sock); }
+        return -1;
+    }
+
+    rpc_client_attach(cl, sock);
+    return 0;
+}
+
+void rpc_client_attach(rpc_client_t* cl, int sock)
+{
+    cl->sock = sock;
+    cl->next_id = 1;
+    cl->frames = 0;
+}
+
+void rpc_client_close(rpc_client_t* cl)
+{
+    if(cl->sock >= 0) { close(cl->sock); }
+    cl->sock = -1;
+}
+
+int rpc_client_call(rpc_client_t* cl,
+                    uint8_t op,
+                    const void* req,
+                    int req_len,
+                    uint8_t* out,
+                    int cap,
+                    int* out_len)
+{
+    uint16_t id = cl->next_id++;
+    int len = REPL_MUX_RPC_HDR + req_len;
+    if(len > REPL_MUX_RPC_MAX_FRAME)
+    {
+        return -1;
+    }
+
+    uint8_t* f = cl->frame;
+    f[0] = (len - 2); f[1] = (len - 2) >> 8;
+    f[2] = id; f[3] = id >> 8;
+    f[4] = op;
+    f[5] = 0;
+    if(req_len) { memcpy(f + REPL_MUX_RPC_HDR, req, req_len); }
+    if(send_all(cl->sock, f, len))
+    {
+        return -1;
+    }
+
+    *out_len = 0;
+    cl->frames = 0;
+    while(1)
+    {
+        if(recv_all(cl->sock, f, 2)) { return -1; }
+        len = repl_mux_rpc_frame_len(f, 2);
+        if(len < REPL_MUX_RPC_HDR || recv_all(cl->sock, f + 2, len - 2)) { return -1; }
+        cl->frames++;
+
+        // Frames of another id are left over from a call that gave up
+        if((f[2] | (f[3] << 8)) != id) { continue; }
+
+        int body = len - REPL_MUX_RPC_HDR;
+        if(*out_len + body > cap) { return -1; }
+        memcpy(out + *out_len, f + REPL_MUX_RPC_HDR, body);
+        *out_len += body;
+
+        if(f[5] != REPL_MUX_RPC_MORE) { return f[5]; }
+    }
+}
+
+int rpc_client_print(FILE* f, const uint8_t* fields, int len)
+{
+    const uint8_t* p = fields;
+    const uint8_t* end = fields + len;
+    const uint8_t* v;
+    uint8_t type, n, kind;
+    int r, i;
+
+    while((r = repl_mux_rpc_next(&p, end, &type, &v, &n)) > 0)
+    {
+        const char* name = repl_mux_rpc_field_name(type, &kind);
+        if(!name)
+        {
+            fprintf(f, "field %u, %u bytes\n", type, n);
+            continue;
+        }
+
+        if(type == REPL_MUX_RPC_F_TEXT)
+        {
+            fwrite(v, 1, n, f);
+            continue;
+        }
+        if(type == REPL_MUX_RPC_F_AP) { fputc('\n', f); }
+
+        fprintf(f, "%-16s ", name);
+        switch(kind)
+        {
+            case REPL_MUX_RPC_K_TEXT:
+                fprintf(f, "%.*s", n, (const char*) v);
+                break;
+            case REPL_MUX_RPC_K_INT:
+                fprintf(f, "%" PRId64, repl_mux_rpc_int(v, n));
+                break;
+            case REPL_MUX_RPC_K_HEX:
+                fprintf(f, "0x%" PRIx64, repl_mux_rpc_uint(v, n));
+                break;
+            case REPL_MUX_RPC_K_MAC:
+            case REPL_MUX_RPC_K_STA:
+                for(i = 0; i < 6 && i < n; ++i) { fprintf(f, i ? ":%02x" : "%02x", v[i]); }
+                if(kind == REPL_MUX_RPC_K_STA && n > 6) { fprintf(f, " %d", (int8_t) v[6]); }
+                break;
+            case REPL_MUX_RPC_K_U64S:
+                for(i = 0; i + 8 <= n; i += 8) { fprintf(f, "%s%" PRIu64, i ? " " : "", repl_mux_rpc_uint(v + i, 8)); }
+                break;
+            default:
+                fprintf(f, "%" PRIu64, repl_mux_rpc_uint(v, n));
+                break;
+        }
+        fputc('\n', f);
+    }
+
+    return r;
+}
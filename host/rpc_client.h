@@ -0,0 +1,61 @@
+//*****************************************************************************
+// Client of the repl mux RPC channel (see components/repl_mux/repl_mux_rpc.h).
+// One call sends one request frame and joins the fields of every response
+// frame of it, so the caller gets the whole field list at once.
+//*****************************************************************************
+
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+#include "repl_mux_rpc.h"
+
+typedef struct
+{
+    int sock;
+    uint16_t next_id;
+    uint32_t frames;                    // Response frames read by the last call
+    uint8_t frame[REPL_MUX_RPC_MAX_FRAME];
+} rpc_client_t;
+
+//*****************************************************************************
+// rpc_client_open) Connect to the device.
+//
+// Returns) 0, -1 if the connect failed.
+//*****************************************************************************
+int rpc_client_open(rpc_client_t* cl, const char* ip, uint16_t port);
+
+//*****************************************************************************
+// rpc_client_attach) Use a socket that is already connected, i.e. one end of
+//                    a socketpair in a test.
+//*****************************************************************************
+void rpc_client_attach(rpc_client_t* cl, int sock);
+
+void rpc_client_close(rpc_client_t* cl);
+
+//*****************************************************************************
+// rpc_client_call) Send a request and read its whole response.
+//
+// op) repl_mux_rpc_op_t.
+// req) Request body, req_len bytes.
+// out) The fields of the response go here, cap bytes.
+// out_len) Out param, bytes of out used.
+//
+// Returns) The repl_mux_rpc_status_t of the response, -1 if the connection
+//          failed or the response did not fit out.
+//*****************************************************************************
+int rpc_client_call(rpc_client_t* cl,
+                    uint8_t op,
+                    const void* req,
+                    int req_len,
+                    uint8_t* out,
+                    int cap,
+                    int* out_len);
+
+//*****************************************************************************
+// rpc_client_print) Print a field list, one field a line by its name. Text
+//                   fields print as they are.
+//
+// Returns) 0, -1 if the fields are cut short.
+//*****************************************************************************
+int rpc_client_print(FILE* f, const uint8_t* fields, int len);
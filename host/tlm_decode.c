@@ -0,0 +1,610 @@
+//*****************************************************************************
+// Decoder of the telemetry stream (see components/telemetry/telemetry.h and
+// telemetry_rec.h). Reads it live from the device or from a file, i.e. the
+// "telemetry" capture pulled from the flash log, and prints the series:
+//
+//   table  - A row per sample, a column per field. Counters are shown as a
+//            rate per second, from the sample before. Under each row the
+//            tasks that used the most CPU, in % of one core.
+//   csv    - Long format, t_ms,series,value a line. Fields as sent, counters
+//            as their running value, task CPU as cpu.<name> in %.
+//
+//   tlm_decode                        live from 192.168.4.1:425
+//   tlm_decode -c -f telemetry.bin > tlm.csv
+//
+// A stream that starts mid record, the flash log wrapped over its start, is
+// read from the first whole record on. Lost samples show as a gap in seq.
+//
+// -t runs a self test instead, records encoded by the firmware encoder and
+// fed in random sized pieces behind junk.
+//
+// usage: tlm_decode [-s <ip>] [-p <port>] [-f <file | ->] [-c] [-n <tasks>]
+//        tlm_decode -t
+//*****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "telemetry_rec.h"
+
+#define DEFAULT_PORT 425
+#define DEFAULT_TOP 5
+#define MAX_REC (TELEMETRY_REC_HDR + TELEMETRY_MAX_BODY)
+#define MAX_NAMES 256
+#define HEADER_EVERY 20                     // Rows between repeats of the column names
+
+typedef struct
+{
+    FILE* out;
+    uint8_t csv;
+    uint8_t top;                            // Tasks shown under a row
+
+    uint8_t buf[2 * MAX_REC];               // Always room for one whole record
+    int have;
+
+    uint32_t interval_ms;
+    uint32_t samples;
+    uint32_t lost;                          // Gaps in seq
+    uint32_t skipped;                       // Bytes that were not a record
+
+    uint16_t n_names;
+    uint32_t name_id[MAX_NAMES];
+    char name[MAX_NAMES][TELEMETRY_TASK_NAME_LEN + 1];
+
+    uint8_t have_prev;
+    uint32_t prev_seq;
+    uint32_t prev_t;
+    uint8_t prev_has[256];
+    uint64_t prev_val[256];
+
+    uint8_t n_cols;                         // Columns of the last header
+    uint8_t cols[TELEMETRY_MAX_FIELDS];
+    uint32_t rows;
+} decoder_t;
+
+static telemetry_sample_t sample;
+
+//*****************************************************************************
+// Records
+//*****************************************************************************
+
+static const char* task_name(decoder_t* d, uint32_t id)
+{
+    static char anon[16];
+    uint16_t i;
+    for(i = 0; i < d->n_names; ++i)
+    {
+        if(d->name_id[i] == id) { return d->name[i]; }
+    }
+    snprintf(anon, sizeof(anon), "task%" PRIu32, id);
+    return anon;
+}
+
+static int on_hello(decoder_t* d, const uint8_t* body, int len)
+{
+    const uint8_t* p = body + 5;
+    uint64_t v;
+
+    if(len < 5 || (body[0] | body[1] << 8 | body[2] << 16 | (uint32_t) body[3] << 24) != TELEMETRY_MAGIC ||
+       telemetry_get_varint(&p, body + len, &v) || p != body + len)
+    {
+        return -1;
+    }
+    if(body[4] != TELEMETRY_VERSION)
+    {
+        fprintf(stderr, "tlm_decode: stream is version %u, this reads %u\n", body[4], TELEMETRY_VERSION);
+    }
+
+    d->interval_ms = v;
+    if(!d->csv)
+    {
+        fprintf(d->out, "# telemetry v%u, a sample every %" PRIu32 " ms\n", body[4], d->interval_ms);
+    }
+    return 0;
+}
+
+// Names are only taken once the whole record parsed, junk that looked like a
+// header must not rename anything
+static int on_tasks(decoder_t* d, const uint8_t* body, int len)
+{
+    const uint8_t* p = body;
+    const uint8_t* end = body + len;
+    const uint8_t* names[255];
+    uint32_t ids[255];
+    uint8_t lens[255];
+    uint64_t id;
+    uint8_t n, i;
+    uint16_t j;
+
+    if(p >= end) { return -1; }
+    n = *p++;
+    for(i = 0; i < n; ++i)
+    {
+        if(telemetry_get_varint(&p, end, &id) || p >= end || end - p - 1 < *p) { return -1; }
+        ids[i] = id;
+        lens[i] = *p++;
+        names[i] = p;
+        p += lens[i];
+    }
+    if(p != end)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < n; ++i)
+    {
+        uint8_t nl = (lens[i] > TELEMETRY_TASK_NAME_LEN) ? TELEMETRY_TASK_NAME_LEN : lens[i];
+
+        for(j = 0; j < d->n_names && d->name_id[j] != ids[i]; ++j);
+        if(j == MAX_NAMES) { j = 0; }       // Full of dead tasks, reuse
+        if(j == d->n_names && d->n_names < MAX_NAMES) { d->n_names++; }
+
+        d->name_id[j] = ids[i];
+        memcpy(d->name[j], names[i], nl);
+        d->name[j][nl] = 0;
+    }
+
+    return 0;
+}
+
+static void print_header(decoder_t* d, const telemetry_sample_t* s)
+{
+    uint8_t i, kind;
+
+    fprintf(d->out, "%10s %6s", "t_s", "seq");
+    for(i = 0; i < s->n_fields; ++i)
+    {
+        const char* n = telemetry_field_name(s->field[i], &kind);
+        char col[32];
+        if(n) { snprintf(col, sizeof(col), "%s%s", n, kind == TELEMETRY_K_COUNTER ? "/s" : ""); }
+        else  { snprintf(col, sizeof(col), "F%u", s->field[i]); }
+        fprintf(d->out, " %12s", col);
+
+        d->cols[i] = s->field[i];
+    }
+    fputc('\n', d->out);
+
+    d->n_cols = s->n_fields;
+    d->rows = 0;
+}
+
+static void print_row(decoder_t* d, const telemetry_sample_t* s)
+{
+    uint32_t dt = s->t_ms - d->prev_t;
+    uint8_t i, j, kind;
+
+    if(s->n_fields != d->n_cols || memcmp(s->field, d->cols, s->n_fields) || d->rows == HEADER_EVERY)
+    {
+        print_header(d, s);
+    }
+    d->rows++;
+
+    fprintf(d->out, "%10.3f %6" PRIu32, s->t_ms / 1000.0, s->seq);
+    for(i = 0; i < s->n_fields; ++i)
+    {
+        uint8_t f = s->field[i];
+        uint64_t v = s->value[i];
+
+        if(!telemetry_field_name(f, &kind)) { kind = TELEMETRY_K_GAUGE; }
+        if(kind != TELEMETRY_K_COUNTER)
+        {
+            fprintf(d->out, " %12" PRIu64, v);
+        }
+        else if(d->have_prev && d->prev_has[f] && dt && v >= d->prev_val[f])
+        {
+            fprintf(d->out, " %12.1f", (double) (v - d->prev_val[f]) * 1000.0 / dt);
+        }
+        else
+        {
+            fprintf(d->out, " %12s", "-");
+        }
+    }
+    fputc('\n', d->out);
+
+    // Top tasks by CPU, a selection sort of the few shown
+    uint8_t shown[TELEMETRY_MAX_TASKS] = {0};
+    uint8_t n = (s->n_tasks < d->top) ? s->n_tasks : d->top;
+    if(n)
+    {
+        fprintf(d->out, "%17s", "cpu%");
+    }
+    for(i = 0; i < n; ++i)
+    {
+        int best = -1;
+        for(j = 0; j < s->n_tasks; ++j)
+        {
+            if(!shown[j] && (best < 0 || s->cpu[j] > s->cpu[best])) { best = j; }
+        }
+        shown[best] = 1;
+        fprintf(d->out, "  %s %u.%u", task_name(d, s->task[best]), s->cpu[best] / 10, s->cpu[best] % 10);
+    }
+    if(n)
+    {
+        fputc('\n', d->out);
+    }
+}
+
+static void print_csv(decoder_t* d, const telemetry_sample_t* s)
+{
+    uint8_t i;
+
+    for(i = 0; i < s->n_fields; ++i)
+    {
+        const char* n = telemetry_field_name(s->field[i], NULL);
+        if(n)
+        {
+            fprintf(d->out, "%" PRIu32 ",%s,%" PRIu64 "\n", s->t_ms, n, s->value[i]);
+        }
+        else
+        {
+            fprintf(d->out, "%" PRIu32 ",F%u,%" PRIu64 "\n", s->t_ms, s->field[i], s->value[i]);
+        }
+    }
+
+    for(i = 0; i < s->n_tasks; ++i)
+    {
+        fprintf(d->out, "%" PRIu32 ",cpu.%s,%u.%u\n", s->t_ms, task_name(d, s->task[i]),
+                s->cpu[i] / 10, s->cpu[i] % 10);
+    }
+}
+
+static int on_sample(decoder_t* d, const uint8_t* body, int len)
+{
+    telemetry_sample_t* s = &sample;
+    uint8_t i;
+
+    if(telemetry_parse_sample(body, len, s))
+    {
+        return -1;
+    }
+
+    // seq starts over when the device or the service restarted
+    if(d->have_prev && s->seq > d->prev_seq + 1)
+    {
+        d->lost += s->seq - d->prev_seq - 1;
+        if(!d->csv) { fprintf(d->out, "# %" PRIu32 " samples lost\n", s->seq - d->prev_seq - 1); }
+    }
+    if(d->have_prev && s->seq <= d->prev_seq)
+    {
+        d->have_prev = 0;
+    }
+
+    if(d->csv) { print_csv(d, s); }
+    else       { print_row(d, s); }
+
+    memset(d->prev_has, 0, sizeof(d->prev_has));
+    for(i = 0; i < s->n_fields; ++i)
+    {
+        d->prev_has[s->field[i]] = 1;
+        d->prev_val[s->field[i]] = s->value[i];
+    }
+    d->prev_seq = s->seq;
+    d->prev_t = s->t_ms;
+    d->have_prev = 1;
+    d->samples++;
+    return 0;
+}
+
+static int on_record(decoder_t* d, const uint8_t* rec, int len)
+{
+    const uint8_t* body = rec + TELEMETRY_REC_HDR;
+    len -= TELEMETRY_REC_HDR;
+
+    switch(rec[1])
+    {
+        case TELEMETRY_REC_HELLO:  return on_hello(d, body, len);
+        case TELEMETRY_REC_TASKS:  return on_tasks(d, body, len);
+        case TELEMETRY_REC_SAMPLE: return on_sample(d, body, len);
+        default:                   return -1;
+    }
+}
+
+//*****************************************************************************
+// Stream
+//*****************************************************************************
+
+// Take every whole record in the buffer. A record that does not parse is
+// junk that happened to look like a header, skip a byte and look again. At
+// the end of the stream a record cut short is junk too.
+static void consume(decoder_t* d, uint8_t at_end)
+{
+    int off = 0;
+    while(off < d->have)
+    {
+        int r = telemetry_rec_len(d->buf + off, d->have - off);
+        if(!at_end && (r == 0 || r > d->have - off))
+        {
+            break;
+        }
+
+        if(r > 0 && r <= d->have - off && on_record(d, d->buf + off, r) == 0)
+        {
+            off += r;
+            continue;
+        }
+
+        off++;
+        d->skipped++;
+    }
+
+    memmove(d->buf, d->buf + off, d->have - off);
+    d->have -= off;
+}
+
+static void decoder_init(decoder_t* d, FILE* out, uint8_t csv, uint8_t top)
+{
+    memset(d, 0, sizeof(*d));
+    d->out = out;
+    d->csv = csv;
+    d->top = top;
+    if(csv)
+    {
+        fprintf(out, "t_ms,series,value\n");
+    }
+}
+
+static void feed(decoder_t* d, const uint8_t* data, int len)
+{
+    while(len > 0)
+    {
+        int n = (int) sizeof(d->buf) - d->have;
+        if(n > len) { n = len; }
+
+        memcpy(d->buf + d->have, data, n);
+        d->have += n;
+        data += n;
+        len -= n;
+        consume(d, 0);
+    }
+}
+
+static void finish(decoder_t* d)
+{
+    consume(d, 1);
+}
+
+//*****************************************************************************
+// Self test
+//*****************************************************************************
+
+#define TEST_SAMPLES 50
+
+static int enc_hello(uint8_t* out, int cap, uint32_t interval)
+{
+    telemetry_enc_t e;
+    telemetry_enc_begin(&e, out, cap, TELEMETRY_REC_HELLO);
+    telemetry_enc_u32(&e, TELEMETRY_MAGIC);
+    telemetry_enc_u8(&e, TELEMETRY_VERSION);
+    telemetry_enc_varint(&e, interval);
+    return telemetry_enc_end(&e);
+}
+
+static int enc_tasks(uint8_t* out, int cap)
+{
+    static const char* names[] = { "IDLE0", "IDLE1", "wifi", "NET Reactor" };
+    telemetry_enc_t e;
+    uint8_t i;
+
+    telemetry_enc_begin(&e, out, cap, TELEMETRY_REC_TASKS);
+    telemetry_enc_list(&e);
+    for(i = 0; i < 4; ++i)
+    {
+        telemetry_enc_item(&e);
+        telemetry_enc_varint(&e, 100 + i);
+        telemetry_enc_u8(&e, strlen(names[i]));
+        telemetry_enc_bytes(&e, names[i], strlen(names[i]));
+    }
+    return telemetry_enc_end(&e);
+}
+
+static int enc_sample(uint8_t* out, int cap, uint32_t seq)
+{
+    telemetry_enc_t e;
+    telemetry_enc_begin(&e, out, cap, TELEMETRY_REC_SAMPLE);
+    telemetry_enc_varint(&e, seq);
+    telemetry_enc_varint(&e, 5000 + seq * 1000);
+
+    telemetry_enc_list(&e);
+    telemetry_enc_field(&e, TELEMETRY_F_HEAP_FREE, 150000 - seq);
+    telemetry_enc_field(&e, TELEMETRY_F_PKTS, 1ull << 33 | (seq * 500));      // 500/s
+    telemetry_enc_field(&e, 99, seq * 7);                                       // One this does not know
+
+    telemetry_enc_list(&e);
+    telemetry_enc_item(&e); telemetry_enc_varint(&e, 100); telemetry_enc_varint(&e, 805);
+    telemetry_enc_item(&e); telemetry_enc_varint(&e, 102); telemetry_enc_varint(&e, 120);
+    telemetry_enc_item(&e); telemetry_enc_varint(&e, 103); telemetry_enc_varint(&e, 999);
+    return telemetry_enc_end(&e);
+}
+
+static int varint_round_trip(void)
+{
+    static const uint64_t vals[] = { 0, 1, 127, 128, 300, 16383, 16384, 0xffffffffull, ~0ull };
+    uint8_t b[16];
+    telemetry_enc_t e;
+    uint64_t v;
+    unsigned i;
+    int fail = 0;
+
+    for(i = 0; i < sizeof(vals) / sizeof(vals[0]); ++i)
+    {
+        const uint8_t* p = b;
+        e.buf = b; e.cap = sizeof(b); e.len = 0; e.err = 0;
+        telemetry_enc_varint(&e, vals[i]);
+        fail |= (telemetry_get_varint(&p, b + e.len, &v) || v != vals[i] || p != b + e.len);
+        fail |= (vals[i] == ~0ull && e.len != 10);
+        p = b;
+        fail |= (e.len > 1 && !telemetry_get_varint(&p, b + e.len - 1, &v));   // Cut short
+    }
+
+    // A record that does not fit is dropped whole
+    telemetry_enc_begin(&e, b, sizeof(b), TELEMETRY_REC_SAMPLE);
+    telemetry_enc_bytes(&e, "0123456789abcdef", 16);
+    fail |= (telemetry_enc_end(&e) != -1);
+
+    return fail;
+}
+
+static int self_test(void)
+{
+    static uint8_t stream[64 * 1024];
+    decoder_t* d = malloc(sizeof(*d));
+    char* text = NULL;
+    size_t text_len = 0;
+    int n = 0, len, i, fail = 0;
+    uint8_t rec[MAX_REC];
+
+    fail |= varint_round_trip();
+
+    // The tail of a record cut by a flash wrap, then junk that looks like a header
+    len = enc_sample(rec, sizeof(rec), 999);
+    memcpy(stream, rec + len / 2, len - len / 2);
+    n = len - len / 2;
+    stream[n++] = TELEMETRY_SYNC;
+    stream[n++] = TELEMETRY_REC_SAMPLE;
+    stream[n++] = 3;
+    stream[n++] = 0;
+    stream[n++] = 0x80;
+
+    n += enc_hello(stream + n, sizeof(stream) - n, 1000);
+    n += enc_tasks(stream + n, sizeof(stream) - n);
+    for(i = 0; i < TEST_SAMPLES; ++i)
+    {
+        if(i == 20) { continue; }             // A lost one
+        n += enc_sample(stream + n, sizeof(stream) - n, i);
+    }
+    stream[n++] = TELEMETRY_SYNC;             // And a cut off end
+
+    // Table, in random sized pieces
+    FILE* out = open_memstream(&text, &text_len);
+    decoder_init(d, out, 0, 2);
+    srand(7);
+    for(i = 0; i < n; )
+    {
+        int k = 1 + rand() % 97;
+        if(k > n - i) { k = n - i; }
+        feed(d, stream + i, k);
+        i += k;
+    }
+    finish(d);
+    fclose(out);
+
+    fail |= (d->samples != TEST_SAMPLES - 1 || d->lost != 1 || d->interval_ms != 1000);
+    fail |= (d->skipped != (uint32_t) (len - len / 2 + 5 + 1));
+    fail |= !strstr(text, "PKTS/s");
+    fail |= !strstr(text, "500.0");
+    fail |= !strstr(text, "F99");
+    fail |= !strstr(text, "NET Reactor 99.9  IDLE0 80.5\n");
+    fail |= !strstr(text, "# 1 samples lost");
+    fail |= (strstr(text, "wifi") != NULL);   // Not in the top 2
+    free(text);
+
+    // CSV, all at once
+    text = NULL;
+    out = open_memstream(&text, &text_len);
+    decoder_init(d, out, 1, DEFAULT_TOP);
+    feed(d, stream, n);
+    finish(d);
+    fclose(out);
+
+    fail |= (d->samples != TEST_SAMPLES - 1);
+    fail |= !strstr(text, "t_ms,series,value\n");
+    fail |= !strstr(text, "8000,PKTS,8589936092\n");
+    fail |= !strstr(text, "8000,F99,21\n");
+    fail |= !strstr(text, "8000,cpu.wifi,12.0\n");
+    if(fail) { fputs(text, stderr); }
+    free(text);
+    free(d);
+
+    printf("tlm_decode: self test %s\n", fail ? "FAIL" : "PASS");
+    return fail;
+}
+
+//*****************************************************************************
+// Main
+//*****************************************************************************
+
+static int open_stream(const char* ip, uint16_t port)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        fprintf(stderr, "connect %s:%d: %s\n", ip, port, strerror(errno));
+        if(sock >= 0) { close(sock); }
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char** argv)
+{
+    const char* ip = "192.168.4.1";
+    const char* file = NULL;
+    uint16_t port = DEFAULT_PORT;
+    uint8_t csv = 0, top = DEFAULT_TOP;
+    int opt, fd;
+
+    while((opt = getopt(argc, argv, "s:p:f:cn:t")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'f': file = optarg; break;
+            case 'c': csv = 1; break;
+            case 'n': top = atoi(optarg); break;
+            case 't': return self_test();
+            default: goto usage;
+        }
+    }
+    if(optind != argc)
+    {
+        goto usage;
+    }
+
+    if(!file)                 { fd = open_stream(ip, port); }
+    else if(!strcmp(file, "-")) { fd = 0; }
+    else if((fd = open(file, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+    }
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    decoder_t* d = malloc(sizeof(*d));
+    uint8_t chunk[4096];
+    ssize_t r;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    decoder_init(d, stdout, csv, top);
+    while((r = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        feed(d, chunk, r);
+    }
+    finish(d);
+
+    fprintf(stderr, "tlm_decode: %" PRIu32 " samples, %" PRIu32 " lost, %" PRIu32 " bytes skipped\n",
+            d->samples, d->lost, d->skipped);
+    if(fd > 0) { close(fd); }
+    free(d);
+    return 0;
+
+    usage:
+    fprintf(stderr, "usage: tlm_decode [-s <ip>] [-p <port>] [-f <file | ->] [-c] [-n <tasks>]\n"
+                    "       tlm_decode -t\n");
+    return 1;
+}
@@ -25,20 +25,64 @@
 //                   in RAM buffer
 //
 //    * TCP File Server - Serves up the WPA2 handshake packets stored in flash
-//                        to requestors over the AP. The file server can be
-//                        accessed at 192.168.4.1:420
+//                        to requestors over the AP, several at a time. The
+//                        file server can be accessed at 192.168.4.1:420, or
+//                        :422 for the resumable v2 protocol (host/fs_client)
 //
 //    * REPL MUX - Provides multiplexing of logging and input to the repl. Also
 //                 provides command table (i.e. our own version of esp console)
 //                 This launchs 4 threads. One each for UART in, UART out, Net
 //                 in, Net out. The endpoint for the Net repl is a TCP server
-//                 bound to 192.168.4.1:421
+//                 bound to 192.168.4.1:421. Hot path logs can be sent
+//                 tokenized (tlog on) and decoded with host/log_decode
 //
 //    * EAPOL Logger - Sits on top of the packet sniffer after the mac logger
 //                     has done his business. You Pass an AP index to this comp
 //                     and will listen and save in ram each of the 6 packets
 //                     needed to capture a WPA2 handshake. 
 //
+//    * Capture Writer - Shared service that takes capture records from the
+//                       RX path into RAM buffers and flushes them to SPIFFS
+//                       from a low priority task. Data Pkt Dumper and EAPOL
+//                       Logger write their pcaps through it.
+//
+//    * Data Pkt Dumper - Instances that each dump frames matching their own
+//                        filter (types, subtypes, MACs) into their own pcap.
+//
+//    * Flash Log - Append only record log on the raw "capture" partition. An
+//                  alternate capture writer backend that skips SPIFFS for
+//                  sustained high rate captures.
+//
+//    * Pre Trigger - Keeps the last few seconds of filtered frames in a RAM
+//                    ring and only writes a capture around an event (REPL,
+//                    assoc to a watched BSSID, traffic spike, new STA).
+//
+//    * Survey Logger - Header only capture for long surveys. Frame meta data
+//                      goes into compressed columnar blocks, at most 18
+//                      bytes a frame before compression.
+//
+//    * PCAP Stream - Streams filtered frames live as pcap to TCP clients on
+//                    192.168.4.1:423, e.g. nc piped into wireshark. A ring
+//                    with a cursor per client, slow clients drop the oldest.
+//
+//    * Capture Time - Stamps frames from the radio's rx timestamp on one
+//                     monotonic base and maps them to wall clock time once
+//                     set over the REPL (time_set, scripts/time_sync.py).
+//
+//    * Capture Catalog - RAM table of the capture files with size, CRC,
+//                        records and SSID / BSSID tags, kept up to date by
+//                        the capture writer and saved to SPIFFS. ls, rm and
+//                        the file server use it instead of scanning SPIFFS.
+//
+//    * Net Reactor - One task and one select serving the sockets of the TCP
+//                    REPL, RPC and file server through pluggable handlers,
+//                    in place of a task per service. NR_stats.
+//
+//    * Telemetry - Samples heap, per task CPU and the counters of the
+//                  services above every interval and streams them as compact
+//                  binary records on 192.168.4.1:425, optionally into the
+//                  flash log too. Read with host/tlm_decode.
+//
 //*****************************************************************************
 
 
@@ -56,21 +100,35 @@
 // (6) Completely Static memory allocation
 // (7) All config should be exported via a Kconfig param
 //
+// A task, queue or lock made at init does not count as static for (6).
+//
 // |-----------------------------------------------------------|
 // | Component       | (1) | (2) | (3) | (4) | (5) | (6) | (7) |
 // | --------------- | --- | --- | --- | --- | --- | --- | --- |
 // | mac logger      |  X  |  X  |  X  |  X  |  X  |     |     |
 // | pkt_sniffer     |  X  |  X  |  X  |  X  |  X  |     |     |
 // | tcp_file_server |  X  |  X  |  X  |  X  |  X  |     |     |
-// | repl_mux        |  X  |  X  |  X  |  X  |  X  |     |  X  |
+// | repl_mux        |     |     |  X  |  X  |  X  |     |  X  |
 // | eapol logger    |     |     |     |     |     |     |     |
+// | capture writer  |     |     |  X  |  X  |     |     |  X  |
+// | data pkt dumper |  X  |  X  |  X  |  X  |  X  |     |  X  |
+// | flash log       |     |     |  X  |  X  |  X  |     |  X  |
+// | pre trigger     |  X  |     |  X  |  X  |  X  |     |  X  |
+// | survey logger   |  X  |  X  |  X  |  X  |  X  |     |  X  |
+// | capture time    |     |     |  X  |  X  |  X  |  X  |  X  |
+// | pcap stream     |     |     |  X  |  X  |  X  |  X  |  X  |
+// | capture catalog |  X  |     |  X  |  X  |  X  |     |  X  |
+// | net reactor     |     |     |  X  |  X  |  X  |     |  X  |
+// | telemetry       |     |     |  X  |  X  |  X  |  X  |  X  |
 // |-----------------------------------------------------------|
 //
 //*****************************************************************************
 
 #include <stdio.h>
 #include <dirent.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 
 #include "esp_partition.h"
 #include "esp_spiffs.h"
@@ -81,6 +139,7 @@
 #include "heap_memory_layout.h"
 #include "esp_mac.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
 
 #include "pkt_sniffer.h"
 #include "tcp_file_server.h"
@@ -88,6 +147,15 @@
 #include "repl_mux.h"
 #include "data_pkt_dumper.h"
 #include "eapol.h"
+#include "capture_writer.h"
+#include "capture_catalog.h"
+#include "flash_log.h"
+#include "pre_trigger.h"
+#include "survey_logger.h"
+#include "capture_time.h"
+#include "pcap_stream.h"
+#include "net_reactor.h"
+#include "telemetry.h"
 
 static const char* TAG = "MAIN";
 
@@ -164,16 +232,46 @@ static int do_send_deauth(int, char**);
 
 static int do_DPD_init(int argc, char** argv);
 static int do_DPD_fini(int argc, char** argv);
+static int do_DPD_stats(int argc, char** argv);
+static int do_CW_stats(int argc, char** argv);
+static int do_FL_stats(int argc, char** argv);
+static int do_FL_bench(int argc, char** argv);
+static int do_PT_init(int argc, char** argv);
+static int do_PT_fini(int argc, char** argv);
+static int do_PT_fire(int argc, char** argv);
+static int do_PT_watch(int argc, char** argv);
+static int do_PT_spike(int argc, char** argv);
+static int do_PT_new_sta(int argc, char** argv);
+static int do_PT_stats(int argc, char** argv);
+static int do_SV_init(int argc, char** argv);
+static int do_SV_fini(int argc, char** argv);
+static int do_SV_stats(int argc, char** argv);
+static int do_time_set(int argc, char** argv);
+static int do_time_get(int argc, char** argv);
+static int do_LS_init(int argc, char** argv);
+static int do_LS_fini(int argc, char** argv);
+static int do_LS_stats(int argc, char** argv);
+static int do_NR_stats(int argc, char** argv);
+static int do_TM_launch(int argc, char** argv);
+static int do_TM_kill(int argc, char** argv);
+static int do_TM_interval(int argc, char** argv);
+static int do_TM_stats(int argc, char** argv);
+static void telemetry_source(telemetry_enc_t* e);
 
 static int do_tcp_file_server_kill(int argc, char** argv);
 static int do_tcp_file_server_launch(int argc, char** argv);
 
+static int rpc_sniff(const uint8_t* body, int len, repl_mux_rpc_out_t* out);
+static int rpc_aps(const uint8_t* body, int len, repl_mux_rpc_out_t* out);
+
 //*****************************************************************************
 // We configure the wifi such that it can both be a host and a client. Be sure
 // that you do not run pkt sniffer with a client connected or it will fail. We
 // implement the following scheme. When a client connects we kill the packet
 // sniffer if running. In the future if there are other services that cant be 
-// ran concurrently with a client than we will kill them as well.
+// ran concurrently with a client than we will kill them as well. The one
+// exception is the pcap stream, its client is on the AP so the sniffer is left
+// running (on the AP channel) while the stream is.
 //
 // We provide a command called pkt_sniffer_delay_launch. It works the same as
 // the packet sniffer launch function but will wait until the client STA
@@ -201,18 +299,22 @@ void app_main(void)
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     initialize_nvs();
     initialize_filesystem();
+    ESP_ERROR_CHECK_WITHOUT_ABORT(capture_catalog_init(MOUNT_PATH));
+    ESP_ERROR_CHECK(capture_writer_init());
     init_wifi();
+    ESP_ERROR_CHECK(net_reactor_init());
+    ESP_ERROR_CHECK(telemetry_set_source(telemetry_source));
 
     // Some misc system level repl functions defined below
     repl_mux_register("part_table", "Print the partition table", &do_part_table);
-    repl_mux_register("ls", "List files on spiffs", &do_ls);
+    repl_mux_register("ls", "List capture files on spiffs with their catalog meta data", &do_ls);
     repl_mux_register("df", "Disk free on spiffs", &do_df);
     repl_mux_register("cat", "cat contents of file", &do_cat);
     repl_mux_register("soc_regions", "Print Tracked RAM regions: soc_regions <all|free> <cond|ext>", &do_dump_soc_regions);
     repl_mux_register("tasks", "Print List of Tasks", &do_tasks);
     repl_mux_register("free", "Print Available Heap Mem", &do_free);
     repl_mux_register("restart", "SW Restart", &do_restart);
-    repl_mux_register("rm", "Delete all the files on the FS", &do_rm);
+    repl_mux_register("rm", "rm [name], delete a file and its .idx, every file if no name", &do_rm);
     repl_mux_register("get_task", "Print name of current task", &do_get_task);
     repl_mux_register("dump_wifi_stats", "Dump Wifi Stats <module>", &do_dump_wifi_stats);
     repl_mux_register("get_ll", "get log level", &do_get_log_level);
@@ -229,9 +331,36 @@ void app_main(void)
     #endif
 
     repl_mux_register("ML_dump", "dump mac data", &do_mac_logger_dump);
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_SNIFF, &rpc_sniff);
+    repl_mux_rpc_register(REPL_MUX_RPC_OP_APS, &rpc_aps);
     repl_mux_register("ML_init", "Register the Mac logger cb with pkt sniffer and init the component", &do_mac_logger_init);
     repl_mux_register("ML_clear", "Clear the AP and STA list of the mac logger", &do_mac_logger_clear);
-    repl_mux_register("DPD_init", "Data Packet Dumper init and register", &do_DPD_init);
+    repl_mux_register("DPD_init", "Open a Data Packet Dumper instance with its own file and filter", &do_DPD_init);
+    repl_mux_register("DPD_fini", "Flush and close a Data Packet Dumper instance", &do_DPD_fini);
+    repl_mux_register("DPD_stats", "dump stats of the open Data Packet Dumpers", &do_DPD_stats);
+    repl_mux_register("CW_stats", "dump capture writer stats", &do_CW_stats);
+    repl_mux_register("FL_stats", "dump flash log stats", &do_FL_stats);
+    repl_mux_register("FL_bench", "FL_bench <kb>, time the flash log vs SPIFFS", &do_FL_bench);
+    repl_mux_register("PT_init", "Arm the pre trigger RAM ring with a filter and windows", &do_PT_init);
+    repl_mux_register("PT_fini", "Stop filling the pre trigger ring", &do_PT_fini);
+    repl_mux_register("PT_fire", "Trigger a pre trigger capture now", &do_PT_fire);
+    repl_mux_register("PT_watch", "PT_watch <bssid|off>, trigger on assoc reqs to bssid", &do_PT_watch);
+    repl_mux_register("PT_spike", "PT_spike <pkts per sec>, trigger on traffic spikes, 0 = off", &do_PT_spike);
+    repl_mux_register("PT_new_sta", "PT_new_sta <0|1>, trigger when the mac logger sees a new STA", &do_PT_new_sta);
+    repl_mux_register("PT_stats", "dump pre trigger stats", &do_PT_stats);
+    repl_mux_register("SV_init", "Start a header only columnar survey capture", &do_SV_init);
+    repl_mux_register("SV_fini", "Flush and close the survey capture", &do_SV_fini);
+    repl_mux_register("SV_stats", "dump survey logger stats", &do_SV_stats);
+    repl_mux_register("time_set", "time_set <unix secs[.frac]>, set the capture wall clock", &do_time_set);
+    repl_mux_register("time_get", "dump capture time base and wall clock", &do_time_get);
+    repl_mux_register("LS_init", "Stream filtered frames live as pcap on :423", &do_LS_init);
+    repl_mux_register("LS_fini", "Stop the live pcap stream", &do_LS_fini);
+    repl_mux_register("LS_stats", "dump live pcap stream stats", &do_LS_stats);
+    repl_mux_register("NR_stats", "dump net reactor stack and CPU time per handler", &do_NR_stats);
+    repl_mux_register("TM_launch", "TM_launch [<ms>] [flash], stream telemetry on :425", &do_TM_launch);
+    repl_mux_register("TM_kill", "Stop the telemetry stream", &do_TM_kill);
+    repl_mux_register("TM_interval", "TM_interval <ms>, change the telemetry sampling rate", &do_TM_interval);
+    repl_mux_register("TM_stats", "dump telemetry stats", &do_TM_stats);
 
     repl_mux_register("EL_init", "Init the eapol logger, passing an index from ML", &do_eapol_logger_init);
     repl_mux_register("EL_clear", "Init the eapol logger, passing an index from ML", &do_eapol_logger_clear);
@@ -306,7 +435,7 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
     {
         // wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
 
-        if(pkt_sniffer_is_running())
+        if(pkt_sniffer_is_running() && !pcap_stream_is_running())
         {
             ESP_ERROR_CHECK_WITHOUT_ABORT(pkt_sniffer_kill());
         }
@@ -401,9 +530,14 @@ static int do_send_deauth(int argc, char** argv)
     return 0;
 }
 
+static uint8_t ml_inited = 0;      // Telemetry only asks the mac logger once it is up
+
 static int do_mac_logger_init(int argc, char** argv)
 {
-    ESP_ERROR_CHECK_WITHOUT_ABORT(mac_logger_init());
+    if(ESP_ERROR_CHECK_WITHOUT_ABORT(mac_logger_init()) == ESP_OK)
+    {
+        ml_inited = 1;
+    }
     return 0;
 }
 
@@ -514,22 +648,646 @@ static int do_PS_stats(int argc, char** argv)
     return 0;
 }
 
+// A size arg given in KB as bytes. Returns -1 if it is not a number or the
+// bytes do not fit 32 bits.
+static int parse_kb(const char* arg, uint32_t* bytes)
+{
+    char* end;
+    long kb = strtol(arg, &end, 10);
+
+    if(end == arg || *end || kb < 0 || (unsigned long) kb > UINT32_MAX / 1024)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Invalid size %s KB, 0 to %lu\n", arg, (unsigned long) (UINT32_MAX / 1024));
+        return -1;
+    }
+
+    *bytes = (uint32_t) kb * 1024;
+    return 0;
+}
+
 static int do_DPD_init(int argc, char** argv)
 {
-    if(argc != 3)
+    if(argc != 4 && argc != 6 && argc != 7 && argc != 9)
     {
-        esp_log_write(ESP_LOG_INFO, "", "usage DPD_init <pkt sub type base 10> <dump_name> (see dot11.h)");
+        esp_log_write(ESP_LOG_INFO, "", "usage DPD_init <dump_name> <mgmt subtype mask hex> <data subtype mask hex> [<addr_num> <mac>] [<rotate_kb> <rotate_secs> <max_files>] (see dot11.h)\n");
         return -1;
     }
 
-    ESP_ERROR_CHECK_WITHOUT_ABORT(data_pkt_dumper_init((data_pkt_subtype_t) strtol(argv[1], NULL,10), argv[2]));
+    pkt_filter_t filter = {0};
+    filter.mgmt_subtype_bitmap = (uint16_t) strtol(argv[2], NULL, 16);
+    filter.data_subtype_bitmap = (uint16_t) strtol(argv[3], NULL, 16);
+    if(filter.mgmt_subtype_bitmap) { filter.type_bitmap |= (1 << PKT_MGMT); }
+    if(filter.data_subtype_bitmap) { filter.type_bitmap |= (1 << PKT_DATA); }
+
+    int arg = 4;
+    if(argc == 6 || argc == 9)
+    {
+        uint8_t addr_num = (uint8_t) strtol(argv[4], NULL, 10);
+        uint8_t* mac = NULL;
+        if(addr_num == 1) { mac = filter.addr1_match; }
+        if(addr_num == 2) { mac = filter.addr2_match; }
+        if(addr_num == 3) { mac = filter.addr3_match; }
+
+        if(!mac || sscanf(argv[5], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", mac, mac+1, mac+2, mac+3, mac+4, mac+5) != 6)
+        {
+            esp_log_write(ESP_LOG_INFO, "", "Invalid addr num or mac\n");
+            return -1;
+        }
+        filter.addr_active_bitmap |= (1 << (addr_num - 1));
+        arg = 6;
+    }
+
+    capture_writer_rotate_t rotate = {0};
+    if(argc == 7 || argc == 9)
+    {
+        if(parse_kb(argv[arg], &rotate.max_bytes)) { return -1; }
+        rotate.max_secs = (uint32_t) strtol(argv[arg+1], NULL, 10);
+        rotate.max_files = (uint16_t) strtol(argv[arg+2], NULL, 10);
+    }
+
+    uint8_t handle;
+    if(ESP_ERROR_CHECK_WITHOUT_ABORT(data_pkt_dumper_open(&filter, argv[1], &rotate, &handle)) == ESP_OK)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Dumper %d opened\n", handle);
+    }
 
     return 0;
 }
 
 static int do_DPD_fini(int argc, char** argv)
 {
-    data_pkt_dumper_fini();  // always ok
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage DPD_fini <dumper>\n");
+        return -1;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(data_pkt_dumper_close((uint8_t) strtol(argv[1], NULL, 10)));
+    return 0;
+}
+
+static int do_DPD_stats(int argc, char** argv)
+{
+    data_pkt_dumper_stats_t stats;
+    pkt_filter_t filter;
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+    uint8_t i;
+
+    for(i = 0; i < CONFIG_DPD_MAX_INSTANCES; ++i)
+    {
+        if(data_pkt_dumper_get_stats(i, &stats, &filter, path) != ESP_OK)
+        {
+            continue;
+        }
+
+        int64_t secs = (esp_timer_get_time() - stats.start_us) / (1000 * 1000);
+        esp_log_write(ESP_LOG_INFO, "", "%d) %s  mgmt 0x%04x  data 0x%04x  addr 0x%x  %llds\n",
+                      i, path, filter.mgmt_subtype_bitmap, filter.data_subtype_bitmap,
+                      filter.addr_active_bitmap, secs);
+        esp_log_write(ESP_LOG_INFO, "", "   pkts %lu (mgmt %lu data %lu)  bytes %llu  drops %lu  busy %lu\n",
+                      stats.pkts, stats.mgmt_pkts, stats.data_pkts, stats.bytes, stats.drops, stats.busy_drops);
+    }
+
+    return 0;
+}
+
+static int do_CW_stats(int argc, char** argv)
+{
+    capture_writer_stats_t* stats = capture_writer_get_stats();
+
+    esp_log_write(ESP_LOG_INFO, "", "Buffered     = %lu\n", stats->bytes_buffered);
+    esp_log_write(ESP_LOG_INFO, "", "Written      = %llu\n", stats->bytes_written);
+    esp_log_write(ESP_LOG_INFO, "", "Records      = %lu\n", stats->records);
+    esp_log_write(ESP_LOG_INFO, "", "Overruns     = %lu\n", stats->overruns);
+    esp_log_write(ESP_LOG_INFO, "", "Flushes      = %lu\n", stats->flushes);
+    esp_log_write(ESP_LOG_INFO, "", "Timer Flush  = %lu\n", stats->timer_flushes);
+    esp_log_write(ESP_LOG_INFO, "", "Write Errors = %lu\n", stats->write_errors);
+    esp_log_write(ESP_LOG_INFO, "", "Rotations    = %lu\n", stats->rotations);
+    esp_log_write(ESP_LOG_INFO, "", "Files Del    = %lu\n", stats->files_deleted);
+    esp_log_write(ESP_LOG_INFO, "", "Full Drops   = %llu\n", stats->full_drops);
+    esp_log_write(ESP_LOG_INFO, "", "Flush us     = %lu last  %lu max  %llu avg\n",
+                  stats->flush_us_last,
+                  stats->flush_us_max,
+                  stats->flushes ? stats->flush_us_total / stats->flushes : 0);
+    esp_log_write(ESP_LOG_INFO, "", "Index Ents   = %lu\n", stats->index_entries);
+    esp_log_write(ESP_LOG_INFO, "", "Compressed   = %llu -> %llu  ratio x%llu.%02llu  %llu us/MB\n",
+                  stats->comp_in,
+                  stats->comp_out,
+                  stats->comp_out ? stats->comp_in / stats->comp_out : 0,
+                  stats->comp_out ? (stats->comp_in * 100 / stats->comp_out) % 100 : 0,
+                  stats->comp_in ? (stats->comp_us << 20) / stats->comp_in : 0);
+
+    return 0;
+}
+
+//*****************************************************************************
+// Flash Log
+//*****************************************************************************
+
+static int do_FL_stats(int argc, char** argv)
+{
+    flash_log_stats_t* stats = flash_log_get_stats();
+
+    esp_log_write(ESP_LOG_INFO, "", "Head         = 0x%lx / %lu slots\n", stats->head, flash_log_num_slots());
+    esp_log_write(ESP_LOG_INFO, "", "Next Seq     = %lu\n", stats->next_seq);
+    esp_log_write(ESP_LOG_INFO, "", "Next File    = %u\n", stats->next_file_id);
+    esp_log_write(ESP_LOG_INFO, "", "Records      = %lu\n", stats->records);
+    esp_log_write(ESP_LOG_INFO, "", "Payload      = %llu\n", stats->payload_bytes);
+    esp_log_write(ESP_LOG_INFO, "", "Padding      = %llu\n", stats->pad_bytes);
+    esp_log_write(ESP_LOG_INFO, "", "Erases       = %lu  (%lu inline)\n", stats->erases, stats->erase_stalls);
+    esp_log_write(ESP_LOG_INFO, "", "Wraps        = %lu\n", stats->wraps);
+    esp_log_write(ESP_LOG_INFO, "", "Write Errors = %lu\n", stats->write_errors);
+    esp_log_write(ESP_LOG_INFO, "", "Boot Scan    = %lu us  %lu reads  %lu torn\n",
+                  stats->scan_us, stats->scan_reads, stats->torn_records);
+
+    return 0;
+}
+
+// Time appending kb KB in buffer sized chunks to the flash log and then to a
+// SPIFFS file, the same way the capture writer flush task would.
+static uint8_t bench_buf[CONFIG_CAPTURE_WRITER_BUF_SIZE];
+
+static int do_FL_bench(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage) FL_bench <kb>\n");
+        return -1;
+    }
+
+    uint32_t total;
+    if(parse_kb(argv[1], &total))
+    {
+        return -1;
+    }
+
+    uint32_t done, i;
+    uint16_t file_id;
+    int64_t t0, t1, start;
+    int64_t worst[2] = {0, 0};
+    int64_t elapsed[2] = {0, 0};
+    uint32_t bytes[2] = {total, total};
+
+    for(i = 0; i < sizeof(bench_buf); ++i)
+    {
+        bench_buf[i] = (uint8_t) (i * 7 + (i >> 5));
+    }
+
+    if(ESP_ERROR_CHECK_WITHOUT_ABORT(flash_log_open("fl_bench", &file_id)) != ESP_OK)
+    {
+        return -1;
+    }
+
+    start = esp_timer_get_time();
+    for(done = 0; done < total; done += sizeof(bench_buf))
+    {
+        t0 = esp_timer_get_time();
+        flash_log_append(file_id, bench_buf, sizeof(bench_buf));
+        t1 = esp_timer_get_time();
+        if(t1 - t0 > worst[0]) { worst[0] = t1 - t0; }
+        flash_log_maintain();
+    }
+    flash_log_close(file_id);
+    elapsed[0] = esp_timer_get_time() - start;
+
+    FILE* f = fopen("/spiffs/fl_bench", "w");
+    if(!f)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Failed to open /spiffs/fl_bench\n");
+        return -1;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+
+    start = esp_timer_get_time();
+    for(done = 0; done < total; done += sizeof(bench_buf))
+    {
+        t0 = esp_timer_get_time();
+        if(fwrite(bench_buf, 1, sizeof(bench_buf), f) != sizeof(bench_buf))
+        {
+            esp_log_write(ESP_LOG_INFO, "", "SPIFFS full after %lu bytes\n", done);
+            bytes[1] = done;
+            break;
+        }
+        t1 = esp_timer_get_time();
+        if(t1 - t0 > worst[1]) { worst[1] = t1 - t0; }
+    }
+    fclose(f);
+    elapsed[1] = esp_timer_get_time() - start;
+    remove("/spiffs/fl_bench");
+
+    esp_log_write(ESP_LOG_INFO, "", "flash log  %8llu KB/s  worst %7lld us\n",
+                  elapsed[0] ? ((uint64_t) bytes[0] * 1000000 / elapsed[0]) >> 10 : 0, worst[0]);
+    esp_log_write(ESP_LOG_INFO, "", "spiffs     %8llu KB/s  worst %7lld us\n",
+                  elapsed[1] ? ((uint64_t) bytes[1] * 1000000 / elapsed[1]) >> 10 : 0, worst[1]);
+
+    return 0;
+}
+
+//*****************************************************************************
+// Pre Trigger
+//*****************************************************************************
+
+static int do_PT_init(int argc, char** argv)
+{
+    if(argc != 5 && argc != 6)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage PT_init <mgmt subtype mask hex> <data subtype mask hex> <pre_ms> <post_ms> [<pre_pkts>] (see dot11.h)\n");
+        return -1;
+    }
+
+    pre_trigger_cfg_t cfg = {0};
+    cfg.filter.mgmt_subtype_bitmap = (uint16_t) strtol(argv[1], NULL, 16);
+    cfg.filter.data_subtype_bitmap = (uint16_t) strtol(argv[2], NULL, 16);
+    if(cfg.filter.mgmt_subtype_bitmap) { cfg.filter.type_bitmap |= (1 << PKT_MGMT); }
+    if(cfg.filter.data_subtype_bitmap) { cfg.filter.type_bitmap |= (1 << PKT_DATA); }
+    cfg.pre_ms = (uint32_t) strtol(argv[3], NULL, 10);
+    cfg.post_ms = (uint32_t) strtol(argv[4], NULL, 10);
+    if(argc == 6)
+    {
+        cfg.pre_pkts = (uint16_t) strtol(argv[5], NULL, 10);
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_init(&cfg));
+    return 0;
+}
+
+static int do_PT_fini(int argc, char** argv)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_fini());
+    return 0;
+}
+
+static int do_PT_fire(int argc, char** argv)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_fire(PRE_TRIGGER_MANUAL));
+    return 0;
+}
+
+static int do_PT_watch(int argc, char** argv)
+{
+    uint8_t mac[6];
+
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage PT_watch <bssid|off>\n");
+        return -1;
+    }
+
+    if(!strcmp(argv[1], "off"))
+    {
+        ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_watch_bssid(NULL));
+        return 0;
+    }
+
+    if(sscanf(argv[1], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", mac, mac+1, mac+2, mac+3, mac+4, mac+5) != 6)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "Invalid mac\n");
+        return -1;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_watch_bssid(mac));
+    return 0;
+}
+
+static int do_PT_spike(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage PT_spike <pkts per sec>\n");
+        return -1;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_set_spike((uint16_t) strtol(argv[1], NULL, 10)));
+    return 0;
+}
+
+static int do_PT_new_sta(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage PT_new_sta <0|1>\n");
+        return -1;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pre_trigger_set_new_sta((uint8_t) strtol(argv[1], NULL, 10)));
+    return 0;
+}
+
+static int do_PT_stats(int argc, char** argv)
+{
+    pre_trigger_stats_t stats;
+    uint8_t triggered;
+    uint32_t ring_used;
+
+    pre_trigger_get_stats(&stats, &triggered, &ring_used);
+
+    esp_log_write(ESP_LOG_INFO, "", "State        = %s\n", triggered ? "triggered" : "armed");
+    esp_log_write(ESP_LOG_INFO, "", "Ring Used    = %lu / %d\n", ring_used, CONFIG_PRE_TRIGGER_RING_KB * 1024);
+    esp_log_write(ESP_LOG_INFO, "", "Pkts         = %lu\n", stats.pkts);
+    esp_log_write(ESP_LOG_INFO, "", "Evicted      = %lu\n", stats.evicted);
+    esp_log_write(ESP_LOG_INFO, "", "Drops        = %lu full  %lu too big\n", stats.full_drops, stats.big_drops);
+    esp_log_write(ESP_LOG_INFO, "", "Triggers     = %lu manual  %lu assoc  %lu spike  %lu new sta  (%lu extended)\n",
+                  stats.triggers[PRE_TRIGGER_MANUAL], stats.triggers[PRE_TRIGGER_ASSOC],
+                  stats.triggers[PRE_TRIGGER_SPIKE], stats.triggers[PRE_TRIGGER_NEW_STA], stats.ignored);
+    esp_log_write(ESP_LOG_INFO, "", "Captures     = %lu  last %s\n", stats.captures, stats.last_path);
+    esp_log_write(ESP_LOG_INFO, "", "Written      = %lu pre  %lu post\n", stats.pre_written, stats.post_written);
+    esp_log_write(ESP_LOG_INFO, "", "Writer       = %lu retries  %lu errors\n", stats.writer_retries, stats.write_errors);
+
+    return 0;
+}
+
+//*****************************************************************************
+// Survey Logger
+//*****************************************************************************
+
+static int do_SV_init(int argc, char** argv)
+{
+    if(argc != 4 && argc != 7)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage SV_init <name> <mgmt subtype mask hex> <data subtype mask hex> [<rotate_kb> <rotate_secs> <max_files>] (see dot11.h)\n");
+        return -1;
+    }
+
+    pkt_filter_t filter = {0};
+    filter.mgmt_subtype_bitmap = (uint16_t) strtol(argv[2], NULL, 16);
+    filter.data_subtype_bitmap = (uint16_t) strtol(argv[3], NULL, 16);
+    if(filter.mgmt_subtype_bitmap) { filter.type_bitmap |= (1 << PKT_MGMT); }
+    if(filter.data_subtype_bitmap) { filter.type_bitmap |= (1 << PKT_DATA); }
+
+    capture_writer_rotate_t rotate = {0};
+    if(argc == 7)
+    {
+        if(parse_kb(argv[4], &rotate.max_bytes)) { return -1; }
+        rotate.max_secs = (uint32_t) strtol(argv[5], NULL, 10);
+        rotate.max_files = (uint16_t) strtol(argv[6], NULL, 10);
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(survey_logger_open(&filter, argv[1], &rotate));
+    return 0;
+}
+
+static int do_SV_fini(int argc, char** argv)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(survey_logger_close());
+    return 0;
+}
+
+static int do_SV_stats(int argc, char** argv)
+{
+    survey_logger_stats_t stats;
+    char path[CAPTURE_WRITER_PATH_LEN + 1];
+
+    if(survey_logger_get_stats(&stats, path) != ESP_OK)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "No survey open\n");
+        return 0;
+    }
+
+    int64_t secs = (esp_timer_get_time() - stats.start_us) / (1000 * 1000);
+    esp_log_write(ESP_LOG_INFO, "", "File         = %s  %llds\n", path, secs);
+    esp_log_write(ESP_LOG_INFO, "", "Pkts         = %lu in %lu blocks  (%lu dropped)\n", stats.pkts, stats.blocks, stats.drops);
+    esp_log_write(ESP_LOG_INFO, "", "MAC Seals    = %lu\n", stats.mac_seals);
+    esp_log_write(ESP_LOG_INFO, "", "Bytes        = %llu frames -> %llu encoded  %llu.%02llu per frame before LZ\n",
+                  stats.frame_bytes, stats.block_bytes,
+                  stats.pkts ? stats.block_bytes / stats.pkts : 0,
+                  stats.pkts ? (stats.block_bytes * 100 / stats.pkts) % 100 : 0);
+
+    return 0;
+}
+
+//*****************************************************************************
+// PCAP Stream
+//*****************************************************************************
+
+static int do_LS_init(int argc, char** argv)
+{
+    if(argc != 3 && argc != 4)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage LS_init <mgmt subtype mask hex> <data subtype mask hex> [<exclude self 0|1>] (see dot11.h)\n");
+        return -1;
+    }
+
+    pcap_stream_cfg_t cfg = {0};
+    cfg.filter.mgmt_subtype_bitmap = (uint16_t) strtol(argv[1], NULL, 16);
+    cfg.filter.data_subtype_bitmap = (uint16_t) strtol(argv[2], NULL, 16);
+    if(cfg.filter.mgmt_subtype_bitmap) { cfg.filter.type_bitmap |= (1 << PKT_MGMT); }
+    if(cfg.filter.data_subtype_bitmap) { cfg.filter.type_bitmap |= (1 << PKT_DATA); }
+    cfg.exclude_self = (argc == 4) ? (uint8_t) strtol(argv[3], NULL, 10) : 1;
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pcap_stream_init(&cfg));
+    return 0;
+}
+
+static int do_LS_fini(int argc, char** argv)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(pcap_stream_fini());
+    return 0;
+}
+
+static int do_LS_stats(int argc, char** argv)
+{
+    pcap_stream_stats_t stats;
+    pcap_stream_client_stats_t clients[CONFIG_PCAP_STREAM_MAX_CLIENTS];
+    uint32_t ring_used;
+    uint8_t i;
+
+    pcap_stream_get_stats(&stats, clients, &ring_used);
+
+    esp_log_write(ESP_LOG_INFO, "", "State        = %s\n", pcap_stream_is_running() ? "streaming" : "stopped");
+    esp_log_write(ESP_LOG_INFO, "", "Ring Used    = %lu / %d\n", ring_used, CONFIG_PCAP_STREAM_RING_KB * 1024);
+    esp_log_write(ESP_LOG_INFO, "", "Pkts         = %lu  (%lu evicted, %lu self skipped)\n", stats.pkts, stats.evicted, stats.self_skipped);
+    esp_log_write(ESP_LOG_INFO, "", "Clients      = %lu served  %lu refused\n", stats.accepted, stats.refused);
+    esp_log_write(ESP_LOG_INFO, "", "Sent         = %llu bytes  %lu dropped\n", stats.bytes_sent, stats.drops);
+
+    for(i = 0; i < CONFIG_PCAP_STREAM_MAX_CLIENTS; ++i)
+    {
+        if(!clients[i].active) { continue; }
+        esp_log_write(ESP_LOG_INFO, "", "  %-15s  %llu bytes  %lu pkts  %lu dropped  %lu behind\n",
+                      clients[i].ip_addr, clients[i].bytes_sent, clients[i].pkts,
+                      clients[i].drops, clients[i].lag);
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// Net Reactor
+//*****************************************************************************
+
+// Stack of the tasks the reactor took over, NET In and NET Out, the file
+// server (4096) and the pcap stream (3072). NET Cmd is still a task of its own.
+#define NR_REPLACED_STACK (2 * CONFIG_REPL_MUX_STACK_SIZE + 4096 + 3072)
+
+static int do_NR_stats(int argc, char** argv)
+{
+    net_reactor_stats_t s;
+    net_reactor_handler_stats_t h;
+    uint8_t i;
+
+    net_reactor_get_stats(&s);
+    uint64_t up = s.up_us ? s.up_us : 1;
+
+    esp_log_write(ESP_LOG_INFO, "", "Stack        = %lu bytes, %lu least free\n", s.stack_size, s.stack_free);
+    esp_log_write(ESP_LOG_INFO, "", "Stack Freed  = %ld bytes vs a task per service\n",
+                  (long) NR_REPLACED_STACK - (long) s.stack_size - CONFIG_REPL_MUX_NET_CMD_STACK_SIZE);
+    esp_log_write(ESP_LOG_INFO, "", "Rounds       = %lu  (%lu woken)\n", s.rounds, s.wakes);
+    esp_log_write(ESP_LOG_INFO, "", "In Select    = %llu of %llu ms\n", s.wait_us / 1000, s.up_us / 1000);
+    esp_log_write(ESP_LOG_INFO, "", "Handlers     = %u\n", s.handlers);
+
+    for(i = 0; i < CONFIG_NET_REACTOR_MAX_HANDLERS; ++i)
+    {
+        if(net_reactor_get_handler_stats(i, &h) != ESP_OK) { continue; }
+        esp_log_write(ESP_LOG_INFO, "", "  %-16s %llu us CPU (%llu.%02llu%%)  %lu calls  max %lu us\n",
+                      h.name, h.busy_us,
+                      h.busy_us * 100 / up, (h.busy_us * 10000 / up) % 100,
+                      h.calls, h.max_us);
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// Telemetry
+//*****************************************************************************
+
+// The sample fields of the services main owns, runs on the net reactor task
+static void telemetry_source(telemetry_enc_t* e)
+{
+    pkt_sniffer_stats_t* ps = pkt_sniffer_get_stats();
+    capture_writer_stats_t* cw = capture_writer_get_stats();
+    repl_mux_stats_t mux;
+    pcap_stream_stats_t ls;
+    uint32_t used;
+    ap_t ap;
+    uint8_t i, n;
+
+    telemetry_enc_field(e, TELEMETRY_F_PKTS, ps->num_pkt_total);
+    telemetry_enc_field(e, TELEMETRY_F_DATA_PKTS, ps->num_data_pkt);
+    telemetry_enc_field(e, TELEMETRY_F_MGMT_PKTS, ps->num_mgmt_pkt);
+    telemetry_enc_field(e, TELEMETRY_F_SNIFF_RUNNING, pkt_sniffer_is_running());
+
+    if(ml_inited && mac_logger_get_ap_list_len(&n) == ESP_OK)
+    {
+        uint32_t stas = 0;
+        for(i = 0; i < n; ++i)
+        {
+            if(mac_logger_get_ap(i, &ap) == ESP_OK) { stas += ap.num_assoc_stas; }
+        }
+        telemetry_enc_field(e, TELEMETRY_F_APS, n);
+        telemetry_enc_field(e, TELEMETRY_F_STAS, stas);
+    }
+
+    telemetry_enc_field(e, TELEMETRY_F_CW_BUFFERED, cw->bytes_buffered);
+    telemetry_enc_field(e, TELEMETRY_F_CW_WRITTEN, cw->bytes_written);
+    telemetry_enc_field(e, TELEMETRY_F_CW_OVERRUNS, cw->overruns);
+
+    repl_mux_get_stats(&mux, &used);
+    telemetry_enc_field(e, TELEMETRY_F_MUX_RING, used);
+    telemetry_enc_field(e, TELEMETRY_F_MUX_DROPPED, mux.dropped);
+
+    if(pcap_stream_is_running())
+    {
+        pcap_stream_get_stats(&ls, NULL, &used);
+        telemetry_enc_field(e, TELEMETRY_F_LS_RING, used);
+        telemetry_enc_field(e, TELEMETRY_F_LS_DROPS, ls.drops);
+    }
+}
+
+static int do_TM_launch(int argc, char** argv)
+{
+    telemetry_cfg_t cfg = {0};
+    uint8_t i;
+
+    if(argc > 3)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage TM_launch [<interval ms>] [flash]\n");
+        return -1;
+    }
+
+    for(i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "flash")) { cfg.flash = 1; }
+        else                          { cfg.interval_ms = (uint32_t) strtoul(argv[i], NULL, 10); }
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(telemetry_launch(&cfg));
+    return 0;
+}
+
+static int do_TM_kill(int argc, char** argv)
+{
+    ESP_ERROR_CHECK_WITHOUT_ABORT(telemetry_kill());
+    return 0;
+}
+
+static int do_TM_interval(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage TM_interval <ms>\n");
+        return -1;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(telemetry_set_interval((uint32_t) strtoul(argv[1], NULL, 10)));
+    return 0;
+}
+
+static int do_TM_stats(int argc, char** argv)
+{
+    telemetry_stats_t s;
+    telemetry_client_stats_t clients[CONFIG_TELEMETRY_MAX_CLIENTS];
+    uint8_t i;
+
+    telemetry_get_stats(&s, clients);
+
+    esp_log_write(ESP_LOG_INFO, "", "State        = %s\n", telemetry_is_running() ? "sampling" : "stopped");
+    esp_log_write(ESP_LOG_INFO, "", "Interval     = %lu ms\n", s.interval_ms);
+    esp_log_write(ESP_LOG_INFO, "", "Samples      = %lu  (%lu us last, %lu us max)\n", s.samples, s.sample_us, s.sample_us_max);
+    esp_log_write(ESP_LOG_INFO, "", "Tasks Missed = %lu\n", s.tasks_missed);
+    esp_log_write(ESP_LOG_INFO, "", "Clients      = %lu served  %lu refused\n", s.accepted, s.refused);
+    esp_log_write(ESP_LOG_INFO, "", "Sent         = %llu bytes  %lu dropped\n", s.bytes_sent, s.drops);
+    esp_log_write(ESP_LOG_INFO, "", "Flash        = %llu bytes  %lu errors\n", s.flash_bytes, s.flash_errors);
+
+    for(i = 0; i < CONFIG_TELEMETRY_MAX_CLIENTS; ++i)
+    {
+        if(!clients[i].active) { continue; }
+        esp_log_write(ESP_LOG_INFO, "", "  %-15s  %llu bytes  %lu records  %lu dropped  %lu queued\n",
+                      clients[i].ip_addr, clients[i].bytes_sent, clients[i].records,
+                      clients[i].drops, clients[i].queued);
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// Capture Time
+//*****************************************************************************
+
+static int do_time_set(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        esp_log_write(ESP_LOG_INFO, "", "usage time_set <unix secs[.frac]>\n");
+        return -1;
+    }
+
+    double secs = strtod(argv[1], NULL);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(capture_time_set_epoch((uint64_t) (secs * 1000000.0)));
+    return 0;
+}
+
+static int do_time_get(int argc, char** argv)
+{
+    capture_time_stats_t stats;
+    capture_time_get_stats(&stats);
+
+    uint64_t wall = capture_time_to_wall(esp_timer_get_time());
+    esp_log_write(ESP_LOG_INFO, "", "Wall Clock   = %llu.%06llu  (%s)\n",
+                  wall / 1000000, wall % 1000000, stats.epoch_set ? "set" : "not set, since boot");
+    esp_log_write(ESP_LOG_INFO, "", "RX Offset    = %lld us\n", stats.rx_offset_us);
+    esp_log_write(ESP_LOG_INFO, "", "RX Stamps    = %lu  (%lu resyncs, %lu clamps)\n",
+                  stats.rx_stamps, stats.resyncs, stats.clamps);
+
     return 0;
 }
 
@@ -559,7 +1317,7 @@ static int do_eapol_logger_clear(int argc, char** argv)
 static int do_el_deauth(int argc, char** argv)
 {
     int i;
-    for(i = 0; i < 10; ++i)
+    for(i = 0; i < 10 && !repl_mux_cancelled(); ++i)
     {
         esp_log_write(ESP_LOG_INFO, "", "Sending deauth ...");
         ESP_ERROR_CHECK_WITHOUT_ABORT(eapol_logger_deauth_curr());
@@ -608,21 +1366,67 @@ static int do_part_table(int argc, char** argv)
 }
 
 static int do_ls(int argc, char** argv)
-{ 
-    
-    DIR *d;
-    struct dirent *dir;
-
+{
+    capture_catalog_entry_t e;
+    capture_catalog_stats_t stats;
+    char when[20];
+    struct tm tm;
+    uint16_t i;
+    uint8_t j;
+
+    // Flags) o = open, i = .idx sidecar, z = compressed, f = not written by us
     esp_log_write(ESP_LOG_INFO, "","%s\n", MOUNT_PATH);
-    d = opendir(MOUNT_PATH);
+    for(i = 0; capture_catalog_get(i, &e) == ESP_OK; ++i)
+    {
+        time_t t = e.created;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime_r(&t, &tm));
+        esp_log_write(ESP_LOG_INFO, "", "   %8lu  %s  %7lu  %c%c%c%c  %s",
+                      (unsigned long) e.size, when, (unsigned long) e.records,
+                      (e.flags & CAPTURE_CATALOG_OPEN) ? 'o' : '-',
+                      (e.flags & CAPTURE_CATALOG_SIDECAR) ? 'i' : '-',
+                      (e.flags & CAPTURE_CATALOG_COMPRESSED) ? 'z' : '-',
+                      (e.flags & CAPTURE_CATALOG_FOREIGN) ? 'f' : '-',
+                      e.name);
+        if(e.ssid[0])
+        {
+            esp_log_write(ESP_LOG_INFO, "", "  \"%s\"", e.ssid);
+        }
+        for(j = 0; j < e.n_bssids; ++j)
+        {
+            esp_log_write(ESP_LOG_INFO, "", "%s"MACSTR, j ? "," : "  ", MAC2STR(e.bssids[j]));
+        }
+        esp_log_write(ESP_LOG_INFO, "", "%s\n", (e.flags & CAPTURE_CATALOG_BSSID_OVERFLOW) ? ",..." : "");
+    }
+
+    // Files created while the catalog was full are only on the FS
+    capture_catalog_get_stats(&stats);
+    uint16_t untracked = 0;
+    DIR* d = stats.untracked ? opendir(MOUNT_PATH) : NULL;
     if(d)
     {
-        while((dir = readdir(d))!=NULL)
+        struct dirent* dir;
+        struct stat st;
+        char path[48];
+
+        while((dir = readdir(d)) != NULL)
         {
-            esp_log_write(ESP_LOG_INFO, "","   - %s\n", dir->d_name);
+            if(dir->d_name[0] == '.' || capture_catalog_find(dir->d_name, &e) == ESP_OK) { continue; }
+
+            snprintf(path, sizeof(path), "%s/%.32s", MOUNT_PATH, dir->d_name);
+            if(stat(path, &st)) { continue; }
+            esp_log_write(ESP_LOG_INFO, "", "   %8lu  %19s  %7s  ?     %s\n",
+                          (unsigned long) st.st_size, "", "", dir->d_name);
+            untracked++;
         }
         closedir(d);
     }
+
+    esp_log_write(ESP_LOG_INFO, "", "%d of %d files", stats.n_files, stats.max_files);
+    if(untracked)
+    {
+        esp_log_write(ESP_LOG_INFO, "", ", %u more not tracked (?)", untracked);
+    }
+    esp_log_write(ESP_LOG_INFO, "", "\n");
     return 0;
 }
 
@@ -652,7 +1456,7 @@ static int do_cat(int argc, char **argv)
         return 1;
     }
     
-    while(fgets(line, 81, f))
+    while(fgets(line, 81, f) && !repl_mux_cancelled())
     {
         esp_log_write(ESP_LOG_INFO, "","%s", line);
     }
@@ -663,22 +1467,38 @@ static int do_cat(int argc, char **argv)
 
 static int do_rm(int argc, char** argv)
 {
-    DIR *d;
-    struct dirent *dir;
-    char path[33];
+    char path[48];
 
-    d = opendir(MOUNT_PATH);
-    if(d)
+    if(argc == 2)
+    {
+        snprintf(path, sizeof(path), "%s/%.32s", MOUNT_PATH, argv[1]);
+        esp_log_write(ESP_LOG_INFO, "","Removing %s\n",path);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(capture_catalog_delete(path));
+    }
+    else
     {
-        while((dir = readdir(d))!=NULL)
+        // Tracked files with their entries, then whatever else is on the FS,
+        // files made while the catalog was full included. The catalog file
+        // stays, it is written back below.
+        ESP_ERROR_CHECK_WITHOUT_ABORT(capture_catalog_clear());
+
+        DIR* d = opendir(MOUNT_PATH);
+        struct dirent* dir;
+        if(d)
         {
-            snprintf(path, 33, "%s/%.22s", MOUNT_PATH, dir->d_name);
-            esp_log_write(ESP_LOG_INFO, "","Removing %s\n",path);
-            remove(path);
+            while((dir = readdir(d)) != NULL)
+            {
+                if(!strcmp(dir->d_name, CONFIG_CAPTURE_CATALOG_FILE)) { continue; }
+
+                snprintf(path, sizeof(path), "%s/%.32s", MOUNT_PATH, dir->d_name);
+                esp_log_write(ESP_LOG_INFO, "","Removing %s\n",path);
+                remove(path);
+            }
+            closedir(d);
         }
-        closedir(d);
     }
 
+    ESP_ERROR_CHECK_WITHOUT_ABORT(capture_catalog_sync());
     return 0;
 }
 
@@ -896,4 +1716,76 @@ static int do_set_log_level(int argc, char** argv)
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+//*****************************************************************************
+// RPC queries, the PS_stats and ML_dump of tools (see repl_mux_rpc.h)
+//*****************************************************************************
+
+static int rpc_put_u64s(repl_mux_rpc_out_t* out, uint8_t type, const uint64_t* v)
+{
+    uint8_t b[16 * 8];
+    uint8_t i, j;
+    for(i = 0; i < 16; ++i)
+    {
+        for(j = 0; j < 8; ++j) { b[8*i + j] = v[i] >> (8 * j); }
+    }
+
+    return repl_mux_rpc_put(out, type, b, sizeof(b));
+}
+
+static int rpc_sniff(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    pkt_sniffer_stats_t* stats = pkt_sniffer_get_stats();
+    uint64_t count;
+
+    repl_mux_rpc_put_u8(out, REPL_MUX_RPC_F_SNIFF_RUNNING, pkt_sniffer_is_running());
+    repl_mux_rpc_put_u64(out, REPL_MUX_RPC_F_PKTS, stats->num_pkt_total);
+    repl_mux_rpc_put_u64(out, REPL_MUX_RPC_F_DATA_PKTS, stats->num_data_pkt);
+    repl_mux_rpc_put_u64(out, REPL_MUX_RPC_F_MGMT_PKTS, stats->num_mgmt_pkt);
+    rpc_put_u64s(out, REPL_MUX_RPC_F_DATA_SUBTYPES, stats->num_data_subtype);
+    rpc_put_u64s(out, REPL_MUX_RPC_F_MGMT_SUBTYPES, stats->num_mgmt_subtype);
+
+    if(stats->timer && gptimer_get_raw_count(stats->timer, &count) == ESP_OK)
+    {
+        repl_mux_rpc_put_u64(out, REPL_MUX_RPC_F_SNIFF_SECS, count / (1000*1000));
+    }
+
+    return REPL_MUX_RPC_OK;
+}
+
+static int rpc_aps(const uint8_t* body, int len, repl_mux_rpc_out_t* out)
+{
+    uint8_t i, j, n;
+    ap_t ap;
+
+    if(mac_logger_get_ap_list_len(&n) != ESP_OK)
+    {
+        return REPL_MUX_RPC_FAIL;
+    }
+
+    for(i = 0; i < n; ++i)
+    {
+        if(mac_logger_get_ap(i, &ap) != ESP_OK) { break; }
+
+        repl_mux_rpc_put_u8(out, REPL_MUX_RPC_F_AP, i);
+        repl_mux_rpc_put_text(out, REPL_MUX_RPC_F_SSID, (char*) ap.ssid, strnlen((char*) ap.ssid, SSID_MAX_LEN));
+        repl_mux_rpc_put(out, REPL_MUX_RPC_F_BSSID, ap.bssid, MAC_LEN);
+        repl_mux_rpc_put_u8(out, REPL_MUX_RPC_F_CHANNEL, ap.channel);
+        repl_mux_rpc_put(out, REPL_MUX_RPC_F_RSSI, &ap.rssi, 1);
+        repl_mux_rpc_put_u32(out, REPL_MUX_RPC_F_GROUP_CIPHER, ap.group_cipher_suite);
+        repl_mux_rpc_put_u32(out, REPL_MUX_RPC_F_PAIRWISE_CIPHER, ap.pairwise_cipher_suite);
+        repl_mux_rpc_put_u32(out, REPL_MUX_RPC_F_AKM, ap.auth_key_management);
+        repl_mux_rpc_put_u8(out, REPL_MUX_RPC_F_PMF, (ap.rsn_cap.mgmt_frame_protect_req << 1) | ap.rsn_cap.mgmt_frame_protect_cap);
+
+        for(j = 0; j < ap.num_assoc_stas; ++j)
+        {
+            uint8_t sta[MAC_LEN + 1];
+            memcpy(sta, ap.stas[j].mac, MAC_LEN);
+            sta[MAC_LEN] = ap.stas[j].rssi;
+            repl_mux_rpc_put(out, REPL_MUX_RPC_F_STA, sta, sizeof(sta));
+        }
+    }
+
+    return REPL_MUX_RPC_OK;
+}
@@ -0,0 +1,93 @@
+# Inflate a capture file written by the capture writer with compression on
+# back into the plain pcap / pcapng it holds. The file is a run of blocks
+#
+#   | magic "CWZ1" | raw_len (u16) | blk_len (u16) | payload |
+#
+# where the payload is stored raw if blk_len == raw_len, else it is an LZ4
+# block (see components/capture_writer/capture_lz.h). Files that do not start
+# with the magic are copied through untouched.
+#
+# usage: python3 cw_decompress.py <in file> <out file>
+
+import struct
+import sys
+
+MAGIC = b'CWZ1'
+HDR = struct.Struct('<4sHH')
+
+def lz4_block(src, raw_len):
+    out = bytearray()
+    i = 0
+    n = len(src)
+    while i < n:
+        token = src[i]
+        i += 1
+
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                b = src[i]
+                i += 1
+                lit += b
+                if b != 255:
+                    break
+        out += src[i:i + lit]
+        i += lit
+
+        # Last sequence is literals only
+        if i >= n:
+            break
+
+        off = src[i] | (src[i + 1] << 8)
+        i += 2
+        if off == 0 or off > len(out):
+            raise ValueError('bad match offset %d' % off)
+
+        ml = token & 0xf
+        if ml == 15:
+            while True:
+                b = src[i]
+                i += 1
+                ml += b
+                if b != 255:
+                    break
+        ml += 4
+
+        # Matches may overlap their own output, copy byte by byte
+        start = len(out) - off
+        for k in range(ml):
+            out.append(out[start + k])
+
+    if len(out) != raw_len:
+        raise ValueError('block inflated to %d expected %d' % (len(out), raw_len))
+    return bytes(out)
+
+def inflate(data):
+    if data[:4] != MAGIC:
+        return data
+
+    out = bytearray()
+    i = 0
+    while i + HDR.size <= len(data):
+        magic, raw_len, blk_len = HDR.unpack_from(data, i)
+        if magic != MAGIC:
+            raise ValueError('bad block magic at offset %d' % i)
+        i += HDR.size
+        payload = data[i:i + blk_len]
+        if len(payload) != blk_len:
+            print('truncated block at offset %d, stopping' % (i - HDR.size))
+            break
+        i += blk_len
+        if blk_len == raw_len:
+            out += payload
+        else:
+            out += lz4_block(payload, raw_len)
+    return bytes(out)
+
+if __name__ == '__main__':
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    out = inflate(data)
+    with open(sys.argv[2], 'wb') as f:
+        f.write(out)
+    print('%d -> %d bytes' % (len(data), len(out)))
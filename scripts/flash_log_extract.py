@@ -0,0 +1,90 @@
+# Pull the captures out of a dump of the flash log partition (see
+# components/flash_log/flash_log.h). Grab the dump with
+#
+#   parttool.py read_partition --partition-name capture --output capture.bin
+#
+# The dump is a run of fixed size records
+#
+#   | magic "FL" | type | rsvd | seq | file_id | len | crc32 | payload ... |
+#
+# Records with a bad magic or CRC (erased, torn or overwritten) are skipped.
+# The good ones are grouped by file id in seq order and each file is written
+# to the out dir under the name from its OPEN record. If the log wrapped over
+# the OPEN record of a capture the file is written as file_<id>.partial.
+# Compressed captures are inflated with cw_decompress.
+#
+# usage: python3 flash_log_extract.py <dump> <out dir> [record size]
+
+import os
+import struct
+import sys
+import zlib
+
+from cw_decompress import inflate
+
+MAGIC = 0x4C46
+HDR = struct.Struct('<HBBIHHI')
+REC_OPEN = 1
+REC_DATA = 2
+REC_CLOSE = 3
+
+def parse(dump, rec_size):
+    recs = []
+    bad = 0
+    for off in range(0, len(dump) - rec_size + 1, rec_size):
+        magic, typ, _, seq, file_id, length, crc = HDR.unpack_from(dump, off)
+        if magic != MAGIC or length > rec_size - HDR.size:
+            continue
+
+        hdr = HDR.pack(magic, typ, 0, seq, file_id, length, 0)
+        payload = dump[off + HDR.size:off + HDR.size + length]
+        if zlib.crc32(hdr + payload) != crc:
+            bad += 1
+            continue
+        recs.append((seq, typ, file_id, payload))
+
+    recs.sort()
+    return recs, bad
+
+def main():
+    if len(sys.argv) < 3:
+        print('usage: python3 flash_log_extract.py <dump> <out dir> [record size]')
+        sys.exit(1)
+
+    rec_size = int(sys.argv[3]) if len(sys.argv) > 3 else 512
+    with open(sys.argv[1], 'rb') as f:
+        dump = f.read()
+
+    recs, bad = parse(dump, rec_size)
+    print('%d good records, %d bad' % (len(recs), bad))
+
+    # File ids are reused after 64K captures, a new OPEN starts a new file
+    files = []
+    current = {}
+    for seq, typ, file_id, payload in recs:
+        if typ == REC_OPEN:
+            name = payload.split(b'\0')[0].decode(errors='replace')
+            current[file_id] = [os.path.basename(name), bytearray(), False]
+            files.append(current[file_id])
+        elif file_id not in current:
+            current[file_id] = ['file_%d.partial' % file_id, bytearray(), False]
+            files.append(current[file_id])
+
+        if typ == REC_DATA:
+            current[file_id][1] += payload
+        elif typ == REC_CLOSE:
+            current[file_id][2] = True
+
+    os.makedirs(sys.argv[2], exist_ok=True)
+    for name, data, closed in files:
+        try:
+            data = inflate(bytes(data))
+        except ValueError as e:
+            print('%s: %s, writing it as is' % (name, e))
+
+        with open(os.path.join(sys.argv[2], name), 'wb') as f:
+            f.write(data)
+        print('%-32s %10d bytes%s' % (name, len(data), '' if closed else '  (not closed)'))
+
+if __name__ == '__main__':
+    main()
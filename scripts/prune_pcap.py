@@ -1,9 +1,10 @@
 # To crack a wpa2 handshake we need the association req + response + 4 eapol
 # packets. Take a cap file, find those 4 packets and export slimmed down pcap
-# with just those
+# with just those. Reads classic pcap and pcapng w/ radiotap alike.
 
 import sys
 from scapy.all import EAPOL, wrpcap, rdpcap
+from scapy.layers.dot11 import Dot11
 
 input_file = sys.argv[1]
 out_file = sys.argv[2]
@@ -14,10 +15,15 @@ out_pkts = []
 for p in pkts: 
     if EAPOL in p:
         out_pkts.append(p)
-    if p.fields['type'] == 0 and p.fields['subtype'] == 0:
+        continue
+    # The 802.11 header sits under radiotap in a pcapng capture
+    d = p.getlayer(Dot11)
+    if d is None:
+        continue
+    if d.type == 0 and d.subtype == 0:
         out_pkts.append(p)
-    if p.fields['type'] == 0 and p.fields['subtype'] == 1:    
+    if d.type == 0 and d.subtype == 1:    
         out_pkts.append(p)
 
 for p in out_pkts:
-    wrpcap(out_file, p, append=True)
\ No newline at end of file
+    wrpcap(out_file, p, append=True)
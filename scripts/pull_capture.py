@@ -0,0 +1,147 @@
+# Pull part of a capture from the tcp file server using its sidecar index.
+# First the <capture>.idx file is pulled and summarized (time range, frame
+# counts, BSSIDs), then a query is sent for just the spans that overlap a time
+# window and / or saw a BSSID. The server answers with the capture file header
+# followed by the matching spans, which is itself a valid capture file. If the
+# capture is LZ compressed it is inflated on the way out.
+#
+# usage: python3 pull_capture.py <capture name> <out file>
+#            [--from <secs>] [--to <secs>] [--bssid <mac>]
+#
+# Times are seconds relative to the first frame of the capture.
+
+import argparse
+import socket
+import struct
+import time
+
+from cw_decompress import inflate
+
+SERVER = ("192.168.4.1", 420)
+QUERY_REQ = 0xff
+QUERY_TIME = 0x01
+QUERY_BSSID = 0x02
+
+IDX_MAGIC = 0x58495743
+IDX_HDR = struct.Struct('<IHHII')
+IDX_ENTRY = struct.Struct('<QQIIHHHBB24s')
+INDEX_BSSID_OVERFLOW = 0x02
+
+QUERY = struct.Struct('<BB6sQQ')
+
+def recv_all(sock, n):
+    data = b''
+    while len(data) < n:
+        d = sock.recv(n - len(data))
+        if len(d) == 0:
+            raise IOError('server closed connection')
+        data += d
+    return data
+
+# Run the file server handshake, returns the socket and {path: index}
+def connect():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect(SERVER)
+
+    n_files = recv_all(sock, 1)[0]
+    sock.send(bytes([n_files]))
+
+    files = {}
+    for i in range(0, n_files):
+        data = recv_all(sock, 33)
+        files[data[1:].rstrip(b'\0').decode('utf-8')] = data[0]
+    return sock, files
+
+def recv_file(sock):
+    print("Server Sending " + recv_all(sock, 33)[1:].rstrip(b'\0').decode('utf-8'))
+    data = b''
+    while 1:
+        d = sock.recv(4096)
+        if len(d) == 0:
+            break
+        data += d
+    sock.close()
+    return data
+
+def find(files, name):
+    for path, i in files.items():
+        if path.endswith('/' + name):
+            return i
+    raise KeyError(name + ' not found on server, have ' + str(list(files.keys())))
+
+def pull(name):
+    sock, files = connect()
+    sock.send(bytes([find(files, name)]))
+    return recv_file(sock)
+
+def query(name, flags, bssid, t_start, t_end):
+    sock, files = connect()
+    sock.send(bytes([QUERY_REQ]) + QUERY.pack(find(files, name), flags, bssid, t_start, t_end))
+    return recv_file(sock)
+
+def parse_index(data):
+    magic, version, entry_len, data_hdr_len, _ = IDX_HDR.unpack_from(data, 0)
+    if magic != IDX_MAGIC or entry_len != IDX_ENTRY.size:
+        raise ValueError('not a capture index')
+
+    spans = []
+    for off in range(IDX_HDR.size, len(data) - entry_len + 1, entry_len):
+        first, last, offset, length, n_pkts, n_mgmt, n_data, n_bssids, flags, bssids = IDX_ENTRY.unpack_from(data, off)
+        spans.append({
+            'first': first, 'last': last, 'offset': offset, 'len': length,
+            'pkts': n_pkts, 'mgmt': n_mgmt, 'data': n_data, 'flags': flags,
+            'bssids': [bssids[i*6:i*6+6] for i in range(0, min(n_bssids, 4))]
+        })
+    return data_hdr_len, spans
+
+def mac_str(b):
+    return ':'.join('%02x' % x for x in b)
+
+def summarize(data_hdr_len, spans):
+    if not spans:
+        print('Index has no spans')
+        return
+    t0 = spans[0]['first']
+    size = data_hdr_len + sum(s['len'] for s in spans)
+    bssids = set()
+    for s in spans:
+        bssids.update(mac_str(b) for b in s['bssids'])
+    print('%d spans, %d bytes, %.1f secs, %d pkts (%d mgmt %d data)' % (
+        len(spans), size, (spans[-1]['last'] - t0) / 1e6,
+        sum(s['pkts'] for s in spans), sum(s['mgmt'] for s in spans), sum(s['data'] for s in spans)))
+    print('BSSIDs seen: ' + ', '.join(sorted(bssids)))
+    if t0 > 1e15:
+        # Stamps are unix time once the capture wall clock was set
+        print('Starts at ' + time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(t0 / 1e6)))
+    if any(s['flags'] & INDEX_BSSID_OVERFLOW for s in spans):
+        print('Some spans saw more BSSIDs than the index keeps, they always match')
+
+if __name__ == '__main__':
+    p = argparse.ArgumentParser()
+    p.add_argument('name')
+    p.add_argument('out')
+    p.add_argument('--from', dest='t_from', type=float)
+    p.add_argument('--to', dest='t_to', type=float)
+    p.add_argument('--bssid')
+    args = p.parse_args()
+
+    data_hdr_len, spans = parse_index(pull(args.name + '.idx'))
+    summarize(data_hdr_len, spans)
+
+    flags = 0
+    t_start = t_end = 0
+    bssid = bytes(6)
+    t0 = spans[0]['first'] if spans else 0
+    if args.t_from is not None or args.t_to is not None:
+        flags |= QUERY_TIME
+        t_start = t0 + int((args.t_from or 0) * 1e6)
+        t_end = t0 + int(args.t_to * 1e6) if args.t_to is not None else 0xffffffffffffffff
+    if args.bssid:
+        flags |= QUERY_BSSID
+        bssid = bytes(int(x, 16) for x in args.bssid.split(':'))
+
+    data = query(args.name, flags, bssid, t_start, t_end)
+    print('Received %d bytes' % len(data))
+
+    with open(args.out, 'wb') as f:
+        f.write(inflate(data))
@@ -3,6 +3,7 @@ from scapy.all import wrpcap
 from scapy.layers.dot11 import Dot11
 import socket
 import sys
+from cw_decompress import inflate
 
 sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
 sock.connect(("192.168.4.1", 420))
@@ -56,7 +57,12 @@ while 1:
     print("Recieved " + str(len(_data)) + " bytes")
 
 
-print("Writing to test.pcap")
-f = open("test.pcap", "wb")
+# Captures may be LZ compressed by the capture writer, no-op if not
+data = inflate(data)
+
+# pcapng w/ radiotap starts with a section header block, else classic pcap
+out = "test.pcapng" if data[:4] == b'\x0a\x0d\x0d\x0a' else "test.pcap"
+print("Writing to " + out)
+f = open(out, "wb")
 f.write(data)
 f.close()
\ No newline at end of file
@@ -0,0 +1,162 @@
+# Expand a survey logger file (see components/survey_logger/survey_logger.h)
+# into one row per frame. The file is inflated first if the capture writer
+# compressed it, then each columnar block is decoded with its MAC table.
+#
+#   out file ending in .csv  - ts_us,type,subtype,flags,addr1,addr2,addr3,
+#                              seq,frag,len,rssi,rate,channel
+#   out file ending in .pcap - header only radiotap pcap. Each record is the
+#                              24 byte 802.11 header rebuilt from the columns
+#                              with the original frame length, so wireshark
+#                              shows the frames as cut short by the snaplen.
+#
+# usage: python3 survey_decode.py <in file> <out file .csv|.pcap>
+
+import struct
+import sys
+
+from cw_decompress import inflate
+
+FILE_MAGIC = 0x46535743
+BLOCK_MAGIC = 0x56535743
+FILE_HDR = struct.Struct('<IHHQ')
+N_COLS = 11
+BLOCK_HDR = struct.Struct('<IHBBQ%dHH' % N_COLS)
+NO_MAC = 0xff
+TS, FC, FLAGS, A1, A2, A3, SEQ, LEN, RSSI, RATE, CHAN = range(N_COLS)
+
+# Legacy rate index (wifi_phy_rate_t) to radiotap units of 500 Kbps
+LEGACY_RATE_500K = [2, 4, 11, 22, 0, 4, 11, 22, 96, 48, 24, 12, 108, 72, 36, 18]
+
+def varints(col):
+    out = []
+    v = 0
+    shift = 0
+    for b in col:
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            out.append(v)
+            v = 0
+            shift = 0
+    return out
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+def decode_block(data, off):
+    fields = BLOCK_HDR.unpack_from(data, off)
+    magic, n_pkts, n_macs, _, base_us = fields[:5]
+    col_len = fields[5:5 + N_COLS]
+    if magic != BLOCK_MAGIC:
+        raise ValueError('bad block magic at offset %d' % off)
+    off += BLOCK_HDR.size
+
+    macs = [data[off + 6 * i:off + 6 * i + 6] for i in range(n_macs)]
+    off += 6 * n_macs
+
+    cols = []
+    for n in col_len:
+        cols.append(data[off:off + n])
+        off += n
+
+    ts = varints(cols[TS])
+    seqs = varints(cols[SEQ])
+    lens = varints(cols[LEN])
+    last_seq = [0] * n_macs
+
+    rows = []
+    t = base_us
+    for i in range(n_pkts):
+        t += ts[i]
+        a = [cols[c][i] for c in (A1, A2, A3)]
+        prev = last_seq[a[1]] if a[1] != NO_MAC else 0
+        seq = (prev + unzigzag(seqs[i])) & 0xffff
+        if a[1] != NO_MAC:
+            last_seq[a[1]] = seq
+        rows.append({
+            'ts_us': t,
+            'fc': cols[FC][i],
+            'flags': cols[FLAGS][i],
+            'addrs': [macs[x] if x != NO_MAC else None for x in a],
+            'seq_ctrl': seq,
+            'len': lens[i],
+            'rssi': struct.unpack('b', cols[RSSI][i:i + 1])[0],
+            'rate': cols[RATE][i],
+            'chan': cols[CHAN][i],
+        })
+    return rows, off
+
+def decode(data):
+    data = inflate(data)
+    magic, version, n_cols, start_us = FILE_HDR.unpack_from(data, 0)
+    if magic != FILE_MAGIC or n_cols != N_COLS:
+        raise ValueError('not a survey file')
+
+    rows = []
+    off = FILE_HDR.size
+    while off + BLOCK_HDR.size <= len(data):
+        try:
+            block, off = decode_block(data, off)
+        except (ValueError, IndexError) as e:
+            print('stopping at offset %d: %s' % (off, e))
+            break
+        rows += block
+    return rows
+
+def mac_str(m):
+    return ':'.join('%02x' % b for b in m) if m else ''
+
+def write_csv(rows, path):
+    with open(path, 'w') as f:
+        f.write('ts_us,type,subtype,flags,addr1,addr2,addr3,seq,frag,len,rssi,rate,channel\n')
+        for r in rows:
+            f.write('%d,%d,%d,0x%02x,%s,%s,%s,%d,%d,%d,%d,%s,%d\n' % (
+                r['ts_us'], (r['fc'] >> 2) & 3, r['fc'] >> 4, r['flags'],
+                mac_str(r['addrs'][0]), mac_str(r['addrs'][1]), mac_str(r['addrs'][2]),
+                r['seq_ctrl'] >> 4, r['seq_ctrl'] & 0xf, r['len'], r['rssi'],
+                ('mcs%d' % (r['rate'] & 0x7f)) if r['rate'] & 0x80 else str(r['rate']),
+                r['chan']))
+
+def radiotap(r):
+    # flags (FCS included in the original length), rate or MCS, channel, signal
+    flags = struct.pack('<B', 0x10)
+    ch = r['chan']
+    freq = 2484 if ch == 14 else 2407 + 5 * ch
+    if r['rate'] & 0x80:
+        present = (1 << 1) | (1 << 3) | (1 << 5) | (1 << 19)
+        body = flags + b'\0' + struct.pack('<HHb', freq, 0x00c0, r['rssi'])
+        body += struct.pack('<BBB', 0x02, 0, r['rate'] & 0x7f)
+    else:
+        i = r['rate'] & 0xf
+        present = (1 << 1) | (1 << 2) | (1 << 3) | (1 << 5)
+        chan_flags = 0x0080 | (0x0020 if i < 8 else 0x0040)
+        body = flags + struct.pack('<BHHb', LEGACY_RATE_500K[i], freq, chan_flags, r['rssi'])
+    return struct.pack('<BBHI', 0, 0, 8 + len(body), present) + body
+
+def write_pcap(rows, path):
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 0xffff, 127))
+        for r in rows:
+            a = [m if m else b'\0' * 6 for m in r['addrs']]
+            hdr = struct.pack('<BBH6s6s6sH', r['fc'], r['flags'], 0, a[0], a[1], a[2], r['seq_ctrl'])
+            hdr = hdr[:min(24, r['len'])]
+            rt = radiotap(r)
+            f.write(struct.pack('<IIII', r['ts_us'] // 1000000, r['ts_us'] % 1000000,
+                                len(rt) + len(hdr), len(rt) + r['len']))
+            f.write(rt + hdr)
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print('usage: python3 survey_decode.py <in file> <out file .csv|.pcap>')
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    rows = decode(data)
+
+    if sys.argv[2].endswith('.pcap'):
+        write_pcap(rows, sys.argv[2])
+    else:
+        write_csv(rows, sys.argv[2])
+    print('%d frames from %d bytes, %.1f bytes per frame' %
+          (len(rows), len(data), len(data) / max(len(rows), 1)))
@@ -0,0 +1,24 @@
+# Set the capture wall clock (see components/capture_time/capture_time.h) from
+# this host's clock over the net REPL. Run it once connected to the AP and
+# before starting a capture, all pcap / pcapng / index / survey timestamps
+# written afterwards are unix time.
+#
+# usage: python3 time_sync.py
+
+import socket
+import time
+
+REPL = ("192.168.4.1", 421)
+
+if __name__ == '__main__':
+    s = socket.create_connection(REPL, timeout=5)
+    # Connect first so only the send itself adds to the error
+    s.sendall(('time_set %.6f\n' % time.time()).encode())
+    time.sleep(0.2)
+    s.sendall(b'time_get\n')
+    time.sleep(0.5)
+    try:
+        print(s.recv(4096).decode(errors='replace'))
+    except socket.timeout:
+        pass
+    s.close()